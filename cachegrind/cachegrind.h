@@ -73,7 +73,10 @@ typedef
        * you include both `cachegrind.h` and `callgrind.h`.
        */
       VG_USERREQ__CG_START_INSTRUMENTATION = VG_USERREQ_TOOL_BASE('C','G'),
-      VG_USERREQ__CG_STOP_INSTRUMENTATION
+      VG_USERREQ__CG_STOP_INSTRUMENTATION,
+      VG_USERREQ__CG_REGISTER_VARIABLE,
+      VG_USERREQ__CG_UNREGISTER_VARIABLE,
+      VG_USERREQ__CG_CIG_EPOCH
    } Vg_CachegrindClientRequest;
 
 /* Start Cachegrind instrumentation if not already enabled. Use this
@@ -94,5 +97,46 @@ typedef
   VALGRIND_DO_CLIENT_REQUEST_STMT(VG_USERREQ__CG_STOP_INSTRUMENTATION, \
                                   0, 0, 0, 0, 0)
 
+/* Register the address range [`_qzz_begin`, `_qzz_end`] as a variable
+ * named `_qzz_name` for the cache interaction graph (CIG).  Cache lines
+ * of this range that evict, or are evicted by, lines of other registered
+ * variables are reported in the `cacheusage.cr.out` file.  The range must
+ * not overlap a variable that is still registered.  Has no effect unless
+ * `--cache-sim=yes` is given.
+ */
+#define CACHEGRIND_REGISTER_VARIABLE(_qzz_name, _qzz_begin, _qzz_end)  \
+  VALGRIND_DO_CLIENT_REQUEST_STMT(VG_USERREQ__CG_REGISTER_VARIABLE,    \
+                                  (_qzz_name), (_qzz_begin), (_qzz_end), \
+                                  0, 0)
+
+/* As `CACHEGRIND_REGISTER_VARIABLE`, for an array of structs of
+ * `_qzz_elem_size` bytes (at most 4096).  The references to it are also
+ * counted by their offset in an element, and written as a field heat
+ * map to the `cacheusage.field.out` file, from which `cu_annotate
+ * --fields` suggests splitting the hot fields from the cold ones.
+ */
+#define CACHEGRIND_REGISTER_STRUCT_ARRAY(_qzz_name, _qzz_begin, _qzz_end, \
+                                         _qzz_elem_size)                \
+  VALGRIND_DO_CLIENT_REQUEST_STMT(VG_USERREQ__CG_REGISTER_VARIABLE,     \
+                                  (_qzz_name), (_qzz_begin), (_qzz_end), \
+                                  (_qzz_elem_size), 0)
+
+/* Stop tracking the registered variable containing `_qzz_addr`, e.g.
+ * before the memory backing it is freed.  Interactions recorded so far
+ * are kept and still reported at exit.
+ */
+#define CACHEGRIND_UNREGISTER_VARIABLE(_qzz_addr)                       \
+  VALGRIND_DO_CLIENT_REQUEST_STMT(VG_USERREQ__CG_UNREGISTER_VARIABLE,   \
+                                  (_qzz_addr), 0, 0, 0, 0)
+
+/* End the current CIG epoch and start one named `_qzz_name`, or unnamed
+ * if it is NULL, e.g. between the phases of a program.  The CR and CU
+ * counts of each epoch are appended to the `cacheusage.epoch.out` file.
+ * Has no effect unless `--cig-epoch` is given.
+ */
+#define CACHEGRIND_CIG_EPOCH(_qzz_name)                                 \
+  VALGRIND_DO_CLIENT_REQUEST_STMT(VG_USERREQ__CG_CIG_EPOCH,             \
+                                  (_qzz_name), 0, 0, 0, 0)
+
 #endif /* __CACHEGRIND_H */
 
@@ -1,25 +1,16 @@
 /*
    This file consists of an infinite cache simulator and a fully associative cache simulator.
    They are used by Cachegrind to identify compulsory and conflict cache misses.
+   A stack distance engine can replace both (--cache-sim-mode=stackdist).
 */
 
 #define HELPER_DEBUG 0
 
-/* The following configuration is only for supporting 64 bytes cacheline */
-
-#define RANGE_SIZE (1024*64*64) /* size of bits*/
-
-#define CB_SIZE 64
-#define LOG2CB 6
-
-#define LOG2BM_BLOCK 12  /*each bit stands for a cacheblock, a long is 64 bits*/
-
-#define LOG2RANGE 22
-
-#define CB_MASK (((long)1 << LOG2CB) - 1)
-#define BM_BLOCK_MASK ((((long)1 << LOG2BM_BLOCK) - 1) & ~CB_MASK)
-#define BITMAP_MASK ((((long)1 << LOG2RANGE) - 1) & ~BM_BLOCK_MASK & ~CB_MASK)
-#define RANGE_MASK (~(((long)1 << LOG2RANGE) - 1))
+/* The engines work on block numbers.  The *_ref_is_miss and
+   cachesd_ref_distance entry points take the log2 of the line size as an
+   argument, so that callers inlining them with a constant keep constant
+   shifts; each engine also records the line size it was set up with, for
+   callers without a constant. */
 
 VgFile  *cu_fp = NULL;
 
@@ -30,317 +21,485 @@ typedef struct {
 } MemRef; /* We assume each memory refernce cannot span across more than two cache blocks. */
 
 /*data structure for infinitive cache */
-typedef struct {
-    Addr     addr;       /* start address of range */
-    ULong    *bitmap;     /* one bit stands for a cacheblock*/
-} MemRange;
+/* The set of blocks ever touched is a sparse bitset: a radix tree over the
+   block number whose 4 KB leaves hold one bit per block.  Leaves and
+   interior nodes are allocated on first touch, and the tree grows a level
+   at its root whenever a block beyond its reach shows up, so the common
+   47-bit user address space needs three interior levels.  The last leaf
+   used is remembered; sequential and stack accesses rarely walk the tree. */
+#define INFI_LEAF_BITS  15  /* 4 KB leaf, 32768 blocks */
+#define INFI_NODE_BITS  9   /* 512 children per interior node */
+#define INFI_LEAF_MASK  ((1UL << INFI_LEAF_BITS) - 1)
+#define INFI_NODE_MASK  ((1UL << INFI_NODE_BITS) - 1)
 
 typedef struct {
-    int max_num_ranges; /* the number of ranges allocated */
-    int cur_num_ranges; /* the number of ranges used */
-    MemRange  *ranges;
+    Int      line_size_bits;
+    Int      height;       /* interior levels above the leaves */
+    void     *root;        /* a leaf when height is 0 */
+    UWord    last_key;     /* block number >> INFI_LEAF_BITS of last_leaf */
+    ULong    *last_leaf;
+    UInt     n_leaves;
+    UInt     n_nodes;
 } cache_infi;
 
 /*data structure for the fully associative cache */
-typedef struct cache_block_struct {
-    UWord    block_addr;  /* TAG of a chace line*/
-    struct cache_block_struct *up;      /* more recently used */
-    struct cache_block_struct *down;    /* less recently used */ 
-    struct cache_block_struct *bucket;  /* for hash collisions*/
-} CacheBlock; 
+/* Cache lines live in one array and are linked by 32-bit indices, both on
+   the LRU list and on the hash chains, which halves the footprint of the
+   pointer-based version for LL-sized caches.  The links and the tag of a
+   line share one record because a hit relinks the line and both of its
+   neighbours. */
+#define FA_NO_LINE  0xFFFFFFFFU
 
 typedef struct {
-  int size;
-  CacheBlock **buckets;
-} HashTable;
+    UWord    block_addr;  /* TAG of a cache line, 0 if the line is empty */
+    UInt     up;          /* more recently used line */
+    UInt     down;        /* less recently used line */
+    UInt     next;        /* next line in the same hash bucket */
+} FALine;
 
 typedef struct {
-    int num_blocks;            /* the number of cache lines */
-    CacheBlock  *blocks_list;  /*A circular list doubly linked*/
-    CacheBlock  *top;
-    HashTable *table;
+    Int     line_size_bits;
+    UInt    num_blocks;    /* the number of cache lines */
+    FALine  *lines;        /* a circular list doubly linked */
+    UInt    top;           /* most recently used line; lines[top].up is the LRU one */
+    UInt    *buckets;      /* first line of each hash chain */
+    UInt    buckets_mask;  /* number of buckets - 1, a power of two */
+    Int     buckets_bits;
 } cache_fa;
 
-/* return 0 if ref has been accessed, 1 if not been accessed */
-__attribute__((always_inline))
-static __inline__
-int cacheinfi_handle_access(cache_infi *cache, Addr a, UChar size )
-{
-    UInt map_offset, bit_start, bit_end, b;
-    int hi, lo, i;
-    ULong cb_id;
+/*data structure for the stack distance engine */
+/* The LRU stack distance of a reference is the number of distinct blocks
+   referenced since the previous reference to the same block.  A fully
+   associative LRU cache of N lines hits exactly when the distance is
+   below N, so one engine answers for FA_D1, FA_LL and INFI at once.
+   All blocks ever referenced stay on one LRU list.  The list is cut into
+   bins at the powers of two and at the sizes of the simulated caches, and
+   every block knows its bin; a reference moves the block to the top and
+   the last block of each bin it passed down into the next bin.  This
+   gives the distance rounded down to a bin boundary, which is all the
+   histogram and the miss classification need, at O(log distance) cost. */
+#define SD_COLD      (~(UWord)0)   /* distance of the first reference to a block */
+#define SD_NUM_BINS  32            /* distance histogram: 0, 1, 2-3, 4-7, ... */
+#define SD_MAX_BOUNDS (SD_NUM_BINS + 8)
 
-    cb_id = a >> LOG2CB;
-    map_offset = (a & BITMAP_MASK) >> LOG2BM_BLOCK; 
-    bit_start = (a & BM_BLOCK_MASK) >> LOG2CB;
-    bit_end = ((a + size - 1) & BM_BLOCK_MASK) >> LOG2CB; 
+typedef struct {
+    UWord    block_addr;
+    UInt     up;           /* more recently used block */
+    UInt     down;         /* less recently used block */
+    UInt     next;         /* next block in the same hash bucket */
+    UInt     bin;          /* blocks in bin k are below bounds[k-1] blocks */
+} SDLine;
 
-    if(bit_start == bit_end)
-        bit_end++;
+typedef struct {
+    Int      line_size_bits;
+    SDLine   *lines;       /* every block referenced so far */
+    UInt     n_lines;
+    UInt     max_lines;
+    UInt     *buckets;     /* first line of each hash chain */
+    UInt     buckets_mask;
+    Int      buckets_bits;
+    UInt     top;          /* most recently used block */
+    UInt     bottom;       /* least recently used block */
+    UInt     bounds[SD_MAX_BOUNDS];  /* bin boundaries, increasing */
+    UInt     tails[SD_MAX_BOUNDS];   /* last block of each bin */
+    UInt     n_bounds;
+} cache_sd;
+
+static void cacheinfi_setup(cache_infi *cache, Int line_size)
+{
+    cache->line_size_bits = VG_(log2)(line_size);
+    cache->height = 0;
+    cache->root = NULL;
+    cache->last_key = 0;
+    cache->last_leaf = NULL;
+    cache->n_leaves = 0;
+    cache->n_nodes = 0;
+}
 
-    if(HELPER_DEBUG)
-        VG_(fprintf)(cu_fp, "cb addr: %llx, map_offset: %x, bit:[%x - %x]\n", cb_id, map_offset, bit_start, bit_end);
+/* Bytes held by the leaves and interior nodes, for --stats. */
+static ULong cacheinfi_footprint(const cache_infi *cache)
+{
+    return (ULong)cache->n_leaves * (1UL << (INFI_LEAF_BITS - 3))
+           + (ULong)cache->n_nodes * (sizeof(void*) << INFI_NODE_BITS);
+}
 
-    hi = cache->cur_num_ranges - 1;
-    lo = 0;
-    while(lo <= hi)
-    {
-        i = (hi + lo)/2;
-        if(cache->ranges[i].addr + RANGE_SIZE <= a)
-           lo = i + 1;
-        else if(cache->ranges[i].addr > a)
-           hi = i - 1;
-        else { /* found the range */
-            int sum = 0;
-
-            if(HELPER_DEBUG)
-                VG_(fprintf)(cu_fp, "\trange [%d] is found, bitmap: %p %llx\n", i, &(cache->ranges[i].bitmap[map_offset]), cache->ranges[i].bitmap[map_offset]);
-            for ( b = bit_start; b < bit_end; b++)
-               sum += ((cache->ranges[i].bitmap[map_offset] & ((long)1 << b)) != 0);
-            
-            if(HELPER_DEBUG)
-                VG_(fprintf)(cu_fp, "\tsum: %d\n", sum);
-
-            if (sum == (bit_end - bit_start))
-                return 0; /*every byte is accessed*/
-
-            for ( b = bit_start; b < bit_end; b++)  /*set bits*/
-               cache->ranges[i].bitmap[map_offset] |= ((long)1 << b);
-
-            if(HELPER_DEBUG)
-                VG_(fprintf)(cu_fp, "-=<>=- bitmap: %p %llx\n", &(cache->ranges[i].bitmap[map_offset]), cache->ranges[i].bitmap[map_offset]);
-            return 1;
-        }
+/* Find the leaf for `key`, allocating it and the path to it if needed. */
+static __attribute__((noinline))
+ULong *cacheinfi_leaf(cache_infi *cache, UWord key)
+{
+    void **slot;
+    Int level;
+
+    /* grow at the root until the tree covers `key` */
+    while (cache->height * INFI_NODE_BITS < 8 * sizeof(UWord)
+           && (key >> (cache->height * INFI_NODE_BITS)) != 0) {
+        void **node = VG_(calloc)("InfiCache.node", 1UL << INFI_NODE_BITS, sizeof(void*));
+        node[0] = cache->root;
+        cache->root = node;
+        cache->height++;
+        cache->n_nodes++;
     }
 
-    /* (lo > hi) means a new range should be created*/
-    if(cache->cur_num_ranges >= (cache->max_num_ranges)) /* all allocated ranged are used*/
-    {
-        cache->max_num_ranges = (cache->max_num_ranges + 16) * 2;
-        if(cache->ranges == NULL)
-            cache->ranges = VG_(calloc)("InfiCache.1", cache->max_num_ranges * sizeof(MemRange), 1);
-        else 
-            cache->ranges = VG_(realloc)("InfiCache.resize.1", cache->ranges, cache->max_num_ranges * sizeof(MemRange));
-
-        if(cache->ranges == NULL)
-        {
-            VG_(fprintf)(cu_fp, "Memory allocation error for c->ranges\n");
-            VG_(exit)(1);
+    slot = &cache->root;
+    for (level = cache->height - 1; level >= 0; level--) {
+        if (*slot == NULL) {
+            *slot = VG_(calloc)("InfiCache.node", 1UL << INFI_NODE_BITS, sizeof(void*));
+            cache->n_nodes++;
         }
+        slot = &((void**)*slot)[(key >> (level * INFI_NODE_BITS)) & INFI_NODE_MASK];
     }
-
-    for(i = cache->cur_num_ranges - 1; i >= 0; i--)
-    {
-        if(cache->ranges[i].addr < a)
-            break;
-        cache->ranges[i+1] = cache->ranges[i];
+    if (*slot == NULL) {
+        *slot = VG_(calloc)("InfiCache.leaf", 1, 1UL << (INFI_LEAF_BITS - 3));
+        cache->n_leaves++;
     }
-    cache->cur_num_ranges++;
 
-    cache->ranges[i+1].addr = a & RANGE_MASK;
-    cache->ranges[i+1].bitmap = VG_(calloc)("InfiCache.bitmap", RANGE_SIZE / sizeof(long), sizeof(long));
+    if (HELPER_DEBUG)
+        VG_(fprintf)(cu_fp, "-=<>=- leaf [%lx], height %d\n", key, cache->height);
 
-    if(HELPER_DEBUG)
-        VG_(fprintf)(cu_fp, "-=<>=- new range [%lx] is added\n", cache->ranges[i+1].addr);
+    cache->last_key = key;
+    cache->last_leaf = *slot;
+    return *slot;
+}
 
-    if(cache->ranges[i+1].bitmap == NULL)
-    {
-        VG_(fprintf)(cu_fp, "Memory allocation error for c->ranges[i-1].bitmap\n");
-        VG_(exit)(1);
-    }
-    
-    for (b = bit_start; b < bit_end; b++)  /*set bits*/
-        cache->ranges[i+1].bitmap[map_offset] |= ((long)1 << b);
+/* return 0 if the block has been accessed, 1 if not been accessed */
+__attribute__((always_inline))
+static __inline__
+int cacheinfi_handle_access(cache_infi *cache, UWord block)
+{
+    UWord key = block >> INFI_LEAF_BITS;
+    UWord bit = block & INFI_LEAF_MASK;
+    ULong *leaf, mask;
 
-    if(HELPER_DEBUG)
-        VG_(fprintf)(cu_fp, "-=<>=- num_range [%d], bitmap: %p %llx\n", cache->cur_num_ranges, &(cache->ranges[i+1].bitmap[map_offset]), cache->ranges[i+1].bitmap[map_offset]);
+    if (LIKELY(key == cache->last_key && cache->last_leaf != NULL))
+        leaf = cache->last_leaf;
+    else
+        leaf = cacheinfi_leaf(cache, key);
 
+    mask = 1ULL << (bit & 63);
+    if (leaf[bit >> 6] & mask)
+        return 0;
+    leaf[bit >> 6] |= mask;
     return 1;
 }
 
-__attribute__((always_inline))
-static __inline__
-int cachefa_setup(cache_fa *cache, int size)
+static void cachefa_setup(cache_fa *cache, int size, int line_size)
 {
-    //if(cache == NULL || !size || (size & (size - 1)))
-    //    return -1;
+    UInt i, n = size, num_buckets = 1;
+    Int bits = 0;
 
-    cache->num_blocks = size;
-    cache->blocks_list = VG_(calloc)("FACache.cachelines", sizeof(CacheBlock), size);
+    while (num_buckets < n) {
+        num_buckets <<= 1;
+        bits++;
+    }
+
+    cache->line_size_bits = VG_(log2)(line_size);
+    cache->num_blocks = n;
+    cache->lines = VG_(malloc)("FACache.cachelines", sizeof(FALine) * n);
+    cache->buckets = VG_(malloc)("FACache.HashTable.Buckets", sizeof(UInt) * num_buckets);
+    cache->buckets_mask = num_buckets - 1;
+    cache->buckets_bits = bits;
 
-    cache->table = VG_(calloc)("FACache.HashTable", sizeof(HashTable), size);
-    cache->table->size = size;
-    cache->table->buckets = VG_(calloc)("FACache.HasthTable.Buckets", sizeof(CacheBlock*), size);
+    for (i = 0; i < num_buckets; i++)
+        cache->buckets[i] = FA_NO_LINE;
 
     /* build the doubly linked circular list */
-    int i;
-    for(i = 1; i < size-1; i++)
-    {
-        cache->blocks_list[i].down = &cache->blocks_list[i+1];
-        cache->blocks_list[i].up = &cache->blocks_list[i-1];
+    for (i = 0; i < n; i++) {
+        cache->lines[i].block_addr = 0;
+        cache->lines[i].down = (i + 1) % n;
+        cache->lines[i].up   = (i + n - 1) % n;
+        cache->lines[i].next = FA_NO_LINE;
     }
-    cache->blocks_list[0].up = &cache->blocks_list[size-1];
-    cache->blocks_list[0].down = &cache->blocks_list[1];
-    cache->blocks_list[size-1].up = &cache->blocks_list[size-2];
-    cache->blocks_list[size-1].down = &cache->blocks_list[0];
+    cache->top = 0;
+}
 
-    cache->top = cache->blocks_list;
-    return 0;
+/* The low bits of the block address select the bucket, so a contiguous
+   range of blocks fills consecutive buckets as with the former `% size`;
+   the bits above are mixed in multiplicatively so that ranges a multiple
+   of the table size apart do not share chains. */
+static __inline__ UInt cachefa_hash(const cache_fa *cache, UWord block_addr)
+{
+    return (UInt)(block_addr + (block_addr >> cache->buckets_bits) * 0x9E3779B1U)
+           & cache->buckets_mask;
 }
 
-/*return value: 0 means a cache hit, 1 means a cache miss, -1 means error*/
+/*return value: 0 means a cache hit, 1 means a cache miss*/
 __attribute__((always_inline))
 static __inline__
-int cachefa_handle_access(cache_fa *cache, Addr a, UChar size)
+int cachefa_handle_access(cache_fa *cache, UWord block_addr)
 {
-    ULong block_addr = a >> LOG2CB;
+    FALine *lines = cache->lines;
+    UInt bucket_id, line, top = cache->top;
 
-    /* search ref in the hash table */
-    int bucket_id = block_addr % cache->table->size;
-    CacheBlock *bucket = cache->table->buckets[bucket_id];
-    CacheBlock *ptr = NULL;
+    /* repeated accesses to the most recently used line */
+    if (lines[top].block_addr == block_addr)
+        return 0;
 
-    while(bucket != NULL && bucket->block_addr != block_addr)
-        bucket = bucket->bucket;
+    /* search ref in the hash table */
+    bucket_id = cachefa_hash(cache, block_addr);
+    line = cache->buckets[bucket_id];
+    while (line != FA_NO_LINE && lines[line].block_addr != block_addr)
+        line = lines[line].next;
 
-    if(HELPER_DEBUG)
-        VG_(fprintf)(cu_fp, "cb addr: %llx, bucket_id: %d, bucket: %p\n", block_addr, bucket_id, bucket);
+    if (HELPER_DEBUG)
+        VG_(fprintf)(cu_fp, "cb addr: %lx, bucket_id: %u, line: %u\n", block_addr, bucket_id, line);
 
-    if(!bucket) /* a cache miss*/
+    if (line != FA_NO_LINE) /* a cache hit for a cacheblock which is not the top one*/
     {
-        CacheBlock *bottom = cache->top->up;
-
-        ULong evicted_addr = bottom->block_addr;
-        int evicted_bucket_id = evicted_addr % cache->table->size;
-
-        if(HELPER_DEBUG)
-            VG_(fprintf)(cu_fp, "evicted cb addr: %llx, bucket_id: %d\n", evicted_addr, evicted_bucket_id);
-
-        /*replace the bottome block, and move it to the top */
-        bottom->block_addr = block_addr;
-        cache->top = bottom; 
-
-        if(evicted_addr)
-        {
-            /* remove the evicted block from the hashtable */
-            ptr = cache->table->buckets[evicted_bucket_id];
-
-            if(HELPER_DEBUG)
-            {
-                VG_(fprintf)(cu_fp, "HashTable Buckets[%d]: ", evicted_bucket_id);
-                while(ptr != NULL)
-                {
-                    VG_(fprintf)(cu_fp, "%lx ", ptr->block_addr);
-                    ptr = ptr->bucket;
-                }
-                VG_(fprintf)(cu_fp, "\n");
-
-                ptr = cache->table->buckets[evicted_bucket_id];
-            }
-
-            if(ptr == cache->top)
-                cache->table->buckets[evicted_bucket_id] = ptr->bucket;
-            else if(ptr != NULL)
-            {
-                while(ptr->bucket != cache->top)
-                   ptr = ptr->bucket;
-    
-                ptr->bucket = cache->top->bucket;
-            }
-
-            if(HELPER_DEBUG)
-                VG_(fprintf)(cu_fp, "-=<>=- Hash remove bucket[%d]: addr[%llx]\n", evicted_bucket_id, evicted_addr);
-        }
-
-        /* add the new block to the hashtable */
-        cache->top->bucket = cache->table->buckets[bucket_id];
-        cache->table->buckets[bucket_id] = cache->top;
-        if(HELPER_DEBUG)
-        {
-            VG_(fprintf)(cu_fp, "-=<>=- Hash add bucket[%d]: addr[%lx]\n", bucket_id, cache->table->buckets[bucket_id]->block_addr);
-            ptr = cache->table->buckets[bucket_id];
-            VG_(fprintf)(cu_fp, "HashTable Buckets[%d]: ", bucket_id);
-            while(ptr != NULL)
-            {
-                VG_(fprintf)(cu_fp, "%lx ", ptr->block_addr);
-                ptr = ptr->bucket;
-            }
-            VG_(fprintf)(cu_fp, "\n");
-        }
+        /* detach the block from the list */
+        lines[lines[line].up].down = lines[line].down;
+        lines[lines[line].down].up = lines[line].up;
+
+        /* add it between top and bottom */
+        lines[line].up = lines[top].up;
+        lines[line].down = top;
+        lines[lines[top].up].down = line;
+        lines[top].up = line;
+
+        cache->top = line;  /* update top */
+        return 0;
+    }
 
-/*        ptr = cache->table->buckets[bucket_id];
-        fprintf(stdout, "HashTable Buckets[%d]: ", bucket_id);
-        int count = 0;
-        while(ptr != NULL)
-        {
-            ptr = ptr->bucket;
-            count++;
-        }
-        fprintf(stdout, "%d\n", count);*/
+    /* a cache miss: replace the bottom block, and move it to the top */
+    line = lines[top].up;
+    cache->top = line;
 
-        return 1;
-    }
-    else 
+    if (lines[line].block_addr != 0)
     {
-        if(bucket != cache->top) /* a cache hit for a cacheblock which is not the top one*/
-        {
-            /* move the cache block to the top */
-    
-            bucket->up->down = bucket->down; /* detach the block from the list*/ 
-            bucket->down->up = bucket->up; 
-    
-            bucket->up = cache->top->up; /* add it between top and bottom */ 
-            bucket->down = cache->top;
-            cache->top->up->down = bucket;
-            cache->top->up = bucket;
-    
-            cache->top = bucket;  /* update top */
-        }
+        /* remove the evicted block from the hashtable */
+        UInt *p = &cache->buckets[cachefa_hash(cache, lines[line].block_addr)];
+
+        while (*p != line)
+            p = &lines[*p].next;
+        *p = lines[line].next;
 
-        return 0; 
+        if (HELPER_DEBUG)
+            VG_(fprintf)(cu_fp, "-=<>=- Hash remove: addr[%lx]\n", lines[line].block_addr);
     }
+
+    /* add the new block to the hashtable */
+    lines[line].block_addr = block_addr;
+    lines[line].next = cache->buckets[bucket_id];
+    cache->buckets[bucket_id] = line;
+
+    if (HELPER_DEBUG)
+        VG_(fprintf)(cu_fp, "-=<>=- Hash add bucket[%u]: addr[%lx]\n", bucket_id, block_addr);
+
+    return 1;
 }
 
 __attribute__((always_inline))
 static __inline__
-Bool cacheinfi_ref_is_miss(cache_infi* c, Addr a, UChar size)
+Bool cacheinfi_ref_is_miss(cache_infi* c, Addr a, UChar size, Int line_size_bits)
 {
-    Addr a1;
-    UChar size1;
-    UWord block1 = a >> LOG2CB;    //TODO using c->line_size_bits;
-    UWord block2 = (a + size - 1) >> LOG2CB; //TODO using c->line_size_bits;
+    UWord block1 = a >> line_size_bits;
+    UWord block2 = (a + size - 1) >> line_size_bits;
 
     if(block1 == block2)
-        return cacheinfi_handle_access(c, a, size);
+        return cacheinfi_handle_access(c, block1);
+    else if(!cacheinfi_handle_access(c, block1))
+        return cacheinfi_handle_access(c, block2);
     else
-    {
-        size1 = (1 << LOG2CB) - (CB_MASK & a) - 1; //TODO using c->line_size_bits 
-        a1 = a + size1 + 1;
-        if(!cacheinfi_handle_access(c, a, size1))
-           return cacheinfi_handle_access(c, a1, size - size1);
-        else
-           return True;
-    }
+        return True;
 }
 
 __attribute__((always_inline))
 static __inline__
-Bool cachefa_ref_is_miss(cache_fa* c, Addr a, UChar size)
+Bool cachefa_ref_is_miss(cache_fa* c, Addr a, UChar size, Int line_size_bits)
 {
-    Addr a1;
-    UChar size1;
-    UWord block1 = a >> LOG2CB;    //TODO using c->line_size_bits;
-    UWord block2 = (a + size - 1) >> LOG2CB; //TODO using c->line_size_bits;
+    UWord block1 = a >> line_size_bits;
+    UWord block2 = (a + size - 1) >> line_size_bits;
 
     if(block1 == block2)
-        return cachefa_handle_access(c, a, size);
+        return cachefa_handle_access(c, block1);
+    else if(!cachefa_handle_access(c, block1))
+        return cachefa_handle_access(c, block2);
     else
-    {
-        size1 = (1 << LOG2CB) - (CB_MASK & a) - 1; //TODO using c->line_size_bits 
-        a1 = a + size1 + 1;
-        if(!cachefa_handle_access(c, a, size1))
-           return cachefa_handle_access(c, a1, size - size1);
+        return True;
+}
+
+static void cachesd_add_bound(cache_sd *sd, UWord bound)
+{
+    UInt i, j;
+
+    if (bound == 0 || bound > (1U << 31))
+        return;
+    for (i = 0; i < sd->n_bounds && sd->bounds[i] < bound; i++)
+        ;
+    if (i < sd->n_bounds && sd->bounds[i] == bound)
+        return;
+    tl_assert(sd->n_bounds < SD_MAX_BOUNDS);
+    for (j = sd->n_bounds; j > i; j--)
+        sd->bounds[j] = sd->bounds[j - 1];
+    sd->bounds[i] = bound;
+    sd->n_bounds++;
+}
+
+/* `lines1` and `lines2` are the sizes, in lines, whose hit or miss must
+   be exact besides the powers of two. */
+static void cachesd_setup(cache_sd *sd, UWord lines1, UWord lines2, Int line_size)
+{
+    UInt i;
+
+    sd->line_size_bits = VG_(log2)(line_size);
+    sd->max_lines = 1 << 12;
+    sd->lines = VG_(malloc)("SDCache.lines", sizeof(SDLine) * sd->max_lines);
+    sd->n_lines = 0;
+
+    sd->buckets_bits = 12;
+    sd->buckets_mask = (1 << sd->buckets_bits) - 1;
+    sd->buckets = VG_(malloc)("SDCache.buckets", sizeof(UInt) << sd->buckets_bits);
+    for (i = 0; i <= sd->buckets_mask; i++)
+        sd->buckets[i] = FA_NO_LINE;
+
+    sd->top = sd->bottom = FA_NO_LINE;
+
+    sd->n_bounds = 0;
+    for (i = 0; i < SD_NUM_BINS - 1; i++)
+        cachesd_add_bound(sd, (UWord)1 << i);
+    cachesd_add_bound(sd, lines1);
+    cachesd_add_bound(sd, lines2);
+}
+
+static __inline__ UInt cachesd_hash(const cache_sd *sd, UWord block_addr)
+{
+    return (UInt)(block_addr + (block_addr >> sd->buckets_bits) * 0x9E3779B1U)
+           & sd->buckets_mask;
+}
+
+static void cachesd_grow(cache_sd *sd)
+{
+    UInt i, h;
+
+    if (sd->n_lines == sd->max_lines) {
+        sd->max_lines *= 2;
+        sd->lines = VG_(realloc)("SDCache.lines", sd->lines,
+                                 sizeof(SDLine) * sd->max_lines);
+    }
+
+    if (sd->n_lines > sd->buckets_mask) {
+        VG_(free)(sd->buckets);
+        sd->buckets_bits++;
+        sd->buckets_mask = (1 << sd->buckets_bits) - 1;
+        sd->buckets = VG_(malloc)("SDCache.buckets", sizeof(UInt) << sd->buckets_bits);
+        for (i = 0; i <= sd->buckets_mask; i++)
+            sd->buckets[i] = FA_NO_LINE;
+        for (i = 0; i < sd->n_lines; i++) {
+            h = cachesd_hash(sd, sd->lines[i].block_addr);
+            sd->lines[i].next = sd->buckets[h];
+            sd->buckets[h] = i;
+        }
+    }
+}
+
+/* The block is about to become the top one: the last block of each bin
+   above `bin` moves down into the next bin. */
+__attribute__((always_inline))
+static __inline__
+void cachesd_shift_bins(cache_sd *sd, UInt bin, UInt line)
+{
+    SDLine *lines = sd->lines;
+    UInt k, t;
+
+    for (k = 0; k < bin; k++) {
+        t = sd->tails[k];
+        lines[t].bin = k + 1;
+        sd->tails[k] = k == 0 ? line : lines[t].up;
+    }
+}
+
+/*return value: the stack distance of the block rounded down to a bin
+  boundary, or SD_COLD*/
+__attribute__((always_inline))
+static __inline__
+UWord cachesd_handle_access(cache_sd *sd, UWord block_addr)
+{
+    SDLine *lines = sd->lines;
+    UInt h, line, bin;
+
+    /* repeated references to the most recently used block */
+    if (sd->top != FA_NO_LINE && lines[sd->top].block_addr == block_addr)
+        return 0;
+
+    h = cachesd_hash(sd, block_addr);
+    line = sd->buckets[h];
+    while (line != FA_NO_LINE && lines[line].block_addr != block_addr)
+        line = lines[line].next;
+
+    if (line != FA_NO_LINE) {
+        bin = lines[line].bin;
+        if (bin < sd->n_bounds && sd->tails[bin] == line)
+            sd->tails[bin] = lines[line].up;
+        cachesd_shift_bins(sd, bin, line);
+
+        /* detach the block from the list */
+        lines[lines[line].up].down = lines[line].down;
+        if (line == sd->bottom)
+            sd->bottom = lines[line].up;
         else
-           return True;
+            lines[lines[line].down].up = lines[line].up;
+    } else {
+        /* a new block: every bin boundary already reached moves down */
+        if (sd->n_lines == sd->max_lines || sd->n_lines > sd->buckets_mask) {
+            cachesd_grow(sd);
+            lines = sd->lines;
+            h = cachesd_hash(sd, block_addr);
+        }
+        line = sd->n_lines++;
+        lines[line].block_addr = block_addr;
+        lines[line].next = sd->buckets[h];
+        sd->buckets[h] = line;
+
+        for (bin = 0; bin < sd->n_bounds && sd->bounds[bin] < sd->n_lines; bin++)
+            ;
+        cachesd_shift_bins(sd, bin, line);
+        if (sd->bottom == FA_NO_LINE)
+            sd->bottom = line;
+        bin = SD_MAX_BOUNDS;
+    }
+
+    /* add it on top */
+    lines[line].up = FA_NO_LINE;
+    lines[line].down = sd->top;
+    if (sd->top != FA_NO_LINE)
+        lines[sd->top].up = line;
+    sd->top = line;
+    lines[line].bin = 0;
+
+    if (bin == SD_MAX_BOUNDS) {
+        /* the list just reached a boundary: its bottom block ends that bin */
+        UInt k;
+        for (k = 0; k < sd->n_bounds && sd->bounds[k] <= sd->n_lines; k++)
+            if (sd->bounds[k] == sd->n_lines)
+                sd->tails[k] = sd->bottom;
+        return SD_COLD;
     }
+    return bin == 0 ? 0 : sd->bounds[bin - 1];
+}
+
+/* Straddling references take the larger distance of their two blocks. */
+__attribute__((always_inline))
+static __inline__
+UWord cachesd_ref_distance(cache_sd* sd, Addr a, UChar size, Int line_size_bits)
+{
+    UWord block1 = a >> line_size_bits;
+    UWord block2 = (a + size - 1) >> line_size_bits;
+    UWord dist1, dist2;
+
+    dist1 = cachesd_handle_access(sd, block1);
+    if (block1 == block2)
+        return dist1;
+
+    dist2 = cachesd_handle_access(sd, block2);
+    return dist1 > dist2 ? dist1 : dist2;
+}
+
+/* 0 for distance 0, b+1 for distances in [2^b, 2^(b+1)) */
+static __inline__ UInt cachesd_bin(UWord dist)
+{
+    UInt bin;
+
+    if (dist == 0)
+        return 0;
+    bin = 64 - __builtin_clzll(dist);
+    return bin < SD_NUM_BINS ? bin : SD_NUM_BINS - 1;
 }
@@ -29,6 +29,7 @@
 
 #include "pub_tool_basics.h"
 #include "pub_tool_debuginfo.h"
+#include "pub_tool_gdbserver.h"
 #include "pub_tool_libcbase.h"
 #include "pub_tool_libcassert.h"
 #include "pub_tool_libcfile.h"
@@ -37,11 +38,21 @@
 #include "pub_tool_mallocfree.h"
 #include "pub_tool_options.h"
 #include "pub_tool_oset.h"
+#include "pub_tool_threadstate.h"
 #include "pub_tool_tooliface.h"
 #include "pub_tool_transtab.h"
 #include "pub_tool_xarray.h"
 #include "pub_tool_clientstate.h"
 #include "pub_tool_machine.h"      // VG_(fnptr_to_fnentry)
+#include "pub_tool_stacktrace.h"
+
+#if defined(VGA_amd64)
+#  include "libvex_guest_amd64.h"
+#elif defined(VGA_x86)
+#  include "libvex_guest_x86.h"
+#elif defined(VGA_arm64)
+#  include "libvex_guest_arm64.h"
+#endif
 
 #include "cachegrind.h"
 #include "cg_arch.h"
@@ -66,9 +77,29 @@ static Bool  clo_instr_at_start = True; /* instrument at startup? */
 static const HChar* clo_cachegrind_out_file = "cachegrind.out.%p";
 static const HChar* clo_cacheusage_d1_out_file = "cacheusage.d1.out.%p";
 static const HChar* clo_cacheusage_ll_out_file = "cacheusage.ll.out.%p";
+static const HChar* clo_cacheusage_l2_out_file = "cacheusage.l2.out.%p";
 static const HChar* clo_cacheusage_cr_out_file = "cacheusage.cr.out.%p";
+static const HChar* clo_cacheusage_rd_out_file = "cacheusage.rd.out.%p";
 /* The size of words for tracking cacheline usage. For a 64 byte cacheline, acceptable ones include: 1,2,4,8,16,32,64*/
 static UInt  clo_word_size = DEFAULT_WORD_SIZE; 
+static Int   clo_cache_sim_batch = 0; /* references buffered before simulation, 0 for none */
+static UInt  clo_cig_auto_vars = 0;   /* CIG_AUTO_* kinds registered without client requests */
+static Int   clo_cig_auto_min = 4096; /* smallest variable registered automatically */
+static Long  clo_cig_epoch = -1;      /* instructions per CIG epoch, 0 for client requests only, -1 for no epochs */
+static const HChar* clo_cacheusage_epoch_out_file = "cacheusage.epoch.out.%p";
+static const HChar* clo_cacheusage_tlb_out_file = "cacheusage.tlb.out.%p";
+static const HChar* clo_cacheusage_field_out_file = "cacheusage.field.out.%p";
+static const HChar* clo_cacheusage_icig_out_file = "cacheusage.icig.out.%p";
+static const HChar* clo_trace_out = NULL;
+static const HChar* clo_trace_in  = NULL;
+static const HChar* clo_code_layout = NULL; /* --trace-in: functions to move, from cu_order */
+static Long  clo_sim_sample_on = 0;   /* instructions per measured interval, 0 for no sampling */
+static Long  clo_sim_sample_off = 0;  /* instructions fast-forwarded after each */
+static Long  clo_sim_sample_warm = 0; /* instructions simulated but not counted before each */
+static Bool  clo_cacheusage_bin = False; /* binary D1 usage and CR files? */
+
+#define CIG_AUTO_HEAP     (1 << 0)
+#define CIG_AUTO_GLOBALS  (1 << 1)
 
 /*------------------------------------------------------------*/
 /*--- Cachesim configuration                               ---*/
@@ -82,6 +113,10 @@ static Int min_line_size = 0; /* min of L1 and LL cache line sizes */
 
 static OSet* CC_table;
 
+// The CC tables of the D1/LL configurations; the first is CC_table.
+// Each LineCC is chained to the same line in the next table.
+static OSet* cfg_CC_tables[MAX_SIM_CFGS];
+
 //------------------------------------------------------------
 // Primary data structure #2: InstrInfo table
 // - Holds the cached info about each instr that is used for simulation.
@@ -95,6 +130,8 @@ typedef struct _InstrInfo InstrInfo;
 struct _InstrInfo {
    Addr    instr_addr;
    UChar   instr_len;
+   Bool    non_temporal;   // a non-temporal store, with --write-back=yes
+   UInt    trace_id;       // id in the --trace-out stream, 0 until defined there
    LineCC* parent;         // parent line-CC
 };
 
@@ -191,70 +228,94 @@ static void get_debug_info(Addr instr_addr, const HChar **dir,
    }
 }
 
-// Do a three step traversal: by file, then fn, then line.
-// Returns a pointer to the line CC, creates a new one if necessary.
-static LineCC* get_lineCC(Addr origAddr)
+// Returns a pointer to the line CC of `loc`, creates a new one if
+// necessary.
+static LineCC* get_lineCC_at(const CodeLoc* loc)
 {
-   const HChar *fn, *file, *dir;
-   UInt    line;
-   CodeLoc loc;
    LineCC* lineCC;
+   LineCC* prev;
    Int     i;
+   UInt    k;
 
-   get_debug_info(origAddr, &dir, &file, &fn, &line);
-
-   // Form an absolute pathname if a directory is available
-   HChar absfile[VG_(strlen)(dir) + 1 + VG_(strlen)(file) + 1];
-
-   if (dir[0]) {
-      VG_(sprintf)(absfile, "%s/%s", dir, file);
-   } else {
-      VG_(sprintf)(absfile, "%s", file);
-   }
-
-   loc.file = absfile;
-   loc.fn   = fn;
-   loc.line = line;
-
-   lineCC = VG_(OSetGen_Lookup)(CC_table, &loc);
+   lineCC = VG_(OSetGen_Lookup)(CC_table, loc);
    if (!lineCC) {
       // Allocate and zero a new node.
       lineCC           = VG_(OSetGen_AllocNode)(CC_table, sizeof(LineCC));
-      lineCC->loc.file = get_perm_string(loc.file);
-      lineCC->loc.fn   = get_perm_string(loc.fn);
-      lineCC->loc.line = loc.line;
-      lineCC->Ir.a     = 0;
-      lineCC->Ir.m1    = 0;
-      lineCC->Ir.mL    = 0;
-      lineCC->Dr.a     = 0;
-      lineCC->Dr.m1    = 0;
-      lineCC->Dr.mL    = 0;
-      lineCC->Dw.a     = 0;
-      lineCC->Dw.m1    = 0;
-      lineCC->Dw.mL    = 0;
+      lineCC->loc.file = get_perm_string(loc->file);
+      lineCC->loc.fn   = get_perm_string(loc->fn);
+      lineCC->loc.line = loc->line;
+      VG_(memset)(&lineCC->Ir, 0, sizeof(CacheCC));
+      VG_(memset)(&lineCC->Dr, 0, sizeof(CacheCC));
+      VG_(memset)(&lineCC->Dw, 0, sizeof(CacheCC));
       lineCC->Bc.b     = 0;
       lineCC->Bc.mp    = 0;
       lineCC->Bi.b     = 0;
       lineCC->Bi.mp    = 0;
+      VG_(memset)(&lineCC->Pf, 0, sizeof(PrefetchCC));
+      VG_(memset)(&lineCC->Tr, 0, sizeof(TrafficCC));
+      VG_(memset)(&lineCC->Tlb, 0, sizeof(TlbCC));
+      VG_(memset)(&lineCC->Smp, 0, sizeof(SampleCC));
+      lineCC->rd_hist  = NULL;
+      lineCC->trace_id = 0;
+      lineCC->fn_id    = 0;
+      lineCC->next_cfg = NULL;
 
       for(i = 0; i < MAX_NUM_BINS; i++)
       {
         lineCC->num_evicts_D1[i] = 0;
         lineCC->num_evicts_LL[i] = 0;
+        lineCC->num_evicts_L2[i] = 0;
       }
 
-      lineCC->cr_table_D1 = NULL;
-      lineCC->cr_table_LL = NULL;
+      VG_(memset)(&lineCC->cr_table_D1, 0, sizeof(cr_table_t));
+      VG_(memset)(&lineCC->cr_table_LL, 0, sizeof(cr_table_t));
+      VG_(memset)(&lineCC->cr_table_TLB, 0, sizeof(cr_table_t));
 
-      lineCC->cu_table_D1 = NULL;
-      lineCC->cu_table_LL = NULL;
+      VG_(memset)(&lineCC->cu_table_D1, 0, sizeof(cu_table_t));
+      VG_(memset)(&lineCC->cu_table_LL, 0, sizeof(cu_table_t));
 
       VG_(OSetGen_Insert)(CC_table, lineCC);
+
+      // The other D1/LL configurations start from the same zeroed counts.
+      prev = lineCC;
+      for (k = 1; k < n_sim_cfgs; k++) {
+         LineCC* more = VG_(OSetGen_AllocNode)(cfg_CC_tables[k], sizeof(LineCC));
+         *more = *lineCC;
+         VG_(OSetGen_Insert)(cfg_CC_tables[k], more);
+         prev->next_cfg = more;
+         prev = more;
+      }
    }
 
    return lineCC;
 }
 
+// Do a three step traversal: by file, then fn, then line.
+// Returns a pointer to the line CC, creates a new one if necessary.
+static LineCC* get_lineCC(Addr origAddr)
+{
+   const HChar *fn, *file, *dir;
+   UInt    line;
+   CodeLoc loc;
+
+   get_debug_info(origAddr, &dir, &file, &fn, &line);
+
+   // Form an absolute pathname if a directory is available
+   HChar absfile[VG_(strlen)(dir) + 1 + VG_(strlen)(file) + 1];
+
+   if (dir[0]) {
+      VG_(sprintf)(absfile, "%s/%s", dir, file);
+   } else {
+      VG_(sprintf)(absfile, "%s", file);
+   }
+
+   loc.file = absfile;
+   loc.fn   = fn;
+   loc.line = line;
+
+   return get_lineCC_at(&loc);
+}
+
 /*------------------------------------------------------------*/
 /*--- Cache simulation functions                           ---*/
 /*------------------------------------------------------------*/
@@ -302,8 +363,7 @@ void log_1IrGen_0D_cache_access(InstrInfo* n)
 {
    //VG_(printf)("1IrGen_0D :  CCaddr=0x%010lx,  iaddr=0x%010lx,  isize=%lu\n",
    //             n, n->instr_addr, n->instr_len);
-   cachesim_I1_doref_Gen(n->instr_addr, n->instr_len,
-			 &n->parent->Ir.m1, &n->parent->Ir.mL);
+   cachesim_I1_doref_Gen(n->instr_addr, n->instr_len, n->parent);
    n->parent->Ir.a++;
 }
 
@@ -312,8 +372,7 @@ void log_1IrNoX_0D_cache_access(InstrInfo* n)
 {
    //VG_(printf)("1IrNoX_0D :  CCaddr=0x%010lx,  iaddr=0x%010lx,  isize=%lu\n",
    //             n, n->instr_addr, n->instr_len);
-   cachesim_I1_doref_NoX(n->instr_addr, n->instr_len,
-			 &n->parent->Ir.m1, &n->parent->Ir.mL);
+   cachesim_I1_doref_NoX(n->instr_addr, n->instr_len, n->parent);
    n->parent->Ir.a++;
 }
 
@@ -324,11 +383,9 @@ void log_2IrNoX_0D_cache_access(InstrInfo* n, InstrInfo* n2)
    //            "            CC2addr=0x%010lx, i2addr=0x%010lx, i2size=%lu\n",
    //            n,  n->instr_addr,  n->instr_len,
    //            n2, n2->instr_addr, n2->instr_len);
-   cachesim_I1_doref_NoX(n->instr_addr, n->instr_len,
-			 &n->parent->Ir.m1, &n->parent->Ir.mL);
+   cachesim_I1_doref_NoX(n->instr_addr, n->instr_len, n->parent);
    n->parent->Ir.a++;
-   cachesim_I1_doref_NoX(n2->instr_addr, n2->instr_len,
-			 &n2->parent->Ir.m1, &n2->parent->Ir.mL);
+   cachesim_I1_doref_NoX(n2->instr_addr, n2->instr_len, n2->parent);
    n2->parent->Ir.a++;
 }
 
@@ -341,14 +398,11 @@ void log_3IrNoX_0D_cache_access(InstrInfo* n, InstrInfo* n2, InstrInfo* n3)
    //            n,  n->instr_addr,  n->instr_len,
    //            n2, n2->instr_addr, n2->instr_len,
    //            n3, n3->instr_addr, n3->instr_len);
-   cachesim_I1_doref_NoX(n->instr_addr, n->instr_len,
-			 &n->parent->Ir.m1, &n->parent->Ir.mL);
+   cachesim_I1_doref_NoX(n->instr_addr, n->instr_len, n->parent);
    n->parent->Ir.a++;
-   cachesim_I1_doref_NoX(n2->instr_addr, n2->instr_len,
-			 &n2->parent->Ir.m1, &n2->parent->Ir.mL);
+   cachesim_I1_doref_NoX(n2->instr_addr, n2->instr_len, n2->parent);
    n2->parent->Ir.a++;
-   cachesim_I1_doref_NoX(n3->instr_addr, n3->instr_len,
-			 &n3->parent->Ir.m1, &n3->parent->Ir.mL);
+   cachesim_I1_doref_NoX(n3->instr_addr, n3->instr_len, n3->parent);
    n3->parent->Ir.a++;
 }
 
@@ -358,11 +412,10 @@ void log_1IrNoX_1Dr_cache_access(InstrInfo* n, Addr data_addr, Word data_size)
    //VG_(printf)("1IrNoX_1Dr:  CCaddr=0x%010lx,  iaddr=0x%010lx,  isize=%lu\n"
    //            "                               daddr=0x%010lx,  dsize=%lu\n",
    //            n, n->instr_addr, n->instr_len, data_addr, data_size);
-   cachesim_I1_doref_NoX(n->instr_addr, n->instr_len,
-			 &n->parent->Ir.m1, &n->parent->Ir.mL);
+   cachesim_I1_doref_NoX(n->instr_addr, n->instr_len, n->parent);
    n->parent->Ir.a++;
 
-   cachesim_D1_doref(data_addr, data_size, &n->parent->Dr.m1, &n->parent->Dr.mL, n->parent->loc.line, n->parent, &n->parent->Dr);
+   cachesim_D1_doref(data_addr, data_size, n->parent, REF_READ, n->instr_addr);
 
    n->parent->Dr.a++;
 }
@@ -373,11 +426,10 @@ void log_1IrNoX_1Dw_cache_access(InstrInfo* n, Addr data_addr, Word data_size)
    //VG_(printf)("1IrNoX_1Dw:  CCaddr=0x%010lx,  iaddr=0x%010lx,  isize=%lu\n"
    //            "                               daddr=0x%010lx,  dsize=%lu\n",
    //            n, n->instr_addr, n->instr_len, data_addr, data_size);
-   cachesim_I1_doref_NoX(n->instr_addr, n->instr_len,
-			 &n->parent->Ir.m1, &n->parent->Ir.mL);
+   cachesim_I1_doref_NoX(n->instr_addr, n->instr_len, n->parent);
    n->parent->Ir.a++;
 
-   cachesim_D1_doref(data_addr, data_size, &n->parent->Dw.m1, &n->parent->Dw.mL, n->parent->loc.line, n->parent, &n->parent->Dw);
+   cachesim_D1_doref(data_addr, data_size, n->parent, REF_WRITE, n->instr_addr);
 
    n->parent->Dw.a++;
 }
@@ -390,7 +442,7 @@ void log_0Ir_1Dr_cache_access(InstrInfo* n, Addr data_addr, Word data_size)
 {
    //VG_(printf)("0Ir_1Dr:  CCaddr=0x%010lx,  daddr=0x%010lx,  dsize=%lu\n",
    //            n, data_addr, data_size);
-   cachesim_D1_doref(data_addr, data_size, &n->parent->Dr.m1, &n->parent->Dr.mL, n->parent->loc.line, n->parent, &n->parent->Dr);
+   cachesim_D1_doref(data_addr, data_size, n->parent, REF_READ, n->instr_addr);
 
    n->parent->Dr.a++;
 }
@@ -401,7 +453,16 @@ void log_0Ir_1Dw_cache_access(InstrInfo* n, Addr data_addr, Word data_size)
 {
    //VG_(printf)("0Ir_1Dw:  CCaddr=0x%010lx,  daddr=0x%010lx,  dsize=%lu\n",
    //            n, data_addr, data_size);
-   cachesim_D1_doref(data_addr, data_size, &n->parent->Dw.m1, &n->parent->Dw.mL, n->parent->loc.line, n->parent, &n->parent->Dw);
+   cachesim_D1_doref(data_addr, data_size, n->parent, REF_WRITE, n->instr_addr);
+
+   n->parent->Dw.a++;
+}
+
+/* A non-temporal store; see is_non_temporal_store. */
+static VG_REGPARM(3)
+void log_0Ir_1Dnt_cache_access(InstrInfo* n, Addr data_addr, Word data_size)
+{
+   cachesim_D1_doref(data_addr, data_size, n->parent, REF_WRITE_NT, n->instr_addr);
 
    n->parent->Dw.a++;
 }
@@ -433,187 +494,1775 @@ void log_ind_branch(InstrInfo* n, UWord actual_dst)
 
 
 /*------------------------------------------------------------*/
-/*--- Instrumentation types and structures                 ---*/
+/*--- Batched cache simulation                             ---*/
 /*------------------------------------------------------------*/
 
-/* Maintain an ordered list of memory events which are outstanding, in
-   the sense that no IR has yet been generated to do the relevant
-   helper calls.  The BB is scanned top to bottom and memory events
-   are added to the end of the list, merging with the most recent
-   notified event where possible (Dw immediately following Dr and
-   having the same size and EA can be merged).
-
-   This merging is done so that for architectures which have
-   load-op-store instructions (x86, amd64), the insn is treated as if
-   it makes just one memory reference (a modify), rather than two (a
-   read followed by a write at the same address).
+/* With --cache-sim-batch=N the cache helpers only append a record per
+   reference to a buffer of N records, and cachesim_drain_batch runs the
+   simulators over the whole buffer when it is full.  The records keep
+   the order of the references, so the results are those of the
+   unbatched helpers, provided the buffer is drained before anything
+   reads the simulation state or frees the InstrInfos it points to: at
+   exit, on client requests, and when superblocks are discarded.
+   Valgrind runs one thread at a time, so a single buffer sees the
+   references in the order the unbatched helpers would. */
+
+/* A record holds an instruction read, a data access, or both when a
+   helper reports an IrNoX together with the Dr or Dw it makes.  Dr and
+   Dw together are a non-temporal store. */
+#define BatchIrNoX  1
+#define BatchIrGen  2
+#define BatchDr     4
+#define BatchDw     8
+#define BatchDnt    (BatchDr | BatchDw)
+
+typedef struct {
+   InstrInfo* n;
+   Addr       data_addr;  /* Dr and Dw only */
+   UChar      data_size;
+   UChar      kind;       /* Batch* bits */
+} BatchRef;
+
+static BatchRef* batch_refs = NULL;
+static Int       batch_used = 0;
+
+static Int       trace_fd = -1;  /* --trace-out file */
+
+/* Simulates the reference of a record, counting it in `cc`: the line CC
+   of its instruction, except during a --sim-sample warm-up. */
+__attribute__((always_inline))
+static __inline__
+void cachesim_batch_ref(InstrInfo* n, LineCC* cc, UInt kind,
+                        Addr data_addr, UChar data_size)
+{
+   if (kind & BatchIrNoX) {
+      cachesim_I1_doref_NoX(n->instr_addr, n->instr_len, cc);
+      cc->Ir.a++;
+   } else if (kind & BatchIrGen) {
+      cachesim_I1_doref_Gen(n->instr_addr, n->instr_len, cc);
+      cc->Ir.a++;
+   }
 
-   At various points the list will need to be flushed, that is, IR
-   generated from it.  That must happen before any possible exit from
-   the block (the end, or an IRStmt_Exit).  Flushing also takes place
-   when there is no space to add a new event.
+   if (UNLIKELY((kind & BatchDnt) == BatchDnt)) {
+      cachesim_D1_doref(data_addr, data_size, cc, REF_WRITE_NT, n->instr_addr);
+      cc->Dw.a++;
+   } else if (kind & BatchDr) {
+      cachesim_D1_doref(data_addr, data_size, cc, REF_READ, n->instr_addr);
+      cc->Dr.a++;
+   } else if (kind & BatchDw) {
+      cachesim_D1_doref(data_addr, data_size, cc, REF_WRITE, n->instr_addr);
+      cc->Dw.a++;
+   }
+}
 
-   If we require the simulation statistics to be up to date with
-   respect to possible memory exceptions, then the list would have to
-   be flushed before each memory reference.  That would however lose
-   performance by inhibiting event-merging during flushing.
+static void trace_write_batch(void);
 
-   Flushing the list consists of walking it start to end and emitting
-   instrumentation IR for each event, in the order in which they
-   appear.  It may be possible to emit a single call for two adjacent
-   events in order to reduce the number of helper function calls made.
-   For example, it could well be profitable to handle two adjacent Ir
-   events with a single helper call.  */
+static void cachesim_drain_batch(void)
+{
+   Int i;
 
-typedef
-   IRExpr 
-   IRAtom;
+   if (trace_fd >= 0)
+      trace_write_batch();
 
-typedef 
-   enum { 
-      Ev_IrNoX,  // Instruction read not crossing cache lines
-      Ev_IrGen,  // Generic Ir, not being detected as IrNoX
-      Ev_Dr,     // Data read
-      Ev_Dw,     // Data write
-      Ev_Dm,     // Data modify (read then write)
-      Ev_Bc,     // branch conditional
-      Ev_Bi      // branch indirect (to unknown destination)
+   for (i = 0; i < batch_used; i++) {
+      const BatchRef* r = &batch_refs[i];
+      cachesim_batch_ref(r->n, r->n->parent, r->kind, r->data_addr, r->data_size);
    }
-   EventTag;
+   batch_used = 0;
+}
 
-typedef
-   struct {
-      EventTag   tag;
-      InstrInfo* inode;
-      union {
-         struct {
-         } IrGen;
-         struct {
-         } IrNoX;
-         struct {
-            IRAtom* ea;
-            Int     szB;
-         } Dr;
-         struct {
-            IRAtom* ea;
-            Int     szB;
-         } Dw;
-         struct {
-            IRAtom* ea;
-            Int     szB;
-         } Dm;
-         struct {
-            IRAtom* taken; /* :: Ity_I1 */
-         } Bc;
-         struct {
-            IRAtom* dst;
-         } Bi;
-      } Ev;
+/* --cache-sim-threads=private: the references of the thread that ran
+   last are simulated in its D1 before the next thread's are. */
+static void cg_start_client_code(ThreadId tid, ULong blocks_done)
+{
+   if (tid != sim_tid) {
+      cachesim_drain_batch();
+      sim_tid = tid;
    }
-   Event;
+}
 
-static void init_Event ( Event* ev ) {
-   VG_(memset)(ev, 0, sizeof(Event));
+__attribute__((always_inline))
+static __inline__
+void batch_ref(InstrInfo* n, UChar kind, Addr data_addr, Word data_size)
+{
+   BatchRef* r = &batch_refs[batch_used];
+
+   r->n = n;
+   r->data_addr = data_addr;
+   r->data_size = data_size;
+   r->kind = kind;
+   if (UNLIKELY(++batch_used == clo_cache_sim_batch))
+      cachesim_drain_batch();
 }
 
-static IRAtom* get_Event_dea ( Event* ev ) {
-   switch (ev->tag) {
-      case Ev_Dr: return ev->Ev.Dr.ea;
-      case Ev_Dw: return ev->Ev.Dw.ea;
-      case Ev_Dm: return ev->Ev.Dm.ea;
-      default:    tl_assert(0);
-   }
+static VG_REGPARM(1)
+void log_1IrGen_0D_cache_batch(InstrInfo* n)
+{
+   batch_ref(n, BatchIrGen, 0, 0);
 }
 
-static Int get_Event_dszB ( Event* ev ) {
-   switch (ev->tag) {
-      case Ev_Dr: return ev->Ev.Dr.szB;
-      case Ev_Dw: return ev->Ev.Dw.szB;
-      case Ev_Dm: return ev->Ev.Dm.szB;
-      default:    tl_assert(0);
-   }
+static VG_REGPARM(1)
+void log_1IrNoX_0D_cache_batch(InstrInfo* n)
+{
+   batch_ref(n, BatchIrNoX, 0, 0);
 }
 
+static VG_REGPARM(2)
+void log_2IrNoX_0D_cache_batch(InstrInfo* n, InstrInfo* n2)
+{
+   batch_ref(n, BatchIrNoX, 0, 0);
+   batch_ref(n2, BatchIrNoX, 0, 0);
+}
 
-/* Up to this many unnotified events are allowed.  Number is
-   arbitrary.  Larger numbers allow more event merging to occur, but
-   potentially induce more spilling due to extending live ranges of
-   address temporaries. */
-#define N_EVENTS 16
+static VG_REGPARM(3)
+void log_3IrNoX_0D_cache_batch(InstrInfo* n, InstrInfo* n2, InstrInfo* n3)
+{
+   batch_ref(n, BatchIrNoX, 0, 0);
+   batch_ref(n2, BatchIrNoX, 0, 0);
+   batch_ref(n3, BatchIrNoX, 0, 0);
+}
 
+static VG_REGPARM(3)
+void log_1IrNoX_1Dr_cache_batch(InstrInfo* n, Addr data_addr, Word data_size)
+{
+   batch_ref(n, BatchIrNoX | BatchDr, data_addr, data_size);
+}
 
-/* A struct which holds all the running state during instrumentation.
-   Mostly to avoid passing loads of parameters everywhere. */
-typedef
-   struct {
-      /* The current outstanding-memory-event list. */
-      Event events[N_EVENTS];
-      Int   events_used;
+static VG_REGPARM(3)
+void log_1IrNoX_1Dw_cache_batch(InstrInfo* n, Addr data_addr, Word data_size)
+{
+   batch_ref(n, BatchIrNoX | BatchDw, data_addr, data_size);
+}
 
-      /* The array of InstrInfo bins for the BB. */
-      SB_info* sbInfo;
+/* Same prototype as log_0Ir_1Dr_cache_access, for addEvent_D_guarded. */
+static VG_REGPARM(3)
+void log_0Ir_1Dr_cache_batch(InstrInfo* n, Addr data_addr, Word data_size)
+{
+   batch_ref(n, BatchDr, data_addr, data_size);
+}
 
-      /* Number InstrInfo bins 'used' so far. */
-      Int sbInfo_i;
+static VG_REGPARM(3)
+void log_0Ir_1Dw_cache_batch(InstrInfo* n, Addr data_addr, Word data_size)
+{
+   batch_ref(n, BatchDw, data_addr, data_size);
+}
 
-      /* The output SB being constructed. */
-      IRSB* sbOut;
+static VG_REGPARM(3)
+void log_0Ir_1Dnt_cache_batch(InstrInfo* n, Addr data_addr, Word data_size)
+{
+   batch_ref(n, BatchDnt, data_addr, data_size);
+}
+
+/* Replace a cache helper chosen by the instrumenter by its batching
+   counterpart, if --cache-sim-batch is on.  Other helpers are kept. */
+static void batch_helper(const HChar** helperName, void** helperAddr)
+{
+   static const struct {
+      void* plain;
+      void* batch;
+      const HChar* name;
+   } helpers[] = {
+      { &log_1IrGen_0D_cache_access,  &log_1IrGen_0D_cache_batch,  "log_1IrGen_0D_cache_batch" },
+      { &log_1IrNoX_0D_cache_access,  &log_1IrNoX_0D_cache_batch,  "log_1IrNoX_0D_cache_batch" },
+      { &log_2IrNoX_0D_cache_access,  &log_2IrNoX_0D_cache_batch,  "log_2IrNoX_0D_cache_batch" },
+      { &log_3IrNoX_0D_cache_access,  &log_3IrNoX_0D_cache_batch,  "log_3IrNoX_0D_cache_batch" },
+      { &log_1IrNoX_1Dr_cache_access, &log_1IrNoX_1Dr_cache_batch, "log_1IrNoX_1Dr_cache_batch" },
+      { &log_1IrNoX_1Dw_cache_access, &log_1IrNoX_1Dw_cache_batch, "log_1IrNoX_1Dw_cache_batch" },
+      { &log_0Ir_1Dr_cache_access,    &log_0Ir_1Dr_cache_batch,    "log_0Ir_1Dr_cache_batch" },
+      { &log_0Ir_1Dw_cache_access,    &log_0Ir_1Dw_cache_batch,    "log_0Ir_1Dw_cache_batch" },
+      { &log_0Ir_1Dnt_cache_access,   &log_0Ir_1Dnt_cache_batch,   "log_0Ir_1Dnt_cache_batch" },
+   };
+   UInt i;
+
+   if (clo_cache_sim_batch == 0)
+      return;
+   for (i = 0; i < sizeof(helpers) / sizeof(helpers[0]); i++) {
+      if (*helperAddr == helpers[i].plain) {
+         *helperName = helpers[i].name;
+         *helperAddr = helpers[i].batch;
+         return;
+      }
    }
-   CgState;
+}
 
 
 /*------------------------------------------------------------*/
-/*--- Instrumentation main                                 ---*/
+/*--- Sampled cache simulation                             ---*/
 /*------------------------------------------------------------*/
 
-// Note that origAddr is the real origAddr, not the address of the first
-// instruction in the block (they can be different due to redirection).
-static
-SB_info* get_SB_info(IRSB* sbIn, Addr origAddr)
+/* --sim-sample=<on>:<off>[:<warmup>] only measures the caches in
+   intervals of <on> instructions.  <warmup> instructions precede each
+   interval; they are simulated, to refill the caches, but their misses
+   go to sample_warm_CCs.  The <off> instructions after it are
+   fast-forwarded: only their accesses are counted.  The instructions are
+   counted down by IR at the start of each superblock, as for
+   --cig-epoch, and sample_tick moves on to the next phase.
+
+   Translations can only be discarded from client requests, not from
+   sample_tick, so the cache helpers are replaced by ones that look at
+   the phase when they run instead of being chosen when a superblock is
+   instrumented.
+
+   The accesses outside the measured intervals are counted in
+   LineCC.Smp.  The cachegrind.out file extrapolates each line's misses
+   by the ratio of its accesses to its measured ones; a line that was
+   never measured gets none.  Its header gives the totals with a 95%
+   confidence interval, from the spread of the miss rates of the
+   measured intervals.  The other output files only hold what was
+   measured. */
+
+typedef enum { SAMPLE_WARM, SAMPLE_ON, SAMPLE_OFF } SamplePhase;
+
+static Bool        sim_sample = False;
+static SamplePhase sample_phase = SAMPLE_WARM;
+static Word        sample_left = 0;     /* instructions until the next tick */
+static Word        sample_budget = 0;   /* sample_left when last set */
+static ULong       sample_instrs[3];    /* instructions run in each phase */
+
+/* The L1 (I1 + D1) and LL miss rates of the measured intervals, summed
+   and summed squared, per configuration, and the references and misses
+   of the current interval, counted by sample_ref. */
+static UInt        sample_n = 0;
+static Double      sample_L1_sum[MAX_SIM_CFGS], sample_L1_sum2[MAX_SIM_CFGS];
+static Double      sample_LL_sum[MAX_SIM_CFGS], sample_LL_sum2[MAX_SIM_CFGS];
+static ULong       sample_refs;
+static ULong       sample_L1[MAX_SIM_CFGS], sample_LL[MAX_SIM_CFGS];
+
+/* Take the misses of the warm-up intervals, chained like the line CCs of
+   the configurations.  Not in any CC table. */
+static LineCC      sample_warm_CCs[MAX_SIM_CFGS];
+
+__attribute__((always_inline))
+static __inline__
+void sample_ref(InstrInfo* n, UInt kind, Addr data_addr, Word data_size)
 {
-   Int      i, n_instrs;
-   IRStmt*  st;
-   SB_info* sbInfo;
-
-   // Count number of original instrs in SB
-   n_instrs = 0;
-   for (i = 0; i < sbIn->stmts_used; i++) {
-      st = sbIn->stmts[i];
-      if (Ist_IMark == st->tag) n_instrs++;
+   LineCC *cc = n->parent, *line;
+   UInt    k;
+
+   if (sample_phase == SAMPLE_ON) {
+      /* The misses of the reference are the growth of the line's. */
+      for (k = 0, line = cc; k < n_sim_cfgs; k++, line = line->next_cfg) {
+         sample_L1[k] -= line->Ir.m1 + line->Dr.m1 + line->Dw.m1;
+         sample_LL[k] -= line->Ir.mL + line->Dr.mL + line->Dw.mL;
+      }
+      cachesim_batch_ref(n, cc, kind, data_addr, data_size);
+      for (k = 0, line = cc; k < n_sim_cfgs; k++, line = line->next_cfg) {
+         sample_L1[k] += line->Ir.m1 + line->Dr.m1 + line->Dw.m1;
+         sample_LL[k] += line->Ir.mL + line->Dr.mL + line->Dw.mL;
+      }
+      if (kind & (BatchIrNoX | BatchIrGen))
+         sample_refs++;
+      if (kind & (BatchDr | BatchDw))
+         sample_refs++;
+      return;
    }
+   if (sample_phase == SAMPLE_WARM)
+      cachesim_batch_ref(n, sample_warm_CCs, kind, data_addr, data_size);
+   if (kind & (BatchIrNoX | BatchIrGen))
+      cc->Smp.Ir++;
+   if ((kind & BatchDnt) == BatchDr)
+      cc->Smp.Dr++;
+   else if (kind & BatchDw)
+      cc->Smp.Dw++;
+}
 
-   // Check that we don't have an entry for this BB in the instr-info table.
-   // If this assertion fails, there has been some screwup:  some
-   // translations must have been discarded but Cachegrind hasn't discarded
-   // the corresponding entries in the instr-info table.
-   sbInfo = VG_(OSetGen_Lookup)(instrInfoTable, &origAddr);
-   tl_assert(NULL == sbInfo);
+static VG_REGPARM(1)
+void log_1IrGen_0D_cache_sample(InstrInfo* n)
+{
+   sample_ref(n, BatchIrGen, 0, 0);
+}
 
-   // BB never translated before (at this address, at least;  could have
-   // been unloaded and then reloaded elsewhere in memory)
-   sbInfo = VG_(OSetGen_AllocNode)(instrInfoTable,
-                                sizeof(SB_info) + n_instrs*sizeof(InstrInfo)); 
-   sbInfo->SB_addr  = origAddr;
-   sbInfo->n_instrs = n_instrs;
-   VG_(OSetGen_Insert)( instrInfoTable, sbInfo );
+static VG_REGPARM(1)
+void log_1IrNoX_0D_cache_sample(InstrInfo* n)
+{
+   sample_ref(n, BatchIrNoX, 0, 0);
+}
 
-   return sbInfo;
+static VG_REGPARM(2)
+void log_2IrNoX_0D_cache_sample(InstrInfo* n, InstrInfo* n2)
+{
+   sample_ref(n, BatchIrNoX, 0, 0);
+   sample_ref(n2, BatchIrNoX, 0, 0);
 }
 
+static VG_REGPARM(3)
+void log_3IrNoX_0D_cache_sample(InstrInfo* n, InstrInfo* n2, InstrInfo* n3)
+{
+   sample_ref(n, BatchIrNoX, 0, 0);
+   sample_ref(n2, BatchIrNoX, 0, 0);
+   sample_ref(n3, BatchIrNoX, 0, 0);
+}
 
-static void showEvent ( Event* ev )
+static VG_REGPARM(3)
+void log_1IrNoX_1Dr_cache_sample(InstrInfo* n, Addr data_addr, Word data_size)
 {
-   switch (ev->tag) {
-      case Ev_IrGen:
-         VG_(printf)("IrGen %p\n", ev->inode);
-         break;
-      case Ev_IrNoX:
-         VG_(printf)("IrNoX %p\n", ev->inode);
-         break;
-      case Ev_Dr:
-         VG_(printf)("Dr %p %d EA=", ev->inode, ev->Ev.Dr.szB);
-         ppIRExpr(ev->Ev.Dr.ea); 
-         VG_(printf)("\n");
+   sample_ref(n, BatchIrNoX | BatchDr, data_addr, data_size);
+}
+
+static VG_REGPARM(3)
+void log_1IrNoX_1Dw_cache_sample(InstrInfo* n, Addr data_addr, Word data_size)
+{
+   sample_ref(n, BatchIrNoX | BatchDw, data_addr, data_size);
+}
+
+/* Same prototype as log_0Ir_1Dr_cache_access, for addEvent_D_guarded. */
+static VG_REGPARM(3)
+void log_0Ir_1Dr_cache_sample(InstrInfo* n, Addr data_addr, Word data_size)
+{
+   sample_ref(n, BatchDr, data_addr, data_size);
+}
+
+static VG_REGPARM(3)
+void log_0Ir_1Dw_cache_sample(InstrInfo* n, Addr data_addr, Word data_size)
+{
+   sample_ref(n, BatchDw, data_addr, data_size);
+}
+
+static VG_REGPARM(3)
+void log_0Ir_1Dnt_cache_sample(InstrInfo* n, Addr data_addr, Word data_size)
+{
+   sample_ref(n, BatchDnt, data_addr, data_size);
+}
+
+/* Replace a cache helper chosen by the instrumenter by its sampling
+   counterpart, if --sim-sample is on.  Other helpers are kept. */
+static void sample_helper(const HChar** helperName, void** helperAddr)
+{
+   static const struct {
+      void* plain;
+      void* sample;
+      const HChar* name;
+   } helpers[] = {
+      { &log_1IrGen_0D_cache_access,  &log_1IrGen_0D_cache_sample,  "log_1IrGen_0D_cache_sample" },
+      { &log_1IrNoX_0D_cache_access,  &log_1IrNoX_0D_cache_sample,  "log_1IrNoX_0D_cache_sample" },
+      { &log_2IrNoX_0D_cache_access,  &log_2IrNoX_0D_cache_sample,  "log_2IrNoX_0D_cache_sample" },
+      { &log_3IrNoX_0D_cache_access,  &log_3IrNoX_0D_cache_sample,  "log_3IrNoX_0D_cache_sample" },
+      { &log_1IrNoX_1Dr_cache_access, &log_1IrNoX_1Dr_cache_sample, "log_1IrNoX_1Dr_cache_sample" },
+      { &log_1IrNoX_1Dw_cache_access, &log_1IrNoX_1Dw_cache_sample, "log_1IrNoX_1Dw_cache_sample" },
+      { &log_0Ir_1Dr_cache_access,    &log_0Ir_1Dr_cache_sample,    "log_0Ir_1Dr_cache_sample" },
+      { &log_0Ir_1Dw_cache_access,    &log_0Ir_1Dw_cache_sample,    "log_0Ir_1Dw_cache_sample" },
+      { &log_0Ir_1Dnt_cache_access,   &log_0Ir_1Dnt_cache_sample,   "log_0Ir_1Dnt_cache_sample" },
+   };
+   UInt i;
+
+   if (!sim_sample)
+      return;
+   for (i = 0; i < sizeof(helpers) / sizeof(helpers[0]); i++) {
+      if (*helperAddr == helpers[i].plain) {
+         *helperName = helpers[i].name;
+         *helperAddr = helpers[i].sample;
+         return;
+      }
+   }
+}
+
+static void sample_enter(SamplePhase phase)
+{
+   Long n = phase == SAMPLE_WARM ? clo_sim_sample_warm
+          : phase == SAMPLE_ON   ? clo_sim_sample_on
+          :                        clo_sim_sample_off;
+
+   sample_phase = phase;
+   sample_budget = (Word)n;
+   sample_left = sample_budget;
+}
+
+// Adds the miss rates of the measured interval that just ended.
+static void sample_interval_end(void)
+{
+   Double r;
+   UInt   k;
+
+   if (sample_refs > 0) {
+      for (k = 0; k < n_sim_cfgs; k++) {
+         r = (Double)sample_L1[k] / sample_refs;
+         sample_L1_sum[k]  += r;
+         sample_L1_sum2[k] += r * r;
+         r = (Double)sample_LL[k] / sample_refs;
+         sample_LL_sum[k]  += r;
+         sample_LL_sum2[k] += r * r;
+      }
+      sample_n++;
+   }
+   sample_refs = 0;
+   VG_(memset)(sample_L1, 0, sizeof(sample_L1));
+   VG_(memset)(sample_LL, 0, sizeof(sample_LL));
+}
+
+static void sample_tick(void)
+{
+   sample_instrs[sample_phase] += sample_budget - sample_left;
+   switch (sample_phase) {
+      case SAMPLE_WARM:
+         sample_enter(SAMPLE_ON);
+         break;
+      case SAMPLE_ON:
+         sample_interval_end();
+         sample_enter(SAMPLE_OFF);
+         break;
+      case SAMPLE_OFF:
+         sample_enter(clo_sim_sample_warm > 0 ? SAMPLE_WARM : SAMPLE_ON);
+         break;
+   }
+}
+
+static void sample_init(void)
+{
+   UInt k;
+
+   for (k = 0; k < n_sim_cfgs; k++) {
+      sample_warm_CCs[k].loc.file = get_perm_string("(warm-up)");
+      sample_warm_CCs[k].loc.fn   = get_perm_string("(warm-up)");
+      sample_warm_CCs[k].next_cfg = k + 1 < n_sim_cfgs ? &sample_warm_CCs[k + 1]
+                                                       : NULL;
+   }
+   sample_enter(clo_sim_sample_warm > 0 ? SAMPLE_WARM : SAMPLE_ON);
+}
+
+// The counts are zeroed (cg.zero): start the statistics again.
+static void sample_zero(void)
+{
+   sample_n = 0;
+   sample_refs = 0;
+   VG_(memset)(sample_instrs, 0, sizeof(sample_instrs));
+   VG_(memset)(sample_L1_sum, 0, sizeof(sample_L1_sum));
+   VG_(memset)(sample_L1_sum2, 0, sizeof(sample_L1_sum2));
+   VG_(memset)(sample_LL_sum, 0, sizeof(sample_LL_sum));
+   VG_(memset)(sample_LL_sum2, 0, sizeof(sample_LL_sum2));
+   VG_(memset)(sample_L1, 0, sizeof(sample_L1));
+   VG_(memset)(sample_LL, 0, sizeof(sample_LL));
+   sample_budget = sample_left;
+}
+
+// The interval running at exit is measured too.
+static void sample_finish(void)
+{
+   sample_instrs[sample_phase] += sample_budget - sample_left;
+   sample_budget = sample_left;
+   if (sample_phase == SAMPLE_ON)
+      sample_interval_end();
+}
+
+static ULong sample_scale(ULong m, ULong measured, ULong total)
+{
+   if (measured == 0 || measured == total)
+      return m;
+   return (ULong)((Double)m * total / measured + 0.5);
+}
+
+static void sample_scale_CacheCC(CacheCC* cc, ULong unmeasured)
+{
+   ULong total = cc->a + unmeasured;
+
+   cc->m1     = sample_scale(cc->m1,     cc->a, total);
+   cc->m2     = sample_scale(cc->m2,     cc->a, total);
+   cc->mL     = sample_scale(cc->mL,     cc->a, total);
+   cc->m1_inv = sample_scale(cc->m1_inv, cc->a, total);
+   cc->m1_opt = sample_scale(cc->m1_opt, cc->a, total);
+   cc->a      = total;
+}
+
+// Copies `lineCC` to `out` with its counts extrapolated to all its
+// accesses.  The counts that follow from data references are scaled as
+// the data misses are.
+static LineCC* sample_extrapolate(LineCC* out, const LineCC* lineCC)
+{
+   ULong d = lineCC->Dr.a + lineCC->Dw.a;
+   ULong t = d + lineCC->Smp.Dr + lineCC->Smp.Dw;
+
+   *out = *lineCC;
+   sample_scale_CacheCC(&out->Ir, lineCC->Smp.Ir);
+   sample_scale_CacheCC(&out->Dr, lineCC->Smp.Dr);
+   sample_scale_CacheCC(&out->Dw, lineCC->Smp.Dw);
+   out->Pf.issued    = sample_scale(out->Pf.issued,    d, t);
+   out->Pf.useful    = sample_scale(out->Pf.useful,    d, t);
+   out->Pf.late      = sample_scale(out->Pf.late,      d, t);
+   out->Pf.polluting = sample_scale(out->Pf.polluting, d, t);
+   out->Tr.wb_D1     = sample_scale(out->Tr.wb_D1,     d, t);
+   out->Tr.wb_L2     = sample_scale(out->Tr.wb_L2,     d, t);
+   out->Tr.wb_LL     = sample_scale(out->Tr.wb_LL,     d, t);
+   out->Tr.mem_rd    = sample_scale(out->Tr.mem_rd,    d, t);
+   out->Tr.mem_wr    = sample_scale(out->Tr.mem_wr,    d, t);
+   out->Tlb.mr       = sample_scale(out->Tlb.mr,       d, t);
+   out->Tlb.mw       = sample_scale(out->Tlb.mw,       d, t);
+   out->Tlb.walk_r   = sample_scale(out->Tlb.walk_r,   d, t);
+   out->Tlb.walk_w   = sample_scale(out->Tlb.walk_w,   d, t);
+   return out;
+}
+
+static Double sample_sqrt(Double x)
+{
+   Double r = x > 1.0 ? x : 1.0;
+   Int    i;
+
+   if (x <= 0.0)
+      return 0.0;
+   for (i = 0; i < 64; i++)
+      r = (r + x / r) / 2;
+   return r;
+}
+
+// The half width of the 95% confidence interval of `refs` references'
+// misses, from the miss rates of the measured intervals.
+static ULong sample_ci95(Double sum, Double sum2, ULong refs)
+{
+   Double var;
+
+   if (sample_n < 2)
+      return 0;
+   var = (sum2 - sum * sum / sample_n) / (sample_n - 1);
+   return (ULong)(1.96 * sample_sqrt(var / sample_n) * refs + 0.5);
+}
+
+// "desc:" lines with the sampling parameters and the extrapolated totals.
+static void fprint_sample_desc(VgFile *fp, UInt cfg)
+{
+   LineCC *lineCC, scaled;
+   ULong  refs = 0, L1 = 0, LL = 0, all;
+
+   VG_(OSetGen_ResetIter)(cfg_CC_tables[cfg]);
+   while ( (lineCC = VG_(OSetGen_Next)(cfg_CC_tables[cfg])) ) {
+      sample_extrapolate(&scaled, lineCC);
+      refs += scaled.Ir.a + scaled.Dr.a + scaled.Dw.a;
+      L1   += scaled.Ir.m1 + scaled.Dr.m1 + scaled.Dw.m1;
+      LL   += scaled.Ir.mL + scaled.Dr.mL + scaled.Dw.mL;
+   }
+   all = sample_instrs[SAMPLE_WARM] + sample_instrs[SAMPLE_ON]
+       + sample_instrs[SAMPLE_OFF] + (sample_budget - sample_left);
+
+   VG_(fprintf)(fp, "desc: Sampling:         %lld on, %lld off, %lld warm-up "
+                    "instructions\n",
+                clo_sim_sample_on, clo_sim_sample_off, clo_sim_sample_warm);
+   VG_(fprintf)(fp, "desc: Measured:         %llu of %llu instructions, "
+                    "%u intervals\n",
+                sample_instrs[SAMPLE_ON]
+                   + (sample_phase == SAMPLE_ON ? sample_budget - sample_left : 0),
+                all, sample_n);
+   if (sample_n < 2) {
+      VG_(fprintf)(fp, "desc: L1 misses:        %llu (extrapolated)\n", L1);
+      VG_(fprintf)(fp, "desc: LL misses:        %llu (extrapolated)\n", LL);
+   } else {
+      VG_(fprintf)(fp, "desc: L1 misses:        %llu +- %llu (extrapolated, "
+                       "95%% confidence)\n",
+                   L1, sample_ci95(sample_L1_sum[cfg], sample_L1_sum2[cfg], refs));
+      VG_(fprintf)(fp, "desc: LL misses:        %llu +- %llu (extrapolated, "
+                       "95%% confidence)\n",
+                   LL, sample_ci95(sample_LL_sum[cfg], sample_LL_sum2[cfg], refs));
+   }
+}
+
+/* Subtract the `n_instrs` instructions of the superblock being built
+   from `*left`, and call `tick` if it goes below zero. */
+#if defined(VG_BIGENDIAN)
+# define CGEndness Iend_BE
+#elif defined(VG_LITTLEENDIAN)
+# define CGEndness Iend_LE
+#else
+# error "Unknown endianness"
+#endif
+
+static void countdown_instrument(IRSB* sbOut, IRType hWordTy, UInt n_instrs,
+                                 Word* left, const HChar* tick_name,
+                                 void (*tick)(void))
+{
+   Bool     is64 = (hWordTy == Ity_I64);
+   IRTemp   t1 = newIRTemp(sbOut->tyenv, hWordTy);
+   IRTemp   t2 = newIRTemp(sbOut->tyenv, hWordTy);
+   IRTemp   g  = newIRTemp(sbOut->tyenv, Ity_I1);
+   IRDirty* di;
+
+   addStmtToIRSB(sbOut, IRStmt_WrTmp(t1,
+      IRExpr_Load(CGEndness, hWordTy, mkIRExpr_HWord((HWord)left))));
+   addStmtToIRSB(sbOut, IRStmt_WrTmp(t2,
+      IRExpr_Binop(is64 ? Iop_Sub64 : Iop_Sub32, IRExpr_RdTmp(t1),
+                   is64 ? IRExpr_Const(IRConst_U64(n_instrs))
+                        : IRExpr_Const(IRConst_U32(n_instrs)))));
+   addStmtToIRSB(sbOut, IRStmt_Store(CGEndness,
+      mkIRExpr_HWord((HWord)left), IRExpr_RdTmp(t2)));
+   addStmtToIRSB(sbOut, IRStmt_WrTmp(g,
+      IRExpr_Binop(is64 ? Iop_CmpLT64S : Iop_CmpLT32S, IRExpr_RdTmp(t2),
+                   is64 ? IRExpr_Const(IRConst_U64(0))
+                        : IRExpr_Const(IRConst_U32(0)))));
+   di = unsafeIRDirty_0_N(0, tick_name, VG_(fnptr_to_fnentry)(tick),
+                          mkIRExprVec_0());
+   di->guard = IRExpr_RdTmp(g);
+   addStmtToIRSB(sbOut, IRStmt_Dirty(di));
+}
+
+/* Count the `n_instrs` instructions of the superblock being built. */
+static void sample_instrument(IRSB* sbOut, IRType hWordTy, UInt n_instrs)
+{
+   countdown_instrument(sbOut, hWordTy, n_instrs, &sample_left,
+                        "sample_tick", &sample_tick);
+}
+
+
+/*------------------------------------------------------------*/
+/*--- Instruction-side CIG                                 ---*/
+/*------------------------------------------------------------*/
+
+/* --cig-ifetch=yes builds the instruction-side CIG of cg_sim.c.  Its
+   nodes are the functions whose code was fetched, by name and object,
+   as functions of different objects may have the same name (static
+   ones, or "(below main)").  The extent of a function is that of its
+   instructions seen so far.  The graph is written at exit, for
+   cu_order, which computes a function order from it and predicts its
+   I1 misses by replaying a --trace-out trace with --code-layout: the
+   code of the functions listed there is moved before it is simulated. */
+
+typedef struct {
+   const HChar* name;    // perm strings, compared by address
+   const HChar* obj;
+} FnKey;
+
+typedef struct {
+   FnKey        key;
+   UInt         id;
+   Addr         lo, hi;  // the instructions seen are in [lo, hi)
+} FnNode;
+
+static OSet*    fn_table = NULL;
+static FnNode** fn_array = NULL;  // by id - 1
+static UInt     n_fns = 0, fn_array_size = 0;
+
+static Word cmp_FnKey_FnNode(const void* vkey, const void* vnode)
+{
+   const FnKey* a = vkey;
+   const FnKey* b = &((const FnNode*)vnode)->key;
+
+   if (a->name != b->name)
+      return (UWord)a->name < (UWord)b->name ? -1 : 1;
+   if (a->obj != b->obj)
+      return (UWord)a->obj < (UWord)b->obj ? -1 : 1;
+   return 0;
+}
+
+// Adds the instruction at `a` of `line` to the graph's function.  Code
+// without a function name is left out.  A line is only ever given one
+// function, that of its first instruction: the instructions of a line
+// of the same name in another object do not extend it.
+static void icig_note_instr(LineCC* line, Addr a, UInt len)
+{
+   const HChar* obj;
+   FnKey  key;
+   FnNode* fn;
+
+   if (VG_(strcmp)(line->loc.fn, "???") == 0)
+      return;
+   // A replayed address is not in the objects of the replaying client.
+   if (clo_trace_in || !VG_(get_objname)(VG_(current_DiEpoch)(), a, &obj))
+      obj = "???";
+   key.name = line->loc.fn;
+   key.obj  = get_perm_string(obj);
+
+   if (line->fn_id == 0) {
+      fn = VG_(OSetGen_Lookup)(fn_table, &key);
+      if (fn == NULL) {
+         fn = VG_(OSetGen_AllocNode)(fn_table, sizeof(FnNode));
+         fn->key = key;
+         fn->id  = ++n_fns;
+         fn->lo  = a;
+         fn->hi  = a + len;
+         VG_(OSetGen_Insert)(fn_table, fn);
+         if (n_fns > fn_array_size) {
+            fn_array_size = 2 * fn_array_size + 256;
+            fn_array = VG_(realloc)("cg.main.icig.1", fn_array,
+                                    fn_array_size * sizeof(FnNode*));
+         }
+         fn_array[fn->id - 1] = fn;
+      }
+      line->fn_id = fn->id;
+   }
+
+   fn = fn_array[line->fn_id - 1];
+   if (fn->key.obj != key.obj)
+      return;
+   if (a < fn->lo)
+      fn->lo = a;
+   if (a + len > fn->hi)
+      fn->hi = a + len;
+}
+
+/* --code-layout=<file> lists the code to move, a range per line:
+
+     <from> <to> <new_from>
+
+   in hex, where [from, to) moves to new_from.  Empty lines and lines
+   starting with '#' are skipped. */
+typedef struct {
+   Addr from, to, new_from;
+} CodeMove;
+
+static CodeMove* code_moves = NULL;   // sorted by `from`
+static UInt      n_code_moves = 0;
+
+static Int cmp_CodeMove(const void* va, const void* vb)
+{
+   const CodeMove* a = va;
+   const CodeMove* b = vb;
+   return a->from < b->from ? -1 : a->from > b->from ? 1 : 0;
+}
+
+static void code_layout_bad(UInt line_no)
+{
+   VG_(fmsg)("malformed --code-layout file '%s', line %u\n",
+             clo_code_layout, line_no);
+   VG_(exit)(1);
+}
+
+static void code_layout_read(void)
+{
+   Int    size = 0, max = 4096, n, fd;
+   UInt   i, line_no = 0, max_moves = 0;
+   HChar  *buf, *p, *end;
+   SysRes sres = VG_(open)(clo_code_layout, VKI_O_RDONLY, 0);
+
+   if (sr_isError(sres)) {
+      VG_(fmsg)("can't open --code-layout file '%s'\n", clo_code_layout);
+      VG_(exit)(1);
+   }
+   fd = sr_Res(sres);
+   buf = VG_(malloc)("cg.main.crl.1", max + 1);
+   while ((n = VG_(read)(fd, buf + size, max - size)) > 0) {
+      size += n;
+      if (size == max) {
+         max *= 2;
+         buf = VG_(realloc)("cg.main.crl.1", buf, max + 1);
+      }
+   }
+   VG_(close)(fd);
+   buf[size] = 0;
+
+   for (p = buf; *p; p = end) {
+      CodeMove m;
+      HChar* next = VG_(strchr)(p, '\n');
+      end = next ? next + 1 : p + VG_(strlen)(p);
+      if (next)
+         *next = 0;
+      line_no++;
+      while (VG_(isspace)(*p))
+         p++;
+      if (*p == 0 || *p == '#')
+         continue;
+
+      m.from     = VG_(strtoull16)(p, &p);
+      m.to       = VG_(strtoull16)(p, &p);
+      m.new_from = VG_(strtoull16)(p, &p);
+      while (VG_(isspace)(*p))
+         p++;
+      if (*p != 0 || m.from >= m.to)
+         code_layout_bad(line_no);
+      if (n_code_moves == max_moves) {
+         max_moves = 2 * max_moves + 256;
+         code_moves = VG_(realloc)("cg.main.crl.2", code_moves,
+                                   max_moves * sizeof(CodeMove));
+      }
+      code_moves[n_code_moves++] = m;
+   }
+   VG_(free)(buf);
+
+   VG_(ssort)(code_moves, n_code_moves, sizeof(CodeMove), cmp_CodeMove);
+   for (i = 1; i < n_code_moves; i++) {
+      if (code_moves[i].from < code_moves[i - 1].to) {
+         VG_(fmsg)("--code-layout file '%s' moves overlapping ranges\n",
+                   clo_code_layout);
+         VG_(exit)(1);
+      }
+   }
+}
+
+// The address of the code at `a` after the moves of --code-layout.
+static Addr code_layout_move(Addr a)
+{
+   UInt lo = 0, hi = n_code_moves;
+
+   while (lo < hi) {
+      UInt mid = (lo + hi) / 2;
+      if (a < code_moves[mid].from)
+         hi = mid;
+      else if (a >= code_moves[mid].to)
+         lo = mid + 1;
+      else
+         return code_moves[mid].new_from + (a - code_moves[mid].from);
+   }
+   return a;
+}
+
+
+/*------------------------------------------------------------*/
+/*--- Trace capture and replay                             ---*/
+/*------------------------------------------------------------*/
+
+/* --trace-out=<file> writes every reference the cache simulators see to
+   a file, so that other cache configurations can be simulated later with
+   --trace-in=<file> (see cg_replay) without running the program again.
+   Capture goes through the batch buffer: each drain encodes the buffered
+   records into a large output buffer before simulating them.
+
+   The file starts with two text lines, the magic line and the "cmd:"
+   line of the traced run, followed by records made of a byte and
+   ULEB128 varints ("sleb" ones are zigzag encoded):
+
+     TRACE_LINE   file, fn (length then bytes), line    defines line id n
+     TRACE_INSTR  addr, len byte, line id              defines instr id n
+     TRACE_REG    name (length+1, 0 for none), begin, end
+     TRACE_UNREG  addr
+     TRACE_REG_BLOCK  as TRACE_REG, for a --cig-auto-vars=heap block
+     0x01..0x7f   a reference: the low four bits are its Batch* bits,
+                  the high three log2 of the data size plus one, or 0.
+                  Then the sleb delta of the instr id from the previous
+                  reference, and for Dr/Dw the sleb delta of the data
+                  address from the previous one, followed by the size
+                  byte if it is not a power of two up to 64.
+
+   Ids count from 1 in order of definition; a line or instruction is
+   defined just before its first reference.  Whether an instruction read
+   crosses a line is decided again at replay, for the replayed caches. */
+
+#define TRACE_MAGIC     "cachegrind-trace 1\n"
+#define TRACE_LINE      0x80
+#define TRACE_INSTR     0x81
+#define TRACE_REG       0x82
+#define TRACE_UNREG     0x83
+#define TRACE_REG_BLOCK 0x84
+#define TRACE_BUF_SIZE  (1 << 20)
+
+static UChar* trace_buf = NULL;
+static Int    trace_buf_used = 0;
+static UInt   trace_n_lines = 0;    /* ids defined so far */
+static UInt   trace_n_instrs = 0;
+static UInt   trace_last_instr = 0; /* delta bases */
+static Addr   trace_last_data = 0;
+static ULong  trace_n_refs = 0;
+static ULong  trace_bytes = 0;
+
+static HChar* replay_cmd = NULL;    /* "cmd:" of the traced run */
+
+static void trace_flush(void)
+{
+   if (trace_buf_used > 0
+       && VG_(write)(trace_fd, trace_buf, trace_buf_used) != trace_buf_used) {
+      VG_(umsg)("error: can't write trace file '%s'\n", clo_trace_out);
+      VG_(exit)(1);
+   }
+   trace_bytes += trace_buf_used;
+   trace_buf_used = 0;
+}
+
+/* Makes room for `n` more bytes. */
+static __inline__ void trace_reserve(Int n)
+{
+   if (UNLIKELY(trace_buf_used + n > TRACE_BUF_SIZE))
+      trace_flush();
+}
+
+static __inline__ void trace_put_byte(UChar b)
+{
+   trace_buf[trace_buf_used++] = b;
+}
+
+static __inline__ void trace_put_uleb(ULong v)
+{
+   while (v >= 0x80) {
+      trace_put_byte((UChar)(v | 0x80));
+      v >>= 7;
+   }
+   trace_put_byte((UChar)v);
+}
+
+static __inline__ void trace_put_sleb(Long v)
+{
+   trace_put_uleb(((ULong)v << 1) ^ (ULong)(v >> 63));
+}
+
+static void trace_put_text(const HChar* str, Int len)
+{
+   Int i;
+
+   for (i = 0; i < len; i++) {
+      trace_reserve(1);
+      trace_put_byte(str[i]);
+   }
+}
+
+static void trace_put_string(const HChar* str)
+{
+   Int len = VG_(strlen)(str);
+
+   trace_reserve(10);
+   trace_put_uleb(len);
+   trace_put_text(str, len);
+}
+
+static void trace_def_instr(InstrInfo* n)
+{
+   LineCC* lineCC = n->parent;
+
+   if (lineCC->trace_id == 0) {
+      lineCC->trace_id = ++trace_n_lines;
+      trace_reserve(1);
+      trace_put_byte(TRACE_LINE);
+      trace_put_string(lineCC->loc.file);
+      trace_put_string(lineCC->loc.fn);
+      trace_reserve(10);
+      trace_put_uleb(lineCC->loc.line);
+   }
+   n->trace_id = ++trace_n_instrs;
+   trace_reserve(32);
+   trace_put_byte(TRACE_INSTR);
+   trace_put_uleb(n->instr_addr);
+   trace_put_byte(n->instr_len);
+   trace_put_uleb(lineCC->trace_id);
+}
+
+static void trace_write_batch(void)
+{
+   Int i;
+
+   for (i = 0; i < batch_used; i++) {
+      const BatchRef* r = &batch_refs[i];
+
+      if (UNLIKELY(r->n->trace_id == 0))
+         trace_def_instr(r->n);
+      UInt size = r->data_size;
+      UInt size_code = 0;
+
+      // Almost all accesses are 1, 2, 4, ... or 64 bytes wide.
+      if (size > 0 && size <= 64 && (size & (size - 1)) == 0)
+         size_code = VG_(log2)(size) + 1;
+      trace_reserve(32);
+      trace_put_byte(r->kind | (size_code << 4));
+      trace_put_sleb((Long)r->n->trace_id - (Long)trace_last_instr);
+      trace_last_instr = r->n->trace_id;
+      if (r->kind & (BatchDr | BatchDw)) {
+         trace_put_sleb((Long)(r->data_addr - trace_last_data));
+         if (size_code == 0)
+            trace_put_byte(size);
+         trace_last_data = r->data_addr;
+      }
+   }
+   trace_n_refs += batch_used;
+}
+
+static void trace_register_var(const HChar* name, Addr begin, Addr end,
+                               Bool block)
+{
+   Int len = name ? VG_(strlen)(name) : -1;
+
+   trace_reserve(11);
+   trace_put_byte(block ? TRACE_REG_BLOCK : TRACE_REG);
+   trace_put_uleb(len + 1);
+   if (name)
+      trace_put_text(name, len);
+   trace_reserve(20);
+   trace_put_uleb(begin);
+   trace_put_uleb(end);
+}
+
+static void trace_unregister_var(Addr addr)
+{
+   trace_reserve(11);
+   trace_put_byte(TRACE_UNREG);
+   trace_put_uleb(addr);
+}
+
+static void trace_open(void)
+{
+   HChar* trace_out_file = VG_(expand_file_name)("--trace-out", clo_trace_out);
+   SysRes sres = VG_(open)(trace_out_file, VKI_O_CREAT|VKI_O_TRUNC|VKI_O_WRONLY,
+                           VKI_S_IRUSR|VKI_S_IWUSR);
+   Int i;
+
+   if (sr_isError(sres)) {
+      VG_(fmsg)("can't create trace file '%s'\n", trace_out_file);
+      VG_(exit)(1);
+   }
+   VG_(free)(trace_out_file);
+   trace_fd = sr_Res(sres);
+   trace_buf = VG_(malloc)("cg.main.trace", TRACE_BUF_SIZE);
+
+   trace_put_text(TRACE_MAGIC, VG_(strlen)(TRACE_MAGIC));
+   trace_put_text("cmd: ", 5);
+   trace_put_text(VG_(args_the_exename), VG_(strlen)(VG_(args_the_exename)));
+   for (i = 0; i < VG_(sizeXA)( VG_(args_for_client) ); i++) {
+      HChar* arg = * (HChar**) VG_(indexXA)( VG_(args_for_client), i );
+      trace_put_text(" ", 1);
+      trace_put_text(arg, VG_(strlen)(arg));
+   }
+   trace_put_text("\n", 1);
+}
+
+static void trace_close(void)
+{
+   trace_flush();
+   VG_(close)(trace_fd);
+   trace_fd = -1;
+}
+
+/* A forked child keeps simulating, but only the parent is traced. */
+static void trace_atfork_child(ThreadId tid)
+{
+   if (trace_fd >= 0) {
+      VG_(close)(trace_fd);
+      trace_fd = -1;
+   }
+}
+
+static Int    replay_fd = -1;
+static UChar* replay_buf = NULL;
+static Int    replay_pos = 0;
+static Int    replay_len = 0;
+
+static void replay_bad(void)
+{
+   VG_(fmsg)("malformed trace file '%s'\n", clo_trace_in);
+   VG_(exit)(1);
+}
+
+static __inline__ Int replay_get_byte(void)
+{
+   if (UNLIKELY(replay_pos == replay_len)) {
+      replay_len = VG_(read)(replay_fd, replay_buf, TRACE_BUF_SIZE);
+      replay_pos = 0;
+      if (replay_len <= 0) {
+         replay_len = 0;
+         return -1;
+      }
+   }
+   return replay_buf[replay_pos++];
+}
+
+static __inline__ ULong replay_get_uleb(void)
+{
+   ULong v = 0;
+   Int shift = 0, b;
+
+   do {
+      b = replay_get_byte();
+      if (b < 0 || shift > 63)
+         replay_bad();
+      v |= (ULong)(b & 0x7f) << shift;
+      shift += 7;
+   } while (b & 0x80);
+   return v;
+}
+
+static __inline__ Long replay_get_sleb(void)
+{
+   ULong v = replay_get_uleb();
+   return (Long)(v >> 1) ^ -(Long)(v & 1);
+}
+
+/* Reads `len` bytes into a new string. */
+static HChar* replay_get_text(ULong len)
+{
+   HChar* str;
+   ULong i;
+
+   if (len > TRACE_BUF_SIZE)
+      replay_bad();
+   str = VG_(malloc)("cg.main.replay.text", len + 1);
+   for (i = 0; i < len; i++) {
+      Int b = replay_get_byte();
+      if (b < 0)
+         replay_bad();
+      str[i] = b;
+   }
+   str[len] = 0;
+   return str;
+}
+
+/* Reads a text line, without its newline. */
+static HChar* replay_get_line(void)
+{
+   Int    size = 256, len = 0, b;
+   HChar* line = VG_(malloc)("cg.main.replay.line", size);
+
+   while ((b = replay_get_byte()) != '\n') {
+      if (b < 0)
+         replay_bad();
+      if (len == size - 1) {
+         size *= 2;
+         line = VG_(realloc)("cg.main.replay.line", line, size);
+      }
+      line[len++] = b;
+   }
+   line[len] = 0;
+   return line;
+}
+
+/* Runs the references of a --trace-in file through the simulators, as
+   if they were made by the client. */
+static void trace_replay(void)
+{
+   InstrInfo* instrs = NULL;
+   UChar*     instr_kinds = NULL;   /* BatchIrNoX or BatchIrGen */
+   LineCC**   lines = NULL;
+   UInt       n_instrs = 0, max_instrs = 0, n_lines = 0, max_lines = 0;
+   UInt       last_instr = 0;
+   Addr       last_data = 0;
+   HChar*     header;
+   Int        op;
+
+   SysRes sres = VG_(open)(clo_trace_in, VKI_O_RDONLY, 0);
+   if (sr_isError(sres)) {
+      VG_(fmsg)("can't open trace file '%s'\n", clo_trace_in);
+      VG_(exit)(1);
+   }
+   replay_fd = sr_Res(sres);
+   replay_buf = VG_(malloc)("cg.main.replay", TRACE_BUF_SIZE);
+
+   header = replay_get_line();
+   if (VG_(strcmp)(header, "cachegrind-trace 1") != 0)
+      replay_bad();
+   VG_(free)(header);
+   header = replay_get_line();
+   if (VG_(strncmp)(header, "cmd: ", 5) != 0)
+      replay_bad();
+   replay_cmd = VG_(strdup)("cg.main.replay.cmd", header + 5);
+   VG_(free)(header);
+
+   while ((op = replay_get_byte()) >= 0) {
+      if (op < TRACE_LINE) {
+         UInt  kind = op & 0xf;
+         UInt  size_code = op >> 4;
+         UInt  id = last_instr + replay_get_sleb();
+         UChar data_size = 0;
+
+         if (kind == 0 || id == 0 || id > n_instrs)
+            replay_bad();
+         last_instr = id;
+         if (kind & (BatchIrNoX | BatchIrGen))
+            kind = (kind & ~(BatchIrNoX | BatchIrGen)) | instr_kinds[id - 1];
+         if (kind & (BatchDr | BatchDw)) {
+            last_data += replay_get_sleb();
+            op = size_code > 0 ? 1 << (size_code - 1) : replay_get_byte();
+            if (op <= 0)
+               replay_bad();
+            // as for instrumentation, never straddle more than two lines
+            data_size = op > min_line_size ? min_line_size : op;
+         }
+         cachesim_batch_ref(&instrs[id - 1], instrs[id - 1].parent, kind,
+                            last_data, data_size);
+         if (sim_opt && (kind & (BatchDr | BatchDw)))
+            cachesim_opt_record(last_data, data_size, instrs[id - 1].parent,
+                                (kind & BatchDw) != 0);
+         trace_n_refs++;
+         continue;
+      }
+
+      switch (op) {
+      case TRACE_LINE: {
+         CodeLoc loc;
+         HChar*  fn;
+         loc.file = replay_get_text(replay_get_uleb());
+         loc.fn   = fn = replay_get_text(replay_get_uleb());
+         loc.line = replay_get_uleb();
+         if (n_lines == max_lines) {
+            max_lines = 2 * max_lines + 256;
+            lines = VG_(realloc)("cg.main.replay.lines", lines,
+                                 max_lines * sizeof(LineCC*));
+         }
+         lines[n_lines++] = get_lineCC_at(&loc);
+         VG_(free)(loc.file);
+         VG_(free)(fn);
+         break;
+      }
+      case TRACE_INSTR: {
+         Addr addr = replay_get_uleb();
+         Int  len = replay_get_byte();
+         UInt line = replay_get_uleb();
+         if (len <= 0 || line == 0 || line > n_lines)
+            replay_bad();
+         if (n_code_moves > 0)
+            addr = code_layout_move(addr);
+         if (sim_cig_ifetch)
+            icig_note_instr(lines[line - 1], addr, len);
+         if (n_instrs == max_instrs) {
+            max_instrs = 2 * max_instrs + 4096;
+            instrs = VG_(realloc)("cg.main.replay.instrs", instrs,
+                                  max_instrs * sizeof(InstrInfo));
+            instr_kinds = VG_(realloc)("cg.main.replay.kinds", instr_kinds,
+                                       max_instrs);
+         }
+         instrs[n_instrs].instr_addr = addr;
+         instrs[n_instrs].instr_len  = len;
+         instrs[n_instrs].trace_id   = 0;
+         instrs[n_instrs].parent     = lines[line - 1];
+         instr_kinds[n_instrs] = cachesim_is_IrNoX(addr, len) ? BatchIrNoX
+                                                              : BatchIrGen;
+         n_instrs++;
+         break;
+      }
+      case TRACE_REG:
+      case TRACE_REG_BLOCK: {
+         ULong  len = replay_get_uleb();
+         HChar* name = len > 0 ? replay_get_text(len - 1) : NULL;
+         Addr   begin = replay_get_uleb();
+         Addr   end = replay_get_uleb();
+         if (op == TRACE_REG_BLOCK)
+            cachesim_register_block(name, begin, end);
+         else
+            cachesim_register_var(name, begin, end);
+         VG_(free)(name);
+         break;
+      }
+      case TRACE_UNREG:
+         cachesim_unregister_var(replay_get_uleb());
+         break;
+      default:
+         replay_bad();
+      }
+   }
+
+   VG_(close)(replay_fd);
+   VG_(free)(replay_buf);
+   VG_(free)(lines);
+   // The LineCCs live on; the InstrInfos were only needed here.
+   VG_(free)(instrs);
+   VG_(free)(instr_kinds);
+}
+
+/*------------------------------------------------------------*/
+/*--- Automatic variables                                  ---*/
+/*------------------------------------------------------------*/
+
+/* --cig-auto-vars=heap,globals registers variables for the CIG without
+   client requests.
+
+   Heap blocks of at least --cig-auto-min bytes are registered when the
+   allocator returns them, named after the stack of the allocation, and
+   the blocks with the same name make up one variable.  The allocator
+   is not replaced, which would change the program being simulated;
+   instead the superblocks starting at the entry of malloc and friends
+   call cg_heap_enter, which records the size, the name and the stack
+   pointer, and every superblock ending in a return calls
+   cg_heap_return, which registers the block if the stack pointer shows
+   that the allocator returns.  That is not only in the allocator, which
+   may end with a tail call (calloc to memset, say), and costs little
+   next to the simulation of every reference.  Guest chasing is turned off so
+   that the entries always start a superblock.  free and realloc retire
+   the block at their entry.
+
+   Globals of at least --cig-auto-min bytes are registered from the data
+   symbols of each object when it is mapped, and retired when it is
+   unmapped. */
+
+typedef enum {
+   HEAP_MALLOC, HEAP_CALLOC, HEAP_REALLOC, HEAP_MEMALIGN,
+   HEAP_POSIX_MEMALIGN, HEAP_FREE
+} HeapFn;
+
+static const struct {
+   const HChar* name;
+   HeapFn       fn;
+} heap_fns[] = {
+   { "malloc",          HEAP_MALLOC },
+   { "__libc_malloc",   HEAP_MALLOC },
+   { "calloc",          HEAP_CALLOC },
+   { "__libc_calloc",   HEAP_CALLOC },
+   { "realloc",         HEAP_REALLOC },
+   { "__libc_realloc",  HEAP_REALLOC },
+   { "memalign",        HEAP_MEMALIGN },
+   { "__libc_memalign", HEAP_MEMALIGN },
+   { "aligned_alloc",   HEAP_MEMALIGN },
+   { "posix_memalign",  HEAP_POSIX_MEMALIGN },
+   { "free",            HEAP_FREE },
+   { "__libc_free",     HEAP_FREE },
+   { "cfree",           HEAP_FREE },
+};
+
+/* The allocation a thread is in, if name != NULL.  An allocator
+   calling itself (realloc calling malloc, say) is not tracked, so there
+   is at most one per thread. */
+typedef struct {
+   HChar* name;    /* of the block, after the allocation stack */
+   Addr   sp;      /* SP at the entry */
+   SizeT  size;
+   Addr   memptr;  /* where posix_memalign stores the block, or 0 */
+} HeapCall;
+
+static HeapCall* heap_calls = NULL;   /* indexed by ThreadId */
+static OSet*     heap_blocks = NULL;  /* start of the registered blocks */
+
+#define HEAP_NAME_FRAMES 2
+
+#if defined(VGA_amd64)
+#  define HEAP_RET_SP_DELTA 8
+static const PtrdiffT heap_arg_offs[3] = {
+   offsetof(VexGuestAMD64State, guest_RDI),
+   offsetof(VexGuestAMD64State, guest_RSI),
+   offsetof(VexGuestAMD64State, guest_RDX),
+};
+#  define HEAP_RES_OFF offsetof(VexGuestAMD64State, guest_RAX)
+#elif defined(VGA_arm64)
+#  define HEAP_RET_SP_DELTA 0
+static const PtrdiffT heap_arg_offs[3] = {
+   offsetof(VexGuestARM64State, guest_X0),
+   offsetof(VexGuestARM64State, guest_X1),
+   offsetof(VexGuestARM64State, guest_X2),
+};
+#  define HEAP_RES_OFF offsetof(VexGuestARM64State, guest_X0)
+#elif defined(VGA_x86)
+#  define HEAP_RET_SP_DELTA 4
+#  define HEAP_RES_OFF offsetof(VexGuestX86State, guest_EAX)
+#endif
+
+#if defined(HEAP_RES_OFF)
+static UWord heap_get_reg(ThreadId tid, PtrdiffT off)
+{
+   UWord w;
+   VG_(get_shadow_regs_area)(tid, (UChar*)&w, 0, off, sizeof(w));
+   return w;
+}
+
+/* Argument n of the call, at the entry of the callee. */
+static UWord heap_get_arg(ThreadId tid, Int n)
+{
+#  if defined(VGA_x86)
+   return ((UWord*)VG_(get_SP)(tid))[n + 1];
+#  else
+   return heap_get_reg(tid, heap_arg_offs[n]);
+#  endif
+}
+
+/* The name of the block `tid` is allocating, at the entry of the
+   allocator: "heap:" and the innermost frames of its callers, operator
+   new left out. */
+static HChar* heap_block_name(ThreadId tid)
+{
+   HChar        name[256];
+   Addr         ips[HEAP_NAME_FRAMES + 3];
+   DiEpoch      ep = VG_(current_DiEpoch)();
+   const HChar* fn;
+   UInt         i, n, shown = 0, line;
+   Int          len;
+
+   n = VG_(get_StackTrace)(tid, ips, HEAP_NAME_FRAMES + 3, NULL, NULL, 0);
+   len = VG_(sprintf)(name, "heap");
+   // ips[0] is the allocator
+   for (i = 1; i < n && shown < HEAP_NAME_FRAMES; i++) {
+      Addr a = ips[i];
+      if (!VG_(get_fnname)(ep, a, &fn))
+         fn = NULL;
+      else if (VG_STREQN(3, fn, "_Zn"))
+         continue;
+      if (fn)
+         len += VG_(snprintf)(name + len, sizeof(name) - len, "%s%s",
+                              shown ? "<" : ":", fn);
+      else
+         len += VG_(snprintf)(name + len, sizeof(name) - len, "%s%#lx",
+                              shown ? "<" : ":", a);
+      if (VG_(get_linenum)(ep, a, &line))
+         len += VG_(snprintf)(name + len, sizeof(name) - len, ":%u", line);
+      shown++;
+   }
+   return VG_(strdup)("cg.main.heap.3", name);
+}
+
+static void heap_retire(Addr p)
+{
+   if (p == 0 || !VG_(OSetWord_Remove)(heap_blocks, p))
+      return;
+   cachesim_drain_batch();
+   if (trace_fd >= 0)
+      trace_unregister_var(p);
+   cachesim_unregister_var(p);
+}
+
+static VG_REGPARM(1) void cg_heap_enter(UWord fn)
+{
+   ThreadId  tid = VG_(get_running_tid)();
+   HeapCall* c = &heap_calls[tid];
+   Addr      sp = VG_(get_SP)(tid);
+   SizeT     size = 0;
+
+   if (c->name != NULL) {
+      if (c->sp > sp)
+         return; // called by the allocator
+      VG_(free)(c->name);
+      c->name = NULL;
+   }
+
+   switch ((HeapFn)fn) {
+   case HEAP_MALLOC:
+      size = heap_get_arg(tid, 0);
+      break;
+   case HEAP_CALLOC:
+      size = heap_get_arg(tid, 0) * heap_get_arg(tid, 1);
+      break;
+   case HEAP_REALLOC:
+      heap_retire(heap_get_arg(tid, 0));
+      size = heap_get_arg(tid, 1);
+      break;
+   case HEAP_MEMALIGN:
+      size = heap_get_arg(tid, 1);
+      break;
+   case HEAP_POSIX_MEMALIGN:
+      size = heap_get_arg(tid, 2);
+      break;
+   case HEAP_FREE:
+      heap_retire(heap_get_arg(tid, 0));
+      return;
+   }
+   if (size < clo_cig_auto_min)
+      return;
+
+   c->name   = heap_block_name(tid);
+   c->sp     = sp;
+   c->size   = size;
+   c->memptr = ((HeapFn)fn == HEAP_POSIX_MEMALIGN) ? heap_get_arg(tid, 0) : 0;
+}
+
+/* Called at every return, after the stack pointer has been popped. */
+static VG_REGPARM(0) void cg_heap_return(void)
+{
+   ThreadId  tid = VG_(get_running_tid)();
+   HeapCall* c = &heap_calls[tid];
+   Addr      p;
+
+   if (c->name == NULL || VG_(get_SP)(tid) != c->sp + HEAP_RET_SP_DELTA)
+      return; // not the allocator returning
+
+   p = heap_get_reg(tid, HEAP_RES_OFF);
+   if (c->memptr != 0)
+      p = (p == 0) ? *(Addr*)c->memptr : 0;
+   if (p != 0) {
+      // The references before the allocation belong to the old mapping.
+      cachesim_drain_batch();
+      if (trace_fd >= 0)
+         trace_register_var(c->name, p, p + c->size - 1, True);
+      if (cachesim_register_block(c->name, p, p + c->size - 1) >= 0)
+         VG_(OSetWord_Insert)(heap_blocks, p);
+   }
+   VG_(free)(c->name);
+   c->name = NULL;
+}
+#endif
+
+static Bool is_heap_fn(const HChar* fn, HeapFn* kind)
+{
+   UInt i;
+
+   for (i = 0; i < sizeof(heap_fns) / sizeof(heap_fns[0]); i++) {
+      if (VG_STREQ(fn, heap_fns[i].name)) {
+         *kind = heap_fns[i].fn;
+         return True;
+      }
+   }
+   return False;
+}
+
+/* Add the call of cg_heap_enter to the superblock starting at `cia`,
+   if it is the entry of an allocator. */
+static void heap_instrument_entry(IRSB* sbOut, Addr cia)
+{
+#if defined(HEAP_RES_OFF)
+   const HChar* fn;
+   HeapFn       kind;
+   IRDirty*     di;
+
+   if (!VG_(get_fnname_if_entry)(VG_(current_DiEpoch)(), cia, &fn)
+       || !is_heap_fn(fn, &kind))
+      return;
+   di = unsafeIRDirty_0_N(1, "cg_heap_enter",
+                          VG_(fnptr_to_fnentry)(&cg_heap_enter),
+                          mkIRExprVec_1(mkIRExpr_HWord(kind)));
+   addStmtToIRSB(sbOut, IRStmt_Dirty(di));
+#endif
+}
+
+/* Add the call of cg_heap_return to the end of a superblock ending with
+   a return. */
+static void heap_instrument_return(IRSB* sbOut, const VexGuestLayout* layout)
+{
+#if defined(HEAP_RES_OFF)
+   IRDirty* di;
+
+   di = unsafeIRDirty_0_N(0, "cg_heap_return",
+                          VG_(fnptr_to_fnentry)(&cg_heap_return),
+                          mkIRExprVec_0());
+   di->nFxState = 2;
+   di->fxState[0].fx        = Ifx_Read;
+   di->fxState[0].offset    = layout->offset_SP;
+   di->fxState[0].size      = layout->sizeof_SP;
+   di->fxState[0].nRepeats  = 0;
+   di->fxState[0].repeatLen = 0;
+   di->fxState[1].fx        = Ifx_Read;
+   di->fxState[1].offset    = HEAP_RES_OFF;
+   di->fxState[1].size      = sizeof(UWord);
+   di->fxState[1].nRepeats  = 0;
+   di->fxState[1].repeatLen = 0;
+   addStmtToIRSB(sbOut, IRStmt_Dirty(di));
+#endif
+}
+
+static OSet* globals_dis = NULL;      /* DebugInfos scanned */
+static OSet* globals_vars = NULL;     /* start of the registered globals */
+static Bool  globals_rescan = False;  /* an object was unmapped */
+
+static void globals_scan(void)
+{
+   const DebugInfo* di;
+   const HChar*     name;
+   Addr             a;
+   SizeT            size;
+   Int              i, n;
+
+   if (globals_rescan) {
+      // Its DebugInfo may be freed, and its address reused.
+      VG_(OSetWord_Destroy)(globals_dis);
+      globals_dis = VG_(OSetWord_Create)(VG_(malloc), "cg.main.gs.1", VG_(free));
+      globals_rescan = False;
+   }
+   for (di = VG_(next_DebugInfo)(NULL); di; di = VG_(next_DebugInfo)(di)) {
+      if (VG_(OSetWord_Contains)(globals_dis, (UWord)di))
+         continue;
+      VG_(OSetWord_Insert)(globals_dis, (UWord)di);
+      cachesim_drain_batch();
+      n = VG_(DebugInfo_syms_howmany)(di);
+      for (i = 0; i < n; i++) {
+         if (!VG_(DebugInfo_get_datasym)(di, i, &a, &size, &name)
+             || size < clo_cig_auto_min)
+            continue;
+         if (trace_fd >= 0)
+            trace_register_var(name, a, a + size - 1, False);
+         // Aliases and globals registered already are left out.
+         if (cachesim_register_var(name, a, a + size - 1) >= 0)
+            VG_(OSetWord_Insert)(globals_vars, a);
+      }
+   }
+}
+
+static void cg_new_mem_startup(Addr a, SizeT len, Bool rr, Bool ww, Bool xx,
+                               ULong di_handle)
+{
+   if (di_handle > 0)
+      globals_scan();
+}
+
+static void cg_new_mem_mmap(Addr a, SizeT len, Bool rr, Bool ww, Bool xx,
+                            ULong di_handle)
+{
+   if (di_handle > 0)
+      globals_scan();
+}
+
+static void cg_die_mem_munmap(Addr a, SizeT len)
+{
+   UWord g, *doomed = NULL;
+   UInt  n_doomed = 0, size = 0, i;
+
+   /* The set is sorted, so the globals in [a, a + len) are contiguous;
+      they are collected first, as removing them would end the walk. */
+   VG_(OSetWord_ResetIter)(globals_vars);
+   while (VG_(OSetWord_Next)(globals_vars, &g)) {
+      if (g < a)
+         continue;
+      if (g - a >= len)
+         break;
+      if (n_doomed == size) {
+         size = (size == 0) ? 16 : 2 * size;
+         doomed = VG_(realloc)("cg.main.dmm.1", doomed, size * sizeof(UWord));
+      }
+      doomed[n_doomed++] = g;
+   }
+   if (n_doomed == 0)
+      return;
+
+   cachesim_drain_batch();
+   for (i = 0; i < n_doomed; i++) {
+      VG_(OSetWord_Remove)(globals_vars, doomed[i]);
+      if (trace_fd >= 0)
+         trace_unregister_var(doomed[i]);
+      cachesim_unregister_var(doomed[i]);
+   }
+   VG_(free)(doomed);
+   globals_rescan = True;
+}
+
+/*------------------------------------------------------------*/
+/*--- Instrumentation types and structures                 ---*/
+/*------------------------------------------------------------*/
+
+/* Maintain an ordered list of memory events which are outstanding, in
+   the sense that no IR has yet been generated to do the relevant
+   helper calls.  The BB is scanned top to bottom and memory events
+   are added to the end of the list, merging with the most recent
+   notified event where possible (Dw immediately following Dr and
+   having the same size and EA can be merged).
+
+   This merging is done so that for architectures which have
+   load-op-store instructions (x86, amd64), the insn is treated as if
+   it makes just one memory reference (a modify), rather than two (a
+   read followed by a write at the same address).
+
+   At various points the list will need to be flushed, that is, IR
+   generated from it.  That must happen before any possible exit from
+   the block (the end, or an IRStmt_Exit).  Flushing also takes place
+   when there is no space to add a new event.
+
+   If we require the simulation statistics to be up to date with
+   respect to possible memory exceptions, then the list would have to
+   be flushed before each memory reference.  That would however lose
+   performance by inhibiting event-merging during flushing.
+
+   Flushing the list consists of walking it start to end and emitting
+   instrumentation IR for each event, in the order in which they
+   appear.  It may be possible to emit a single call for two adjacent
+   events in order to reduce the number of helper function calls made.
+   For example, it could well be profitable to handle two adjacent Ir
+   events with a single helper call.  */
+
+typedef
+   IRExpr 
+   IRAtom;
+
+typedef 
+   enum { 
+      Ev_IrNoX,  // Instruction read not crossing cache lines
+      Ev_IrGen,  // Generic Ir, not being detected as IrNoX
+      Ev_Dr,     // Data read
+      Ev_Dw,     // Data write
+      Ev_Dm,     // Data modify (read then write)
+      Ev_Bc,     // branch conditional
+      Ev_Bi      // branch indirect (to unknown destination)
+   }
+   EventTag;
+
+typedef
+   struct {
+      EventTag   tag;
+      InstrInfo* inode;
+      union {
+         struct {
+         } IrGen;
+         struct {
+         } IrNoX;
+         struct {
+            IRAtom* ea;
+            Int     szB;
+         } Dr;
+         struct {
+            IRAtom* ea;
+            Int     szB;
+         } Dw;
+         struct {
+            IRAtom* ea;
+            Int     szB;
+         } Dm;
+         struct {
+            IRAtom* taken; /* :: Ity_I1 */
+         } Bc;
+         struct {
+            IRAtom* dst;
+         } Bi;
+      } Ev;
+   }
+   Event;
+
+static void init_Event ( Event* ev ) {
+   VG_(memset)(ev, 0, sizeof(Event));
+}
+
+static IRAtom* get_Event_dea ( Event* ev ) {
+   switch (ev->tag) {
+      case Ev_Dr: return ev->Ev.Dr.ea;
+      case Ev_Dw: return ev->Ev.Dw.ea;
+      case Ev_Dm: return ev->Ev.Dm.ea;
+      default:    tl_assert(0);
+   }
+}
+
+static Int get_Event_dszB ( Event* ev ) {
+   switch (ev->tag) {
+      case Ev_Dr: return ev->Ev.Dr.szB;
+      case Ev_Dw: return ev->Ev.Dw.szB;
+      case Ev_Dm: return ev->Ev.Dm.szB;
+      default:    tl_assert(0);
+   }
+}
+
+
+/* Up to this many unnotified events are allowed.  Number is
+   arbitrary.  Larger numbers allow more event merging to occur, but
+   potentially induce more spilling due to extending live ranges of
+   address temporaries. */
+#define N_EVENTS 16
+
+
+/* A struct which holds all the running state during instrumentation.
+   Mostly to avoid passing loads of parameters everywhere. */
+typedef
+   struct {
+      /* The current outstanding-memory-event list. */
+      Event events[N_EVENTS];
+      Int   events_used;
+
+      /* The array of InstrInfo bins for the BB. */
+      SB_info* sbInfo;
+
+      /* Number InstrInfo bins 'used' so far. */
+      Int sbInfo_i;
+
+      /* The output SB being constructed. */
+      IRSB* sbOut;
+   }
+   CgState;
+
+
+/*------------------------------------------------------------*/
+/*--- Instrumentation main                                 ---*/
+/*------------------------------------------------------------*/
+
+// Note that origAddr is the real origAddr, not the address of the first
+// instruction in the block (they can be different due to redirection).
+static
+SB_info* get_SB_info(IRSB* sbIn, Addr origAddr)
+{
+   Int      i, n_instrs;
+   IRStmt*  st;
+   SB_info* sbInfo;
+
+   // Count number of original instrs in SB
+   n_instrs = 0;
+   for (i = 0; i < sbIn->stmts_used; i++) {
+      st = sbIn->stmts[i];
+      if (Ist_IMark == st->tag) n_instrs++;
+   }
+
+   // Check that we don't have an entry for this BB in the instr-info table.
+   // If this assertion fails, there has been some screwup:  some
+   // translations must have been discarded but Cachegrind hasn't discarded
+   // the corresponding entries in the instr-info table.
+   sbInfo = VG_(OSetGen_Lookup)(instrInfoTable, &origAddr);
+   tl_assert(NULL == sbInfo);
+
+   // BB never translated before (at this address, at least;  could have
+   // been unloaded and then reloaded elsewhere in memory)
+   sbInfo = VG_(OSetGen_AllocNode)(instrInfoTable,
+                                sizeof(SB_info) + n_instrs*sizeof(InstrInfo)); 
+   sbInfo->SB_addr  = origAddr;
+   sbInfo->n_instrs = n_instrs;
+   VG_(OSetGen_Insert)( instrInfoTable, sbInfo );
+
+   return sbInfo;
+}
+
+
+static void showEvent ( Event* ev )
+{
+   switch (ev->tag) {
+      case Ev_IrGen:
+         VG_(printf)("IrGen %p\n", ev->inode);
+         break;
+      case Ev_IrNoX:
+         VG_(printf)("IrNoX %p\n", ev->inode);
+         break;
+      case Ev_Dr:
+         VG_(printf)("Dr %p %d EA=", ev->inode, ev->Ev.Dr.szB);
+         ppIRExpr(ev->Ev.Dr.ea); 
+         VG_(printf)("\n");
          break;
       case Ev_Dw:
          VG_(printf)("Dw %p %d EA=", ev->inode, ev->Ev.Dw.szB);
@@ -641,6 +2290,52 @@ static void showEvent ( Event* ev )
    }
 }
 
+/* Is the instruction at `addr` a non-temporal store?  VEX translates
+   them into ordinary stores, so the instruction bytes are decoded: after
+   the legacy and REX prefixes, MOVNTI, MOVNTPS/PD, MOVNTSS/SD, MOVNTQ,
+   MOVNTDQ and MASKMOVQ/DQU, and the VEX and EVEX encoded forms. */
+static Bool is_non_temporal_store(Addr addr, UInt len)
+{
+#if defined(VGA_amd64) || defined(VGA_x86)
+   const UChar* p   = (const UChar*)addr;
+   const UChar* end = p + len;
+   UChar op;
+
+   while (p < end && (*p == 0x66 || *p == 0x67 || *p == 0xF0 || *p == 0xF2
+                      || *p == 0xF3 || *p == 0x2E || *p == 0x36 || *p == 0x3E
+                      || *p == 0x26 || *p == 0x64 || *p == 0x65
+#if defined(VGA_amd64)
+                      || (*p >= 0x40 && *p <= 0x4F)
+#endif
+                     ))
+      p++;
+   if (end - p < 2)
+      return False;
+
+#if defined(VGA_x86)
+   /* In 32-bit mode these are LES, LDS and BOUND unless the next byte
+      would be a register ModRM. */
+   if ((p[0] == 0xC4 || p[0] == 0xC5 || p[0] == 0x62) && (p[1] & 0xC0) != 0xC0)
+      return False;
+#endif
+   if (p[0] == 0x0F) {
+      op = p[1];
+      return op == 0x2B || op == 0xC3 || op == 0xE7 || op == 0xF7;
+   }
+   if (p[0] == 0xC5 && end - p >= 3)
+      op = p[2];
+   else if (p[0] == 0xC4 && end - p >= 4 && (p[1] & 0x1F) == 1)
+      op = p[3];
+   else if (p[0] == 0x62 && end - p >= 5 && (p[1] & 0x03) == 1)
+      op = p[4];
+   else
+      return False;
+   return op == 0x2B || op == 0xE7 || op == 0xF7;
+#else
+   return False;
+#endif
+}
+
 // Reserve and initialise an InstrInfo for the first mention of a new insn.
 static
 InstrInfo* setup_InstrInfo ( CgState* cgs, Addr instr_addr, UInt instr_len )
@@ -651,7 +2346,11 @@ InstrInfo* setup_InstrInfo ( CgState* cgs, Addr instr_addr, UInt instr_len )
    i_node = &cgs->sbInfo->instrs[ cgs->sbInfo_i ];
    i_node->instr_addr = instr_addr;
    i_node->instr_len  = instr_len;
+   i_node->non_temporal = sim_write_back && is_non_temporal_store(instr_addr, instr_len);
+   i_node->trace_id   = 0;
    i_node->parent     = get_lineCC(instr_addr);
+   if (sim_cig_ifetch)
+      icig_note_instr(i_node->parent, instr_addr, instr_len);
    cgs->sbInfo_i++;
    return i_node;
 }
@@ -721,7 +2420,7 @@ static void flushEvents ( CgState* cgs )
             }
             /* Merge an IrNoX with a following Dw. */
             else
-            if (ev2 && ev2->tag == Ev_Dw) {
+            if (ev2 && ev2->tag == Ev_Dw && !ev2->inode->non_temporal) {
                tl_assert(ev2->inode == ev->inode);
                helperName = "log_1IrNoX_1Dw_cache_access";
                helperAddr = &log_1IrNoX_1Dw_cache_access;
@@ -802,8 +2501,13 @@ static void flushEvents ( CgState* cgs )
             break;
          case Ev_Dw:
             /* Data write */
-            helperName = "log_0Ir_1Dw_cache_access";
-            helperAddr = &log_0Ir_1Dw_cache_access;
+            if (ev->inode->non_temporal) {
+               helperName = "log_0Ir_1Dnt_cache_access";
+               helperAddr = &log_0Ir_1Dnt_cache_access;
+            } else {
+               helperName = "log_0Ir_1Dw_cache_access";
+               helperAddr = &log_0Ir_1Dw_cache_access;
+            }
             argv = mkIRExprVec_3( i_node_expr,
                                   get_Event_dea(ev), 
                                   mkIRExpr_HWord( get_Event_dszB(ev) ) );
@@ -834,6 +2538,8 @@ static void flushEvents ( CgState* cgs )
       tl_assert(helperName);
       tl_assert(helperAddr);
       tl_assert(argv);
+      batch_helper(&helperName, &helperAddr);
+      sample_helper(&helperName, &helperAddr);
       di = unsafeIRDirty_0_N( regparms, 
                               helperName, VG_(fnptr_to_fnentry)( helperAddr ), 
                               argv );
@@ -956,6 +2662,7 @@ void addEvent_D_guarded ( CgState* cgs, InstrInfo* inode,
                          : "log_0Ir_1Dr_cache_access";
    helperAddr  = isWrite ? &log_0Ir_1Dw_cache_access
                          : &log_0Ir_1Dr_cache_access;
+   batch_helper(&helperName, &helperAddr);
    argv        = mkIRExprVec_3( i_node_expr,
                                 ea, mkIRExpr_HWord( datasize ) );
    regparms    = 3;
@@ -1011,6 +2718,8 @@ void addEvent_Bi ( CgState* cgs, InstrInfo* inode, IRAtom* whereTo )
 ////////////////////////////////////////////////////////////
 
 
+static void cig_epoch_instrument(IRSB* sbOut, IRType hWordTy, UInt n_instrs); /* below */
+
 static
 IRSB* cg_instrument ( VgCallbackClosure* closure,
                       IRSB* sbIn, 
@@ -1064,6 +2773,13 @@ IRSB* cg_instrument ( VgCallbackClosure* closure,
    cgs.sbInfo      = get_SB_info(sbIn, (Addr)closure->readdr);
    cgs.sbInfo_i    = 0;
 
+   if (clo_cig_auto_vars & CIG_AUTO_HEAP)
+      heap_instrument_entry(cgs.sbOut, cia);
+   if (sim_cig_epoch)
+      cig_epoch_instrument(cgs.sbOut, hWordTy, cgs.sbInfo->n_instrs);
+   if (sim_sample)
+      sample_instrument(cgs.sbOut, hWordTy, cgs.sbInfo->n_instrs);
+
    if (DEBUG_CG)
       VG_(printf)("\n\n---------- cg_instrument ----------\n");
 
@@ -1314,6 +3030,9 @@ IRSB* cg_instrument ( VgCallbackClosure* closure,
    /* At the end of the bb.  Flush outstandings. */
    flushEvents( &cgs );
 
+   if ((clo_cig_auto_vars & CIG_AUTO_HEAP) && sbIn->jumpkind == Ijk_Ret)
+      heap_instrument_return(cgs.sbOut, layout);
+
    /* done.  stay sane ... */
    tl_assert(cgs.sbInfo_i == cgs.sbInfo->n_instrs);
 
@@ -1336,25 +3055,268 @@ static cache_t clo_I1_cache = UNDEFINED_CACHE;
 static cache_t clo_D1_cache = UNDEFINED_CACHE;
 static cache_t clo_LL_cache = UNDEFINED_CACHE;
 
+/* --L2 is a mid level of every configuration, not the old name of --LL
+   that VG_(str_clo_cache_opt) still takes it for. */
+static cache_t clo_L2_cache = UNDEFINED_CACHE;
+
+/* --D1 and --LL also take a ':'-separated list of configurations, e.g.
+   --D1=32768,8,64:49152,12,64.  The first one is clo_D1_cache (or
+   clo_LL_cache), the others are kept here.  A single D1 or LL goes with
+   every configuration of the other list. */
+static cache_t clo_D1_more[MAX_SIM_CFGS - 1];
+static cache_t clo_LL_more[MAX_SIM_CFGS - 1];
+static UInt    clo_n_D1 = 1;
+static UInt    clo_n_LL = 1;
+
+/* Parses a --D1 or --LL list; each configuration goes through
+   VG_(str_clo_cache_opt), as a single one would. */
+static Bool str_clo_cache_list(const HChar* arg)
+{
+   const HChar *opt, *piece, *end;
+   cache_t     *first, *more, junk;
+   UInt        *n;
+   HChar       buf[64];
+
+   if VG_STR_CLO(arg, "--D1", piece) {
+      opt = "--D1"; first = &clo_D1_cache; more = clo_D1_more; n = &clo_n_D1;
+   } else if VG_STR_CLO(arg, "--LL", piece) {
+      opt = "--LL"; first = &clo_LL_cache; more = clo_LL_more; n = &clo_n_LL;
+   } else
+      return False;
+   if (VG_(strchr)(piece, ':') == NULL)
+      return False;   // a single configuration
+
+   *n = 0;
+   while (True) {
+      end = VG_(strchr)(piece, ':');
+      if (end == NULL)
+         end = piece + VG_(strlen)(piece);
+      if (*n == MAX_SIM_CFGS)
+         VG_(fmsg_bad_option)(arg, "At most %d configurations can be given.\n",
+                              MAX_SIM_CFGS);
+      if ((SizeT)(end - piece) > sizeof(buf) - 8)
+         VG_(fmsg_bad_option)(arg, "Bad argument '%s'\n", piece);
+      VG_(snprintf)(buf, sizeof(buf), "%s=", opt);
+      VG_(strncat)(buf, piece, end - piece);
+      VG_(str_clo_cache_opt)(buf, &junk,
+                             *n == 0 ? first : &more[*n - 1],
+                             *n == 0 ? first : &more[*n - 1]);
+      (*n)++;
+      if (*end == 0)
+         break;
+      piece = end + 1;
+   }
+   return True;
+}
+
+/* --DTLB=<entries>,<assoc>,<page_size> and --STLB=<entries>,<assoc>;
+   0 entries for none.  The STLB has the pages of the DTLB. */
+static Int clo_DTLB_entries = 0;
+static Int clo_DTLB_assoc = 0;
+static Int clo_DTLB_page_bits = 12;
+static Int clo_STLB_entries = 0;
+static Int clo_STLB_assoc = 0;
+
+/* Parses the value `str` of a --DTLB (if `page_bits` is not NULL) or
+   --STLB option.  The page size is 4K, 2M, 1G or the same in bytes. */
+static void str_clo_tlb(const HChar* arg, const HChar* str,
+                        Int* entries, Int* assoc, Int* page_bits)
+{
+   HChar *end;
+   Long  n = VG_(strtoll10)(str, &end);
+   Long  a, p;
+
+   if (*end != ',' || n <= 0 || n > (1 << 20))
+      VG_(fmsg_bad_option)(arg, "Bad number of entries\n");
+   a = VG_(strtoll10)(end + 1, &end);
+   if (a <= 0 || n % a != 0 || ((n / a) & (n / a - 1)) != 0)
+      VG_(fmsg_bad_option)(arg, "The entries must be a power of two sets "
+                                "of <assoc> entries\n");
+   if (page_bits != NULL) {
+      if (*end != ',')
+         VG_(fmsg_bad_option)(arg, "Missing page size\n");
+      p = VG_(strtoll10)(end + 1, &end);
+      switch (*end) {
+         case 'K': case 'k': p <<= 10; end++; break;
+         case 'M': case 'm': p <<= 20; end++; break;
+         case 'G': case 'g': p <<= 30; end++; break;
+      }
+      if (p != (1 << 12) && p != (1 << 21) && p != (1 << 30))
+         VG_(fmsg_bad_option)(arg, "The page size must be 4K, 2M or 1G\n");
+      *page_bits = VG_(log2)(p);
+   }
+   if (*end != 0)
+      VG_(fmsg_bad_option)(arg, "Bad argument '%s'\n", str);
+   *entries = n;
+   *assoc = a;
+}
+
+/* Parses --sim-sample=<on>:<off>[:<warmup>], in instructions. */
+static void str_clo_sim_sample(const HChar* arg, const HChar* str)
+{
+   Long  max = (Long)(~(UWord)0 >> 1);
+   HChar *end;
+
+   clo_sim_sample_on = VG_(strtoll10)(str, &end);
+   if (*end != ':' || clo_sim_sample_on <= 0 || clo_sim_sample_on > max)
+      VG_(fmsg_bad_option)(arg, "Bad number of measured instructions\n");
+   clo_sim_sample_off = VG_(strtoll10)(end + 1, &end);
+   if (clo_sim_sample_off <= 0 || clo_sim_sample_off > max)
+      VG_(fmsg_bad_option)(arg, "Bad number of fast-forwarded instructions\n");
+   clo_sim_sample_warm = 0;
+   if (*end == ':') {
+      clo_sim_sample_warm = VG_(strtoll10)(end + 1, &end);
+      if (clo_sim_sample_warm < 0 || clo_sim_sample_warm > max)
+         VG_(fmsg_bad_option)(arg, "Bad number of warm-up instructions\n");
+   }
+   if (*end != 0)
+      VG_(fmsg_bad_option)(arg, "Bad argument '%s'\n", str);
+}
+
 /*------------------------------------------------------------*/
 /*--- cg_fini() and related function                       ---*/
 /*------------------------------------------------------------*/
 
-// Total reads/writes/misses.  Calculated during CC traversal at the end.
-// All auto-zeroed.
-static CacheCC  Ir_total;
-static CacheCC  Dr_total;
-static CacheCC  Dw_total;
+// The header lines go to a text file, or to the string kept in a binary
+// cacheusage file (--cacheusage-format=bin).
+typedef struct {
+   VgFile* fp;
+   XArray* xa;      /* of HChar, when fp is NULL */
+} TextOut;
+
+static void add_char_to_xa(HChar c, void* opaque)
+{
+   VG_(addToXA)((XArray*)opaque, &c);
+}
+
+static void tprintf(TextOut* out, const HChar* format, ...)
+{
+   va_list vargs;
+
+   va_start(vargs, format);
+   if (out->fp)
+      VG_(vfprintf)(out->fp, format, vargs);
+   else
+      VG_(vcbprintf)(add_char_to_xa, out->xa, format, vargs);
+   va_end(vargs);
+}
+
+// Writes the "cmd:" line, without its newline.  A replay writes the
+// command of the traced run.
+static void tprint_cmd_line(TextOut* out)
+{
+   Int i;
+
+   if (replay_cmd) {
+      tprintf(out, "cmd: %s", replay_cmd);
+      return;
+   }
+   tprintf(out, "cmd: %s", VG_(args_the_exename));
+   for (i = 0; i < VG_(sizeXA)( VG_(args_for_client) ); i++) {
+      HChar* arg = * (HChar**) VG_(indexXA)( VG_(args_for_client), i );
+      tprintf(out, " %s", arg);
+   }
+}
+
+static void fprint_cmd_line(VgFile *fp)
+{
+   TextOut out = { fp, NULL };
+   tprint_cmd_line(&out);
+}
+
+// Set by the cg.dump monitor command while it writes the output files.
+static const HChar* dump_prefix = NULL;
+
+// The expanded name of an output file of D1/LL configuration `cfg`: the
+// name given for the first configuration, then with a ".<cfg+1>" suffix.
+// During cg.dump, the file name (not the directory) starts with
+// "<dump_prefix>.".
+static HChar* cfg_out_file(const HChar* option_name, const HChar* format,
+                           UInt cfg)
+{
+   HChar* name = VG_(expand_file_name)(option_name, format);
+   HChar* cfg_name;
+   const HChar* base;
+
+   if (cfg > 0) {
+      cfg_name = VG_(malloc)("cg.main.cfg_out_file", VG_(strlen)(name) + 12);
+      VG_(sprintf)(cfg_name, "%s.%u", name, cfg + 1);
+      VG_(free)(name);
+      name = cfg_name;
+   }
+   if (dump_prefix == NULL)
+      return name;
+   base = VG_(strrchr)(name, '/');
+   base = base ? base + 1 : name;
+   cfg_name = VG_(malloc)("cg.main.cfg_out_file",
+                          VG_(strlen)(name) + VG_(strlen)(dump_prefix) + 2);
+   VG_(memcpy)(cfg_name, name, base - name);
+   VG_(sprintf)(cfg_name + (base - name), "%s.%s", dump_prefix, base);
+   VG_(free)(name);
+   return cfg_name;
+}
+
+// "desc:" lines (giving I1/D1/L2/LL cache configuration). The spaces after
+// the 2nd colon makes cg_annotate's output look nicer.
+static void tprint_cache_desc(TextOut* out, UInt cfg)
+{
+   tprintf(out, "desc: I1 cache:         %s\n"
+                "desc: D1 cache:         %s\n",
+                I1.desc_line, sim_cfgs[cfg].D1.desc_line);
+   if (sim_L2)
+      tprintf(out, "desc: L2 cache:         %s\n", sim_cfgs[cfg].L2.desc_line);
+   tprintf(out, "desc: LL cache:         %s\n", sim_cfgs[cfg].LL.desc_line);
+   if (sim_tlb)
+      tprintf(out, "desc: DTLB:             %s\n", DTLB.desc_line);
+   if (sim_stlb)
+      tprintf(out, "desc: STLB:             %s\n", STLB.desc_line);
+}
+
+static void fprint_cache_desc(VgFile *fp, UInt cfg)
+{
+   TextOut out = { fp, NULL };
+   tprint_cache_desc(&out, cfg);
+}
+
+// The counts that do not depend on D1 and LL are only collected in the
+// first configuration's LineCCs; copy them to the others.
+static void copy_shared_counts_to_cfgs(void)
+{
+   LineCC *lineCC, *more;
+
+   VG_(OSetGen_ResetIter)(CC_table);
+   while ( (lineCC = VG_(OSetGen_Next)(CC_table)) ) {
+      for (more = lineCC->next_cfg; more; more = more->next_cfg) {
+         more->Ir.a  = lineCC->Ir.a;
+         more->Ir.m1 = lineCC->Ir.m1;
+         more->Dr.a  = lineCC->Dr.a;
+         more->Dw.a  = lineCC->Dw.a;
+         more->Bc    = lineCC->Bc;
+         more->Bi    = lineCC->Bi;
+         more->Tlb   = lineCC->Tlb;
+         more->Smp   = lineCC->Smp;
+      }
+   }
+}
+
+// Total reads/writes/misses, per configuration.  Calculated during CC
+// traversal at the end.  All auto-zeroed.
+static CacheCC  Ir_total[MAX_SIM_CFGS];
+static CacheCC  Dr_total[MAX_SIM_CFGS];
+static CacheCC  Dw_total[MAX_SIM_CFGS];
 static BranchCC Bc_total;
 static BranchCC Bi_total;
+static PrefetchCC Pf_total[MAX_SIM_CFGS];
+static TrafficCC  Tr_total[MAX_SIM_CFGS];
+static TlbCC      Tlb_total;
 
-static void fprint_CC_table_and_calc_totals(void)
+static void fprint_CC_table_and_calc_totals(UInt cfg)
 {
-   Int     i;
    VgFile  *fp;
    HChar   *currFile = NULL;
    const HChar *currFn = NULL;
    LineCC* lineCC;
+   LineCC  scaled;
 
    // Setup output filename.  Nb: it's important to do this now, ie. as late
    // as possible.  If we do it at start-up and the program forks and the
@@ -1362,7 +3324,7 @@ static void fprint_CC_table_and_calc_totals(void)
    // parent and child will incorrectly write to the same file;  this
    // happened in 3.3.0.
    HChar* cachegrind_out_file =
-      VG_(expand_file_name)("--cachegrind-out-file", clo_cachegrind_out_file);
+      cfg_out_file("--cachegrind-out-file", clo_cachegrind_out_file, cfg);
 
    fp = VG_(fopen)(cachegrind_out_file, VKI_O_CREAT|VKI_O_TRUNC|VKI_O_WRONLY,
                                         VKI_S_IRUSR|VKI_S_IWUSR);
@@ -1378,40 +3340,49 @@ static void fprint_CC_table_and_calc_totals(void)
       VG_(free)(cachegrind_out_file);
    }
 
-   if (clo_cache_sim) {
-      // "desc:" lines (giving I1/D1/LL cache configuration). The spaces after
-      // the 2nd colon makes cg_annotate's output look nicer.
-      VG_(fprintf)(fp,  "desc: I1 cache:         %s\n"
-                        "desc: D1 cache:         %s\n"
-                        "desc: LL cache:         %s\n",
-                        I1.desc_line, D1.desc_line, LL.desc_line);
-   }
+   if (clo_cache_sim)
+      fprint_cache_desc(fp, cfg);
+   if (sim_sample)
+      fprint_sample_desc(fp, cfg);
 
    // "cmd:" line
-   VG_(fprintf)(fp, "cmd: %s", VG_(args_the_exename));
-   for (i = 0; i < VG_(sizeXA)( VG_(args_for_client) ); i++) {
-      HChar* arg = * (HChar**) VG_(indexXA)( VG_(args_for_client), i );
-      VG_(fprintf)(fp, " %s", arg);
-   }
+   fprint_cmd_line(fp);
    // "events:" line
    if (clo_cache_sim && clo_branch_sim) {
       VG_(fprintf)(fp, "\nevents: Ir I1mr ILmr Dr D1mr DLmr Dw D1mw DLmw "
-                                  "Bc Bcm Bi Bim\n");
+                                  "Bc Bcm Bi Bim");
    }
-   else if (clo_cache_sim && !clo_branch_sim) {
-      VG_(fprintf)(fp, "\nevents: Ir I1mr ILmr Dr D1mr DLmr Dw D1mw DLmw "
-                                  "\n");
+   else if (clo_cache_sim && !clo_branch_sim) {
+      VG_(fprintf)(fp, "\nevents: Ir I1mr ILmr Dr D1mr DLmr Dw D1mw DLmw");
    }
    else if (!clo_cache_sim && clo_branch_sim) {
-      VG_(fprintf)(fp, "\nevents: Ir Bc Bcm Bi Bim\n");
+      VG_(fprintf)(fp, "\nevents: Ir Bc Bcm Bi Bim");
    }
    else {
-      VG_(fprintf)(fp, "\nevents: Ir\n");
+      VG_(fprintf)(fp, "\nevents: Ir");
    }
+   // Prefetches issued, useful, late and polluting.
+   if (clo_cache_sim && sim_prefetch != PF_NONE)
+      VG_(fprintf)(fp, " Pf PfU PfL PfP");
+   // Write-backs from D1 and LL, and bytes read and written in memory.
+   if (clo_cache_sim && sim_write_back)
+      VG_(fprintf)(fp, " D1wb LLwb DRAMr DRAMw");
+   // D1 read and write misses under Belady's OPT.
+   if (clo_cache_sim && sim_opt)
+      VG_(fprintf)(fp, " D1mrOPT D1mwOPT");
+   // L2 misses, and write-backs from L2 to LL.
+   if (clo_cache_sim && sim_L2)
+      VG_(fprintf)(fp, " I2mr D2mr D2mw");
+   if (clo_cache_sim && sim_L2 && sim_write_back)
+      VG_(fprintf)(fp, " L2wb");
+   // DTLB read and write misses, and the page walks of each.
+   if (clo_cache_sim && sim_tlb)
+      VG_(fprintf)(fp, " DTmr DTmw PWr PWw");
+   VG_(fprintf)(fp, "\n");
 
    // Traverse every lineCC
-   VG_(OSetGen_ResetIter)(CC_table);
-   while ( (lineCC = VG_(OSetGen_Next)(CC_table)) ) {
+   VG_(OSetGen_ResetIter)(cfg_CC_tables[cfg]);
+   while ( (lineCC = VG_(OSetGen_Next)(cfg_CC_tables[cfg])) ) {
       Bool just_hit_a_new_file = False;
       // If we've hit a new file, print a "fl=" line.  Note that because
       // each string is stored exactly once in the string table, we can use
@@ -1434,12 +3405,15 @@ static void fprint_CC_table_and_calc_totals(void)
          distinct_fns++;
       }
 
+      if (sim_sample)
+         lineCC = sample_extrapolate(&scaled, lineCC);
+
       // Print the LineCC
       if (clo_cache_sim && clo_branch_sim) {
          VG_(fprintf)(fp,  "%d %llu %llu %llu"
                              " %llu %llu %llu"
                              " %llu %llu %llu"
-                             " %llu %llu %llu %llu\n",
+                             " %llu %llu %llu %llu",
                             lineCC->loc.line,
                             lineCC->Ir.a, lineCC->Ir.m1, lineCC->Ir.mL, 
                             lineCC->Dr.a, lineCC->Dr.m1, lineCC->Dr.mL,
@@ -1450,7 +3424,7 @@ static void fprint_CC_table_and_calc_totals(void)
       else if (clo_cache_sim && !clo_branch_sim) {
          VG_(fprintf)(fp,  "%d %llu %llu %llu"
                              " %llu %llu %llu"
-                             " %llu %llu %llu\n",
+                             " %llu %llu %llu",
                             lineCC->loc.line,
                             lineCC->Ir.a, lineCC->Ir.m1, lineCC->Ir.mL, 
                             lineCC->Dr.a, lineCC->Dr.m1, lineCC->Dr.mL,
@@ -1458,34 +3432,79 @@ static void fprint_CC_table_and_calc_totals(void)
       }
       else if (!clo_cache_sim && clo_branch_sim) {
          VG_(fprintf)(fp,  "%d %llu"
-                             " %llu %llu %llu %llu\n",
+                             " %llu %llu %llu %llu",
                             lineCC->loc.line,
                             lineCC->Ir.a, 
                             lineCC->Bc.b, lineCC->Bc.mp, 
                             lineCC->Bi.b, lineCC->Bi.mp);
       }
       else {
-         VG_(fprintf)(fp,  "%d %llu\n",
+         VG_(fprintf)(fp,  "%d %llu",
                             lineCC->loc.line,
                             lineCC->Ir.a);
       }
+      if (clo_cache_sim && sim_prefetch != PF_NONE)
+         VG_(fprintf)(fp, " %llu %llu %llu %llu",
+                          lineCC->Pf.issued, lineCC->Pf.useful,
+                          lineCC->Pf.late, lineCC->Pf.polluting);
+      if (clo_cache_sim && sim_write_back)
+         VG_(fprintf)(fp, " %llu %llu %llu %llu",
+                          lineCC->Tr.wb_D1, lineCC->Tr.wb_LL,
+                          lineCC->Tr.mem_rd, lineCC->Tr.mem_wr);
+      if (clo_cache_sim && sim_opt)
+         VG_(fprintf)(fp, " %llu %llu", lineCC->Dr.m1_opt, lineCC->Dw.m1_opt);
+      if (clo_cache_sim && sim_L2)
+         VG_(fprintf)(fp, " %llu %llu %llu",
+                          lineCC->Ir.m2, lineCC->Dr.m2, lineCC->Dw.m2);
+      if (clo_cache_sim && sim_L2 && sim_write_back)
+         VG_(fprintf)(fp, " %llu", lineCC->Tr.wb_L2);
+      if (clo_cache_sim && sim_tlb)
+         VG_(fprintf)(fp, " %llu %llu %llu %llu",
+                          lineCC->Tlb.mr, lineCC->Tlb.mw,
+                          lineCC->Tlb.walk_r, lineCC->Tlb.walk_w);
+      VG_(fprintf)(fp, "\n");
 
       // Update summary stats
-      Ir_total.a  += lineCC->Ir.a;
-      Ir_total.m1 += lineCC->Ir.m1;
-      Ir_total.mL += lineCC->Ir.mL;
-      Dr_total.a  += lineCC->Dr.a;
-      Dr_total.m1 += lineCC->Dr.m1;
-      Dr_total.mL += lineCC->Dr.mL;
-      Dw_total.a  += lineCC->Dw.a;
-      Dw_total.m1 += lineCC->Dw.m1;
-      Dw_total.mL += lineCC->Dw.mL;
-      Bc_total.b  += lineCC->Bc.b;
-      Bc_total.mp += lineCC->Bc.mp;
-      Bi_total.b  += lineCC->Bi.b;
-      Bi_total.mp += lineCC->Bi.mp;
-
-      distinct_lines++;
+      Ir_total[cfg].a  += lineCC->Ir.a;
+      Ir_total[cfg].m1 += lineCC->Ir.m1;
+      Ir_total[cfg].mL += lineCC->Ir.mL;
+      Ir_total[cfg].m2 += lineCC->Ir.m2;
+      Dr_total[cfg].a  += lineCC->Dr.a;
+      Dr_total[cfg].m1 += lineCC->Dr.m1;
+      Dr_total[cfg].mL += lineCC->Dr.mL;
+      Dr_total[cfg].m2 += lineCC->Dr.m2;
+      Dr_total[cfg].m1_inv += lineCC->Dr.m1_inv;
+      Dr_total[cfg].m1_opt += lineCC->Dr.m1_opt;
+      Dw_total[cfg].a  += lineCC->Dw.a;
+      Dw_total[cfg].m1 += lineCC->Dw.m1;
+      Dw_total[cfg].mL += lineCC->Dw.mL;
+      Dw_total[cfg].m2 += lineCC->Dw.m2;
+      Dw_total[cfg].m1_inv += lineCC->Dw.m1_inv;
+      Dw_total[cfg].m1_opt += lineCC->Dw.m1_opt;
+      Pf_total[cfg].issued    += lineCC->Pf.issued;
+      Pf_total[cfg].useful    += lineCC->Pf.useful;
+      Pf_total[cfg].late      += lineCC->Pf.late;
+      Pf_total[cfg].polluting += lineCC->Pf.polluting;
+      Tr_total[cfg].wb_D1  += lineCC->Tr.wb_D1;
+      Tr_total[cfg].wb_LL  += lineCC->Tr.wb_LL;
+      Tr_total[cfg].wb_L2  += lineCC->Tr.wb_L2;
+      Tr_total[cfg].mem_rd += lineCC->Tr.mem_rd;
+      Tr_total[cfg].mem_wr += lineCC->Tr.mem_wr;
+      if (cfg == 0) {
+         Bc_total.b  += lineCC->Bc.b;
+         Bc_total.mp += lineCC->Bc.mp;
+         Bi_total.b  += lineCC->Bi.b;
+         Bi_total.mp += lineCC->Bi.mp;
+         Tlb_total.mr     += lineCC->Tlb.mr;
+         Tlb_total.mw     += lineCC->Tlb.mw;
+         Tlb_total.m_comp += lineCC->Tlb.m_comp;
+         Tlb_total.m_conf += lineCC->Tlb.m_conf;
+         Tlb_total.m_cap  += lineCC->Tlb.m_cap;
+         Tlb_total.walk_r += lineCC->Tlb.walk_r;
+         Tlb_total.walk_w += lineCC->Tlb.walk_w;
+
+         distinct_lines++;
+      }
    }
 
    // Summary stats must come after rest of table, since we calculate them
@@ -1495,10 +3514,10 @@ static void fprint_CC_table_and_calc_totals(void)
                         " %llu %llu %llu"
                         " %llu %llu %llu"
                         " %llu %llu %llu"
-                        " %llu %llu %llu %llu\n", 
-                        Ir_total.a, Ir_total.m1, Ir_total.mL,
-                        Dr_total.a, Dr_total.m1, Dr_total.mL,
-                        Dw_total.a, Dw_total.m1, Dw_total.mL,
+                        " %llu %llu %llu %llu", 
+                        Ir_total[cfg].a, Ir_total[cfg].m1, Ir_total[cfg].mL,
+                        Dr_total[cfg].a, Dr_total[cfg].m1, Dr_total[cfg].mL,
+                        Dw_total[cfg].a, Dw_total[cfg].m1, Dw_total[cfg].mL,
                         Bc_total.b, Bc_total.mp, 
                         Bi_total.b, Bi_total.mp);
    }
@@ -1506,32 +3525,51 @@ static void fprint_CC_table_and_calc_totals(void)
       VG_(fprintf)(fp,  "summary:"
                         " %llu %llu %llu"
                         " %llu %llu %llu"
-                        " %llu %llu %llu\n",
-                        Ir_total.a, Ir_total.m1, Ir_total.mL,
-                        Dr_total.a, Dr_total.m1, Dr_total.mL,
-                        Dw_total.a, Dw_total.m1, Dw_total.mL);
+                        " %llu %llu %llu",
+                        Ir_total[cfg].a, Ir_total[cfg].m1, Ir_total[cfg].mL,
+                        Dr_total[cfg].a, Dr_total[cfg].m1, Dr_total[cfg].mL,
+                        Dw_total[cfg].a, Dw_total[cfg].m1, Dw_total[cfg].mL);
    }
    else if (!clo_cache_sim && clo_branch_sim) {
       VG_(fprintf)(fp,  "summary:"
                         " %llu"
-                        " %llu %llu %llu %llu\n", 
-                        Ir_total.a,
+                        " %llu %llu %llu %llu", 
+                        Ir_total[cfg].a,
                         Bc_total.b, Bc_total.mp, 
                         Bi_total.b, Bi_total.mp);
    }
    else {
       VG_(fprintf)(fp, "summary:"
-                        " %llu\n", 
-                        Ir_total.a);
+                        " %llu", 
+                        Ir_total[cfg].a);
    }
+   if (clo_cache_sim && sim_prefetch != PF_NONE)
+      VG_(fprintf)(fp, " %llu %llu %llu %llu",
+                       Pf_total[cfg].issued, Pf_total[cfg].useful,
+                       Pf_total[cfg].late, Pf_total[cfg].polluting);
+   if (clo_cache_sim && sim_write_back)
+      VG_(fprintf)(fp, " %llu %llu %llu %llu",
+                       Tr_total[cfg].wb_D1, Tr_total[cfg].wb_LL,
+                       Tr_total[cfg].mem_rd, Tr_total[cfg].mem_wr);
+   if (clo_cache_sim && sim_opt)
+      VG_(fprintf)(fp, " %llu %llu", Dr_total[cfg].m1_opt, Dw_total[cfg].m1_opt);
+   if (clo_cache_sim && sim_L2)
+      VG_(fprintf)(fp, " %llu %llu %llu",
+                       Ir_total[cfg].m2, Dr_total[cfg].m2, Dw_total[cfg].m2);
+   if (clo_cache_sim && sim_L2 && sim_write_back)
+      VG_(fprintf)(fp, " %llu", Tr_total[cfg].wb_L2);
+   if (clo_cache_sim && sim_tlb)
+      VG_(fprintf)(fp, " %llu %llu %llu %llu",
+                       Tlb_total.mr, Tlb_total.mw, Tlb_total.walk_r, Tlb_total.walk_w);
+   VG_(fprintf)(fp, "\n");
 
    VG_(fclose)(fp);
 }
 
-static void fprint_CC_table_and_cache_d1_usage(void)
+static void fprint_CC_table_and_cache_d1_usage(UInt cfg)
 {
    Int     i;
-   ULong   total_line, summary[MAX_NUM_BINS], total, access, miss, miss_comp, miss_conf, miss_cap;
+   ULong   total_line, summary[MAX_NUM_BINS], total, access, miss, miss_comp, miss_conf, miss_cap, miss_inv;
    VgFile  *fp;
    HChar   *currFile = NULL;
    const HChar *currFn = NULL;
@@ -1543,7 +3581,7 @@ static void fprint_CC_table_and_cache_d1_usage(void)
    // parent and child will incorrectly write to the same file;  this
    // happened in 3.3.0.
    HChar* cacheusage_out_file =
-      VG_(expand_file_name)("--cacheusage-d1-out-file", clo_cacheusage_d1_out_file);
+      cfg_out_file("--cacheusage-d1-out-file", clo_cacheusage_d1_out_file, cfg);
 
    fp = VG_(fopen)(cacheusage_out_file, VKI_O_CREAT|VKI_O_TRUNC|VKI_O_WRONLY,
                                         VKI_S_IRUSR|VKI_S_IWUSR);
@@ -1560,21 +3598,12 @@ static void fprint_CC_table_and_cache_d1_usage(void)
    }
 
    if (clo_cache_sim) {
-      // "desc:" lines (giving I1/D1/LL cache configuration). The spaces after
-      // the 2nd colon makes cg_annotate's output look nicer.
-      VG_(fprintf)(fp,  "desc: I1 cache:         %s\n"
-                        "desc: D1 cache:         %s\n"
-                        "desc: LL cache:         %s\n"
-                        "desc: WordSize:         %u\n",
-                        I1.desc_line, D1.desc_line, LL.desc_line, clo_word_size);
+      fprint_cache_desc(fp, cfg);
+      VG_(fprintf)(fp,  "desc: WordSize:         %u\n", clo_word_size);
    }
 
    // "cmd:" line
-   VG_(fprintf)(fp, "cmd: %s", VG_(args_the_exename));
-   for (i = 0; i < VG_(sizeXA)( VG_(args_for_client) ); i++) {
-      HChar* arg = * (HChar**) VG_(indexXA)( VG_(args_for_client), i );
-      VG_(fprintf)(fp, " %s", arg);
-   }
+   fprint_cmd_line(fp);
 
    // "events:" line
 /*   if (clo_cache_sim && clo_branch_sim) {
@@ -1593,7 +3622,8 @@ static void fprint_CC_table_and_cache_d1_usage(void)
    }*/
 
    //"histogram bins:" line
-   VG_(fprintf)(fp, "\nbins: Access# Miss# Comp# Conf# Cap# Cacheline# ");
+   VG_(fprintf)(fp, "\nbins: Access# Miss# Comp# Conf# Cap# %sCacheline# ",
+                    sim_threads_private ? "Inv# " : "");
    for(i = 0; i < MAX_NUM_BINS; i++)
      VG_(fprintf)(fp, "%d-words ", i+1);
    VG_(fprintf)(fp, "\n");
@@ -1603,14 +3633,15 @@ static void fprint_CC_table_and_cache_d1_usage(void)
    miss_comp = 0;
    miss_conf = 0;
    miss_cap = 0;
+   miss_inv = 0;
    for(i = 0; i < MAX_NUM_BINS; i++)
    {
       summary[i] = 0;
    }
 
    // Traverse every lineCC
-   VG_(OSetGen_ResetIter)(CC_table);
-   while ( (lineCC = VG_(OSetGen_Next)(CC_table)) ) {
+   VG_(OSetGen_ResetIter)(cfg_CC_tables[cfg]);
+   while ( (lineCC = VG_(OSetGen_Next)(cfg_CC_tables[cfg])) ) {
       Bool just_hit_a_new_file = False;
       // If we've hit a new file, print a "fl=" line.  Note that because
       // each string is stored exactly once in the string table, we can use
@@ -1651,11 +3682,14 @@ static void fprint_CC_table_and_cache_d1_usage(void)
          miss_comp += lineCC->Dr.m1_comp + lineCC->Dw.m1_comp;
          miss_conf += lineCC->Dr.m1_conf + lineCC->Dw.m1_conf;
          miss_cap += lineCC->Dr.m1_cap + lineCC->Dw.m1_cap;
+         miss_inv += lineCC->Dr.m1_inv + lineCC->Dw.m1_inv;
 
-         VG_(fprintf)(fp,  "%d %llu %llu %llu %llu %llu %llu",
+         VG_(fprintf)(fp,  "%d %llu %llu %llu %llu %llu",
                            lineCC->loc.line, lineCC->Dr.a + lineCC->Dw.a, lineCC->Dr.m1 + lineCC->Dw.m1, 
-                           lineCC->Dr.m1_comp + lineCC->Dw.m1_comp, lineCC->Dr.m1_conf + lineCC->Dw.m1_conf, lineCC->Dr.m1_cap + lineCC->Dw.m1_cap, 
-                           total_line);
+                           lineCC->Dr.m1_comp + lineCC->Dw.m1_comp, lineCC->Dr.m1_conf + lineCC->Dw.m1_conf, lineCC->Dr.m1_cap + lineCC->Dw.m1_cap);
+         if (sim_threads_private)
+             VG_(fprintf)(fp, " %llu", lineCC->Dr.m1_inv + lineCC->Dw.m1_inv);
+         VG_(fprintf)(fp,  " %llu", total_line);
          for(i = 0; i < MAX_NUM_BINS; i++)
              VG_(fprintf)(fp, " %llu", lineCC->num_evicts_D1[i]);
          VG_(fprintf)(fp,  "\n");
@@ -1671,8 +3705,11 @@ static void fprint_CC_table_and_cache_d1_usage(void)
    }
 
    if (clo_cache_sim) {
-      VG_(fprintf)(fp,  "summary: %llu %llu %llu %llu %llu %llu",
-                        access, miss, miss_comp, miss_conf, miss_cap, total);
+      VG_(fprintf)(fp,  "summary: %llu %llu %llu %llu %llu",
+                        access, miss, miss_comp, miss_conf, miss_cap);
+      if (sim_threads_private)
+          VG_(fprintf)(fp, " %llu", miss_inv);
+      VG_(fprintf)(fp,  " %llu", total);
 
       for(i = 0; i < MAX_NUM_BINS; i++)
           VG_(fprintf)(fp, " %llu", summary[i]);
@@ -1682,10 +3719,14 @@ static void fprint_CC_table_and_cache_d1_usage(void)
    VG_(fclose)(fp);
 }
 
-static void fprint_CC_table_and_cache_ll_usage(void)
+// The usage file of L2 (--L2) or LL, by `level`.  Its accesses are the
+// misses of the level above.
+static void fprint_CC_table_and_cache_ll_usage(UInt cfg, Int level)
 {
    Int     i;
    ULong   total_line, summary[MAX_NUM_BINS], total, access, miss, miss_comp, miss_conf, miss_cap;
+   ULong   l_access, l_miss, l_comp, l_conf, l_cap;
+   const ULong *evicts;
    VgFile  *fp;
    HChar   *currFile = NULL;
    const HChar *currFn = NULL;
@@ -1696,8 +3737,9 @@ static void fprint_CC_table_and_cache_ll_usage(void)
    // output file format string contains a %p (pid) specifier, both the
    // parent and child will incorrectly write to the same file;  this
    // happened in 3.3.0.
-   HChar* cacheusage_out_file =
-      VG_(expand_file_name)("--cacheusage-ll-out-file", clo_cacheusage_ll_out_file);
+   HChar* cacheusage_out_file = (level == CACHE_L2)
+      ? cfg_out_file("--cacheusage-l2-out-file", clo_cacheusage_l2_out_file, cfg)
+      : cfg_out_file("--cacheusage-ll-out-file", clo_cacheusage_ll_out_file, cfg);
 
    fp = VG_(fopen)(cacheusage_out_file, VKI_O_CREAT|VKI_O_TRUNC|VKI_O_WRONLY,
                                         VKI_S_IRUSR|VKI_S_IWUSR);
@@ -1713,21 +3755,11 @@ static void fprint_CC_table_and_cache_ll_usage(void)
       VG_(free)(cacheusage_out_file);
    }
 
-   if (clo_cache_sim) {
-      // "desc:" lines (giving I1/D1/LL cache configuration). The spaces after
-      // the 2nd colon makes cg_annotate's output look nicer.
-      VG_(fprintf)(fp,  "desc: I1 cache:         %s\n"
-                        "desc: D1 cache:         %s\n"
-                        "desc: LL cache:         %s\n",
-                        I1.desc_line, D1.desc_line, LL.desc_line);
-   }
+   if (clo_cache_sim)
+      fprint_cache_desc(fp, cfg);
 
    // "cmd:" line
-   VG_(fprintf)(fp, "cmd: %s", VG_(args_the_exename));
-   for (i = 0; i < VG_(sizeXA)( VG_(args_for_client) ); i++) {
-      HChar* arg = * (HChar**) VG_(indexXA)( VG_(args_for_client), i );
-      VG_(fprintf)(fp, " %s", arg);
-   }
+   fprint_cmd_line(fp);
 
    // "events:" line
 /*   if (clo_cache_sim && clo_branch_sim) {
@@ -1762,8 +3794,8 @@ static void fprint_CC_table_and_cache_ll_usage(void)
    }
 
    // Traverse every lineCC
-   VG_(OSetGen_ResetIter)(CC_table);
-   while ( (lineCC = VG_(OSetGen_Next)(CC_table)) ) {
+   VG_(OSetGen_ResetIter)(cfg_CC_tables[cfg]);
+   while ( (lineCC = VG_(OSetGen_Next)(cfg_CC_tables[cfg])) ) {
       Bool just_hit_a_new_file = False;
       // If we've hit a new file, print a "fl=" line.  Note that because
       // each string is stored exactly once in the string table, we can use
@@ -1786,146 +3818,959 @@ static void fprint_CC_table_and_cache_ll_usage(void)
          distinct_fns++;
       }
 
-      // Print the LineCC
-      total_line = 0;
-      for(i = 0; i < MAX_NUM_BINS; i++)
-      {
-        // Update summary stats
-        summary[i] += lineCC->num_evicts_LL[i];
+      // Print the LineCC
+      evicts = (level == CACHE_L2) ? lineCC->num_evicts_L2 : lineCC->num_evicts_LL;
+      total_line = 0;
+      for(i = 0; i < MAX_NUM_BINS; i++)
+      {
+        // Update summary stats
+        summary[i] += evicts[i];
+
+        // Calculate stats per line
+        total_line += evicts[i]; 
+      }
+
+      if (clo_cache_sim && total_line) {
+
+         if (level == CACHE_L2) {
+            l_access = lineCC->Dr.m1 + lineCC->Dw.m1;
+            l_miss   = lineCC->Dr.m2 + lineCC->Dw.m2;
+            l_comp   = lineCC->Dr.m2_comp + lineCC->Dw.m2_comp;
+            l_conf   = lineCC->Dr.m2_conf + lineCC->Dw.m2_conf;
+            l_cap    = lineCC->Dr.m2_cap + lineCC->Dw.m2_cap;
+         } else {
+            l_access = sim_L2 ? lineCC->Dr.m2 + lineCC->Dw.m2
+                              : lineCC->Dr.m1 + lineCC->Dw.m1;
+            l_miss   = lineCC->Dr.mL + lineCC->Dw.mL;
+            l_comp   = lineCC->Dr.mL_comp + lineCC->Dw.mL_comp;
+            l_conf   = lineCC->Dr.mL_conf + lineCC->Dw.mL_conf;
+            l_cap    = lineCC->Dr.mL_cap + lineCC->Dw.mL_cap;
+         }
+         access += l_access;
+         miss += l_miss;
+         miss_comp += l_comp;
+         miss_conf += l_conf;
+         miss_cap += l_cap;
+
+         VG_(fprintf)(fp,  "%d %llu %llu %llu" 
+                           " %llu %llu %llu",
+                           lineCC->loc.line, l_access, l_miss, l_comp, l_conf, l_cap,
+                           total_line);
+         for(i = 0; i < MAX_NUM_BINS; i++)
+             VG_(fprintf)(fp, "  %llu", evicts[i]);
+         VG_(fprintf)(fp,  "\n");
+      }
+   }
+
+   // Summary stats must come after rest of table, since we calculate them
+   // during traversal.
+   total = 0;
+   for(i = 0; i < MAX_NUM_BINS; i++)
+   {
+      total += summary[i];
+   }
+
+   if (clo_cache_sim) {
+      VG_(fprintf)(fp,  "summary: %llu %llu %llu %llu %llu %llu",
+                        access, miss, miss_comp, miss_conf, miss_cap, total);
+      for(i = 0; i < MAX_NUM_BINS; i++)
+          VG_(fprintf)(fp, " %llu", summary[i]);
+      VG_(fprintf)(fp,  "\n");
+   }
+
+   VG_(fclose)(fp);
+}
+
+// CR records are printed ordered by incoming, then evicted variable id,
+// and CU records by variable id.
+static Int cmp_cacheline_rep(const void* va, const void* vb)
+{
+   const cacheline_rep_t* a = va;
+   const cacheline_rep_t* b = vb;
+
+   if (a->in_id != b->in_id)
+      return a->in_id < b->in_id ? -1 : 1;
+   if (a->out_id != b->out_id)
+      return a->out_id < b->out_id ? -1 : 1;
+   return 0;
+}
+
+static Int cmp_cacheline_usage(const void* va, const void* vb)
+{
+   const cacheline_usage_t* a = va;
+   const cacheline_usage_t* b = vb;
+
+   if (a->vid != b->vid)
+      return a->vid < b->vid ? -1 : 1;
+   return 0;
+}
+
+/*------------------------------------------------------------*/
+/*--- Binary cacheusage files                              ---*/
+/*------------------------------------------------------------*/
+
+// With --cacheusage-format=bin, the D1 usage and CR files are tables of
+// fixed-width records, in the host's byte order, that the Python tools
+// map into memory instead of parsing.  A header is followed by the tables
+// it locates, each starting 8-byte aligned:
+//   STR   interned, NUL-terminated strings (one byte per row)
+//   LINE  a CuBinLine per source line
+//   CR    a CuBinCR per (line, incoming, evicted variable), by line
+//   CU    a CuBinCU per (line, variable), by line
+// Strings are referred to by their offset in STR.  The D1 usage file has
+// the lines that evicted cachelines, and no CR or CU rows; the CR file
+// has the lines that replaced a variable.
+#define CUBIN_MAGIC    "CGCUBIN"
+#define CUBIN_VERSION  1
+#define CUBIN_ENDIAN   0x01020304
+
+#define CUBIN_D1   1          /* kind of file */
+#define CUBIN_CR   2
+
+#define CUBIN_INV  (1 << 0)   /* flags: invalidation misses are counted */
+
+enum { CUBIN_STR, CUBIN_LINE, CUBIN_CR_TAB, CUBIN_CU, CUBIN_N_TABS };
+
+typedef struct {
+   HChar magic[8];
+   UInt  endian;
+   UInt  version;
+   UInt  kind;
+   UInt  n_bins;              /* word bins, MAX_NUM_BINS */
+   UInt  flags;
+   UInt  desc;                /* the "desc:" and "cmd:" lines */
+   struct {
+      ULong offset, n_rows, row_size;
+   } tab[CUBIN_N_TABS];
+} CuBinHeader;
+
+typedef struct {
+   UInt  file, fn;
+   Int   line;
+   UInt  pad;
+   ULong access, miss, comp, conf, cap, inv;   /* D1 */
+   ULong evicts;                               /* sum of bins */
+   ULong bins[MAX_NUM_BINS];   /* evicted cachelines, by words used */
+} CuBinLine;
+
+typedef struct {
+   UInt  line;                 /* LINE row */
+   UInt  in_var, out_var;
+   UInt  pad;
+   ULong total, comp, conf, cap, inv;
+} CuBinCR;
+
+typedef struct {
+   UInt  line;                 /* LINE row */
+   UInt  var;
+   ULong access;
+   ULong bins[MAX_NUM_BINS];
+} CuBinCU;
+
+// Strings are interned by address: file and function names are unique in
+// the string table, and variable names by variable id.
+typedef struct {
+   UWord key;
+   UInt  offset;
+} CuBinString;
+
+typedef struct {
+   XArray* tab[CUBIN_N_TABS];
+   OSet*   strings;            /* of CuBinString */
+   UInt*   var_offsets;        /* by variable id, or 0 */
+} CuBin;
+
+static UInt cubin_string(CuBin* cb, UWord key, const HChar* str)
+{
+   CuBinString* s = VG_(OSetGen_Lookup)(cb->strings, &key);
+
+   if (s == NULL) {
+      s = VG_(OSetGen_AllocNode)(cb->strings, sizeof(CuBinString));
+      s->key = key;
+      s->offset = VG_(sizeXA)(cb->tab[CUBIN_STR]);
+      VG_(addBytesToXA)(cb->tab[CUBIN_STR], str, VG_(strlen)(str) + 1);
+      VG_(OSetGen_Insert)(cb->strings, s);
+   }
+   return s->offset;
+}
+
+static UInt cubin_var(CuBin* cb, UInt id)
+{
+   // Offset 0 is the empty string, so 0 means not interned yet.
+   if (cb->var_offsets[id] == 0) {
+      cb->var_offsets[id] = VG_(sizeXA)(cb->tab[CUBIN_STR]);
+      VG_(addBytesToXA)(cb->tab[CUBIN_STR], var_array[id]->name,
+                        VG_(strlen)(var_array[id]->name) + 1);
+   }
+   return cb->var_offsets[id];
+}
+
+static UInt cubin_add_line(CuBin* cb, const LineCC* lineCC)
+{
+   CuBinLine l;
+   Int i;
+
+   VG_(memset)(&l, 0, sizeof(l));
+   l.file   = cubin_string(cb, (UWord)lineCC->loc.file, lineCC->loc.file);
+   l.fn     = cubin_string(cb, (UWord)lineCC->loc.fn, lineCC->loc.fn);
+   l.line   = lineCC->loc.line;
+   l.access = lineCC->Dr.a + lineCC->Dw.a;
+   l.miss   = lineCC->Dr.m1 + lineCC->Dw.m1;
+   l.comp   = lineCC->Dr.m1_comp + lineCC->Dw.m1_comp;
+   l.conf   = lineCC->Dr.m1_conf + lineCC->Dw.m1_conf;
+   l.cap    = lineCC->Dr.m1_cap + lineCC->Dw.m1_cap;
+   l.inv    = lineCC->Dr.m1_inv + lineCC->Dw.m1_inv;
+   for (i = 0; i < MAX_NUM_BINS; i++) {
+      l.bins[i] = lineCC->num_evicts_D1[i];
+      l.evicts += l.bins[i];
+   }
+   return VG_(addToXA)(cb->tab[CUBIN_LINE], &l);
+}
+
+static void cubin_add_replacements(CuBin* cb, const LineCC* lineCC,
+                                   cacheline_rep_t* crs,
+                                   cacheline_usage_t* cus)
+{
+   const cr_table_t *crt = &lineCC->cr_table_D1;
+   const cu_table_t *cut = &lineCC->cu_table_D1;
+   UInt line = cubin_add_line(cb, lineCC);
+   UInt j, n;
+   Int i;
+
+   for (j = 0, n = 0; j < crt->n_slots; j++)
+      if (crt->slots[j].in_id != NO_VAR)
+         crs[n++] = crt->slots[j];
+   VG_(ssort)(crs, n, sizeof(cacheline_rep_t), cmp_cacheline_rep);
+   for (j = 0; j < n; j++) {
+      CuBinCR r;
+
+      VG_(memset)(&r, 0, sizeof(r));
+      r.line    = line;
+      r.in_var  = cubin_var(cb, crs[j].in_id);
+      r.out_var = cubin_var(cb, crs[j].out_id);
+      r.comp    = crs[j].m_comp;
+      r.conf    = crs[j].m_conf;
+      r.cap     = crs[j].m_cap;
+      r.inv     = crs[j].m_inv;
+      r.total   = r.comp + r.conf + r.cap + r.inv;
+      VG_(addToXA)(cb->tab[CUBIN_CR_TAB], &r);
+   }
+
+   for (j = 0, n = 0; j < cut->n_slots; j++)
+      if (cut->slots[j].vid != NO_VAR)
+         cus[n++] = cut->slots[j];
+   VG_(ssort)(cus, n, sizeof(cacheline_usage_t), cmp_cacheline_usage);
+   for (j = 0; j < n; j++) {
+      CuBinCU u;
+
+      u.line   = line;
+      u.var    = cubin_var(cb, cus[j].vid);
+      u.access = cus[j].num_accesses_D1;
+      for (i = 0; i < MAX_NUM_BINS; i++)
+         u.bins[i] = cus[j].num_evicts_D1[i];
+      VG_(addToXA)(cb->tab[CUBIN_CU], &u);
+   }
+}
+
+/* Write the `size` bytes at `buf` to `fd`, in pieces VG_(write) can
+   count and resuming after a short write.  False if a write fails. */
+static Bool cubin_write_all(Int fd, const void* buf, ULong size)
+{
+   const HChar* p = buf;
+   Int n;
+
+   while (size > 0) {
+      n = VG_(write)(fd, p, size > (1 << 30) ? (1 << 30) : (Int)size);
+      if (n <= 0)
+         return False;
+      p    += n;
+      size -= n;
+   }
+   return True;
+}
+
+static void cubin_write(UInt cfg, UInt kind)
+{
+   static const HChar zeroes[8] = { 0 };
+   static const Word row_sizes[CUBIN_N_TABS] =
+      { 1, sizeof(CuBinLine), sizeof(CuBinCR), sizeof(CuBinCU) };
+   CuBin cb;
+   CuBinHeader h;
+   TextOut out;
+   LineCC* lineCC;
+   cacheline_rep_t *crs = NULL;
+   cacheline_usage_t *cus = NULL;
+   UInt crs_size = 0;
+   ULong offset;
+   SysRes sres;
+   Int fd, t;
+   Bool ok = True;
+   HChar* name = kind == CUBIN_D1
+      ? cfg_out_file("--cacheusage-d1-out-file", clo_cacheusage_d1_out_file, cfg)
+      : cfg_out_file("--cacheusage-cr-out-file", clo_cacheusage_cr_out_file, cfg);
+
+   sres = VG_(open)(name, VKI_O_CREAT|VKI_O_TRUNC|VKI_O_WRONLY,
+                    VKI_S_IRUSR|VKI_S_IWUSR);
+   if (sr_isError(sres)) {
+      VG_(umsg)("error: can't open output data file '%s'\n", name);
+      VG_(umsg)("       ... so detailed results will be missing.\n");
+      VG_(free)(name);
+      return;
+   }
+   fd = sr_Res(sres);
+
+   for (t = 0; t < CUBIN_N_TABS; t++)
+      cb.tab[t] = VG_(newXA)(VG_(malloc), "cg.main.cubin.1", VG_(free),
+                             row_sizes[t]);
+   cb.strings = VG_(OSetGen_Create)(offsetof(CuBinString, key), NULL,
+                                    VG_(malloc), "cg.main.cubin.2", VG_(free));
+   cb.var_offsets = var_index == 0 ? NULL
+      : VG_(calloc)("cg.main.cubin.3", var_index, sizeof(UInt));
+
+   VG_(memset)(&h, 0, sizeof(h));
+   VG_(strcpy)(h.magic, CUBIN_MAGIC);
+   h.endian  = CUBIN_ENDIAN;
+   h.version = CUBIN_VERSION;
+   h.kind    = kind;
+   h.n_bins  = MAX_NUM_BINS;
+   h.flags   = sim_threads_private ? CUBIN_INV : 0;
+
+   // The header lines of the text file, as the first string.
+   VG_(addToXA)(cb.tab[CUBIN_STR], "");
+   h.desc = VG_(sizeXA)(cb.tab[CUBIN_STR]);
+   out.fp = NULL;
+   out.xa = cb.tab[CUBIN_STR];
+   if (clo_cache_sim) {
+      tprint_cache_desc(&out, cfg);
+      if (kind == CUBIN_D1)
+         tprintf(&out, "desc: WordSize:         %u\n", clo_word_size);
+   }
+   tprint_cmd_line(&out);
+   tprintf(&out, "\n");
+   VG_(addToXA)(cb.tab[CUBIN_STR], "");
+
+   VG_(OSetGen_ResetIter)(cfg_CC_tables[cfg]);
+   while ( clo_cache_sim && (lineCC = VG_(OSetGen_Next)(cfg_CC_tables[cfg])) ) {
+      if (kind == CUBIN_D1) {
+         Int i;
+         for (i = 0; i < MAX_NUM_BINS; i++)
+            if (lineCC->num_evicts_D1[i])
+               break;
+         if (i < MAX_NUM_BINS)
+            cubin_add_line(&cb, lineCC);
+      } else if (lineCC->cr_table_D1.n_used > 0) {
+         UInt n = lineCC->cr_table_D1.n_used > lineCC->cu_table_D1.n_used
+                  ? lineCC->cr_table_D1.n_used : lineCC->cu_table_D1.n_used;
+         if (n > crs_size) {
+            crs_size = n;
+            crs = VG_(realloc)("cg.main.cubin.4", crs, sizeof(cacheline_rep_t) * crs_size);
+            cus = VG_(realloc)("cg.main.cubin.5", cus, sizeof(cacheline_usage_t) * crs_size);
+         }
+         cubin_add_replacements(&cb, lineCC, crs, cus);
+      }
+   }
+
+   offset = sizeof(CuBinHeader);
+   for (t = 0; t < CUBIN_N_TABS; t++) {
+      h.tab[t].offset   = offset;
+      h.tab[t].n_rows   = VG_(sizeXA)(cb.tab[t]);
+      h.tab[t].row_size = row_sizes[t];
+      offset += VG_ROUNDUP(h.tab[t].n_rows * h.tab[t].row_size, 8);
+   }
+
+   ok = cubin_write_all(fd, &h, sizeof(h));
+   for (t = 0; t < CUBIN_N_TABS && ok; t++) {
+      ULong size = h.tab[t].n_rows * h.tab[t].row_size;
+      ULong pad  = VG_ROUNDUP(size, 8) - size;
+      if (size > 0)
+         ok = cubin_write_all(fd, VG_(indexXA)(cb.tab[t], 0), size);
+      if (ok && pad > 0)
+         ok = cubin_write_all(fd, zeroes, pad);
+   }
+   if (!ok)
+      VG_(umsg)("error: can't write output data file '%s'\n", name);
+   VG_(close)(fd);
+
+   for (t = 0; t < CUBIN_N_TABS; t++)
+      VG_(deleteXA)(cb.tab[t]);
+   VG_(OSetGen_Destroy)(cb.strings);
+   if (cb.var_offsets)
+      VG_(free)(cb.var_offsets);
+   if (crs) {
+      VG_(free)(crs);
+      VG_(free)(cus);
+   }
+   VG_(free)(name);
+}
+
+static void fprint_CC_table_and_cache_replacement(UInt cfg)
+{
+   Int i;
+   UInt j, n, crs_size = 0;
+   VgFile  *fp;
+   LineCC* lineCC;
+   cacheline_rep_t *crs = NULL;
+   cacheline_usage_t *cus = NULL;
+
+   // Setup output filename.  Nb: it's important to do this now, ie. as late
+   // as possible.  If we do it at start-up and the program forks and the
+   // output file format string contains a %p (pid) specifier, both the
+   // parent and child will incorrectly write to the same file;  this
+   // happened in 3.3.0.
+   HChar* cr_out_file =
+      cfg_out_file("--cacheusage-cr-out-file", clo_cacheusage_cr_out_file, cfg);
+
+   fp = VG_(fopen)(cr_out_file, VKI_O_CREAT|VKI_O_TRUNC|VKI_O_WRONLY,
+                                        VKI_S_IRUSR|VKI_S_IWUSR);
+   if (fp == NULL) {
+      // If the file can't be opened for whatever reason (conflict
+      // between multiple cachegrinded processes?), give up now.
+      VG_(umsg)("error: can't open output data file '%s'\n",
+                cr_out_file );
+      VG_(umsg)("       ... so detailed results will be missing.\n");
+      VG_(free)(cr_out_file);
+      return;
+   } else {
+      VG_(free)(cr_out_file);
+   }
+
+   // Invalidation misses only exist with private D1s.
+   VG_(fprintf)(fp,  "desc SUM: access# miss# compulsory# conflict# capacity#%s\n"
+                     "desc CR: in_var out_var total# compulsory# conflict# capacity#%s\n"
+                     "desc CU: var access#",
+                     sim_threads_private ? " invalidation#" : "",
+                     sim_threads_private ? " invalidation#" : "");
+   for(i = 0; i < MAX_NUM_BINS; i++)
+     VG_(fprintf)(fp, " %d-words", i+1);
+   VG_(fprintf)(fp, "\n");
+/*
+   if (clo_cache_sim)
+      fprint_cache_desc(fp, cfg);
+
+   // "cmd:" line
+   VG_(fprintf)(fp, "cmd: %s", VG_(args_the_exename));
+   for (i = 0; i < VG_(sizeXA)( VG_(args_for_client) ); i++) {
+      HChar* arg = * (HChar**) VG_(indexXA)( VG_(args_for_client), i );
+      VG_(fprintf)(fp, " %s", arg);
+   }
+*/
+   
+   // Traverse every lineCC
+   VG_(OSetGen_ResetIter)(cfg_CC_tables[cfg]);
+   while ( (lineCC = VG_(OSetGen_Next)(cfg_CC_tables[cfg])) ) {
+      cr_table_t *crt = &lineCC->cr_table_D1;
+      cu_table_t *cut = &lineCC->cu_table_D1;
+      if (clo_cache_sim && crt->n_used > 0) {
+         // Sort copies of the entries, leaving the tables usable.
+         if (crt->n_used > crs_size || cut->n_used > crs_size) {
+            crs_size = crt->n_used > cut->n_used ? crt->n_used : cut->n_used;
+            crs = VG_(realloc)("cg.main.fcr.1", crs, sizeof(cacheline_rep_t) * crs_size);
+            cus = VG_(realloc)("cg.main.fcr.2", cus, sizeof(cacheline_usage_t) * crs_size);
+         }
+
+         VG_(fprintf)(fp, "Line: %s:%s:%d\n", lineCC->loc.file, lineCC->loc.fn, lineCC->loc.line);
+
+         VG_(fprintf)(fp,  "SUM: %llu %llu %llu %llu %llu",
+                           lineCC->Dr.a + lineCC->Dw.a, lineCC->Dr.m1 + lineCC->Dw.m1, 
+                           lineCC->Dr.m1_comp + lineCC->Dw.m1_comp, lineCC->Dr.m1_conf + lineCC->Dw.m1_conf, lineCC->Dr.m1_cap + lineCC->Dw.m1_cap);
+         if (sim_threads_private)
+             VG_(fprintf)(fp, " %llu", lineCC->Dr.m1_inv + lineCC->Dw.m1_inv);
+         VG_(fprintf)(fp,  "\n");
+
+         for (j = 0, n = 0; j < crt->n_slots; j++)
+            if (crt->slots[j].in_id != NO_VAR)
+               crs[n++] = crt->slots[j];
+         VG_(ssort)(crs, n, sizeof(cacheline_rep_t), cmp_cacheline_rep);
+         for (j = 0; j < n; j++)
+         {
+             const cacheline_rep_t *cr = &crs[j];
+             ULong total_pair = cr->m_comp + cr->m_conf + cr->m_cap + cr->m_inv;
+
+             VG_(fprintf)(fp,  "CR: %s %s %llu %llu %llu %llu",
+                           var_array[cr->in_id]->name, var_array[cr->out_id]->name, total_pair, cr->m_comp, cr->m_conf, cr->m_cap);
+             if (sim_threads_private)
+                 VG_(fprintf)(fp, " %llu", cr->m_inv);
+             VG_(fprintf)(fp,  "\n");
+
+         }
+         for (j = 0, n = 0; j < cut->n_slots; j++)
+            if (cut->slots[j].vid != NO_VAR)
+               cus[n++] = cut->slots[j];
+         VG_(ssort)(cus, n, sizeof(cacheline_usage_t), cmp_cacheline_usage);
+         for (j = 0; j < n; j++)
+         {
+             const cacheline_usage_t *cu = &cus[j];
+             VG_(fprintf)(fp,  "CU: %s %llu", var_array[cu->vid]->name, cu->num_accesses_D1);
+             for(i = 0; i < MAX_NUM_BINS; i++)
+                 VG_(fprintf)(fp, " %llu", cu->num_evicts_D1[i]);
+             VG_(fprintf)(fp,  "\n");
+         }
+      }
+   }
+
+   if (crs) {
+      VG_(free)(crs);
+      VG_(free)(cus);
+   }
+   VG_(fclose)(fp);
+}
+
+// The DTLB counts of every line that missed in it, and the variables
+// whose pages were evicted by those misses, in the format of the CR
+// file.  The DTLB is shared by the configurations, so there is one file.
+static void fprint_CC_table_and_tlb_replacement(void)
+{
+   UInt j, n, crs_size = 0;
+   VgFile  *fp;
+   LineCC* lineCC;
+   cacheline_rep_t *crs = NULL;
+   HChar* tlb_out_file =
+      cfg_out_file("--cacheusage-tlb-out-file", clo_cacheusage_tlb_out_file, 0);
+
+   fp = VG_(fopen)(tlb_out_file, VKI_O_CREAT|VKI_O_TRUNC|VKI_O_WRONLY,
+                                 VKI_S_IRUSR|VKI_S_IWUSR);
+   if (fp == NULL) {
+      VG_(umsg)("error: can't open output data file '%s'\n",
+                tlb_out_file );
+      VG_(umsg)("       ... so detailed results will be missing.\n");
+      VG_(free)(tlb_out_file);
+      return;
+   } else {
+      VG_(free)(tlb_out_file);
+   }
+
+   VG_(fprintf)(fp,  "desc: DTLB:             %s\n", DTLB.desc_line);
+   if (sim_stlb)
+      VG_(fprintf)(fp, "desc: STLB:             %s\n", STLB.desc_line);
+   VG_(fprintf)(fp,  "desc SUM: access# miss# compulsory# conflict# capacity# walk#\n"
+                     "desc CR: in_var out_var total# compulsory# conflict# capacity#\n");
+
+   VG_(OSetGen_ResetIter)(CC_table);
+   while ( (lineCC = VG_(OSetGen_Next)(CC_table)) ) {
+      cr_table_t *crt = &lineCC->cr_table_TLB;
+      if (lineCC->Tlb.mr + lineCC->Tlb.mw == 0)
+         continue;
+
+      VG_(fprintf)(fp, "Line: %s:%s:%d\n", lineCC->loc.file, lineCC->loc.fn, lineCC->loc.line);
+      VG_(fprintf)(fp, "SUM: %llu %llu %llu %llu %llu %llu\n",
+                       lineCC->Dr.a + lineCC->Dw.a, lineCC->Tlb.mr + lineCC->Tlb.mw,
+                       lineCC->Tlb.m_comp, lineCC->Tlb.m_conf, lineCC->Tlb.m_cap,
+                       lineCC->Tlb.walk_r + lineCC->Tlb.walk_w);
+
+      if (crt->n_used > crs_size) {
+         crs_size = crt->n_used;
+         crs = VG_(realloc)("cg.main.ftr.1", crs, sizeof(cacheline_rep_t) * crs_size);
+      }
+      for (j = 0, n = 0; j < crt->n_slots; j++)
+         if (crt->slots[j].in_id != NO_VAR)
+            crs[n++] = crt->slots[j];
+      VG_(ssort)(crs, n, sizeof(cacheline_rep_t), cmp_cacheline_rep);
+      for (j = 0; j < n; j++) {
+         const cacheline_rep_t *cr = &crs[j];
+         VG_(fprintf)(fp, "CR: %s %s %llu %llu %llu %llu\n",
+                          var_array[cr->in_id]->name, var_array[cr->out_id]->name,
+                          cr->m_comp + cr->m_conf + cr->m_cap,
+                          cr->m_comp, cr->m_conf, cr->m_cap);
+      }
+   }
+
+   if (crs)
+      VG_(free)(crs);
+   VG_(fclose)(fp);
+}
+
+// The field heat map of every variable registered by
+// CACHEGRIND_REGISTER_STRUCT_ARRAY, for cu_annotate --fields.  Its D1
+// misses are those of the first configuration.
+static void fprint_field_heat(void)
+{
+   UInt id, i;
+   VgFile  *fp;
+   HChar* field_out_file =
+      cfg_out_file("--cacheusage-field-out-file", clo_cacheusage_field_out_file, 0);
+
+   fp = VG_(fopen)(field_out_file, VKI_O_CREAT|VKI_O_TRUNC|VKI_O_WRONLY,
+                                   VKI_S_IRUSR|VKI_S_IWUSR);
+   if (fp == NULL) {
+      VG_(umsg)("error: can't open output data file '%s'\n",
+                field_out_file );
+      VG_(umsg)("       ... so detailed results will be missing.\n");
+      VG_(free)(field_out_file);
+      return;
+   } else {
+      VG_(free)(field_out_file);
+   }
+
+   fprint_cache_desc(fp, 0);
+   fprint_cmd_line(fp);
+   VG_(fprintf)(fp, "\n"
+                    "desc FIELD: var elem_size elements access# miss#\n"
+                    "desc HEAT: access# of each byte offset in an element\n");
+
+   for (id = 0; id < var_index; id++) {
+      const variable_t* var = var_array[id];
+      if (var->elem_size == 0)
+         continue;
+      VG_(fprintf)(fp, "FIELD: %s %u %lu %llu %llu\n", var->name, var->elem_size,
+                       (var->end - var->begin + 1) / var->elem_size,
+                       var->field_refs, var->field_misses);
+      VG_(fprintf)(fp, "HEAT:");
+      for (i = 0; i < var->elem_size; i++)
+         VG_(fprintf)(fp, " %llu", var->field_heat[i]);
+      VG_(fprintf)(fp, "\n");
+   }
+   VG_(fclose)(fp);
+}
+
+static Int cmp_fn_edge(const void* va, const void* vb)
+{
+   const fn_edge_t* a = va;
+   const fn_edge_t* b = vb;
+
+   if (a->in_id != b->in_id)
+      return a->in_id < b->in_id ? -1 : 1;
+   return a->out_id < b->out_id ? -1 : a->out_id > b->out_id ? 1 : 0;
+}
+
+// The instruction-side CIG of --cig-ifetch: each function with its
+// extent and instruction counts of the first configuration, by id, then
+// the edges between them.  The name comes last, as C++ names have
+// spaces.
+static void fprint_icig(void)
+{
+   UInt id, j, n;
+   VgFile  *fp;
+   LineCC* lineCC;
+   ULong* counts;
+   fn_edge_t* edges;
+   HChar* icig_out_file =
+      cfg_out_file("--cacheusage-icig-out-file", clo_cacheusage_icig_out_file, 0);
+
+   fp = VG_(fopen)(icig_out_file, VKI_O_CREAT|VKI_O_TRUNC|VKI_O_WRONLY,
+                                  VKI_S_IRUSR|VKI_S_IWUSR);
+   if (fp == NULL) {
+      VG_(umsg)("error: can't open output data file '%s'\n",
+                icig_out_file );
+      VG_(umsg)("       ... so detailed results will be missing.\n");
+      VG_(free)(icig_out_file);
+      return;
+   } else {
+      VG_(free)(icig_out_file);
+   }
+
+   // Ir, I1mr and ILmr of each function.
+   counts = VG_(calloc)("cg.main.fic.1", 3 * n_fns + 1, sizeof(ULong));
+   VG_(OSetGen_ResetIter)(CC_table);
+   while ( (lineCC = VG_(OSetGen_Next)(CC_table)) ) {
+      if (lineCC->fn_id == 0)
+         continue;
+      counts[3 * (lineCC->fn_id - 1)]     += lineCC->Ir.a;
+      counts[3 * (lineCC->fn_id - 1) + 1] += lineCC->Ir.m1;
+      counts[3 * (lineCC->fn_id - 1) + 2] += lineCC->Ir.mL;
+   }
+
+   fprint_cache_desc(fp, 0);
+   fprint_cmd_line(fp);
+   VG_(fprintf)(fp, "\n"
+                    "desc FN: id from to Ir# I1mr# ILmr# object name\n"
+                    "desc EDGE: in out I1_evict# LL_evict#\n");
+
+   for (id = 1; id <= n_fns; id++) {
+      const FnNode* fn = fn_array[id - 1];
+      VG_(fprintf)(fp, "FN: %u %#lx %#lx %llu %llu %llu %s %s\n",
+                       id, fn->lo, fn->hi, counts[3 * (id - 1)],
+                       counts[3 * (id - 1) + 1], counts[3 * (id - 1) + 2],
+                       fn->key.obj, fn->key.name);
+   }
+
+   edges = VG_(malloc)("cg.main.fic.2", sizeof(fn_edge_t) * (fn_edges.n_used + 1));
+   for (j = 0, n = 0; j < fn_edges.n_slots; j++)
+      if (fn_edges.slots[j].in_id != 0)
+         edges[n++] = fn_edges.slots[j];
+   VG_(ssort)(edges, n, sizeof(fn_edge_t), cmp_fn_edge);
+   for (j = 0; j < n; j++)
+      VG_(fprintf)(fp, "EDGE: %u %u %llu %llu\n", edges[j].in_id,
+                       edges[j].out_id, edges[j].evicts_I1, edges[j].evicts_LL);
+
+   VG_(free)(edges);
+   VG_(free)(counts);
+   VG_(fclose)(fp);
+}
+
+/*------------------------------------------------------------*/
+/*--- CIG epochs                                           ---*/
+/*------------------------------------------------------------*/
+
+/* --cig-epoch=<n> splits the run into epochs of about n instructions,
+   or only at CACHEGRIND_CIG_EPOCH client requests if n is 0.  When an
+   epoch ends, the CR and CU counts it added, summed over the source
+   lines, are appended to the epoch file of each configuration and the
+   epoch's tables are emptied.  The simulation counts into those tables
+   as well as into the LineCCs, so ending an epoch walks a table per
+   configuration, keyed by variable (pair), not the CC table.
+
+   The instructions are counted down by IR at the start of each
+   superblock, and cig_epoch_tick is only called when the count goes
+   below zero; epochs therefore end between superblocks. */
+
+static Word     cig_epoch_left = 0;     /* instructions until the next tick */
+static Word     cig_epoch_budget = 0;   /* cig_epoch_left when last set */
+static ULong    cig_instrs = 0;         /* instructions before that */
+static ULong    cig_epoch_start = 0;    /* instruction the epoch started at */
+static UInt     cig_epoch_no = 1;
+static HChar*   cig_epoch_name = NULL;  /* given by CACHEGRIND_CIG_EPOCH */
+static VgFile*  cig_epoch_fps[MAX_SIM_CFGS];
+
+static ULong cig_instrs_now(void)
+{
+   return cig_instrs + (cig_epoch_budget - cig_epoch_left);
+}
+
+static void cig_epoch_set_budget(void)
+{
+   Word max = (Word)(~(UWord)0 >> 1);
 
-        // Calculate stats per line
-        total_line += lineCC->num_evicts_LL[i]; 
-      }
+   cig_instrs = cig_instrs_now();
+   cig_epoch_budget = (clo_cig_epoch > 0 && clo_cig_epoch < max)
+                      ? (Word)clo_cig_epoch : max;
+   cig_epoch_left = cig_epoch_budget;
+}
 
-      if (clo_cache_sim && total_line) {
+static VgFile* cig_epoch_open(UInt cfg)
+{
+   HChar*  name = cfg_out_file("--cacheusage-epoch-out-file",
+                               clo_cacheusage_epoch_out_file, cfg);
+   VgFile* fp = VG_(fopen)(name, VKI_O_CREAT|VKI_O_TRUNC|VKI_O_WRONLY,
+                           VKI_S_IRUSR|VKI_S_IWUSR);
+   Int     i;
+
+   if (fp == NULL) {
+      VG_(umsg)("error: can't open epoch output file '%s'\n", name);
+      VG_(umsg)("       ... so the epochs will be missing.\n");
+      VG_(free)(name);
+      return NULL;
+   }
+   VG_(free)(name);
+
+   VG_(fprintf)(fp,  "desc EPOCH: epoch# first_Ir# last_Ir# name\n"
+                     "desc CR: in_var out_var total# compulsory# conflict# capacity#%s\n"
+                     "desc CU: var access#",
+                     sim_threads_private ? " invalidation#" : "");
+   for (i = 0; i < MAX_NUM_BINS; i++)
+      VG_(fprintf)(fp, " %d-words", i + 1);
+   VG_(fprintf)(fp, "\n");
+   return fp;
+}
 
-         access += lineCC->Dr.m1 + lineCC->Dw.m1;
-         miss += lineCC->Dr.mL + lineCC->Dw.mL;
-         miss_comp += lineCC->Dr.mL_comp + lineCC->Dw.mL_comp;
-         miss_conf += lineCC->Dr.mL_conf + lineCC->Dw.mL_conf;
-         miss_cap += lineCC->Dr.mL_cap + lineCC->Dw.mL_cap;
+/* Append the epoch of configuration `cfg`, which ended at instruction
+   `end`, to its epoch file, and empty its tables. */
+static void cig_epoch_write(UInt cfg, ULong end)
+{
+   sim_cfg_t*         s = &sim_cfgs[cfg];
+   VgFile*            fp = cig_epoch_fps[cfg];
+   cacheline_rep_t*   crs;
+   cacheline_usage_t* cus;
+   UInt               i, j, n;
+
+   if (fp == NULL)
+      fp = cig_epoch_fps[cfg] = cig_epoch_open(cfg);
+   if (fp == NULL)
+      return;
 
-         VG_(fprintf)(fp,  "%d %llu %llu %llu" 
-                           " %llu %llu %llu",
-                           lineCC->loc.line, lineCC->Dr.m1 + lineCC->Dw.m1, lineCC->Dr.mL + lineCC->Dw.mL,
-                           lineCC->Dr.mL_comp + lineCC->Dw.mL_comp, lineCC->Dr.mL_conf + lineCC->Dw.mL_conf, lineCC->Dr.mL_cap + lineCC->Dw.mL_cap,
-                            total_line);
-         for(i = 0; i < MAX_NUM_BINS; i++)
-             VG_(fprintf)(fp, "  %llu", lineCC->num_evicts_LL[i]);
-         VG_(fprintf)(fp,  "\n");
+   VG_(fprintf)(fp, "EPOCH: %u %llu %llu %s\n", cig_epoch_no,
+                cig_epoch_start, end, cig_epoch_name ? cig_epoch_name : "-");
+
+   crs = VG_(malloc)("cg.main.cew.1", sizeof(cacheline_rep_t) * (s->epoch_cr.n_used + 1));
+   for (j = 0, n = 0; j < s->epoch_cr.n_slots; j++) {
+      if (s->epoch_cr.slots[j].in_id != NO_VAR) {
+         crs[n++] = s->epoch_cr.slots[j];
+         s->epoch_cr.slots[j].in_id = NO_VAR;
       }
    }
-
-   // Summary stats must come after rest of table, since we calculate them
-   // during traversal.
-   total = 0;
-   for(i = 0; i < MAX_NUM_BINS; i++)
-   {
-      total += summary[i];
+   s->epoch_cr.n_used = 0;
+   VG_(ssort)(crs, n, sizeof(cacheline_rep_t), cmp_cacheline_rep);
+   for (j = 0; j < n; j++) {
+      const cacheline_rep_t *cr = &crs[j];
+      VG_(fprintf)(fp, "CR: %s %s %llu %llu %llu %llu",
+                   var_array[cr->in_id]->name, var_array[cr->out_id]->name,
+                   cr->m_comp + cr->m_conf + cr->m_cap + cr->m_inv,
+                   cr->m_comp, cr->m_conf, cr->m_cap);
+      if (sim_threads_private)
+         VG_(fprintf)(fp, " %llu", cr->m_inv);
+      VG_(fprintf)(fp, "\n");
    }
+   VG_(free)(crs);
 
-   if (clo_cache_sim) {
-      VG_(fprintf)(fp,  "summary: %llu %llu %llu %llu %llu %llu",
-                        access, miss, miss_comp, miss_conf, miss_cap, total);
-      for(i = 0; i < MAX_NUM_BINS; i++)
-          VG_(fprintf)(fp, " %llu", summary[i]);
-      VG_(fprintf)(fp,  "\n");
+   cus = VG_(malloc)("cg.main.cew.2", sizeof(cacheline_usage_t) * (s->epoch_cu.n_used + 1));
+   for (j = 0, n = 0; j < s->epoch_cu.n_slots; j++) {
+      if (s->epoch_cu.slots[j].vid != NO_VAR) {
+         cus[n++] = s->epoch_cu.slots[j];
+         s->epoch_cu.slots[j].vid = NO_VAR;
+      }
    }
+   s->epoch_cu.n_used = 0;
+   VG_(ssort)(cus, n, sizeof(cacheline_usage_t), cmp_cacheline_usage);
+   for (j = 0; j < n; j++) {
+      const cacheline_usage_t *cu = &cus[j];
+      VG_(fprintf)(fp, "CU: %s %llu", var_array[cu->vid]->name, cu->num_accesses_D1);
+      for (i = 0; i < MAX_NUM_BINS; i++)
+         VG_(fprintf)(fp, " %llu", cu->num_evicts_D1[i]);
+      VG_(fprintf)(fp, "\n");
+   }
+   VG_(free)(cus);
+}
 
-   VG_(fclose)(fp);
+/* End the current epoch; the next one is called `name`, if not NULL. */
+static void cig_epoch_end(const HChar* name)
+{
+   ULong now = cig_instrs_now();
+   UInt  k;
+
+   for (k = 0; k < n_sim_cfgs; k++)
+      cig_epoch_write(k, now);
+   cig_epoch_no++;
+   cig_epoch_start = now;
+   if (cig_epoch_name)
+      VG_(free)(cig_epoch_name);
+   cig_epoch_name = name ? VG_(strdup)("cg.main.cee.1", name) : NULL;
 }
 
-static void fprint_CC_table_and_cache_replacement(void)
+static void cig_epoch_tick(void)
 {
-   Int i;
+   // The references of the epoch must be simulated first.
+   cachesim_drain_batch();
+   if (clo_cig_epoch > 0)
+      cig_epoch_end(NULL);
+   cig_epoch_set_budget();
+}
+
+/* Count the `n_instrs` instructions of the superblock being built. */
+static void cig_epoch_instrument(IRSB* sbOut, IRType hWordTy, UInt n_instrs)
+{
+   countdown_instrument(sbOut, hWordTy, n_instrs, &cig_epoch_left,
+                        "cig_epoch_tick", &cig_epoch_tick);
+}
+
+static void cig_epoch_atfork_child(ThreadId tid)
+{
+   UInt k;
+
+   // The child writes its own files.
+   for (k = 0; k < n_sim_cfgs; k++)
+      cig_epoch_fps[k] = NULL;
+}
+
+static void cig_epoch_finish(void)
+{
+   UInt k;
+
+   cig_epoch_end(NULL);
+   for (k = 0; k < n_sim_cfgs; k++) {
+      if (cig_epoch_fps[k])
+         VG_(fclose)(cig_epoch_fps[k]);
+   }
+}
+
+// Writes the reuse distance histogram of every line in stackdist mode.
+// The bins are named by the smallest distance they hold; a fully
+// associative LRU cache of 2^k lines misses on the first references and
+// on every bin from RD<2^k> on, so miss counts for any such size can be
+// read off the file without another run.
+static void fprint_CC_table_and_reuse_distance(UInt cfg)
+{
+   Int     i;
+   ULong   summary[SD_NUM_BINS + 1], access;
    VgFile  *fp;
+   HChar   *currFile = NULL;
+   const HChar *currFn = NULL;
    LineCC* lineCC;
 
-   UInt low_mask, high_mask = 0;
-   high_mask = high_mask - 1;
-   high_mask = high_mask << 10;
-   low_mask = ~high_mask;
-
    // Setup output filename.  Nb: it's important to do this now, ie. as late
    // as possible.  If we do it at start-up and the program forks and the
    // output file format string contains a %p (pid) specifier, both the
    // parent and child will incorrectly write to the same file;  this
    // happened in 3.3.0.
-   HChar* cr_out_file =
-      VG_(expand_file_name)("--cacheusage-cr-out-file", clo_cacheusage_cr_out_file);
+   HChar* rd_out_file =
+      cfg_out_file("--cacheusage-rd-out-file", clo_cacheusage_rd_out_file, cfg);
 
-   fp = VG_(fopen)(cr_out_file, VKI_O_CREAT|VKI_O_TRUNC|VKI_O_WRONLY,
-                                        VKI_S_IRUSR|VKI_S_IWUSR);
+   fp = VG_(fopen)(rd_out_file, VKI_O_CREAT|VKI_O_TRUNC|VKI_O_WRONLY,
+                                VKI_S_IRUSR|VKI_S_IWUSR);
    if (fp == NULL) {
       // If the file can't be opened for whatever reason (conflict
       // between multiple cachegrinded processes?), give up now.
       VG_(umsg)("error: can't open output data file '%s'\n",
-                cr_out_file );
+                rd_out_file );
       VG_(umsg)("       ... so detailed results will be missing.\n");
-      VG_(free)(cr_out_file);
+      VG_(free)(rd_out_file);
       return;
    } else {
-      VG_(free)(cr_out_file);
+      VG_(free)(rd_out_file);
    }
 
-   VG_(fprintf)(fp,  "desc SUM: access# miss# compulsory# conflict# capacity#\n"
-                     "desc CR: in_var out_var total# compulsory# conflict# capacity#\n"
-                     "desc CU: var access#");
-   for(i = 0; i < MAX_NUM_BINS; i++)
-     VG_(fprintf)(fp, " %d-words", i+1);
-   VG_(fprintf)(fp, "\n");
-/*
-   if (clo_cache_sim) {
-      // "desc:" lines (giving I1/D1/LL cache configuration). The spaces after
-      // the 2nd colon makes cg_annotate's output look nicer.
-      VG_(fprintf)(fp,  "desc: I1 cache:         %s\n"
-                        "desc: D1 cache:         %s\n"
-                        "desc: LL cache:         %s\n",
-                        I1.desc_line, D1.desc_line, LL.desc_line);
-   }
+   fprint_cache_desc(fp, cfg);
 
    // "cmd:" line
-   VG_(fprintf)(fp, "cmd: %s", VG_(args_the_exename));
-   for (i = 0; i < VG_(sizeXA)( VG_(args_for_client) ); i++) {
-      HChar* arg = * (HChar**) VG_(indexXA)( VG_(args_for_client), i );
-      VG_(fprintf)(fp, " %s", arg);
+   fprint_cmd_line(fp);
+
+   //"histogram bins:" line, distances in cache lines
+   VG_(fprintf)(fp, "\nbins: Access# Cold# RD0");
+   for(i = 1; i < SD_NUM_BINS; i++) {
+      ULong lo = 1ULL << (i - 1);
+      if (lo >= (1ULL << 30))
+         VG_(fprintf)(fp, " RD%lluG", lo >> 30);
+      else if (lo >= (1ULL << 20))
+         VG_(fprintf)(fp, " RD%lluM", lo >> 20);
+      else if (lo >= (1ULL << 10))
+         VG_(fprintf)(fp, " RD%lluK", lo >> 10);
+      else
+         VG_(fprintf)(fp, " RD%llu", lo);
    }
-*/
-   
-   // Traverse every lineCC
-   VG_(OSetGen_ResetIter)(CC_table);
-   while ( (lineCC = VG_(OSetGen_Next)(CC_table)) ) {
-      cacheline_rep_t *cr = NULL;
-      cacheline_usage_t *cu = NULL;
-      if (clo_cache_sim && lineCC->cr_table_D1) {
-         VG_(fprintf)(fp, "Line: %s:%s:%d\n", lineCC->loc.file, lineCC->loc.fn, lineCC->loc.line);
+   VG_(fprintf)(fp, "\n");
 
-         VG_(fprintf)(fp,  "SUM: %llu %llu %llu %llu %llu\n",
-                           lineCC->Dr.a + lineCC->Dw.a, lineCC->Dr.m1 + lineCC->Dw.m1, 
-                           lineCC->Dr.m1_comp + lineCC->Dw.m1_comp, lineCC->Dr.m1_conf + lineCC->Dw.m1_conf, lineCC->Dr.m1_cap + lineCC->Dw.m1_cap);
+   access = 0;
+   for(i = 0; i <= SD_NUM_BINS; i++)
+      summary[i] = 0;
 
-         VG_(OSetGen_ResetIter)(lineCC->cr_table_D1);
-         while ( (cr = VG_(OSetGen_Next)(lineCC->cr_table_D1)) ) 
-         {
-             UInt in_id = (cr->pair_id & high_mask) >> 10;
-             UInt out_id = cr->pair_id & low_mask;
-             ULong total_pair = cr->m_comp + cr->m_conf + cr->m_cap;
-             
-             VG_(fprintf)(fp,  "CR: %s %s %llu %llu %llu %llu\n",
-                           var_array[in_id]->name, var_array[out_id]->name, total_pair, cr->m_comp, cr->m_conf, cr->m_cap);
+   // Traverse every lineCC
+   VG_(OSetGen_ResetIter)(cfg_CC_tables[cfg]);
+   while ( (lineCC = VG_(OSetGen_Next)(cfg_CC_tables[cfg])) ) {
+      Bool just_hit_a_new_file = False;
 
-         }
-         VG_(OSetGen_ResetIter)(lineCC->cu_table_D1);
-         while ( (cu = VG_(OSetGen_Next)(lineCC->cu_table_D1)) ) 
-         {
-             VG_(fprintf)(fp,  "CU: %s %llu", var_array[cu->vid]->name, cu->num_accesses_D1);
-             for(i = 0; i < MAX_NUM_BINS; i++)
-                 VG_(fprintf)(fp, " %llu", cu->num_evicts_D1[i]);
-             VG_(fprintf)(fp,  "\n");
-         }
+      if (!lineCC->rd_hist)
+         continue;
+
+      // If we've hit a new file, print a "fl=" line.  Note that because
+      // each string is stored exactly once in the string table, we can use
+      // pointer comparison rather than strcmp() to test for equality.
+      if ( lineCC->loc.file != currFile ) {
+         currFile = lineCC->loc.file;
+         VG_(fprintf)(fp, "fl=%s\n", currFile);
+         just_hit_a_new_file = True;
+      }
+      // If we've hit a new function, print a "fn=" line.
+      if ( just_hit_a_new_file || lineCC->loc.fn != currFn ) {
+         currFn = lineCC->loc.fn;
+         VG_(fprintf)(fp, "fn=%s\n", currFn);
       }
+
+      access += lineCC->Dr.a + lineCC->Dw.a;
+      for(i = 0; i <= SD_NUM_BINS; i++)
+         summary[i] += lineCC->rd_hist[i];
+
+      VG_(fprintf)(fp, "%d %llu %llu", lineCC->loc.line,
+                       lineCC->Dr.a + lineCC->Dw.a, lineCC->rd_hist[SD_NUM_BINS]);
+      for(i = 0; i < SD_NUM_BINS; i++)
+         VG_(fprintf)(fp, " %llu", lineCC->rd_hist[i]);
+      VG_(fprintf)(fp, "\n");
    }
 
+   // Summary stats must come after rest of table, since we calculate them
+   // during traversal.
+   VG_(fprintf)(fp, "summary: %llu %llu", access, summary[SD_NUM_BINS]);
+   for(i = 0; i < SD_NUM_BINS; i++)
+      VG_(fprintf)(fp, " %llu", summary[i]);
+   VG_(fprintf)(fp, "\n");
+
    VG_(fclose)(fp);
 }
 
@@ -1940,6 +4785,47 @@ static UInt ULong_width(ULong n)
    return w + (w-1)/3;   // add space for commas
 }
 
+// Writes every output file, and computes the totals of the summary.
+static void write_output_files(void)
+{
+   UInt cfg;
+
+   VG_(memset)(Ir_total, 0, sizeof(Ir_total));
+   VG_(memset)(Dr_total, 0, sizeof(Dr_total));
+   VG_(memset)(Dw_total, 0, sizeof(Dw_total));
+   VG_(memset)(Pf_total, 0, sizeof(Pf_total));
+   VG_(memset)(Tr_total, 0, sizeof(Tr_total));
+   VG_(memset)(&Bc_total, 0, sizeof(Bc_total));
+   VG_(memset)(&Bi_total, 0, sizeof(Bi_total));
+   VG_(memset)(&Tlb_total, 0, sizeof(Tlb_total));
+
+   if (n_sim_cfgs > 1)
+      copy_shared_counts_to_cfgs();
+   for (cfg = 0; cfg < n_sim_cfgs; cfg++) {
+      fprint_CC_table_and_calc_totals(cfg);
+
+      if (clo_cacheusage_bin)
+         cubin_write(cfg, CUBIN_D1);
+      else
+         fprint_CC_table_and_cache_d1_usage(cfg);
+      if (sim_L2)
+         fprint_CC_table_and_cache_ll_usage(cfg, CACHE_L2);
+      fprint_CC_table_and_cache_ll_usage(cfg, CACHE_LL);
+      if (clo_cacheusage_bin)
+         cubin_write(cfg, CUBIN_CR);
+      else
+         fprint_CC_table_and_cache_replacement(cfg);
+      if (clo_cache_sim && sim_stackdist)
+         fprint_CC_table_and_reuse_distance(cfg);
+   }
+   if (sim_tlb)
+      fprint_CC_table_and_tlb_replacement();
+   if (n_field_vars > 0)
+      fprint_field_heat();
+   if (sim_cig_ifetch)
+      fprint_icig();
+}
+
 static void cg_fini(Int exitcode)
 {
    static HChar fmt[128];   // OK; large enough
@@ -1949,13 +4835,21 @@ static void cg_fini(Int exitcode)
    ULong LL_total_m, LL_total_mr, LL_total_mw,
          LL_total, LL_total_r, LL_total_w;
    Int l1, l2, l3;
-
+   UInt cfg;
+
+   if (clo_trace_in)
+      trace_replay();
+   if (sim_opt)
+      cachesim_opt_finish();
+   cachesim_drain_batch();
+   if (trace_fd >= 0)
+      trace_close();
    cachesim_finish();
-   fprint_CC_table_and_calc_totals();
-
-   fprint_CC_table_and_cache_d1_usage();
-   fprint_CC_table_and_cache_ll_usage();
-   fprint_CC_table_and_cache_replacement();
+   if (sim_cig_epoch)
+      cig_epoch_finish();
+   if (sim_sample)
+      sample_finish();
+   write_output_files();
 
    if (VG_(clo_verbosity) == 0) 
       return;
@@ -1965,77 +4859,176 @@ static void cg_fini(Int exitcode)
 
    /* I cache results.  Use the I_refs value to determine the first column
     * width. */
-   l1 = ULong_width(Ir_total.a);
-   l2 = ULong_width(CG_MAX(Dr_total.a, Bc_total.b));
-   l3 = ULong_width(CG_MAX(Dw_total.a, Bi_total.b));
+   l1 = ULong_width(Ir_total[0].a);
+   l2 = ULong_width(CG_MAX(Dr_total[0].a, Bc_total.b));
+   l3 = ULong_width(CG_MAX(Dw_total[0].a, Bi_total.b));
 
    /* Make format string, getting width right for numbers */
    VG_(sprintf)(fmt, "%%s %%,%dllu\n", l1);
 
    /* Always print this */
-   VG_(umsg)(fmt, "I refs:       ", Ir_total.a);
+   VG_(umsg)(fmt, "I refs:       ", Ir_total[0].a);
 
    /* If cache profiling is enabled, show D access numbers and all
       miss numbers */
    if (clo_cache_sim) {
-      VG_(umsg)(fmt, "I1  misses:   ", Ir_total.m1);
-      VG_(umsg)(fmt, "LLi misses:   ", Ir_total.mL);
+      VG_(umsg)(fmt, "I1  misses:   ", Ir_total[0].m1);
+      if (sim_L2)
+         VG_(umsg)(fmt, "L2i misses:   ", Ir_total[0].m2);
+      VG_(umsg)(fmt, "LLi misses:   ", Ir_total[0].mL);
 
-      if (0 == Ir_total.a) Ir_total.a = 1;
+      if (0 == Ir_total[0].a) Ir_total[0].a = 1;
       VG_(umsg)("I1  miss rate: %*.2f%%\n", l1,
-                Ir_total.m1 * 100.0 / Ir_total.a);
+                Ir_total[0].m1 * 100.0 / Ir_total[0].a);
       VG_(umsg)("LLi miss rate: %*.2f%%\n", l1,
-                Ir_total.mL * 100.0 / Ir_total.a);
+                Ir_total[0].mL * 100.0 / Ir_total[0].a);
       VG_(umsg)("\n");
 
       /* D cache results.  Use the D_refs.rd and D_refs.wr values to
        * determine the width of columns 2 & 3. */
-      D_total.a  = Dr_total.a  + Dw_total.a;
-      D_total.m1 = Dr_total.m1 + Dw_total.m1;
-      D_total.mL = Dr_total.mL + Dw_total.mL;
+      D_total.a  = Dr_total[0].a  + Dw_total[0].a;
+      D_total.m1 = Dr_total[0].m1 + Dw_total[0].m1;
+      D_total.mL = Dr_total[0].mL + Dw_total[0].mL;
+      D_total.m2 = Dr_total[0].m2 + Dw_total[0].m2;
 
       /* Make format string, getting width right for numbers */
       VG_(sprintf)(fmt, "%%s %%,%dllu  (%%,%dllu rd   + %%,%dllu wr)\n",
                         l1, l2, l3);
 
       VG_(umsg)(fmt, "D refs:       ", 
-                     D_total.a, Dr_total.a, Dw_total.a);
+                     D_total.a, Dr_total[0].a, Dw_total[0].a);
       VG_(umsg)(fmt, "D1  misses:   ",
-                     D_total.m1, Dr_total.m1, Dw_total.m1);
+                     D_total.m1, Dr_total[0].m1, Dw_total[0].m1);
+      if (sim_L2)
+         VG_(umsg)(fmt, "L2d misses:   ",
+                        D_total.m2, Dr_total[0].m2, Dw_total[0].m2);
       VG_(umsg)(fmt, "LLd misses:   ",
-                     D_total.mL, Dr_total.mL, Dw_total.mL);
+                     D_total.mL, Dr_total[0].mL, Dw_total[0].mL);
+      if (sim_threads_private)
+         VG_(umsg)(fmt, "D1  inval:    ",
+                        Dr_total[0].m1_inv + Dw_total[0].m1_inv,
+                        Dr_total[0].m1_inv, Dw_total[0].m1_inv);
+      if (sim_opt)
+         VG_(umsg)(fmt, "D1  OPT miss: ",
+                        Dr_total[0].m1_opt + Dw_total[0].m1_opt,
+                        Dr_total[0].m1_opt, Dw_total[0].m1_opt);
 
       if (0 == D_total.a)  D_total.a = 1;
-      if (0 == Dr_total.a) Dr_total.a = 1;
-      if (0 == Dw_total.a) Dw_total.a = 1;
+      if (0 == Dr_total[0].a) Dr_total[0].a = 1;
+      if (0 == Dw_total[0].a) Dw_total[0].a = 1;
       VG_(umsg)("D1  miss rate: %*.1f%% (%*.1f%%     + %*.1f%%  )\n",
                 l1, D_total.m1  * 100.0 / D_total.a,
-                l2, Dr_total.m1 * 100.0 / Dr_total.a,
-                l3, Dw_total.m1 * 100.0 / Dw_total.a);
+                l2, Dr_total[0].m1 * 100.0 / Dr_total[0].a,
+                l3, Dw_total[0].m1 * 100.0 / Dw_total[0].a);
       VG_(umsg)("LLd miss rate: %*.1f%% (%*.1f%%     + %*.1f%%  )\n",
                 l1, D_total.mL  * 100.0 / D_total.a,
-                l2, Dr_total.mL * 100.0 / Dr_total.a,
-                l3, Dw_total.mL * 100.0 / Dw_total.a);
+                l2, Dr_total[0].mL * 100.0 / Dr_total[0].a,
+                l3, Dw_total[0].mL * 100.0 / Dw_total[0].a);
       VG_(umsg)("\n");
 
-      /* LL overall results */
+      /* LL overall results; LL is referenced by the misses of the level
+         above it */
 
-      LL_total   = Dr_total.m1 + Dw_total.m1 + Ir_total.m1;
-      LL_total_r = Dr_total.m1 + Ir_total.m1;
-      LL_total_w = Dw_total.m1;
+      if (sim_L2) {
+         LL_total   = Dr_total[0].m2 + Dw_total[0].m2 + Ir_total[0].m2;
+         LL_total_r = Dr_total[0].m2 + Ir_total[0].m2;
+         LL_total_w = Dw_total[0].m2;
+      } else {
+         LL_total   = Dr_total[0].m1 + Dw_total[0].m1 + Ir_total[0].m1;
+         LL_total_r = Dr_total[0].m1 + Ir_total[0].m1;
+         LL_total_w = Dw_total[0].m1;
+      }
       VG_(umsg)(fmt, "LL refs:      ",
                      LL_total, LL_total_r, LL_total_w);
 
-      LL_total_m  = Dr_total.mL + Dw_total.mL + Ir_total.mL;
-      LL_total_mr = Dr_total.mL + Ir_total.mL;
-      LL_total_mw = Dw_total.mL;
+      LL_total_m  = Dr_total[0].mL + Dw_total[0].mL + Ir_total[0].mL;
+      LL_total_mr = Dr_total[0].mL + Ir_total[0].mL;
+      LL_total_mw = Dw_total[0].mL;
       VG_(umsg)(fmt, "LL misses:    ",
                      LL_total_m, LL_total_mr, LL_total_mw);
 
       VG_(umsg)("LL miss rate:  %*.1f%% (%*.1f%%     + %*.1f%%  )\n",
-                l1, LL_total_m  * 100.0 / (Ir_total.a + D_total.a),
-                l2, LL_total_mr * 100.0 / (Ir_total.a + Dr_total.a),
-                l3, LL_total_mw * 100.0 / Dw_total.a);
+                l1, LL_total_m  * 100.0 / (Ir_total[0].a + D_total.a),
+                l2, LL_total_mr * 100.0 / (Ir_total[0].a + Dr_total[0].a),
+                l3, LL_total_mw * 100.0 / Dw_total[0].a);
+      if (sim_inclusion == INCL_INCLUSIVE) {
+         HChar fmt1[32];
+         VG_(sprintf)(fmt1, "%%s %%,%dllu\n", l1);
+         VG_(umsg)(fmt1, "LL back-inv:  ", n_back_invalidations);
+      }
+
+      if (sim_sample) {
+         VG_(umsg)("\n");
+         VG_(sprintf)(fmt, "%%s %%,%dllu of %%,llu instrs in %%u intervals; "
+                           "the misses above are extrapolated\n", l1);
+         VG_(umsg)(fmt, "Sampled:      ", sample_instrs[SAMPLE_ON],
+                   sample_instrs[SAMPLE_WARM] + sample_instrs[SAMPLE_ON]
+                      + sample_instrs[SAMPLE_OFF],
+                   sample_n);
+      }
+
+      if (sim_tlb) {
+         VG_(umsg)("\n");
+         VG_(umsg)(fmt, "DTLB misses:  ",
+                        Tlb_total.mr + Tlb_total.mw, Tlb_total.mr, Tlb_total.mw);
+         VG_(umsg)(fmt, "Page walks:   ", Tlb_total.walk_r + Tlb_total.walk_w,
+                        Tlb_total.walk_r, Tlb_total.walk_w);
+      }
+
+      if (sim_prefetch != PF_NONE) {
+         VG_(umsg)("\n");
+         VG_(sprintf)(fmt, "%%s %%,%dllu (%%,llu useful, %%,llu late, "
+                           "%%,llu polluting)\n", l1);
+         VG_(umsg)(fmt, "Prefetches:   ", Pf_total[0].issued, Pf_total[0].useful,
+                   Pf_total[0].late, Pf_total[0].polluting);
+      }
+
+      /* Memory traffic, and the instructions executed per byte of it. */
+      if (sim_write_back) {
+         ULong mem = Tr_total[0].mem_rd + Tr_total[0].mem_wr;
+         VG_(umsg)("\n");
+         if (sim_L2) {
+            VG_(sprintf)(fmt, "%%s %%,%dllu  (%%,%dllu D1   + %%,llu L2 + %%,%dllu LL)\n",
+                              l1, l2, l3);
+            VG_(umsg)(fmt, "Write-backs:  ",
+                           Tr_total[0].wb_D1 + Tr_total[0].wb_L2 + Tr_total[0].wb_LL,
+                           Tr_total[0].wb_D1, Tr_total[0].wb_L2, Tr_total[0].wb_LL);
+         } else {
+            VG_(sprintf)(fmt, "%%s %%,%dllu  (%%,%dllu D1   + %%,%dllu LL)\n",
+                              l1, l2, l3);
+            VG_(umsg)(fmt, "Write-backs:  ", Tr_total[0].wb_D1 + Tr_total[0].wb_LL,
+                           Tr_total[0].wb_D1, Tr_total[0].wb_LL);
+         }
+         VG_(sprintf)(fmt, "%%s %%,%dllu  (%%,%dllu rd   + %%,%dllu wr)\n",
+                           l1, l2, l3);
+         VG_(umsg)(fmt, "DRAM bytes:   ", mem, Tr_total[0].mem_rd, Tr_total[0].mem_wr);
+         VG_(umsg)("Intensity:     %.2f Ir per DRAM byte\n",
+                   mem ? (Double)Ir_total[0].a / mem : 0.0);
+      }
+
+      /* The other D1/LL configurations, more briefly. */
+      for (cfg = 1; cfg < n_sim_cfgs; cfg++) {
+         VG_(umsg)("\n");
+         VG_(umsg)("Configuration %u: D1 %s; LL %s\n", cfg + 1,
+                   sim_cfgs[cfg].D1.desc_line, sim_cfgs[cfg].LL.desc_line);
+         VG_(umsg)(fmt, "D1  misses:   ",
+                        Dr_total[cfg].m1 + Dw_total[cfg].m1,
+                        Dr_total[cfg].m1, Dw_total[cfg].m1);
+         if (sim_opt)
+            VG_(umsg)(fmt, "D1  OPT miss: ",
+                           Dr_total[cfg].m1_opt + Dw_total[cfg].m1_opt,
+                           Dr_total[cfg].m1_opt, Dw_total[cfg].m1_opt);
+         if (sim_L2)
+            VG_(umsg)(fmt, "L2d misses:   ",
+                           Dr_total[cfg].m2 + Dw_total[cfg].m2,
+                           Dr_total[cfg].m2, Dw_total[cfg].m2);
+         VG_(umsg)(fmt, "LLd misses:   ",
+                        Dr_total[cfg].mL + Dw_total[cfg].mL,
+                        Dr_total[cfg].mL, Dw_total[cfg].mL);
+         VG_(umsg)(fmt, "LL misses:    ",
+                        Dr_total[cfg].mL + Dw_total[cfg].mL + Ir_total[cfg].mL,
+                        Dr_total[cfg].mL + Ir_total[cfg].mL, Dw_total[cfg].mL);
+      }
    }
 
    /* If branch profiling is enabled, show branch overall results. */
@@ -2090,6 +5083,30 @@ static void cg_fini(Int exitcode)
                 VG_(OSetGen_Size)(CC_table));
       VG_(dmsg)("cachegrind: InstrInfo table size: %u\n",
                 VG_(OSetGen_Size)(instrInfoTable));
+      if (clo_cache_sim) {
+         VG_(dmsg)("cachegrind: CIG variables: %u registered, %u live\n",
+                   var_index, VG_(OSetGen_Size)(var_table));
+         VG_(dmsg)("cachegrind: CIG var index: %u/%u/%u ranges (I1/D1/LL)\n",
+                   I1.vars.n_ranges, sim_cfgs[0].D1.vars.n_ranges,
+                   sim_cfgs[0].LL.vars.n_ranges);
+         if (sim_stackdist)
+            VG_(dmsg)("cachegrind: stack distance: %u blocks, %u bins\n",
+                      sim_cfgs[0].SD.n_lines, sim_cfgs[0].SD.n_bounds + 1);
+         else
+            VG_(dmsg)("cachegrind: INFI bitset: %u leaves, %u nodes, %llu KB\n",
+                      sim_cfgs[0].INFI.n_leaves, sim_cfgs[0].INFI.n_nodes,
+                      cacheinfi_footprint(&sim_cfgs[0].INFI) / 1024);
+         if (n_sim_cfgs > 1)
+            VG_(dmsg)("cachegrind: D1/LL configurations: %u\n", n_sim_cfgs);
+         if (sim_threads_private)
+            VG_(dmsg)("cachegrind: private D1s: %u threads, %llu invalidations\n",
+                      n_sim_tids, n_invalidations);
+      }
+      if (clo_trace_out)
+         VG_(dmsg)("cachegrind: trace: %llu refs, %llu bytes\n",
+                   trace_n_refs, trace_bytes);
+      else if (clo_trace_in)
+         VG_(dmsg)("cachegrind: replayed %llu refs\n", trace_n_refs);
    }
 }
 
@@ -2118,6 +5135,8 @@ void cg_discard_superblock_info ( Addr orig_addr64, VexGuestExtents vge )
    // `vge`.
    SB_info* sbInfo = VG_(OSetGen_Remove)(instrInfoTable, &orig_addr);
    if (sbInfo) {
+      // Buffered references may point into its InstrInfos.
+      cachesim_drain_batch();
       tl_assert(instr_enabled);
       VG_(OSetGen_FreeNode)(instrInfoTable, sbInfo);
    } else {
@@ -2131,22 +5150,86 @@ void cg_discard_superblock_info ( Addr orig_addr64, VexGuestExtents vge )
 
 static Bool cg_process_cmd_line_option(const HChar* arg)
 {
-   if (VG_(str_clo_cache_opt)(arg,
-                              &clo_I1_cache,
-                              &clo_D1_cache,
-                              &clo_LL_cache)) {}
+   cache_t junk;
+   const HChar* tmp_str;
+
+   if (VG_STREQN(5, arg, "--L2="))
+      VG_(str_clo_cache_opt)(arg, &junk, &junk, &clo_L2_cache);
+   else if (str_clo_cache_list(arg)) {}
+   else if (VG_(str_clo_cache_opt)(arg,
+                                   &clo_I1_cache,
+                                   &clo_D1_cache,
+                                   &clo_LL_cache)) {
+      // a single configuration replaces an earlier list
+      if (VG_STREQN(5, arg, "--D1="))
+         clo_n_D1 = 1;
+      else if (!VG_STREQN(5, arg, "--I1="))
+         clo_n_LL = 1;
+   }
+
+   else if VG_STR_CLO(arg, "--DTLB", tmp_str)
+      str_clo_tlb(arg, tmp_str, &clo_DTLB_entries, &clo_DTLB_assoc, &clo_DTLB_page_bits);
+   else if VG_STR_CLO(arg, "--STLB", tmp_str)
+      str_clo_tlb(arg, tmp_str, &clo_STLB_entries, &clo_STLB_assoc, NULL);
 
    else if VG_STR_CLO( arg, "--cachegrind-out-file", clo_cachegrind_out_file) {}
    else if VG_STR_CLO( arg, "--cacheusage-d1-out-file", clo_cacheusage_d1_out_file) {}
    else if VG_STR_CLO( arg, "--cacheusage-ll-out-file", clo_cacheusage_ll_out_file) {}
+   else if VG_STR_CLO( arg, "--cacheusage-l2-out-file", clo_cacheusage_l2_out_file) {}
    else if VG_STR_CLO( arg, "--cacheusage-cr-out-file", clo_cacheusage_cr_out_file) {}
+   else if VG_STR_CLO( arg, "--cacheusage-rd-out-file", clo_cacheusage_rd_out_file) {}
+   else if VG_STR_CLO( arg, "--cacheusage-epoch-out-file", clo_cacheusage_epoch_out_file) {}
+   else if VG_STR_CLO( arg, "--cacheusage-tlb-out-file", clo_cacheusage_tlb_out_file) {}
+   else if VG_STR_CLO( arg, "--cacheusage-field-out-file", clo_cacheusage_field_out_file) {}
+   else if VG_STR_CLO( arg, "--cacheusage-icig-out-file", clo_cacheusage_icig_out_file) {}
    else if VG_INT_CLO(arg, "--cacheusage-word-size", clo_word_size) {
            if(clo_word_size > clo_D1_cache.line_size || clo_word_size <= 0 || (clo_word_size & (clo_word_size - 1)) != 0)
                clo_word_size = DEFAULT_WORD_SIZE;
            }
    else if VG_BOOL_CLO(arg, "--cache-sim",  clo_cache_sim)  {}
+   else if VG_XACT_CLO(arg, "--cache-sim-mode=fa",        sim_stackdist, False) {}
+   else if VG_XACT_CLO(arg, "--cache-sim-mode=stackdist", sim_stackdist, True) {}
+   else if VG_BINT_CLO(arg, "--cache-sim-batch", clo_cache_sim_batch, 0, 1 << 20) {}
+   else if VG_STR_CLO(arg, "--sim-sample", tmp_str)
+      str_clo_sim_sample(arg, tmp_str);
+   else if VG_XACT_CLO(arg, "--prefetch=none",     sim_prefetch, PF_NONE) {}
+   else if VG_XACT_CLO(arg, "--prefetch=nextline", sim_prefetch, PF_NEXTLINE) {}
+   else if VG_XACT_CLO(arg, "--prefetch=stride",   sim_prefetch, PF_STRIDE) {}
+   else if VG_XACT_CLO(arg, "--prefetch=stream",   sim_prefetch, PF_STREAM) {}
+   else if VG_BOOL_CLO(arg, "--write-back",     sim_write_back) {}
+   else if VG_BOOL_CLO(arg, "--write-allocate", sim_write_allocate) {}
+   else if VG_XACT_CLO(arg, "--cache-sim-threads=shared",  sim_threads_private, False) {}
+   else if VG_XACT_CLO(arg, "--cache-sim-threads=private", sim_threads_private, True) {}
+   else if VG_XACT_CLO(arg, "--D1-policy=lru",        sim_policy[CACHE_D1], POLICY_LRU) {}
+   else if VG_XACT_CLO(arg, "--D1-policy=plru",       sim_policy[CACHE_D1], POLICY_PLRU) {}
+   else if VG_XACT_CLO(arg, "--D1-policy=srrip",      sim_policy[CACHE_D1], POLICY_SRRIP) {}
+   else if VG_XACT_CLO(arg, "--D1-policy=brrip",      sim_policy[CACHE_D1], POLICY_BRRIP) {}
+   else if VG_XACT_CLO(arg, "--D1-policy=fifo",       sim_policy[CACHE_D1], POLICY_FIFO) {}
+   else if VG_XACT_CLO(arg, "--D1-policy=random",     sim_policy[CACHE_D1], POLICY_RANDOM) {}
+   else if VG_XACT_CLO(arg, "--LL-policy=lru",        sim_policy[CACHE_LL], POLICY_LRU) {}
+   else if VG_XACT_CLO(arg, "--LL-policy=plru",       sim_policy[CACHE_LL], POLICY_PLRU) {}
+   else if VG_XACT_CLO(arg, "--LL-policy=srrip",      sim_policy[CACHE_LL], POLICY_SRRIP) {}
+   else if VG_XACT_CLO(arg, "--LL-policy=brrip",      sim_policy[CACHE_LL], POLICY_BRRIP) {}
+   else if VG_XACT_CLO(arg, "--LL-policy=fifo",       sim_policy[CACHE_LL], POLICY_FIFO) {}
+   else if VG_XACT_CLO(arg, "--LL-policy=random",     sim_policy[CACHE_LL], POLICY_RANDOM) {}
+   else if VG_XACT_CLO(arg, "--cacheusage-format=text", clo_cacheusage_bin, False) {}
+   else if VG_XACT_CLO(arg, "--cacheusage-format=bin",  clo_cacheusage_bin, True) {}
+   else if VG_XACT_CLO(arg, "--LL-inclusion=nine",      sim_inclusion, INCL_NINE) {}
+   else if VG_XACT_CLO(arg, "--LL-inclusion=inclusive", sim_inclusion, INCL_INCLUSIVE) {}
+   else if VG_XACT_CLO(arg, "--LL-inclusion=exclusive", sim_inclusion, INCL_EXCLUSIVE) {}
+   else if VG_STR_CLO( arg, "--trace-out", clo_trace_out) {}
+   else if VG_STR_CLO( arg, "--trace-in", clo_trace_in) {}
+   else if VG_STR_CLO( arg, "--code-layout", clo_code_layout) {}
+   else if VG_BOOL_CLO(arg, "--opt-sim", sim_opt) {}
+   else if VG_BINT_CLO(arg, "--opt-sim-max-refs", sim_opt_max_refs, 1, 1LL << 40) {}
    else if VG_BOOL_CLO(arg, "--branch-sim", clo_branch_sim) {}
    else if VG_BOOL_CLO(arg, "--instr-at-start", clo_instr_at_start) {}
+   else if VG_USET_CLO(arg, "--cig-auto-vars", "heap,globals", clo_cig_auto_vars) {}
+   else if VG_BINT_CLO(arg, "--cig-auto-min", clo_cig_auto_min, 1, 1 << 30) {}
+   else if VG_BINT_CLO(arg, "--cig-epoch", clo_cig_epoch, 0, 1LL << 62) {}
+   else if VG_BOOL_CLO(arg, "--cig-ifetch", sim_cig_ifetch) {}
+   else if VG_XACT_CLO(arg, "--cig-var-lookup=index", var_lookup_oset, False) {}
+   else if VG_XACT_CLO(arg, "--cig-var-lookup=oset",  var_lookup_oset, True) {}
    else
       return False;
 
@@ -2159,21 +5242,262 @@ static void cg_print_usage(void)
 "    --cachegrind-out-file=<file>     output file name [cachegrind.out.%%p]\n"
 "    --cacheusage-d1-out-file=<file>     d1 cache usage output file name [cacheusage.d1.out.%%p]\n"
 "    --cacheusage-ll-out-file=<file>     ll cache usage output file name [cacheusage.ll.out.%%p]\n"
+"    --cacheusage-l2-out-file=<file>     l2 cache usage output file name, with --L2\n"
+"                                     [cacheusage.l2.out.%%p]\n"
 "    --cacheusage-cr-out-file=<file>     cacheline replacement file name [cacheusage.cr.out.%%p]\n"
+"    --cacheusage-rd-out-file=<file>     reuse distance file name [cacheusage.rd.out.%%p]\n"
+"    --cacheusage-epoch-out-file=<file>  CIG epochs file name [cacheusage.epoch.out.%%p]\n"
+"    --cacheusage-tlb-out-file=<file>    DTLB page replacement file name, with\n"
+"                                     --DTLB [cacheusage.tlb.out.%%p]\n"
+"    --cacheusage-field-out-file=<file>  field heat map file name, with struct\n"
+"                                     arrays [cacheusage.field.out.%%p]\n"
+"    --cacheusage-icig-out-file=<file>  instruction-side CIG file name, with\n"
+"                                     --cig-ifetch [cacheusage.icig.out.%%p]\n"
+"    --cacheusage-format=text|bin     write the D1 usage and cacheline\n"
+"                                     replacement files as text or as\n"
+"                                     binary tables [text]\n"
 "    --cache-sim=yes|no               collect cache stats? [no]\n"
+"    --cache-sim-mode=fa|stackdist    classify misses with fully associative\n"
+"                                     shadow caches or stack distances [fa]\n"
+"    --cache-sim-batch=<n>            buffer <n> references and simulate them\n"
+"                                     together, 0 for none [0]\n"
+"    --sim-sample=<on>:<off>[:<warmup>]  only measure the caches in <on>\n"
+"                                     instructions out of every <off> + <on>,\n"
+"                                     after <warmup> more simulated ones, and\n"
+"                                     extrapolate the misses [measure all]\n"
+"    --cache-sim-threads=shared|private  one D1 for all threads, or one per\n"
+"                                     thread, kept coherent by MESI [shared]\n"
+"    --prefetch=none|nextline|stride|stream  model a D1 next-line or per-\n"
+"                                     instruction stride prefetcher, or an LL\n"
+"                                     stream prefetcher [none]\n"
+"    --write-back=yes|no              model dirty lines and write-backs, and\n"
+"                                     count the bytes read and written in\n"
+"                                     memory [no]\n"
+"    --write-allocate=yes|no          fill the line a write misses on? [yes]\n"
+"    --D1-policy=lru|plru|srrip|brrip|fifo|random  D1 replacement policy [lru]\n"
+"    --LL-policy=lru|plru|srrip|brrip|fifo|random  LL replacement policy [lru]\n"
+"    --L2=<size>,<assoc>,<line_size>  add an L2 between I1/D1 and LL [none]\n"
+"    --LL-inclusion=nine|inclusive|exclusive  LL inclusion of the levels\n"
+"                                     above it [nine]\n"
+"    --DTLB=<entries>,<assoc>,4K|2M|1G  simulate a data TLB [none]\n"
+"    --STLB=<entries>,<assoc>         and a second level TLB behind it [none]\n"
+"    --cig-auto-vars=heap,globals|none  register the heap blocks, named after\n"
+"                                     their allocation stack, and the globals\n"
+"                                     as variables [none]\n"
+"    --cig-auto-min=<n>               smallest variable registered by\n"
+"                                     --cig-auto-vars, in bytes [4096]\n"
+"    --cig-epoch=<n>                  write the CIG of every <n> instructions,\n"
+"                                     and at each CACHEGRIND_CIG_EPOCH, 0 for\n"
+"                                     the client requests only [no epochs]\n"
+"    --cig-ifetch=yes|no              count the I1 and LL lines of each function's\n"
+"                                     code evicted by the fetches of another's\n"
+"                                     (see cu_order) [no]\n"
+"    --trace-out=<file>               also write the simulated references to <file>\n"
+"    --trace-in=<file>                simulate the references of a --trace-out file\n"
+"                                     instead of the client's (see cg_replay)\n"
+"    --code-layout=<file>             with --trace-in, move the code ranges of\n"
+"                                     <file> first (see cu_order)\n"
+"    --opt-sim=yes|no                 with --trace-in, also count the D1 misses\n"
+"                                     of Belady's OPT replacement [no]\n"
+"    --opt-sim-max-refs=<n>           fail if the trace has more than <n> data\n"
+"                                     references for --opt-sim [50000000]\n"
 "    --branch-sim=yes|no              collect branch prediction stats? [no]\n"
 "    --instr-at-start=yes|no          instrument at start? [yes]\n"
    );
    VG_(print_cache_clo_opts)();
+   VG_(printf)(
+"    --D1 and --LL also take a ':'-separated list of configurations, which are\n"
+"    all simulated in the same run; the output files of the 2nd, 3rd, ... get\n"
+"    a .2, .3, ... suffix\n"
+   );
 }
 
 static void cg_print_debug_usage(void)
 {
    VG_(printf)(
-"    (none)\n"
+"    --cig-var-lookup=index|oset      map evicted/incoming lines to variables\n"
+"                                     via the per-cache index or the OSet [index]\n"
    );
 }
 
+/*--------------------------------------------------------------------*/
+/*--- Monitor commands                                             ---*/
+/*--------------------------------------------------------------------*/
+
+static UInt n_dumps = 0;
+
+// Empties a CR table, keeping its slots for the counts to come.
+static void cr_table_clear(cr_table_t* t)
+{
+   UInt j;
+
+   for (j = 0; j < t->n_slots; j++)
+      t->slots[j].in_id = NO_VAR;
+   t->n_used = 0;
+}
+
+static void cu_table_clear(cu_table_t* t)
+{
+   UInt j;
+
+   for (j = 0; j < t->n_slots; j++)
+      t->slots[j].vid = NO_VAR;
+   t->n_used = 0;
+}
+
+// cg.zero: zeroes the counts of every LineCC of every configuration.
+static void zero_CC_tables(void)
+{
+   LineCC* lineCC;
+   UInt k;
+
+   for (k = 0; k < n_sim_cfgs; k++) {
+      VG_(OSetGen_ResetIter)(cfg_CC_tables[k]);
+      while ( (lineCC = VG_(OSetGen_Next)(cfg_CC_tables[k])) ) {
+         VG_(memset)(&lineCC->Ir, 0, sizeof(CacheCC));
+         VG_(memset)(&lineCC->Dr, 0, sizeof(CacheCC));
+         VG_(memset)(&lineCC->Dw, 0, sizeof(CacheCC));
+         VG_(memset)(&lineCC->Bc, 0, sizeof(BranchCC));
+         VG_(memset)(&lineCC->Bi, 0, sizeof(BranchCC));
+         VG_(memset)(&lineCC->Pf, 0, sizeof(PrefetchCC));
+         VG_(memset)(&lineCC->Tr, 0, sizeof(TrafficCC));
+         VG_(memset)(&lineCC->Tlb, 0, sizeof(TlbCC));
+         VG_(memset)(&lineCC->Smp, 0, sizeof(SampleCC));
+         VG_(memset)(lineCC->num_evicts_D1, 0, sizeof(lineCC->num_evicts_D1));
+         VG_(memset)(lineCC->num_evicts_LL, 0, sizeof(lineCC->num_evicts_LL));
+         VG_(memset)(lineCC->num_evicts_L2, 0, sizeof(lineCC->num_evicts_L2));
+         cr_table_clear(&lineCC->cr_table_D1);
+         cr_table_clear(&lineCC->cr_table_LL);
+         cr_table_clear(&lineCC->cr_table_TLB);
+         cu_table_clear(&lineCC->cu_table_D1);
+         cu_table_clear(&lineCC->cu_table_LL);
+         if (lineCC->rd_hist)
+            VG_(memset)(lineCC->rd_hist, 0, (SD_NUM_BINS + 1) * sizeof(ULong));
+      }
+   }
+   cachesim_zero();
+   if (sim_sample)
+      sample_zero();
+}
+
+static void print_monitor_help ( void )
+{
+   VG_(gdb_printf) ("\n");
+   VG_(gdb_printf) ("cachegrind monitor commands:\n");
+   VG_(gdb_printf) ("  cg.dump [<prefix>]\n");
+   VG_(gdb_printf) ("        write the output files now, named <prefix>.<file>\n");
+   VG_(gdb_printf) ("        [dump<n>.<file> for the n-th dump]\n");
+   VG_(gdb_printf) ("  cg.zero\n");
+   VG_(gdb_printf) ("        zero the counts\n");
+   VG_(gdb_printf) ("  cg.top-conflicts [<n>]\n");
+   VG_(gdb_printf) ("        the <n> (at most %d) [10] variable pairs with the most\n",
+                    TOP_CONFLICTS);
+   VG_(gdb_printf) ("        D1 conflict misses\n");
+   VG_(gdb_printf) ("  cg.vars\n");
+   VG_(gdb_printf) ("        the registered variables\n");
+   VG_(gdb_printf) ("\n");
+}
+
+// cg.vars: the ranges of var_table, a variable may have several.
+static void print_monitor_vars ( void )
+{
+   variable_t* var;
+
+   VG_(gdb_printf) ("%u variable(s), %u range(s) registered\n",
+                    var_index, (UInt)VG_(OSetGen_Size)(var_table));
+   VG_(OSetGen_ResetIter)(var_table);
+   while ( (var = VG_(OSetGen_Next)(var_table)) ) {
+      VG_(gdb_printf) ("  %u %s %#lx-%#lx %lu bytes", var->id, var->name,
+                       var->begin, var->end, var->end - var->begin + 1);
+      if (var_array[var->id]->elem_size > 0)
+         VG_(gdb_printf) (", %u-byte elements", var_array[var->id]->elem_size);
+      VG_(gdb_printf) ("\n");
+   }
+}
+
+/* return True if request recognised, False otherwise */
+static Bool handle_gdb_monitor_command (ThreadId tid, const HChar *req)
+{
+   HChar* wcmd;
+   HChar s[VG_(strlen)(req) + 1]; /* copy for strtok_r */
+   HChar *ssaveptr;
+
+   VG_(strcpy) (s, req);
+
+   wcmd = VG_(strtok_r) (s, " ", &ssaveptr);
+   switch (VG_(keyword_id) ("help cg.dump cg.zero cg.top-conflicts cg.vars",
+                            wcmd, kwd_report_duplicated_matches)) {
+   case -2: /* multiple matches */
+      return True;
+   case -1: /* not found */
+      return False;
+   case  0: /* help */
+      print_monitor_help();
+      return True;
+   }
+
+   if (!clo_cache_sim) {
+      VG_(gdb_printf) ("%s needs --cache-sim=yes\n", wcmd);
+      return True;
+   }
+
+   switch (VG_(keyword_id) ("help cg.dump cg.zero cg.top-conflicts cg.vars",
+                            wcmd, kwd_report_none)) {
+   case  1: { /* cg.dump */
+      HChar* arg = VG_(strtok_r) (0, " ", &ssaveptr);
+      HChar  name[20];
+
+      n_dumps++;
+      if (arg == NULL) {
+         VG_(sprintf)(name, "dump%u", n_dumps);
+         arg = name;
+      }
+      dump_prefix = arg;
+      write_output_files();
+      dump_prefix = NULL;
+      VG_(gdb_printf) ("dumped to %s.*\n", arg);
+      return True;
+   }
+   case  2: /* cg.zero */
+      zero_CC_tables();
+      return True;
+   case  3: { /* cg.top-conflicts */
+      HChar* arg = VG_(strtok_r) (0, " ", &ssaveptr);
+      top_conflict_t top[TOP_CONFLICTS];
+      UInt i, n = 10, n_top;
+
+      if (arg != NULL) {
+         HChar* end;
+         Long l = VG_(strtoll10)(arg, &end);
+         if (*end != 0 || l <= 0 || l > TOP_CONFLICTS) {
+            VG_(gdb_printf) ("cg.top-conflicts: <n> must be 1 to %d\n", TOP_CONFLICTS);
+            return True;
+         }
+         n = l;
+      }
+      if (!sim_top_conflicts) {
+         VG_(gdb_printf) ("cg.top-conflicts: not available with --vgdb=no\n");
+         return True;
+      }
+      n_top = cachesim_top_conflicts(top);
+      if (n > n_top)
+         n = n_top;
+      VG_(gdb_printf) ("%u pair(s) with D1 conflict misses, in_var out_var conflict#:\n",
+                       top_pairs.n_used);
+      for (i = 0; i < n; i++)
+         VG_(gdb_printf) ("  %s %s %llu\n", var_array[top[i].in_id]->name,
+                          var_array[top[i].out_id]->name, top[i].m_conf);
+      return True;
+   }
+   case  4: /* cg.vars */
+      print_monitor_vars();
+      return True;
+   default:
+      tl_assert(0);
+      return False;
+   }
+}
+
 /*--------------------------------------------------------------------*/
 /*--- Client requests                                              ---*/
 /*--------------------------------------------------------------------*/
@@ -2211,6 +5535,10 @@ static Bool cg_handle_client_request(ThreadId tid, UWord *args, UWord *ret)
        && VG_USERREQ__GDB_MONITOR_COMMAND != args[0])
       return False;
 
+   // Requests see and change the simulation state, so the references
+   // made before them must be simulated first.
+   cachesim_drain_batch();
+
    switch(args[0]) {
    case VG_USERREQ__CG_START_INSTRUMENTATION:
       set_instr_enabled(True);
@@ -2222,6 +5550,55 @@ static Bool cg_handle_client_request(ThreadId tid, UWord *args, UWord *ret)
       *ret = 0;
       return True;
 
+   case VG_USERREQ__CG_REGISTER_VARIABLE: {
+      // args[4] is the element size of CACHEGRIND_REGISTER_STRUCT_ARRAY,
+      // 0 for CACHEGRIND_REGISTER_VARIABLE.
+      const HChar* name = (const HChar*)args[1];
+      Int id = -1;
+      if (clo_cache_sim) {
+         if (trace_fd >= 0)
+            trace_register_var(name, (Addr)args[2], (Addr)args[3], False);
+         if (args[4] != 0)
+            id = cachesim_register_array(name, (Addr)args[2], (Addr)args[3], args[4]);
+         else
+            id = cachesim_register_var(name, (Addr)args[2], (Addr)args[3]);
+         if (id < 0 && args[4] != 0) {
+            VG_(dmsg)("warning: CACHEGRIND_REGISTER_STRUCT_ARRAY(%s, %#lx, %#lx, %lu)\n",
+                      name ? name : "???", (Addr)args[2], (Addr)args[3], args[4]);
+            VG_(dmsg)("         overlaps a registered variable or is invalid; ignored\n");
+         } else if (id < 0) {
+            VG_(dmsg)("warning: CACHEGRIND_REGISTER_VARIABLE(%s, %#lx, %#lx)\n",
+                      name ? name : "???", (Addr)args[2], (Addr)args[3]);
+            VG_(dmsg)("         overlaps a registered variable or is invalid; ignored\n");
+         }
+      }
+      *ret = (UWord)id;
+      return True;
+   }
+
+   case VG_USERREQ__GDB_MONITOR_COMMAND: {
+      Bool handled = handle_gdb_monitor_command(tid, (HChar*)args[1]);
+      *ret = handled ? 1 : 0;
+      return handled;
+   }
+
+   case VG_USERREQ__CG_CIG_EPOCH:
+      if (sim_cig_epoch)
+         cig_epoch_end((const HChar*)args[1]);
+      *ret = 0;
+      return True;
+
+   case VG_USERREQ__CG_UNREGISTER_VARIABLE:
+      if (clo_cache_sim && trace_fd >= 0)
+         trace_unregister_var((Addr)args[1]);
+      if (clo_cache_sim && !cachesim_unregister_var((Addr)args[1])) {
+         VG_(dmsg)("warning: CACHEGRIND_UNREGISTER_VARIABLE(%#lx) called,\n",
+                   (Addr)args[1]);
+         VG_(dmsg)("         but no registered variable contains it\n");
+      }
+      *ret = 0;
+      return True;
+
    default:
       VG_(message)(Vg_UserMsg,
                    "Warning: unknown cachegrind client request code %llx\n",
@@ -2264,12 +5641,16 @@ static void cg_pre_clo_init(void)
 static void cg_post_clo_init(void)
 {
    cache_t I1c, D1c, LLc; 
+   cache_t D1cs[MAX_SIM_CFGS], LLcs[MAX_SIM_CFGS];
+   const cache_t* L2c = (clo_L2_cache.size != -1) ? &clo_L2_cache : NULL;
+   UInt    k, n_cfgs;
 
    CC_table =
       VG_(OSetGen_Create)(offsetof(LineCC, loc),
                           cmp_CodeLoc_LineCC,
                           VG_(malloc), "cg.main.cpci.1",
                           VG_(free));
+   cfg_CC_tables[0] = CC_table;
    instrInfoTable =
       VG_(OSetGen_Create)(/*keyOff*/0,
                           NULL,
@@ -2281,17 +5662,133 @@ static void cg_post_clo_init(void)
                           VG_(malloc), "cg.main.cpci.3",
                           VG_(free));
 
+   if (clo_trace_out && clo_trace_in) {
+      VG_(fmsg)("--trace-out and --trace-in can't be used together\n");
+      VG_(exit)(1);
+   }
+   if ((clo_trace_out || clo_trace_in) && !clo_cache_sim) {
+      VG_(fmsg)("%s needs --cache-sim=yes\n",
+                clo_trace_out ? "--trace-out" : "--trace-in");
+      VG_(exit)(1);
+   }
+   // Traces do not record which thread made a reference.
+   if ((clo_trace_out || clo_trace_in) && sim_threads_private) {
+      VG_(fmsg)("%s can't be used with --cache-sim-threads=private\n",
+                clo_trace_out ? "--trace-out" : "--trace-in");
+      VG_(exit)(1);
+   }
+
+   if (clo_cig_epoch >= 0 && !clo_cache_sim) {
+      VG_(fmsg)("--cig-epoch needs --cache-sim=yes\n");
+      VG_(exit)(1);
+   }
+   // A trace records neither instruction counts nor client requests.
+   if (clo_cig_epoch >= 0 && clo_trace_in) {
+      VG_(fmsg)("--cig-epoch can't be used with --trace-in\n");
+      VG_(exit)(1);
+   }
+   sim_cig_epoch = clo_cig_epoch >= 0;
+
+   // Only the monitor command reads the heap of cg.top-conflicts.
+   sim_top_conflicts = VG_(clo_vgdb) != Vg_VgdbNo;
+
+   if (clo_cig_auto_vars && !clo_cache_sim) {
+      VG_(fmsg)("--cig-auto-vars needs --cache-sim=yes\n");
+      VG_(exit)(1);
+   }
+   // A trace records the variables registered when it was captured.
+   if (clo_cig_auto_vars && clo_trace_in) {
+      VG_(fmsg)("--cig-auto-vars can't be used with --trace-in\n");
+      VG_(exit)(1);
+   }
+#if !defined(VGA_amd64) && !defined(VGA_x86) && !defined(VGA_arm64)
+   if (clo_cig_auto_vars & CIG_AUTO_HEAP) {
+      VG_(fmsg)("--cig-auto-vars=heap is not supported on this platform\n");
+      VG_(exit)(1);
+   }
+#endif
+
+   if (sim_cig_ifetch && !clo_cache_sim) {
+      VG_(fmsg)("--cig-ifetch needs --cache-sim=yes\n");
+      VG_(exit)(1);
+   }
+   if (clo_code_layout && !clo_trace_in) {
+      VG_(fmsg)("--code-layout needs --trace-in\n");
+      VG_(exit)(1);
+   }
+
+   // OPT needs the references that come after each one.
+   if (sim_opt && !clo_trace_in) {
+      VG_(fmsg)("--opt-sim needs --trace-in\n");
+      VG_(exit)(1);
+   }
+
+   if (!sim_write_allocate && !sim_write_back) {
+      VG_(fmsg)("--write-allocate=no needs --write-back=yes\n");
+      VG_(exit)(1);
+   }
+
+   if (clo_sim_sample_on > 0 && !clo_cache_sim) {
+      VG_(fmsg)("--sim-sample needs --cache-sim=yes\n");
+      VG_(exit)(1);
+   }
+   // The sampling helpers simulate the references as they are made.
+   if (clo_sim_sample_on > 0
+       && (clo_cache_sim_batch > 0 || clo_trace_out || clo_trace_in)) {
+      VG_(fmsg)("--sim-sample can't be used with %s\n",
+                clo_cache_sim_batch > 0 ? "--cache-sim-batch"
+                : clo_trace_out ? "--trace-out" : "--trace-in");
+      VG_(exit)(1);
+   }
+   sim_sample = clo_sim_sample_on > 0;
+
+   if (clo_DTLB_entries > 0 && !clo_cache_sim) {
+      VG_(fmsg)("--DTLB needs --cache-sim=yes\n");
+      VG_(exit)(1);
+   }
+   if (clo_STLB_entries > 0 && clo_DTLB_entries == 0) {
+      VG_(fmsg)("--STLB needs --DTLB\n");
+      VG_(exit)(1);
+   }
+
    if (clo_cache_sim) {
       VG_(post_clo_init_configure_caches)(&I1c, &D1c, &LLc,
                                           &clo_I1_cache,
                                           &clo_D1_cache,
                                           &clo_LL_cache);
 
+      if (clo_n_D1 > 1 && clo_n_LL > 1 && clo_n_D1 != clo_n_LL) {
+         VG_(fmsg)("--D1 and --LL list %u and %u configurations\n",
+                   clo_n_D1, clo_n_LL);
+         VG_(exit)(1);
+      }
+      n_cfgs = (clo_n_D1 > clo_n_LL) ? clo_n_D1 : clo_n_LL;
+      for (k = 0; k < n_cfgs; k++) {
+         D1cs[k] = (k == 0 || clo_n_D1 == 1) ? D1c : clo_D1_more[k - 1];
+         LLcs[k] = (k == 0 || clo_n_LL == 1) ? LLc : clo_LL_more[k - 1];
+      }
+
+      // an exclusive LL swaps whole lines with the level above it
+      for (k = 0; k < n_cfgs && sim_inclusion == INCL_EXCLUSIVE; k++) {
+         Int upper = (L2c != NULL) ? L2c->line_size : D1cs[k].line_size;
+         if (LLcs[k].line_size != upper) {
+            VG_(fmsg)("--LL-inclusion=exclusive needs %s and LL lines of the "
+                      "same size, not %d and %d\n", L2c != NULL ? "L2" : "D1",
+                      upper, LLcs[k].line_size);
+            VG_(exit)(1);
+         }
+      }
+
       // min_line_size is used to make sure that we never feed
       // accesses to the simulator straddling more than two
       // cache lines at any cache level
-      min_line_size = (I1c.line_size < D1c.line_size) ? I1c.line_size : D1c.line_size;
-      min_line_size = (LLc.line_size < min_line_size) ? LLc.line_size : min_line_size;
+      min_line_size = I1c.line_size;
+      if (L2c != NULL && L2c->line_size < min_line_size)
+         min_line_size = L2c->line_size;
+      for (k = 0; k < n_cfgs; k++) {
+         min_line_size = (D1cs[k].line_size < min_line_size) ? D1cs[k].line_size : min_line_size;
+         min_line_size = (LLcs[k].line_size < min_line_size) ? LLcs[k].line_size : min_line_size;
+      }
 
       Int largest_load_or_store_size
          = VG_(machine_get_size_of_largest_guest_register)();
@@ -2307,8 +5804,94 @@ static void cg_post_clo_init(void)
          VG_(exit)(1);
       }
 
-      cachesim_initcaches(I1c, D1c, LLc, clo_word_size);
+      // the word usage of a line is counted in MAX_NUM_BINS bins, so
+      // lines longer than 64 bytes need words longer than the default
+      Int max_line_size = I1c.line_size;
+      if (L2c != NULL && L2c->line_size > max_line_size)
+         max_line_size = L2c->line_size;
+      for (k = 0; k < n_cfgs; k++) {
+         max_line_size = (D1cs[k].line_size > max_line_size) ? D1cs[k].line_size : max_line_size;
+         max_line_size = (LLcs[k].line_size > max_line_size) ? LLcs[k].line_size : max_line_size;
+      }
+      if (max_line_size / clo_word_size > MAX_NUM_BINS) {
+         clo_word_size = max_line_size / MAX_NUM_BINS;
+         VG_(umsg)("Cachegrind: using %u-byte words for the cache usage of "
+                   "%d-byte lines\n", clo_word_size, max_line_size);
+      }
+
+      // the tree of PLRU has a bit per inner node in a UInt
+      for (k = 0; k < 2 * n_cfgs; k++) {
+         const cache_t* c = (k < n_cfgs) ? &D1cs[k] : &LLcs[k - n_cfgs];
+         const HChar* name = (k < n_cfgs) ? "D1" : "LL";
+         if (sim_policy[k < n_cfgs ? CACHE_D1 : CACHE_LL] == POLICY_PLRU
+             && (c->assoc > 32 || (c->assoc & (c->assoc - 1)) != 0)) {
+            VG_(fmsg)("--%s-policy=plru needs a power of two associativity "
+                      "up to 32, not %d\n", name, c->assoc);
+            VG_(exit)(1);
+         }
+      }
+
+      cachesim_initcaches(I1c, D1cs, L2c, LLcs, n_cfgs, clo_word_size);
+      if (clo_DTLB_entries > 0)
+         cachesim_inittlbs(clo_DTLB_entries, clo_DTLB_assoc, clo_DTLB_page_bits,
+                           clo_STLB_entries, clo_STLB_assoc);
+      if (sim_cig_ifetch) {
+         cachesim_init_cig_ifetch();
+         fn_table = VG_(OSetGen_Create)(offsetof(FnNode, key),
+                                        cmp_FnKey_FnNode,
+                                        VG_(malloc), "cg.main.cpci.5",
+                                        VG_(free));
+      }
+      if (clo_code_layout)
+         code_layout_read();
 //      cachesim_initcaches(I1c, D1c, LLc);
+      for (k = 1; k < n_cfgs; k++)
+         cfg_CC_tables[k] =
+            VG_(OSetGen_Create)(offsetof(LineCC, loc),
+                                cmp_CodeLoc_LineCC,
+                                VG_(malloc), "cg.main.cpci.4",
+                                VG_(free));
+
+      // Capture encodes the references of each drained batch.
+      if (clo_trace_out && clo_cache_sim_batch == 0)
+         clo_cache_sim_batch = 4096;
+      if (clo_cache_sim_batch > 0)
+         batch_refs = VG_(malloc)("cg.main.batch", clo_cache_sim_batch * sizeof(BatchRef));
+      if (clo_trace_out) {
+         trace_open();
+         VG_(atfork)(NULL, NULL, trace_atfork_child);
+      }
+      // A replay simulates the trace, not the client.
+      if (clo_trace_in)
+         instr_enabled = False;
+      if (sim_threads_private)
+         VG_(track_start_client_code)(cg_start_client_code);
+      if (sim_sample)
+         sample_init();
+      if (sim_cig_epoch) {
+         cig_epoch_set_budget();
+         VG_(atfork)(NULL, NULL, cig_epoch_atfork_child);
+      }
+      if (clo_cig_auto_vars & CIG_AUTO_HEAP) {
+         heap_calls = VG_(calloc)("cg.main.heap.1", VG_N_THREADS,
+                                  sizeof(HeapCall));
+         heap_blocks = VG_(OSetWord_Create)(VG_(malloc), "cg.main.heap.2",
+                                            VG_(free));
+         // The entries of the allocators must start superblocks.
+         VG_(clo_vex_control).guest_chase = False;
+      }
+      if (clo_cig_auto_vars & CIG_AUTO_GLOBALS) {
+         globals_dis = VG_(OSetWord_Create)(VG_(malloc), "cg.main.gs.1",
+                                            VG_(free));
+         globals_vars = VG_(OSetWord_Create)(VG_(malloc), "cg.main.gs.2",
+                                             VG_(free));
+         VG_(track_new_mem_startup)(cg_new_mem_startup);
+         VG_(track_new_mem_mmap)(cg_new_mem_mmap);
+         VG_(track_die_mem_munmap)(cg_die_mem_munmap);
+      }
+   } else {
+      clo_cache_sim_batch = 0;
+      sim_threads_private = False;
    }
 
    // When instrumentation client requests are enabled, we start with
@@ -36,6 +36,10 @@
       - both blocks miss                 --> one miss (not two)
 */
 
+#if defined(VGA_amd64)
+#include <emmintrin.h>      /* SSE2 is part of the amd64 baseline */
+#endif
+
 /*------------------------------------------------------------*/
 /*--- Types and Data Structures                            ---*/
 /*------------------------------------------------------------*/
@@ -62,6 +66,10 @@ typedef
       ULong mL; /* misses in the second level cache */
       ULong m1_comp, m1_conf, m1_cap;  /* 3 types of cache misses in the first level cache: compulsory, conflict and capacity */
       ULong mL_comp, mL_conf, mL_cap;  /* 3 types of cache misses in the second level cache: compulsory, conflict and capacity */
+      ULong m2; /* misses in the mid level cache (--L2), which only then go on to LL */
+      ULong m2_comp, m2_conf, m2_cap;  /* 3 types of cache misses in the mid level cache */
+      ULong m1_inv;  /* D1 misses on a line another thread's write invalidated (--cache-sim-threads=private) */
+      ULong m1_opt;  /* D1 misses of Belady's OPT replacement (--opt-sim) */
    }
    CacheCC;
 
@@ -72,6 +80,77 @@ typedef
    }
    BranchCC;
 
+typedef
+   struct {
+      ULong issued;    /* prefetches that brought a line in */
+      ULong useful;    /* ... whose line was referenced before its eviction */
+      ULong late;      /* ... referenced, but less than PF_LATE_REFS data references later */
+      ULong polluting; /* ... whose victim was missed on again while remembered */
+   }
+   PrefetchCC;
+
+typedef
+   struct {
+      ULong wb_D1;     /* dirty D1 lines written back to L2 or LL */
+      ULong wb_L2;     /* dirty L2 lines written back to LL (--L2) */
+      ULong wb_LL;     /* dirty LL lines written back to memory */
+      ULong mem_rd;    /* bytes read from memory */
+      ULong mem_wr;    /* bytes written to memory */
+   }
+   TrafficCC;
+
+typedef
+   struct {
+      ULong mr, mw;                 /* DTLB misses of data reads and writes */
+      ULong m_comp, m_conf, m_cap;  /* ... by kind: compulsory, conflict and capacity */
+      ULong walk_r, walk_w;         /* ... that missed in the STLB too: page walks */
+   }
+   TlbCC;
+
+typedef
+   struct {
+      ULong Ir, Dr, Dw;  /* accesses outside the measured intervals (--sim-sample) */
+   }
+   SampleCC;
+
+//------------------------------------------------------------
+// Per-line CIG statistics
+// - cr tables count, per (incoming, evicted) variable pair, the misses of
+//   a source line that replaced a line of one variable by a line of
+//   another; cu tables count, per evicted variable, how much of its
+//   lines was used before eviction.
+// - Both are open-addressing hash tables with linear probing, keyed by
+//   variable ids.  They only grow when a line sees a new variable (pair)
+//   for the first time, so steady-state misses do not allocate.
+
+#define NO_VAR  ((UInt)-1)   /* key of an empty slot */
+
+typedef struct {
+   UInt  in_id, out_id;          /* incoming and evicted variable */
+   ULong m_comp, m_conf, m_cap;  /* 3 types of cache misses: compulsory, conflict and capacity */
+   ULong m_inv;                  /* invalidation misses: out_id is the variable written by the other thread */
+} cacheline_rep_t;
+
+typedef struct {
+   UInt  vid; //variable id
+   ULong num_accesses_D1;
+   ULong num_accesses_LL;
+   ULong num_evicts_D1[MAX_NUM_BINS]; /* The number of cachline evictions with n words used*/
+   ULong num_evicts_LL[MAX_NUM_BINS]; /* The number of cachline evictions with n words used*/
+} cacheline_usage_t;
+
+typedef struct {
+   cacheline_rep_t  *slots;
+   UInt             n_slots;     /* 0 or a power of two */
+   UInt             n_used;
+} cr_table_t;
+
+typedef struct {
+   cacheline_usage_t *slots;
+   UInt             n_slots;     /* 0 or a power of two */
+   UInt             n_used;
+} cu_table_t;
+
 //------------------------------------------------------------
 // Primary data structure #1: CC table
 // - Holds the per-source-line hit/miss stats, grouped by file/function/line.
@@ -86,24 +165,39 @@ typedef struct {
 }
 CodeLoc;
 
-typedef struct {
+typedef struct _LineCC LineCC;
+struct _LineCC {
    CodeLoc  loc; /* Source location that these counts pertain to */
    CacheCC  Ir;  /* Insn read counts */
    CacheCC  Dr;  /* Data read counts */
    CacheCC  Dw;  /* Data write/modify counts */
    BranchCC Bc;  /* Conditional branch counts */
    BranchCC Bi;  /* Indirect branch counts */
+   PrefetchCC Pf; /* Prefetches issued by this line's data references (--prefetch) */
+   TrafficCC Tr;  /* Write-backs and memory traffic caused by this line's misses (--write-back) */
+   TlbCC    Tlb;  /* DTLB misses and page walks (--DTLB), first configuration only */
+   SampleCC Smp;  /* Accesses not counted above (--sim-sample), first configuration only */
 
 /*----------Extension of cache efficiency analysis -----------*/
    ULong num_evicts_D1[MAX_NUM_BINS]; /* The number of cachline evictions with n words used*/
    ULong num_evicts_LL[MAX_NUM_BINS]; /* The number of cachline evictions with n words used*/
+   ULong num_evicts_L2[MAX_NUM_BINS]; /* The number of cachline evictions with n words used, --L2 only*/
+
+   cr_table_t cr_table_D1; //cacheline replacement counts for observing variables in D1
+   cr_table_t cr_table_LL; //cacheline replacement counts for observing variables in LL
+   cr_table_t cr_table_TLB; //page replacement counts for observing variables in the DTLB
+
+   cu_table_t cu_table_D1; //cacheline spatial usage for observing variables in D1
+   cu_table_t cu_table_LL; //cacheline spatial usage for observing variables in LL
+
+   ULong *rd_hist; //reuse distance histogram of data references: SD_NUM_BINS bins, then first references (stackdist mode only)
+
+   UInt trace_id; //id in the --trace-out stream, 0 until defined there
 
-   OSet *cr_table_D1; //cacheline replacement list for observing variables in D1, each element is a cacheline_rep_t
-   OSet *cr_table_LL; //cacheline replacement list for observing variables in LL, each element is a cacheline_rep_t
+   UInt fn_id; //function node of the --cig-ifetch graph, 0 until its code is seen or if it has no name
 
-   OSet *cu_table_D1; //cacheline spatial usage list for observing variables in D1, each element is a cacheline_usage_t
-   OSet *cu_table_LL; //cacheline spatial usage list for observing variables in LL, each element is a cacheline_usage_t
-} LineCC;
+   LineCC *next_cfg; //the same source line in the next D1/LL configuration, if any
+};
 
 // First compare file, then fn, then line.
 static Word cmp_CodeLoc_LineCC(const void *vloc, const void *vcc)
@@ -184,15 +278,105 @@ void close_cu_log(void)
    VG_(fclose)(cu_fp);
 }
 
+#define MAX_NAME_LEN 32
+#define MAX_FIELD_ELEM_SIZE 4096  /* largest struct of a field heat map */
+typedef struct {
+   UInt         id;
+   Addr         begin, end;
+   HChar        *name;
+//   HChar        name[MAX_NAME_LEN];
+   /* Only set in the first range of a variable, that of var_array. */
+   UInt         elem_size;     /* of a struct array, 0 for other variables */
+   ULong        *field_heat;   /* accesses of each byte offset of an element */
+   ULong        field_refs;    /* references to the variable */
+   ULong        field_misses;  /* ... that missed in D1 */
+} variable_t;
+
+/* One entry of a cache's address-to-variable map: cache lines
+   [first, last] belong to `var`, or to no variable if `var` is NULL.
+   The entries of a map are sorted and contiguous, gaps included, so
+   that a remembered position also answers repeated misses outside any
+   variable. */
+typedef struct {
+   UWord        first, last;
+   variable_t   *var;
+} var_range_t;
+
+typedef struct {
+   var_range_t  *ranges;
+   UInt         n_ranges;
+   UInt         size;
+   UInt         hint_in;      /* last range hit for an incoming line */
+   UInt         hint_out;     /* last range hit for an evicted line */
+   UInt         hint_field;   /* last range hit for a field reference */
+} var_map_t;
+
+/* The ways of a set are kept in parallel arrays rather than as one
+   struct per way: a probe only reads the set's tags and ages, which are
+   contiguous, and a hit updates one cacheline_use_t.  The owner of a
+   line is only needed when it is evicted. */
 typedef struct {
-  UWord        tag;
   ULong        bitvector;   // keep track of spatial usage. bit 0 represents only 1 word been used, bit 1 represents only 2 words been used, and so on ...
   ULong        num_accesses; // keep track of temporary reuse. For every cache hit, it increases by one
-  Int          line_num;     // source code line number, for the line that move this cacheline in. It is maily for debugging purpose.
-  LineCC       *src_line;    // pointer to LineCC in cg_main.c, for the line that move this cacheline in.
-} cacheline_t;
+} cacheline_use_t;
 
 typedef struct {
+  LineCC       *src_line;    // pointer to LineCC in cg_main.c, for the line that move this cacheline in.
+  Int          line_num;     // source code line number, for the line that move this cacheline in. It is maily for debugging purpose.
+  Addr         inv_by;       // address written by the thread that invalidated this cacheline, if it is invalid
+  ULong        pf_time;      // pf_clock when a prefetch brought this cacheline in
+} cacheline_owner_t;
+
+/* --cache-sim-threads=private: every thread has its own D1, kept
+   coherent with the others by MESI.  An invalidated line keeps its tag
+   with LINE_INVALID set, so that the next reference to it can be told
+   apart from other misses, and becomes the LRU way of its set. */
+#define LINE_INVALID  ((UWord)1 << (8 * sizeof(UWord) - 1))
+
+#define MESI_S  1
+#define MESI_E  2
+#define MESI_M  3
+
+#define CACHE_I1  0
+#define CACHE_D1  1
+#define CACHE_LL  2
+#define CACHE_L2  3
+
+/* Replacement policies (--D1-policy, --LL-policy).  Each is a set of
+   always inlined functions, switched on in cachesim_policy_hit and
+   cachesim_policy_fill, so that every policy is compiled into the
+   simulation of a reference; the switch costs a well predicted branch
+   on the slow paths, and nothing on a hit to the way last referenced,
+   which needs no update under any of them:
+
+   - LRU and FIFO rank the ways of a set in `ages`, by last reference
+     or by fill; `mru` is the way of rank 0.
+   - PLRU keeps a binary tree of assoc-1 bits per set, in `plru`, each
+     pointing to the half to evict from next.
+   - SRRIP and BRRIP keep a 2-bit re-reference prediction value per way
+     in `ages`; a hit predicts a near re-reference, 0, and the victim is
+     a way predicted distant, RRIP_MAX, after ageing all ways if there is
+     none.  SRRIP fills at RRIP_MAX-1; BRRIP at RRIP_MAX, except for one
+     fill in BRRIP_LONG_ODDS, so that a scan does not flush the set.
+   - RANDOM evicts a pseudo-random way, from a per-cache seed so that
+     runs are repeatable. */
+#define POLICY_LRU     0
+#define POLICY_PLRU    1
+#define POLICY_SRRIP   2
+#define POLICY_BRRIP   3
+#define POLICY_FIFO    4
+#define POLICY_RANDOM  5
+
+#define RRIP_MAX          3
+#define BRRIP_LONG_ODDS   32
+
+static const HChar* policy_names[] = {
+   "LRU", "tree-PLRU", "SRRIP", "BRRIP", "FIFO", "random"
+};
+
+typedef struct _cache_t2 cache_t2;
+struct _cache_t2 {
+   Int          level;                  /* CACHE_I1, CACHE_D1, CACHE_L2 or CACHE_LL */
    Int          size;                   /* bytes */
    Int          assoc;
    Int          line_size;              /* bytes */
@@ -201,47 +385,194 @@ typedef struct {
    Int          line_size_bits;
    Int          tag_shift;
    HChar        desc_line[128];         /* large enough */
-//   UWord*       tags;
    UInt         line_mask;
    Int          num_words_per_line;
    Int          word_size_bits;
-   cacheline_t  *cachelines;
-   UInt         *lru_list;
-} cache_t2;
+   UChar        policy;                 /* POLICY_*, the replacement policy */
+   UWord        *tags;                  /* sets * assoc, 0 if never filled */
+   UInt         *ages;                  /* LRU/FIFO rank (0 is MRU), or RRPV */
+   UInt         *mru;                   /* per set, the way last referenced */
+   UInt         *plru;                  /* per set, the tree bits of POLICY_PLRU */
+   UInt         seed;                   /* POLICY_RANDOM and POLICY_BRRIP */
+   cacheline_use_t   *uses;
+   cacheline_owner_t *owners;
+   UChar        *states;                /* MESI_*, private D1s only */
+   UChar        *dirty;                 /* per way, NULL for I1 and without --write-back */
+   cache_t2     *next;                  /* the level written back to, NULL for LL */
+   Bool         spill;                  /* evicted clean lines go to `next` too (exclusive LL) */
+   struct _sim_cfg_t *inclusive_of;     /* an inclusive LL: the configuration it back-invalidates */
+   var_map_t    vars;                   /* registered variables, keyed by line number */
+   cu_table_t   *epoch_cu;              /* --cig-epoch: the usage of the epoch, D1 only */
+   struct _code_fill_t *code_fills;     /* --cig-ifetch: per way, I1 and the first LL only */
+};
+
+/* --write-back=yes: D1 and LL are write-back caches.  A write marks its
+   line dirty, and a dirty line is written back to the next level, or
+   from LL to memory, when it is evicted; the write-back is counted
+   against the line whose miss evicted it.  A non-temporal store does
+   not fill the line it misses on: the write goes on to the next level,
+   and from LL to memory.  With --write-allocate=no every write does so.
+   Without --write-back, sim_ref_kind turns every reference into a
+   read. */
+#define REF_READ      0
+#define REF_WRITE     1
+#define REF_WRITE_NT  2
+
+/* --L2: a mid level between I1/D1 and LL, in every configuration.  A
+   miss there goes on to LL; a hit stops there.  --LL-inclusion sets how
+   LL relates to the levels above it:
+
+   - nine: neither inclusive nor exclusive.  LL fills on every miss and
+     evicts on its own, as without the option.
+   - inclusive: an LL eviction back-invalidates the line in every level
+     above, which drop it without a write-back to LL: a dirty copy goes
+     to memory.  The shared I1 is only back-invalidated by the LL of the
+     first configuration.
+   - exclusive: LL is a victim cache of the level above it, L2, or D1
+     without --L2.  A data miss there does not fill LL; an LL hit moves
+     the line up, with its dirty state; and every line evicted above,
+     clean or dirty, is filled into LL.  Instruction fetches still go
+     through LL as under nine. */
+#define INCL_NINE       0
+#define INCL_INCLUSIVE  1
+#define INCL_EXCLUSIVE  2
+
+
+/* --prefetch: hardware prefetcher models.  `nextline` fetches the line
+   after each D1 miss into D1.  `stride` keeps a table of the last
+   address and stride of each data referencing instruction, indexed by
+   its address, and fetches the line of the next reference into D1 once
+   the same stride was seen twice.  `stream` follows up to PF_STREAMS
+   sequences of D1 misses to neighbouring lines, as an L2 streamer does,
+   and fetches the next PF_STREAM_DEGREE lines of a confirmed stream
+   into LL, without leaving its 4 KB page.
+
+   A prefetched line is installed as the MRU way with no word used, so
+   its first demand reference is told apart without an extra flag.  The
+   simulator has no timing: a first reference less than PF_LATE_REFS
+   data references after the prefetch is counted as late rather than
+   useful.  The lines evicted by prefetches are remembered in a small
+   direct-mapped pollution filter; a demand miss on one of them counts
+   the prefetch that evicted it as polluting. */
+#define PF_NONE      0
+#define PF_NEXTLINE  1
+#define PF_STRIDE    2
+#define PF_STREAM    3
+
+#define PF_LATE_REFS      16
+#define PF_STRIDES        256   /* stride table entries, a power of two */
+#define PF_STREAMS        16
+#define PF_STREAM_DEGREE  2
+#define PF_VICTIMS        1024  /* pollution filter entries, a power of two */
+
+typedef struct {
+   Addr   pc;            /* instruction, 0 if the entry is free */
+   Addr   last_addr;
+   Word   stride;
+   UInt   conf;          /* 0 to 3; prefetches from 2 on */
+} pf_stride_t;
+
+typedef struct {
+   UWord  last_block;    /* last LL line missed on, 0 if unused */
+   Int    dir;           /* +1 or -1, 0 until confirmed */
+   ULong  last_use;      /* pf_clock, for replacement */
+} pf_stream_t;
 
+typedef struct {
+   UWord  block;         /* a line evicted by a prefetch, 0 if none */
+   LineCC *by;           /* the line whose reference issued the prefetch */
+} pf_victim_t;
+
+/* One simulated D1/LL configuration, with the shadow caches that
+   classify its misses.  --D1 and --LL can list several configurations,
+   which all see the same references; I1 is shared by all of them.  Each
+   configuration counts into its own LineCCs, chained from those of the
+   first one by next_cfg. */
+#define MAX_SIM_CFGS  16
+
+typedef struct _sim_cfg_t sim_cfg_t;
+struct _sim_cfg_t {
+   cache_t2     D1;
+   cache_t2     L2;     /* --L2 only */
+   cache_t2     LL;
+
+   cache_infi   INFI;
+   cache_fa     FA_D1;
+   cache_fa     FA_L2;
+   cache_fa     FA_LL;
+
+   /* --cache-sim-mode=stackdist: one stack distance engine stands in for
+      INFI, FA_D1, FA_L2 and FA_LL. */
+   cache_sd     SD;
+   UWord        SD_D1_lines, SD_L2_lines, SD_LL_lines;
+
+   UInt       (*shadow_classify)(sim_cfg_t* s, Addr a, UChar size, LineCC* line);
+
+   /* --prefetch: the stride table, the streams followed, and the
+      pollution filters of D1 and LL. */
+   pf_stride_t  *pf_strides;
+   pf_stream_t  *pf_streams;
+   pf_victim_t  *pf_victims_D1;
+   pf_victim_t  *pf_victims_LL;
+
+   /* --cache-sim-threads=private: the D1 of each thread, indexed by
+      ThreadId and created on the thread's first data reference.  D1 only
+      gives the geometry; the shadow caches and LL stay shared. */
+   cache_t2     **D1_thr;
+
+   /* --cig-epoch: the CR and CU counts of the current epoch, summed over
+      the source lines. */
+   cr_table_t   epoch_cr;
+   cu_table_t   epoch_cu;
+};
 
-static cache_t2 LL;
 static cache_t2 I1;
-static cache_t2 D1;
 static cache_t2 D1_fa;
 
-static cache_infi INFI;
-static cache_fa FA_D1;
-static cache_fa FA_LL;
+static sim_cfg_t sim_cfgs[MAX_SIM_CFGS];
+static UInt      n_sim_cfgs = 1;
+
+static Bool sim_stackdist = False;
+
+static UInt      sim_prefetch = PF_NONE;
+static ULong     pf_clock = 0;         /* data references, while prefetching */
+
+static Bool      sim_threads_private = False;
+static ThreadId  sim_tid = 1;          /* the thread whose references are simulated */
+static ThreadId  *sim_tids = NULL;     /* the threads with a private D1 */
+static UInt      n_sim_tids = 0;
+static ULong     n_invalidations = 0;  /* lines invalidated in the first configuration */
+
+static Bool      sim_cig_epoch = False;  /* count the CIG per epoch too */
+static Bool      sim_top_conflicts = False;  /* keep the cg.top-conflicts heap */
+
+static UChar     sim_policy[4] = { POLICY_LRU, POLICY_LRU, POLICY_LRU, POLICY_LRU };  /* by CACHE_* */
+
+static Bool      sim_L2 = False;
+static UInt      sim_inclusion = INCL_NINE;
+static ULong     n_back_invalidations = 0;  /* lines back-invalidated in the first configuration */
+
+static Bool      sim_write_back = False;
+static Bool      sim_write_allocate = True;
+static UChar     sim_ref_kind[3] = { REF_READ, REF_READ, REF_READ };  /* by REF_* of the reference */
+static LineCC    *sim_ifetch_line = NULL;  /* the line of the last fetch that missed I1, of every fetch with --cig-ifetch */
 
-#define MAX_NAME_LEN 32
-typedef struct {
-   UInt         id;
-   Addr         begin, end;
-   HChar        *name;
-//   HChar        name[MAX_NAME_LEN];
-} variable_t;
 static UInt var_index = 0;
 static OSet *var_table = NULL;
+static Bool var_lookup_oset = False; /* --cig-var-lookup=oset, for comparison */
 static variable_t **var_array = NULL;
+static OSet *var_sites = NULL;       /* var_site_t, for cachesim_register_block */
 
+/* The id shared by the heap blocks registered under one name. */
 typedef struct {
-   UWord pair_id; //id = var_in->id * 1024 + var_out->id; we assume the total number of variables been tracked is less than 1,024.
-   ULong m_comp, m_conf, m_cap;  /* 3 types of cache misses: compulsory, conflict and capacity */
-} cacheline_rep_t;
+   const HChar  *name;       /* key;  MUST BE FIRST */
+   UInt         id;
+} var_site_t;
 
-typedef struct {
-   UWord vid; //variable id
-   ULong num_accesses_D1;
-   ULong num_accesses_LL;
-   ULong num_evicts_D1[MAX_NUM_BINS]; /* The number of cachline evictions with n words used*/
-   ULong num_evicts_LL[MAX_NUM_BINS]; /* The number of cachline evictions with n words used*/
-} cacheline_usage_t;
+static Word cmp_var_site(const void* vkey, const void* velem)
+{
+   return VG_(strcmp)(*(const HChar* const*)vkey, ((const var_site_t*)velem)->name);
+}
 
 static Word cmp_var_range(const void *vleft, const void *vright)
 {
@@ -281,43 +612,355 @@ static void print_var_table(void)
    }
 }
 
-static void init_var_array(void)
+static UInt var_array_size = 0;
+
+/* Rebuild the address-to-variable map of `c` from var_table.  A line
+   belongs to a variable if its start address lies within the variable,
+   which is what the eviction attribution has always checked. */
+static void cachesim_rebuild_var_map(cache_t2* c)
 {
-   UInt num = VG_(OSetGen_Size)(var_table);
-   var_array = VG_(malloc)("cg.sim.var_table.2", sizeof(variable_t*) * num);
+   var_map_t *m = &c->vars;
+   variable_t *var;
+   UWord first, last, next = 0;
+   UInt n = 0;
+
+   /* At most one gap before each variable. */
+   if (m->size < 2 * VG_(OSetGen_Size)(var_table)) {
+      m->size = 2 * VG_(OSetGen_Size)(var_table);
+      m->ranges = VG_(realloc)("cg.sim.vm.1", m->ranges,
+                               sizeof(var_range_t) * m->size);
+   }
 
-   variable_t *var = NULL;
-   UInt index = 0;
    VG_(OSetGen_ResetIter)(var_table);
    while ( (var = VG_(OSetGen_Next)(var_table)) ) {
-      var_array[index++] = var;
+      first = (var->begin + c->line_size - 1) >> c->line_size_bits;
+      last  = var->end >> c->line_size_bits;
+      if (first > last)
+         continue; /* no line starts inside this variable */
+
+      if (n > 0 && next < first) {
+         m->ranges[n].first = next;
+         m->ranges[n].last  = first - 1;
+         m->ranges[n].var   = NULL;
+         n++;
+      }
+      m->ranges[n].first = first;
+      m->ranges[n].last  = last;
+      m->ranges[n].var   = var;
+      n++;
+      next = last + 1;
    }
 
-   if(index != var_index)
-      VG_(printf)("ERROR: init_var_array(), the number of variables: %u %u \n", index, var_index);
+   m->n_ranges = n;
+   m->hint_in    = 0;
+   m->hint_out   = 0;
+   m->hint_field = 0;
+}
 
-/*   Int i;
-   for(i = 0; i < var_index; i++)
-      VG_(printf)("%s %u %#lx %#lx\n", var_array[i]->name, var_array[i]->id, var_array[i]->begin, var_array[i]->end);*/
+/* Replace the `n_del` ranges of `m` at `at` by the `n_new` ranges of
+   `rs`. */
+static void var_map_splice(var_map_t* m, UInt at, UInt n_del,
+                           const var_range_t* rs, UInt n_new)
+{
+   UInt n = m->n_ranges - n_del + n_new;
+
+   if (m->size < n) {
+      m->size = (m->size == 0) ? 64 : 2 * m->size;
+      if (m->size < n)
+         m->size = n;
+      m->ranges = VG_(realloc)("cg.sim.vm.2", m->ranges,
+                               sizeof(var_range_t) * m->size);
+   }
+   VG_(memmove)(&m->ranges[at + n_new], &m->ranges[at + n_del],
+                sizeof(var_range_t) * (m->n_ranges - at - n_del));
+   if (n_new > 0)
+      VG_(memcpy)(&m->ranges[at], rs, sizeof(var_range_t) * n_new);
+   m->n_ranges = n;
+   /* the hints may now point past the end, or at another range */
+   m->hint_in    = 0;
+   m->hint_out   = 0;
+   m->hint_field = 0;
 }
 
-static variable_t* find_var_in_table(Addr addr)
+/* The index of the first range of `m` not wholly before `line`, or
+   m->n_ranges if there is none. */
+static UInt var_map_search(const var_map_t* m, UWord line)
 {
-   variable_t *var;
+   UInt lo = 0, hi = m->n_ranges, mid;
+
+   while (lo < hi) {
+      mid = (lo + hi) / 2;
+      if (m->ranges[mid].last < line)
+         lo = mid + 1;
+      else
+         hi = mid;
+   }
+   return lo;
+}
 
-   VG_(OSetGen_ResetIter)(var_table);
-   while ( (var = VG_(OSetGen_Next)(var_table)) ) {
-       if(var->begin <= addr && var->end >=addr)
-           return var;
+/* Add the newly registered `var` to the map of `c`.  Its lines fall in
+   a gap of the map, or before or after all of its ranges. */
+static void var_map_insert(cache_t2* c, variable_t* var)
+{
+   var_map_t *m = &c->vars;
+   UWord first = (var->begin + c->line_size - 1) >> c->line_size_bits;
+   UWord last  = var->end >> c->line_size_bits;
+   var_range_t rs[3], *gap;
+   UInt at, n = 0;
+
+   if (first > last)
+      return; /* no line starts inside this variable */
+
+   at = var_map_search(m, first);
+   if (at == m->n_ranges) {
+      if (at > 0 && m->ranges[at - 1].last + 1 < first)
+         rs[n++] = (var_range_t){ m->ranges[at - 1].last + 1, first - 1, NULL };
+      rs[n++] = (var_range_t){ first, last, var };
+      var_map_splice(m, at, 0, rs, n);
+   } else if (m->ranges[at].first > last) {
+      tl_assert(at == 0);
+      rs[n++] = (var_range_t){ first, last, var };
+      if (last + 1 < m->ranges[0].first)
+         rs[n++] = (var_range_t){ last + 1, m->ranges[0].first - 1, NULL };
+      var_map_splice(m, 0, 0, rs, n);
+   } else {
+      gap = &m->ranges[at];
+      tl_assert(gap->var == NULL && gap->first <= first && last <= gap->last);
+      if (gap->first < first)
+         rs[n++] = (var_range_t){ gap->first, first - 1, NULL };
+      rs[n++] = (var_range_t){ first, last, var };
+      if (last < gap->last)
+         rs[n++] = (var_range_t){ last + 1, gap->last, NULL };
+      var_map_splice(m, at, 1, rs, n);
+   }
+}
+
+/* Take the unregistered `var` out of the map of `c`, merging the gap it
+   leaves with its neighbours.  A gap at either end is dropped. */
+static void var_map_remove(cache_t2* c, variable_t* var)
+{
+   var_map_t *m = &c->vars;
+   UWord first = (var->begin + c->line_size - 1) >> c->line_size_bits;
+   UWord last  = var->end >> c->line_size_bits;
+   var_range_t gap;
+   UInt at, end;
+
+   if (first > last)
+      return;
+
+   at = var_map_search(m, first);
+   tl_assert(at < m->n_ranges && m->ranges[at].var == var);
+   gap = (var_range_t){ first, last, NULL };
+   end = at + 1;
+   if (at > 0 && m->ranges[at - 1].var == NULL)
+      gap.first = m->ranges[--at].first;
+   if (end < m->n_ranges && m->ranges[end].var == NULL)
+      gap.last = m->ranges[end++].last;
+   if (at == 0 || end == m->n_ranges)
+      var_map_splice(m, at, end - at, NULL, 0);
+   else
+      var_map_splice(m, at, end - at, &gap, 1);
+}
+
+/* Add `var` to, or take it out of, the map of every cache. */
+static void cachesim_update_var_maps(variable_t* var, Bool add)
+{
+   void (*update)(cache_t2*, variable_t*) = add ? var_map_insert : var_map_remove;
+   UInt k, t;
+
+   if (var_lookup_oset)
+      return;
+   update(&I1, var);
+   for (k = 0; k < n_sim_cfgs; k++) {
+      update(&sim_cfgs[k].D1, var);
+      if (sim_L2)
+         update(&sim_cfgs[k].L2, var);
+      update(&sim_cfgs[k].LL, var);
+      for (t = 0; t < n_sim_tids; t++)
+         update(sim_cfgs[k].D1_thr[sim_tids[t]], var);
+   }
+}
+
+/* Find the variable owning cache line `line` of `c`.  `hint` remembers the
+   range of the previous lookup from the same call site, which answers
+   most lookups without searching. */
+__attribute__((always_inline))
+static __inline__
+variable_t* cachesim_lookup_var(cache_t2* c, UWord line, UInt* hint)
+{
+   const var_map_t *m = &c->vars;
+   const var_range_t *r;
+   UInt lo, hi, mid;
+
+   if (UNLIKELY(var_lookup_oset)) {
+      Addr a = line << c->line_size_bits;
+      return VG_(OSetGen_LookupWithCmp)(var_table, &a, comp_addr_var);
+   }
+   if (m->n_ranges == 0)
+      return NULL;
+
+   r = &m->ranges[*hint];
+   if (LIKELY(r->first <= line && line <= r->last))
+      return r->var;
+
+   if (line < m->ranges[0].first || line > m->ranges[m->n_ranges - 1].last)
+      return NULL;
+
+   lo = 0;
+   hi = m->n_ranges - 1;
+   while (True) {
+      mid = (lo + hi) / 2;
+      r = &m->ranges[mid];
+      if (line < r->first)
+         hi = mid - 1;
+      else if (line > r->last)
+         lo = mid + 1;
+      else
+         break;
+   }
+   *hint = mid;
+   return r->var;
+}
+
+/* Register the range [begin, end] as part of variable `id`, or of a new
+   variable named `name` if `id` is NO_VAR.  Ids are never reused, and
+   var_array keeps the first range of every variable ever registered so
+   that the CR/CU tables can still be printed after it has been
+   unregistered.  The address-to-variable maps are updated in place.
+   Returns the id, or -1 if the range overlaps a registered variable or
+   the id space is exhausted. */
+static Int cachesim_add_var(const HChar* name, Addr begin, Addr end, UInt id)
+{
+   variable_t key, *var;
+
+   if (begin > end || (id == NO_VAR && var_index == NO_VAR))
+      return -1;
+
+   key.begin = begin;
+   key.end   = end;
+   if (VG_(OSetGen_Lookup)(var_table, &key) != NULL)
+      return -1;
+
+   var = VG_(OSetGen_AllocNode)(var_table, sizeof(variable_t));
+   var->begin = begin;
+   var->end   = end;
+   var->elem_size    = 0;
+   var->field_heat   = NULL;
+   var->field_refs   = 0;
+   var->field_misses = 0;
+   if (id == NO_VAR) {
+      if (var_index == var_array_size) {
+         var_array_size = (var_array_size == 0) ? 64 : var_array_size * 2;
+         var_array = VG_(realloc)("cg.sim.var_table.2", var_array,
+                                  sizeof(variable_t*) * var_array_size);
+      }
+      var->name = VG_(strdup)("cg.sim.var_table.1", name ? name : "???");
+      var->id   = var_index++;
+      var_array[var->id] = var;
+   } else {
+      var->name = var_array[id]->name;
+      var->id   = id;
+   }
+   VG_(OSetGen_Insert)(var_table, var);
+   cachesim_update_var_maps(var, True);
+
+   return var->id;
+}
+
+/* Register the variable [begin, end] under `name`, as requested by the
+   client through CACHEGRIND_REGISTER_VARIABLE. */
+static Int cachesim_register_var(const HChar* name, Addr begin, Addr end)
+{
+   return cachesim_add_var(name, begin, end, NO_VAR);
+}
+
+/* The struct arrays registered, and those of them in which no line of
+   the first configuration's D1 starts, which its map does not hold. */
+static UInt        n_field_vars = 0;
+static UInt        n_field_vars_unmapped = 0;
+
+/* Does no line of the first configuration's D1 start in `var`? */
+static Bool cachesim_var_unmapped(const variable_t* var)
+{
+   const cache_t2* c = &sim_cfgs[0].D1;
+
+   return ((var->begin + c->line_size - 1) >> c->line_size_bits)
+          > (var->end >> c->line_size_bits);
+}
+
+/* Register the array [begin, end] of `elem_size`-byte structs under
+   `name`, as CACHEGRIND_REGISTER_STRUCT_ARRAY does.  Its references are
+   also counted by offset in an element, for the field heat map. */
+static Int cachesim_register_array(const HChar* name, Addr begin, Addr end,
+                                   UInt elem_size)
+{
+   Int id;
+
+   if (elem_size == 0 || elem_size > MAX_FIELD_ELEM_SIZE)
+      return -1;
+   id = cachesim_add_var(name, begin, end, NO_VAR);
+   if (id >= 0) {
+      var_array[id]->elem_size  = elem_size;
+      var_array[id]->field_heat = VG_(calloc)("cg.sim.ra.1", elem_size, sizeof(ULong));
+      n_field_vars++;
+      if (cachesim_var_unmapped(var_array[id]))
+         n_field_vars_unmapped++;
+   }
+   return id;
+}
+
+/* Register the heap block [begin, end] (--cig-auto-vars=heap).  The
+   blocks registered under the same name, that of their allocation
+   stack, make up one variable. */
+static Int cachesim_register_block(const HChar* name, Addr begin, Addr end)
+{
+   var_site_t *site;
+   Int id;
+
+   if (name == NULL)
+      name = "???";
+   if (var_sites == NULL)
+      var_sites = VG_(OSetGen_Create)(offsetof(var_site_t, name), cmp_var_site,
+                                      VG_(malloc), "cg.sim.rb.1", VG_(free));
+
+   site = VG_(OSetGen_Lookup)(var_sites, &name);
+   id = cachesim_add_var(name, begin, end, site ? site->id : NO_VAR);
+   if (id >= 0 && site == NULL) {
+      site = VG_(OSetGen_AllocNode)(var_sites, sizeof(var_site_t));
+      site->name = var_array[id]->name;
+      site->id   = id;
+      VG_(OSetGen_Insert)(var_sites, site);
    }
-   return NULL;
+   return id;
+}
+
+/* Stop tracking the variable containing `addr`.  The node stays alive in
+   var_array for the output; it is only taken out of the lookup table.
+   Returns False if no registered variable contains `addr`. */
+static Bool cachesim_unregister_var(Addr addr)
+{
+   variable_t *var = VG_(OSetGen_LookupWithCmp)(var_table, &addr, comp_addr_var);
+
+   if (var == NULL)
+      return False;
+
+   VG_(OSetGen_Remove)(var_table, var);
+   cachesim_update_var_maps(var, False);
+   if (var_array[var->id]->elem_size > 0 && cachesim_var_unmapped(var))
+      n_field_vars_unmapped--;
+   /* Only the first range of a variable is kept, in var_array. */
+   if (var_array[var->id] != var)
+      VG_(OSetGen_FreeNode)(var_table, var);
+   return True;
 }
 
 /* By this point, the size/assoc/line_size has been checked. */
-static void cachesim_initcache(cache_t config, cache_t2* c, UInt word_size)
+static void cachesim_initcache(cache_t config, cache_t2* c, Int level, UInt word_size)
 {
    Int i, j;
 
+   c->level     = level;
+   c->policy    = sim_policy[level];
    c->size      = config.size;
    c->assoc     = config.assoc;
    c->line_size = config.line_size;
@@ -334,193 +977,911 @@ static void cachesim_initcache(cache_t config, cache_t2* c, UInt word_size)
       VG_(sprintf)(c->desc_line, "%d B, %d B, %d-way associative",
                                  c->size, c->line_size, c->assoc);
    }
-
-/*   c->tags = VG_(malloc)("cg.sim.ci.1",
-                         sizeof(UWord) * c->sets * c->assoc);*/
+   if (c->policy != POLICY_LRU)
+      VG_(sprintf)(c->desc_line + VG_(strlen)(c->desc_line), ", %s",
+                   policy_names[c->policy]);
 
    c->line_mask = c->line_size - 1;
    c->word_size_bits = VG_(log2)(word_size);
    c->num_words_per_line = c->line_size / word_size; 
 
-   c->cachelines = VG_(malloc)("cg.sim.ci.1",
-                         sizeof(cacheline_t) * c->sets * c->assoc);
+   c->tags = VG_(malloc)("cg.sim.ci.1",
+                         sizeof(UWord) * c->sets * c->assoc);
+   c->ages = VG_(malloc)("cg.sim.ci.2",
+                         sizeof(UInt) * c->sets * c->assoc);
+   c->mru = VG_(malloc)("cg.sim.ci.5", sizeof(UInt) * c->sets);
+   c->uses = VG_(malloc)("cg.sim.ci.3",
+                         sizeof(cacheline_use_t) * c->sets * c->assoc);
+   c->owners = VG_(malloc)("cg.sim.ci.4",
+                         sizeof(cacheline_owner_t) * c->sets * c->assoc);
 
    for (i = 0; i < c->sets * c->assoc; i++)
    {
-//      c->tags[i] = 0;
-        c->cachelines[i].tag = 0;
-        c->cachelines[i].bitvector = 0;
-        c->cachelines[i].num_accesses = 0;
-        c->cachelines[i].line_num = 0;
-        c->cachelines[i].src_line = NULL;
+        c->tags[i] = 0;
+        c->uses[i].bitvector = 0;
+        c->uses[i].num_accesses = 0;
+        c->owners[i].src_line = NULL;
+        c->owners[i].line_num = 0;
+        c->owners[i].inv_by = 0;
+        c->owners[i].pf_time = 0;
    }
-
-   c->lru_list = VG_(malloc)("cg.sim.ci.2",
-                         sizeof(UInt) * c->sets * c->assoc);
-
+   c->states = NULL;
+   /* Without --write-back every reference is a read, and I1 is never
+      written: no line gets dirty. */
+   c->dirty = sim_write_back && level != CACHE_I1
+      ? VG_(calloc)("cg.sim.ci.8", c->sets * c->assoc, sizeof(UChar))
+      : NULL;
+   c->next = NULL;
+   c->spill = False;
+   c->inclusive_of = NULL;
+   c->code_fills = NULL;
+
+   c->vars.ranges   = NULL;
+   c->vars.n_ranges = 0;
+   c->vars.size     = 0;
+   c->vars.hint_in    = 0;
+   c->vars.hint_out   = 0;
+   c->vars.hint_field = 0;
+
+   /* Way 0 is the first to be evicted. */
    for (i = 0; i < c->sets; i++)
    {
      for (j = 0; j < c->assoc; j++)
-       c->lru_list[i * c->assoc + j] = c->assoc - 1 - j;
+       c->ages[i * c->assoc + j] = c->assoc - 1 - j;
+     c->mru[i] = c->assoc - 1;
    }
 
-   var_table = 
-      VG_(OSetGen_Create)(0,
-                          cmp_var_range,
-                          VG_(malloc), "cg.sim.ci.3",
-                          VG_(free));
+   c->plru = NULL;
+   if (c->policy == POLICY_PLRU)
+      c->plru = VG_(calloc)("cg.sim.ci.9", c->sets, sizeof(UInt));
+   if (c->policy == POLICY_SRRIP || c->policy == POLICY_BRRIP) {
+      for (i = 0; i < c->sets * c->assoc; i++)
+         c->ages[i] = RRIP_MAX;
+      for (i = 0; i < c->sets; i++)
+         c->mru[i] = 0;
+   }
+   c->seed = 0x9E3779B9U ^ level;
 }
 
-/* This attribute forces GCC to inline the function, getting rid of a
- * lot of indirection around the cache_t2 pointer, if it is known to be
- * constant in the caller (the caller is inlined itself).
- * Without inlining of simulator functions, cachegrind can get 40% slower.
- */
-__attribute__((always_inline))
-static __inline__
-Bool cachesim_setref_is_miss(cache_t2* c, UInt set_no, UWord tag, UInt word_begin, UInt word_end, Int line_num, void* line, cacheline_rep_t **cr_hook)
+static __inline__ UInt cr_hash(UInt in_id, UInt out_id)
 {
-   int i, j;
-//   UWord *set;
-   cacheline_t *cacheline;
-   UInt *id;
-   UInt tmp, num_words;
-   ULong num_accesses;
-
-//   set = &(c->tags[set_no * c->assoc]);
-   cacheline = &(c->cachelines[set_no * c->assoc]);
-   id = &(c->lru_list[set_no * c->assoc]);
+   return (in_id * 0x9E3779B1U) ^ out_id;
+}
 
-//   if (CU_DEBUG && cu_fp && c == &D1 && (word_begin > MAX_NUM_BINS || word_end > MAX_NUM_BINS)) 
-//      VG_(fprintf)(cu_fp,  "ERROR: set_no: %u, tag: %lx, begin: %u, end: %u\n", set_no, tag, word_begin, word_end);
+static __inline__ UInt cu_hash(UInt vid)
+{
+   return vid * 0x9E3779B1U;
+}
 
-   /* This loop is unrolled for just the first case, which is the most */
-   /* common.  We can't unroll any further because it would screw up   */
-   /* if we have a direct-mapped (1-way) cache.                        */
-   if (tag == cacheline[id[0]].tag)
-   {
-      bitop_set_range(&cacheline[id[0]].bitvector, word_begin, word_end);
-      cacheline[id[0]].num_accesses++;
+static void cr_table_grow(cr_table_t* t)
+{
+   cacheline_rep_t *old = t->slots;
+   UInt i, j, n_old = t->n_slots;
+
+   t->n_slots = (n_old == 0) ? 8 : n_old * 2;
+   t->slots = VG_(malloc)("cg.sim.cr.1", sizeof(cacheline_rep_t) * t->n_slots);
+   for (i = 0; i < t->n_slots; i++)
+      t->slots[i].in_id = NO_VAR;
+
+   for (i = 0; i < n_old; i++) {
+      if (old[i].in_id == NO_VAR)
+         continue;
+      j = cr_hash(old[i].in_id, old[i].out_id) & (t->n_slots - 1);
+      while (t->slots[j].in_id != NO_VAR)
+         j = (j + 1) & (t->n_slots - 1);
+      t->slots[j] = old[i];
+   }
+   if (old)
+      VG_(free)(old);
+}
 
-      return False;
+static void cu_table_grow(cu_table_t* t)
+{
+   cacheline_usage_t *old = t->slots;
+   UInt i, j, n_old = t->n_slots;
+
+   t->n_slots = (n_old == 0) ? 4 : n_old * 2;
+   t->slots = VG_(malloc)("cg.sim.cu.1", sizeof(cacheline_usage_t) * t->n_slots);
+   for (i = 0; i < t->n_slots; i++)
+      t->slots[i].vid = NO_VAR;
+
+   for (i = 0; i < n_old; i++) {
+      if (old[i].vid == NO_VAR)
+         continue;
+      j = cu_hash(old[i].vid) & (t->n_slots - 1);
+      while (t->slots[j].vid != NO_VAR)
+         j = (j + 1) & (t->n_slots - 1);
+      t->slots[j] = old[i];
    }
+   if (old)
+      VG_(free)(old);
+}
 
-   /* If the tag is one other than the MRU, move it into the MRU spot  */
-   /* and shuffle the rest down.                                       */
-   for (i = 1; i < c->assoc; i++) {
-      if (tag == cacheline[id[i]].tag) {
-         tmp = id[i];
-         for (j = i; j > 0; j--) {
-            id[j] = id[j - 1];
-         }
-         id[0] = tmp;
+/* Return the entry for the pair (in_id, out_id), creating a zeroed one
+   if the pair has not been seen on this line yet.  The pointer stays
+   valid until the next insertion into `t`. */
+__attribute__((always_inline))
+static __inline__
+cacheline_rep_t* cr_table_get(cr_table_t* t, UInt in_id, UInt out_id)
+{
+   cacheline_rep_t *cr;
+   UInt j = 0;
+
+   if (LIKELY(t->n_slots > 0)) {
+      j = cr_hash(in_id, out_id) & (t->n_slots - 1);
+      while (True) {
+         cr = &t->slots[j];
+         if (LIKELY(cr->in_id == in_id && cr->out_id == out_id))
+            return cr;
+         if (cr->in_id == NO_VAR)
+            break;
+         j = (j + 1) & (t->n_slots - 1);
+      }
+   }
 
-         bitop_set_range(&cacheline[tmp].bitvector, word_begin, word_end); 
-         cacheline[tmp].num_accesses++;
+   /* Keep the load factor at or below 3/4. */
+   if (4 * (t->n_used + 1) > 3 * t->n_slots) {
+      cr_table_grow(t);
+      j = cr_hash(in_id, out_id) & (t->n_slots - 1);
+      while (t->slots[j].in_id != NO_VAR)
+         j = (j + 1) & (t->n_slots - 1);
+   }
+   cr = &t->slots[j];
+   cr->in_id  = in_id;
+   cr->out_id = out_id;
+   cr->m_comp = 0;
+   cr->m_conf = 0;
+   cr->m_cap  = 0;
+   cr->m_inv  = 0;
+   t->n_used++;
+   return cr;
+}
 
-         return False;
+/* As cr_table_get, for the usage entry of variable `vid`. */
+__attribute__((always_inline))
+static __inline__
+cacheline_usage_t* cu_table_get(cu_table_t* t, UInt vid)
+{
+   cacheline_usage_t *cu;
+   UInt j = 0;
+
+   if (LIKELY(t->n_slots > 0)) {
+      j = cu_hash(vid) & (t->n_slots - 1);
+      while (True) {
+         cu = &t->slots[j];
+         if (LIKELY(cu->vid == vid))
+            return cu;
+         if (cu->vid == NO_VAR)
+            break;
+         j = (j + 1) & (t->n_slots - 1);
       }
    }
 
-   /* A miss;  install this tag as MRU, shuffle rest down. */
-   UInt evict_id = id[c->assoc - 1];
-   cacheline_t evict_line = cacheline[evict_id];
-   num_words = bitop_count(evict_line.bitvector);
-   num_accesses = evict_line.num_accesses;
-
-//   if (CU_DEBUG && (!num_words || num_words > MAX_NUM_BINS) && evict_line.tag && cu_fp && c == &D1)
-//      VG_(fprintf)(cu_fp,  "ERROR: Ev %lx %x, %u, line: %d, %p\n", evict_line.tag, evict_line.bitvector, num_words, evict_line.line_num, evict_line.src_line);
+   if (4 * (t->n_used + 1) > 3 * t->n_slots) {
+      cu_table_grow(t);
+      j = cu_hash(vid) & (t->n_slots - 1);
+      while (t->slots[j].vid != NO_VAR)
+         j = (j + 1) & (t->n_slots - 1);
+   }
+   cu = &t->slots[j];
+   VG_(memset)(cu, 0, sizeof(cacheline_usage_t));
+   cu->vid = vid;
+   t->n_used++;
+   return cu;
+}
 
-   for (j = c->assoc - 1; j > 0; j--) {
-      id[j] = id[j - 1];
+/* The way of a set holding `tag`, or -1.  On amd64 the tags are
+   compared four at a time with SSE2, which has no 64-bit compare: two
+   32-bit compares are ANDed with their swapped halves. */
+__attribute__((always_inline))
+static __inline__
+Int cachesim_find_way(const UWord* tags, const UInt* ages, Int assoc, UWord tag)
+{
+   Int i, way;
+
+#if defined(VGA_amd64)
+   const __m128i t = _mm_set1_epi64x(tag);
+   for (i = 0; i + 4 <= assoc; i += 4) {
+      __m128i e0 = _mm_cmpeq_epi32(_mm_loadu_si128((const __m128i*)&tags[i]), t);
+      __m128i e1 = _mm_cmpeq_epi32(_mm_loadu_si128((const __m128i*)&tags[i + 2]), t);
+      Int m;
+      e0 = _mm_and_si128(e0, _mm_shuffle_epi32(e0, _MM_SHUFFLE(2, 3, 0, 1)));
+      e1 = _mm_and_si128(e1, _mm_shuffle_epi32(e1, _MM_SHUFFLE(2, 3, 0, 1)));
+      m = _mm_movemask_pd(_mm_castsi128_pd(e0))
+          | (_mm_movemask_pd(_mm_castsi128_pd(e1)) << 2);
+      if (m) {
+         way = i + __builtin_ctz(m);
+         goto found;
+      }
+   }
+#else
+   i = 0;
+#endif
+   for (; i < assoc; i++) {
+      if (tags[i] == tag) {
+         way = i;
+         goto found;
+      }
+   }
+   return -1;
+
+  found:
+   /* Only the tag of never filled ways can appear more than once in a
+      set; the most recently used of them is the one that hits. */
+   if (UNLIKELY(tag == 0)) {
+      for (i = way + 1; i < assoc; i++)
+         if (tags[i] == 0 && ages[i] < ages[way])
+            way = i;
    }
-   cacheline[evict_id].tag = tag;
-   cacheline[evict_id].bitvector = 0;
-   cacheline[evict_id].num_accesses = 0;
-   cacheline[evict_id].line_num = line_num;
-   cacheline[evict_id].src_line = line;
-   bitop_set_range(&cacheline[evict_id].bitvector, word_begin, word_end);
-   id[0] = evict_id;
+   return way;
+}
 
-   if(num_words && evict_line.tag && evict_line.src_line)
-   {
-     if(c==&D1)
-       evict_line.src_line->num_evicts_D1[num_words-1]++;
+/* A hit on a way of age `age`: the ways that were more recent get
+   older by one. */
+__attribute__((always_inline))
+static __inline__
+void cachesim_age_hit(UInt* ages, Int assoc, UInt age)
+{
+   Int i = 0;
+
+#if defined(VGA_amd64)
+   const __m128i a = _mm_set1_epi32(age);
+   for (; i + 4 <= assoc; i += 4) {
+      __m128i v = _mm_loadu_si128((const __m128i*)&ages[i]);
+      v = _mm_sub_epi32(v, _mm_cmplt_epi32(v, a));
+      _mm_storeu_si128((__m128i*)&ages[i], v);
+   }
+#endif
+   for (; i < assoc; i++)
+      ages[i] += (ages[i] < age);
+}
 
-     if(c==&LL)
-       evict_line.src_line->num_evicts_LL[num_words-1]++;
+/* A miss: every way gets older by one, and the one that was the LRU is
+   returned, as the new MRU. */
+__attribute__((always_inline))
+static __inline__
+Int cachesim_age_miss(UInt* ages, Int assoc)
+{
+   Int i = 0, way = 0;
+
+#if defined(VGA_amd64)
+   const __m128i one = _mm_set1_epi32(1);
+   const __m128i lru = _mm_set1_epi32(assoc);
+   for (; i + 4 <= assoc; i += 4) {
+      __m128i v = _mm_add_epi32(_mm_loadu_si128((const __m128i*)&ages[i]), one);
+      Int m = _mm_movemask_ps(_mm_castsi128_ps(_mm_cmpeq_epi32(v, lru)));
+      _mm_storeu_si128((__m128i*)&ages[i], v);
+      if (m)
+         way = i + __builtin_ctz(m);
+   }
+#endif
+   for (; i < assoc; i++) {
+      if (++ages[i] == assoc)
+         way = i;
+   }
+   ages[way] = 0;
+   return way;
+}
 
+/* POLICY_PLRU: node n of the tree of a set is bit n of its bits, with
+   the root at 1 and the children of n at 2n and 2n+1; the leaves,
+   assoc to 2*assoc-1, are the ways.  A set bit sends the victim right.
+   A reference makes the nodes on the way's path point away from it. */
+__attribute__((always_inline))
+static __inline__
+void cachesim_plru_touch(UInt* bits, Int assoc, Int way)
+{
+   UInt n = 1, half;
+
+   for (half = assoc >> 1; half > 0; half >>= 1) {
+      if (way & half) {
+         *bits &= ~(1U << n);
+         n = 2 * n + 1;
+      } else {
+         *bits |= 1U << n;
+         n = 2 * n;
+      }
    }
+}
 
-   LineCC* rline = (LineCC*)line;
-   variable_t *var_in = NULL, *var_out = NULL;
+__attribute__((always_inline))
+static __inline__
+Int cachesim_plru_victim(UInt bits, Int assoc)
+{
+   UInt n = 1;
 
-   //We only check the start address of each cacheline, which may not be the actually address of data been accessed. 
-   //We assume the number of errors generated can be ignored
-   Addr out = evict_line.tag << c->line_size_bits;
-   var_out = VG_(OSetGen_LookupWithCmp)(var_table, &out, comp_addr_var); 
-//   var_out = find_var_in_table(out);
-   if(var_out != NULL)
-   {
-      UWord vid = var_out->id;
+   while (n < (UInt)assoc)
+      n = 2 * n + ((bits >> n) & 1);
+   return n - assoc;
+}
 
-      if(c==&D1)
-      {
-         if(rline->cu_table_D1 == NULL)
-            rline->cu_table_D1 = VG_(OSetGen_Create)(offsetof(cacheline_usage_t, vid), NULL, VG_(malloc), "cg.sim.cu.1", VG_(free));
-         cacheline_usage_t *cu = VG_(OSetGen_Lookup)(rline->cu_table_D1, &vid);
-         if(cu == NULL)
-         {
-           cu = VG_(OSetGen_AllocNode)(rline->cu_table_D1, sizeof(cacheline_usage_t));
-           cu->vid = vid;
-           for(i = 0; i < MAX_NUM_BINS; i++)
-           {
-             cu->num_evicts_D1[i] = 0;
-           }
-           cu->num_accesses_D1 = 0;
-           VG_(OSetGen_Insert)(rline->cu_table_D1, cu);
-         }
-         cu->num_evicts_D1[num_words-1]++; 
-         cu->num_accesses_D1 += num_accesses;
-      }
+/* The low bits of VG_(random), a power of two LCG, have short periods,
+   which a cyclic reference pattern can lock onto. */
+__attribute__((always_inline))
+static __inline__
+UInt cachesim_random(cache_t2* c)
+{
+   return VG_(random)(&c->seed) >> 16;
+}
 
-      Addr in = tag << c->line_size_bits;
-      var_in = VG_(OSetGen_LookupWithCmp)(var_table, &in, comp_addr_var); //We assume the number of errors can be ignored
-//      var_in = find_var_in_table(in);
-      if(var_in != NULL)
-      {
-         UWord pair_id = (var_in->id << 10) + var_out->id;
-
-         if(c==&D1)
-         {
-            if(rline->cr_table_D1 == NULL)
-               rline->cr_table_D1 = VG_(OSetGen_Create)(offsetof(cacheline_rep_t, pair_id), NULL, VG_(malloc), "cg.sim.cr.1", VG_(free));
-            cacheline_rep_t *cr = VG_(OSetGen_Lookup)(rline->cr_table_D1, &pair_id);
-            if(cr == NULL)
-            {
-              cr = VG_(OSetGen_AllocNode)(rline->cr_table_D1, sizeof(cacheline_rep_t));
-              cr->pair_id = pair_id;
-              cr->m_comp = 0;
-              cr->m_conf = 0;
-              cr->m_cap = 0;
-              VG_(OSetGen_Insert)(rline->cr_table_D1, cr);
-            }
-            *cr_hook = cr;
-         }
-      }
+/* POLICY_SRRIP and POLICY_BRRIP: the first way predicted to be
+   re-referenced in the distant future, after ageing the set until
+   there is one. */
+__attribute__((always_inline))
+static __inline__
+Int cachesim_rrip_victim(UInt* rrpv, Int assoc)
+{
+   Int i;
+
+   while (True) {
+      for (i = 0; i < assoc; i++)
+         if (rrpv[i] == RRIP_MAX)
+            return i;
+      for (i = 0; i < assoc; i++)
+         rrpv[i]++;
    }
-   return True;
 }
 
+/* A hit on `way` of set `set_no` of `c`, other than its mru way. */
 __attribute__((always_inline))
 static __inline__
-Bool cachesim_ref_is_miss(cache_t2* c, Addr a, UChar size, Int line_num, LineCC *line, cacheline_rep_t **cr_hook)
+void cachesim_policy_hit(cache_t2* c, UInt set_no, Int way)
 {
-   /* A memory block has the size of a cache line */
-   UWord block1 =  a         >> c->line_size_bits;
-   UWord block2 = (a+size-1) >> c->line_size_bits;
-   UInt  set1   = block1 & c->sets_min_1;
-
+   UInt *ages = &c->ages[set_no * c->assoc];
+
+   switch (c->policy) {
+   case POLICY_LRU:
+      cachesim_age_hit(ages, c->assoc, ages[way]);
+      ages[way] = 0;
+      break;
+   case POLICY_PLRU:
+      cachesim_plru_touch(&c->plru[set_no], c->assoc, way);
+      break;
+   case POLICY_SRRIP:
+   case POLICY_BRRIP:
+      ages[way] = 0;
+      break;
+   case POLICY_FIFO:
+      /* the mru way stays the last filled, of rank 0 */
+      return;
+   case POLICY_RANDOM:
+      break;
+   }
+   c->mru[set_no] = way;
+}
+
+/* A miss in set `set_no` of `c`: returns the way to evict and fill,
+   which becomes the mru way. */
+__attribute__((always_inline))
+static __inline__
+Int cachesim_policy_fill(cache_t2* c, UInt set_no)
+{
+   UInt *ages = &c->ages[set_no * c->assoc];
+   Int  way;
+
+   switch (c->policy) {
+   case POLICY_PLRU:
+      way = cachesim_plru_victim(c->plru[set_no], c->assoc);
+      cachesim_plru_touch(&c->plru[set_no], c->assoc, way);
+      break;
+   case POLICY_SRRIP:
+      way = cachesim_rrip_victim(ages, c->assoc);
+      ages[way] = RRIP_MAX - 1;
+      break;
+   case POLICY_BRRIP:
+      way = cachesim_rrip_victim(ages, c->assoc);
+      ages[way] = cachesim_random(c) % BRRIP_LONG_ODDS == 0
+                  ? RRIP_MAX - 1 : RRIP_MAX;
+      break;
+   case POLICY_RANDOM:
+      way = cachesim_random(c) % c->assoc;
+      break;
+   default:  /* POLICY_LRU, POLICY_FIFO */
+      way = cachesim_age_miss(ages, c->assoc);
+      break;
+   }
+   c->mru[set_no] = way;
+   return way;
+}
+
+/* The epoch's copies of the CR and CU counts (--cig-epoch), kept out of
+   line of the simulation. */
+static __attribute__((noinline))
+cacheline_rep_t* cachesim_epoch_cr(sim_cfg_t* s, UInt in_id, UInt out_id)
+{
+   return cr_table_get(&s->epoch_cr, in_id, out_id);
+}
+
+static __attribute__((noinline))
+void cachesim_epoch_cu(cu_table_t* t, UInt vid, UInt num_words, ULong num_accesses)
+{
+   cacheline_usage_t *cu = cu_table_get(t, vid);
+   cu->num_evicts_D1[num_words-1]++;
+   cu->num_accesses_D1 += num_accesses;
+}
+
+/* cg.top-conflicts: the D1 conflict misses of the first configuration,
+   summed over the source lines for each (incoming, evicted) variable
+   pair, and a min-heap of the TOP_CONFLICTS pairs with the most.  The
+   `m_inv` field of a pair holds its position in the heap plus one, or
+   0.  A count only grows by one at a time, so a pair outside the heap
+   never has more misses than the heap's minimum: it takes the place of
+   the minimum as soon as it passes it, and the heap stays exact.  It is
+   only kept when the monitor commands can be sent, i.e. without
+   --vgdb=no. */
+#define TOP_CONFLICTS 64
+
+typedef struct {
+   UInt  in_id, out_id;
+   ULong m_conf;
+} top_conflict_t;
+
+static cr_table_t      top_pairs;
+static top_conflict_t  top_heap[TOP_CONFLICTS];
+static UInt            n_top_heap = 0;
+
+static void top_heap_place(UInt pos, const top_conflict_t* tc)
+{
+   top_heap[pos] = *tc;
+   cr_table_get(&top_pairs, tc->in_id, tc->out_id)->m_inv = pos + 1;
+}
+
+/* The count of the pair at `pos` has grown: move it down the heap. */
+static void top_heap_sift_down(UInt pos)
+{
+   top_conflict_t tc = top_heap[pos];
+
+   while (True) {
+      UInt child = 2 * pos + 1;
+      if (child >= n_top_heap)
+         break;
+      if (child + 1 < n_top_heap && top_heap[child + 1].m_conf < top_heap[child].m_conf)
+         child++;
+      if (top_heap[child].m_conf >= tc.m_conf)
+         break;
+      top_heap_place(pos, &top_heap[child]);
+      pos = child;
+   }
+   top_heap_place(pos, &tc);
+}
+
+static void top_heap_sift_up(UInt pos)
+{
+   top_conflict_t tc = top_heap[pos];
+
+   while (pos > 0 && top_heap[(pos - 1) / 2].m_conf > tc.m_conf) {
+      top_heap_place(pos, &top_heap[(pos - 1) / 2]);
+      pos = (pos - 1) / 2;
+   }
+   top_heap_place(pos, &tc);
+}
+
+/* A conflict miss of a line of `in_id` that evicted one of `out_id`. */
+static __attribute__((noinline))
+void cachesim_top_conflict(UInt in_id, UInt out_id)
+{
+   cacheline_rep_t *p = cr_table_get(&top_pairs, in_id, out_id);
+   top_conflict_t tc = { in_id, out_id, ++p->m_conf };
+
+   if (p->m_inv != 0) {
+      top_heap[p->m_inv - 1].m_conf = tc.m_conf;
+      top_heap_sift_down(p->m_inv - 1);
+   } else if (n_top_heap < TOP_CONFLICTS) {
+      top_heap[n_top_heap++] = tc;
+      top_heap_sift_up(n_top_heap - 1);
+   } else if (tc.m_conf > top_heap[0].m_conf) {
+      cr_table_get(&top_pairs, top_heap[0].in_id, top_heap[0].out_id)->m_inv = 0;
+      top_heap[0] = tc;
+      top_heap_sift_down(0);
+   }
+}
+
+static Int cmp_top_conflict(const void* va, const void* vb)
+{
+   const top_conflict_t* a = va;
+   const top_conflict_t* b = vb;
+
+   if (a->m_conf != b->m_conf)
+      return a->m_conf > b->m_conf ? -1 : 1;
+   if (a->in_id != b->in_id)
+      return a->in_id < b->in_id ? -1 : 1;
+   return a->out_id < b->out_id ? -1 : (a->out_id > b->out_id);
+}
+
+/* Copies the pairs of the heap to `out`, TOP_CONFLICTS long, by
+   decreasing count; returns how many there are. */
+static UInt cachesim_top_conflicts(top_conflict_t* out)
+{
+   VG_(memcpy)(out, top_heap, n_top_heap * sizeof(top_conflict_t));
+   VG_(ssort)(out, n_top_heap, sizeof(top_conflict_t), cmp_top_conflict);
+   return n_top_heap;
+}
+
+/* Count the eviction from `c` of line `evict_tag`, of which `num_words`
+   words were used, with `num_accesses` hits, since `evict_src` brought it
+   in.  If it belongs to a variable, the usage is also counted against
+   `rline`, the line evicting it, and the variable is returned. */
+__attribute__((always_inline))
+static __inline__
+variable_t* cachesim_count_evict(cache_t2* c, UWord evict_tag, LineCC* evict_src, UInt num_words, ULong num_accesses, LineCC* rline)
+{
+   variable_t *var_out;
+
+   if(num_words && evict_tag && evict_src)
+   {
+     if(c->level == CACHE_D1)
+       evict_src->num_evicts_D1[num_words-1]++;
+
+     if(c->level == CACHE_LL)
+       evict_src->num_evicts_LL[num_words-1]++;
+
+     if(c->level == CACHE_L2)
+       evict_src->num_evicts_L2[num_words-1]++;
+   }
+
+   //We only check the start address of each cacheline, which may not be the actually address of data been accessed. 
+   //We assume the number of errors generated can be ignored
+   var_out = cachesim_lookup_var(c, evict_tag, &c->vars.hint_out);
+   if(var_out != NULL && c->level == CACHE_D1 && num_words)
+   {
+      cacheline_usage_t *cu = cu_table_get(&rline->cu_table_D1, var_out->id);
+      cu->num_evicts_D1[num_words-1]++; 
+      cu->num_accesses_D1 += num_accesses;
+      if (UNLIKELY(c->epoch_cu != NULL))
+         cachesim_epoch_cu(c->epoch_cu, var_out->id, num_words, num_accesses);
+   }
+   return var_out;
+}
+
+/* The first demand reference to a line a prefetch brought into way `i`
+   of `c`. */
+static __attribute__((noinline))
+void cachesim_pf_first_use(cache_t2* c, Int i)
+{
+   const cacheline_owner_t *owner = &c->owners[i];
+
+   if (pf_clock - owner->pf_time < PF_LATE_REFS)
+      owner->src_line->Pf.late++;
+   else
+      owner->src_line->Pf.useful++;
+}
+
+/* --cig-ifetch: the instruction-side CIG.  Its nodes are functions,
+   numbered from 1 by cg_main.c, and an edge (in_id, out_id) counts the
+   lines of out_id's code that fetches of in_id's code evicted from I1
+   and from the first configuration's LL.  Those caches remember which
+   function's fetch filled each way, and the line it filled: any other
+   fill of the way, by data, a prefetch or a write-back, changes the
+   line, so that only code evicted by code makes an edge.  I1 never
+   spills, so an exclusive LL is filled by fetches that miss I1 as a
+   non-inclusive one is, and no fill of code goes unrecorded. */
+typedef struct _code_fill_t {
+   UWord tag;     /* the line filled by a fetch of fn_id's code */
+   UInt  fn_id;
+} code_fill_t;
+
+typedef struct {
+   UInt  in_id, out_id;          /* fetching and evicted function, 0 for an empty slot */
+   ULong evicts_I1, evicts_LL;
+} fn_edge_t;
+
+typedef struct {
+   fn_edge_t  *slots;
+   UInt       n_slots;     /* 0 or a power of two */
+   UInt       n_used;
+} fn_edge_table_t;
+
+static Bool            sim_cig_ifetch = False;
+static fn_edge_table_t fn_edges;
+
+static void fn_edge_table_grow(fn_edge_table_t* t)
+{
+   fn_edge_t *old = t->slots;
+   UInt i, j, n_old = t->n_slots;
+
+   t->n_slots = (n_old == 0) ? 1024 : n_old * 2;
+   t->slots = VG_(calloc)("cg.sim.fe.1", t->n_slots, sizeof(fn_edge_t));
+
+   for (i = 0; i < n_old; i++) {
+      if (old[i].in_id == 0)
+         continue;
+      j = cr_hash(old[i].in_id, old[i].out_id) & (t->n_slots - 1);
+      while (t->slots[j].in_id != 0)
+         j = (j + 1) & (t->n_slots - 1);
+      t->slots[j] = old[i];
+   }
+   if (old)
+      VG_(free)(old);
+}
+
+/* Return the edge (in_id, out_id), creating a zeroed one if needed. */
+static fn_edge_t* fn_edge_get(fn_edge_table_t* t, UInt in_id, UInt out_id)
+{
+   fn_edge_t *e;
+   UInt j = 0;
+
+   if (t->n_slots > 0) {
+      j = cr_hash(in_id, out_id) & (t->n_slots - 1);
+      while (True) {
+         e = &t->slots[j];
+         if (e->in_id == in_id && e->out_id == out_id)
+            return e;
+         if (e->in_id == 0)
+            break;
+         j = (j + 1) & (t->n_slots - 1);
+      }
+   }
+
+   if (4 * (t->n_used + 1) > 3 * t->n_slots) {
+      fn_edge_table_grow(t);
+      j = cr_hash(in_id, out_id) & (t->n_slots - 1);
+      while (t->slots[j].in_id != 0)
+         j = (j + 1) & (t->n_slots - 1);
+   }
+   e = &t->slots[j];
+   e->in_id  = in_id;
+   e->out_id = out_id;
+   t->n_used++;
+   return e;
+}
+
+/* Way `i` of `c` was filled with line `tag` of function `in_id`'s code,
+   evicting `evict_tag`. */
+static __attribute__((noinline))
+void cachesim_code_fill(cache_t2* c, Int i, UWord evict_tag, UWord tag, UInt in_id)
+{
+   code_fill_t *fill = &c->code_fills[i];
+   fn_edge_t *e;
+
+   if (in_id != 0 && fill->fn_id != 0 && evict_tag != 0 && fill->tag == evict_tag) {
+      e = fn_edge_get(&fn_edges, in_id, fill->fn_id);
+      if (c->level == CACHE_I1)
+         e->evicts_I1++;
+      else
+         e->evicts_LL++;
+   }
+   fill->tag   = tag;
+   fill->fn_id = in_id;
+}
+
+static void cachesim_init_cig_ifetch(void)
+{
+   I1.code_fills = VG_(calloc)("cg.sim.ici.1", I1.sets * I1.assoc,
+                               sizeof(code_fill_t));
+   sim_cfgs[0].LL.code_fills =
+      VG_(calloc)("cg.sim.ici.2", sim_cfgs[0].LL.sets * sim_cfgs[0].LL.assoc,
+                  sizeof(code_fill_t));
+}
+
+static void cachesim_make_lru(cache_t2* c, UInt set_no, Int w);
+
+/* Drops the lines of `c` within line `block` of `LL`, as an inclusive
+   LL evicts it on a miss of `line`. */
+static void cachesim_drop_lines(cache_t2* c, const cache_t2* LL, UWord block, LineCC* line)
+{
+   Addr  a    = block << LL->line_size_bits;
+   UWord b    = a >> c->line_size_bits;
+   UWord last = (a + LL->line_size - 1) >> c->line_size_bits;
+   UInt  set_no;
+   Int   w, i;
+
+   for (; b <= last; b++) {
+      set_no = b & c->sets_min_1;
+      w = cachesim_find_way(&c->tags[set_no * c->assoc], &c->ages[set_no * c->assoc],
+                            c->assoc, b);
+      if (w < 0)
+         continue;
+
+      i = set_no * c->assoc + w;
+      cachesim_count_evict(c, b, c->owners[i].src_line,
+                           bitop_count(c->uses[i].bitvector),
+                           c->uses[i].num_accesses, line);
+      if (c->dirty != NULL && c->dirty[i]) {
+         line->Tr.mem_wr += c->line_size;
+         c->dirty[i] = 0;
+      }
+      c->tags[i] = 0;
+      c->uses[i].bitvector = 0;
+      c->uses[i].num_accesses = 0;
+      c->owners[i].src_line = NULL;
+      cachesim_make_lru(c, set_no, w);
+      if (LL == &sim_cfgs[0].LL)
+         n_back_invalidations++;
+   }
+}
+
+/* --LL-inclusion=inclusive: `LL` evicts line `block` on a miss of
+   `line`, so the levels above must not keep it. */
+static __attribute__((noinline))
+void cachesim_back_invalidate(cache_t2* LL, UWord block, LineCC* line)
+{
+   sim_cfg_t *s = LL->inclusive_of;
+   UInt t;
+
+   if (line == NULL)
+      line = sim_ifetch_line;
+
+   if (sim_L2)
+      cachesim_drop_lines(&s->L2, LL, block, line);
+   cachesim_drop_lines(&s->D1, LL, block, line);
+   for (t = 0; t < n_sim_tids; t++)
+      cachesim_drop_lines(s->D1_thr[sim_tids[t]], LL, block, line);
+   if (s == &sim_cfgs[0])
+      cachesim_drop_lines(&I1, LL, block, line);
+}
+
+/* Writes line `block` of `c` back, as a miss of `line` evicts it: a
+   dirty line, or a clean one that `c` spills into an exclusive LL.  A
+   dirty LL line goes to memory.  The next level takes the whole line,
+   so a miss there fills the line without reading it. */
+static __attribute__((noinline))
+void cachesim_writeback(cache_t2* c, UWord block, LineCC* line, Bool dirty)
+{
+   cache_t2 *n = c->next;
+   UWord nblock, evict_tag;
+   UInt  set_no;
+   Int   w, i;
+   Bool  evict_dirty;
+
+   if (line == NULL)
+      line = sim_ifetch_line;
+
+   if (n == NULL) {
+      line->Tr.wb_LL++;
+      line->Tr.mem_wr += c->line_size;
+      return;
+   }
+   if (dirty) {
+      if (c->level == CACHE_L2)
+         line->Tr.wb_L2++;
+      else
+         line->Tr.wb_D1++;
+   }
+
+   nblock = (block << c->line_size_bits) >> n->line_size_bits;
+   set_no = nblock & n->sets_min_1;
+   w = cachesim_find_way(&n->tags[set_no * n->assoc], &n->ages[set_no * n->assoc],
+                         n->assoc, nblock);
+   if (w >= 0) {
+      if (dirty)
+         n->dirty[set_no * n->assoc + w] = 1;
+      return;
+   }
+
+   w = cachesim_policy_fill(n, set_no);
+   i = set_no * n->assoc + w;
+   evict_tag = n->tags[i];
+   if (evict_tag != 0) {
+      cachesim_count_evict(n, evict_tag, n->owners[i].src_line,
+                           bitop_count(n->uses[i].bitvector),
+                           n->uses[i].num_accesses, line);
+      if (n->inclusive_of != NULL)
+         cachesim_back_invalidate(n, evict_tag, line);
+      evict_dirty = n->dirty != NULL && n->dirty[i];
+      if (evict_dirty || n->spill)
+         cachesim_writeback(n, evict_tag, line, evict_dirty);
+   }
+
+   n->tags[i] = nblock;
+   n->uses[i].bitvector = 0;
+   n->uses[i].num_accesses = 0;
+   bitop_set_range(&n->uses[i].bitvector, 0, n->num_words_per_line - 1);
+   n->owners[i].src_line = line;
+   n->owners[i].line_num = line->loc.line;
+   if (n->dirty != NULL)
+      n->dirty[i] = dirty;
+}
+
+/* This attribute forces GCC to inline the function, getting rid of a
+ * lot of indirection around the cache_t2 pointer, if it is known to be
+ * constant in the caller (the caller is inlined itself).
+ * Without inlining of simulator functions, cachegrind can get 40% slower.
+ *
+ * Under LRU, recency is kept as a per-way age, the way's rank in the
+ * set's LRU order, so a hit only ages the ways that were more recent than
+ * it.  The MRU way is checked first, as most hits are to it; a hit there
+ * leaves the state of every policy as it is.
+ */
+__attribute__((always_inline))
+static __inline__
+Bool cachesim_setref_is_miss(cache_t2* c, UInt set_no, UWord tag, UInt word_begin, UInt word_end, UInt ref, Int line_num, void* line, cacheline_rep_t **cr_hook)
+{
+   Int way, evict_id;
+   UWord *tags = &c->tags[set_no * c->assoc];
+   UInt  *ages = &c->ages[set_no * c->assoc];
+   UInt num_words;
+   ULong num_accesses;
+   UWord evict_tag;
+   LineCC *evict_src;
+   cacheline_use_t *use;
+   cacheline_owner_t *owner;
+
+   way = c->mru[set_no];
+   if (tag == tags[way]) {
+      ages[way] = 0;   /* already so, but after an SRRIP or BRRIP fill */
+      use = &c->uses[set_no * c->assoc + way];
+      if (UNLIKELY(use->bitvector == 0))
+         cachesim_pf_first_use(c, set_no * c->assoc + way);
+      bitop_set_range(&use->bitvector, word_begin, word_end);
+      use->num_accesses++;
+      if (ref != REF_READ)
+         c->dirty[set_no * c->assoc + way] = 1;
+
+      return False;
+   }
+
+   way = cachesim_find_way(tags, ages, c->assoc, tag);
+   if (way >= 0) {
+      cachesim_policy_hit(c, set_no, way);
+      use = &c->uses[set_no * c->assoc + way];
+      if (UNLIKELY(use->bitvector == 0))
+         cachesim_pf_first_use(c, set_no * c->assoc + way);
+      bitop_set_range(&use->bitvector, word_begin, word_end);
+      use->num_accesses++;
+      if (ref != REF_READ)
+         c->dirty[set_no * c->assoc + way] = 1;
+
+      return False;
+   }
+
+   /* A non-temporal write miss goes on to the next level. */
+   if (ref == REF_WRITE_NT)
+      return True;
+
+   /* A miss;  install this tag in the way the policy evicts. */
+   evict_id = cachesim_policy_fill(c, set_no);
+
+   use   = &c->uses[set_no * c->assoc + evict_id];
+   owner = &c->owners[set_no * c->assoc + evict_id];
+   evict_tag = tags[evict_id];
+   evict_src = owner->src_line;
+   num_words = bitop_count(use->bitvector);
+   num_accesses = use->num_accesses;
+   if (UNLIKELY(c->inclusive_of != NULL) && evict_tag != 0)
+      cachesim_back_invalidate(c, evict_tag, line);
+   if (UNLIKELY(c->dirty != NULL) && c->dirty[set_no * c->assoc + evict_id])
+      cachesim_writeback(c, evict_tag, line, True);
+   else if (UNLIKELY(c->spill) && evict_tag != 0 && !(evict_tag & LINE_INVALID))
+      cachesim_writeback(c, evict_tag, line, False);
+   if (UNLIKELY(c->dirty != NULL))
+      c->dirty[set_no * c->assoc + evict_id] = (ref != REF_READ);
+
+   tags[evict_id] = tag;
+   use->bitvector = 0;
+   use->num_accesses = 0;
+   owner->line_num = line_num;
+   owner->src_line = line;
+   bitop_set_range(&use->bitvector, word_begin, word_end);
+   /* Only fetches have no line. */
+   if (UNLIKELY(c->code_fills != NULL) && line == NULL)
+      cachesim_code_fill(c, set_no * c->assoc + evict_id, evict_tag, tag,
+                         sim_ifetch_line->fn_id);
+
+   LineCC* rline = (LineCC*)line;
+   variable_t *var_in = NULL, *var_out = NULL;
+
+   var_out = cachesim_count_evict(c, evict_tag, evict_src, num_words, num_accesses, rline);
+   if(var_out != NULL)
+   {
+      var_in = cachesim_lookup_var(c, tag, &c->vars.hint_in); //We assume the number of errors can be ignored
+      if(var_in != NULL)
+      {
+         if(c->level == CACHE_D1)
+            *cr_hook = cr_table_get(&rline->cr_table_D1, var_in->id, var_out->id);
+      }
+   }
+   return True;
+}
+
+__attribute__((always_inline))
+static __inline__
+Bool cachesim_ref_is_miss(cache_t2* c, Addr a, UChar size, UInt ref, Int line_num, LineCC *line, cacheline_rep_t **cr_hook)
+{
+   /* A memory block has the size of a cache line */
+   UWord block1 =  a         >> c->line_size_bits;
+   UWord block2 = (a+size-1) >> c->line_size_bits;
+   UInt  set1   = block1 & c->sets_min_1;
+
    UWord addr_offset = a & c->line_mask; 
    UWord word_begin = addr_offset >> c->word_size_bits;
    UWord word_end1 = (addr_offset + size - 1) >> c->word_size_bits;
@@ -536,7 +1897,7 @@ Bool cachesim_ref_is_miss(cache_t2* c, Addr a, UChar size, Int line_num, LineCC
 
    /* Access entirely within line. */
    if (block1 == block2)
-      return cachesim_setref_is_miss(c, set1, tag1, word_begin, word_end1, line_num, line, cr_hook);
+      return cachesim_setref_is_miss(c, set1, tag1, word_begin, word_end1, ref, line_num, line, cr_hook);
 
    /* Access straddles two lines. */
    else if (block1 + 1 == block2) {
@@ -547,11 +1908,11 @@ Bool cachesim_ref_is_miss(cache_t2* c, Addr a, UChar size, Int line_num, LineCC
       word_end1 = c->num_words_per_line - 1;
 
       /* always do both, as state is updated as side effect */
-      if (cachesim_setref_is_miss(c, set1, tag1, word_begin, word_end1, line_num, line, cr_hook)) {
-         cachesim_setref_is_miss(c, set2, tag2, 0, word_end2, line_num, line, cr_hook);
+      if (cachesim_setref_is_miss(c, set1, tag1, word_begin, word_end1, ref, line_num, line, cr_hook)) {
+         cachesim_setref_is_miss(c, set2, tag2, 0, word_end2, ref, line_num, line, cr_hook);
          return True;
       }
-      return cachesim_setref_is_miss(c, set2, tag2, 0, word_end2, line_num, line, cr_hook);
+      return cachesim_setref_is_miss(c, set2, tag2, 0, word_end2, ref, line_num, line, cr_hook);
    }
    VG_(printf)("addr: %lx  size: %u  blocks: %lu %lu",
                a, size, block1, block2);
@@ -563,76 +1924,289 @@ Bool cachesim_ref_is_miss(cache_t2* c, Addr a, UChar size, Int line_num, LineCC
 static
 void cachesim_collect_undrained_lines(cache_t2* c)
 {
-   Int i, j;
-   UInt id, num_words;
-   cacheline_t *cl = c->cachelines;
+   Int i;
+   UInt num_words;
+   LineCC *src;
 
-   for (i = 0; i < c->sets; i++)
+   for (i = 0; i < c->sets * c->assoc; i++)
    {
-     for (j = 0; j < c->assoc; j++)
-     {
-        id = c->lru_list[i * c->assoc + j];
-        if(cl[id].tag && cl[id].src_line) 
-        {
-           num_words = bitop_count(cl[id].bitvector);
-
-           if(c==&D1)
-             cl[id].src_line->num_evicts_D1[num_words-1]++;
-           if(c==&LL)
-             cl[id].src_line->num_evicts_LL[num_words-1]++;
-        }
-     }
+      src = c->owners[i].src_line;
+      num_words = bitop_count(c->uses[i].bitvector);
+      if(c->tags[i] && src && num_words) 
+      {
+
+         if(c->level == CACHE_D1)
+           src->num_evicts_D1[num_words-1]++;
+         if(c->level == CACHE_LL)
+           src->num_evicts_LL[num_words-1]++;
+         if(c->level == CACHE_L2)
+           src->num_evicts_L2[num_words-1]++;
+      }
+   }
+}
+
+/* Misses of a reference in the shadow caches, as SHADOW_* bits.  The
+   engines take the line size as an argument; the variants instantiated
+   below fix it at 32, 64 or 128 bytes so that the shifts are constants,
+   and cachesim_initcaches picks one.  Other line sizes, or D1 and LL
+   lines of different sizes, go through the _gen variants. */
+#define SHADOW_INFI   1   /* never referenced before */
+#define SHADOW_FA     2   /* missed by a fully associative D1 */
+#define SHADOW_FA_LL  4   /* missed by a fully associative LL */
+#define SHADOW_FA_L2  8   /* missed by a fully associative L2 (--L2) */
+
+__attribute__((always_inline))
+static __inline__
+UInt shadow_fa(sim_cfg_t* s, Addr a, UChar size, Int D1_bits, Int LL_bits)
+{
+   UInt shadow = 0;
+
+   if (cacheinfi_ref_is_miss(&s->INFI, a, size, D1_bits))
+      shadow |= SHADOW_INFI;
+   if (cachefa_ref_is_miss(&s->FA_D1, a, size, D1_bits))
+      shadow |= SHADOW_FA;
+   if (cachefa_ref_is_miss(&s->FA_LL, a, size, LL_bits))
+      shadow |= SHADOW_FA_LL;
+   if (UNLIKELY(sim_L2)
+       && cachefa_ref_is_miss(&s->FA_L2, a, size, s->FA_L2.line_size_bits))
+      shadow |= SHADOW_FA_L2;
+   return shadow;
+}
+
+__attribute__((always_inline))
+static __inline__
+UInt shadow_sd(sim_cfg_t* s, Addr a, UChar size, LineCC* line, Int D1_bits)
+{
+   UWord dist = cachesd_ref_distance(&s->SD, a, size, D1_bits);
+   UInt shadow = 0;
+
+   if (UNLIKELY(line->rd_hist == NULL))
+      line->rd_hist = VG_(calloc)("cg.sim.rd_hist", SD_NUM_BINS + 1, sizeof(ULong));
+   line->rd_hist[dist == SD_COLD ? SD_NUM_BINS : cachesd_bin(dist)]++;
+
+   /* a fully associative LRU cache of N lines hits below distance N */
+   if (dist == SD_COLD)
+      shadow |= SHADOW_INFI;
+   if (dist >= s->SD_D1_lines)
+      shadow |= SHADOW_FA;
+   if (dist >= s->SD_LL_lines)
+      shadow |= SHADOW_FA_LL;
+   if (dist >= s->SD_L2_lines)
+      shadow |= SHADOW_FA_L2;
+   return shadow;
+}
+
+#define SHADOW_VARIANTS(bits)                                                    \
+   static UInt shadow_fa_##bits(sim_cfg_t* s, Addr a, UChar size, LineCC* line) \
+   {                                                                             \
+      return shadow_fa(s, a, size, bits, bits);                                  \
+   }                                                                             \
+   static UInt shadow_sd_##bits(sim_cfg_t* s, Addr a, UChar size, LineCC* line) \
+   {                                                                             \
+      return shadow_sd(s, a, size, line, bits);                                  \
    }
+
+SHADOW_VARIANTS(5)
+SHADOW_VARIANTS(6)
+SHADOW_VARIANTS(7)
+
+static UInt shadow_fa_gen(sim_cfg_t* s, Addr a, UChar size, LineCC* line)
+{
+   return shadow_fa(s, a, size, s->FA_D1.line_size_bits, s->FA_LL.line_size_bits);
+}
+
+static UInt shadow_sd_gen(sim_cfg_t* s, Addr a, UChar size, LineCC* line)
+{
+   return shadow_sd(s, a, size, line, s->SD.line_size_bits);
 }
 
 static void cachefa_initcache(cache_t config, cache_fa* c)
 {
 //   VG_(fprintf)(cu_fp, "cachefa_initcache capacity: %d\n", config.size);
-   cachefa_setup(c, (config.size / config.line_size));
+   cachefa_setup(c, (config.size / config.line_size), config.line_size);
+}
+
+/* `L2c` is NULL without --L2. */
+static void cachesim_initcfg(sim_cfg_t* s, cache_t D1c, const cache_t* L2c, cache_t LLc,
+                             UInt word_size)
+{
+   cachesim_initcache(D1c, &s->D1, CACHE_D1, word_size);
+   cachesim_initcache(LLc, &s->LL, CACHE_LL, word_size);
+   s->D1.next = &s->LL;
+   if (L2c != NULL) {
+      cachesim_initcache(*L2c, &s->L2, CACHE_L2, word_size);
+      s->D1.next = &s->L2;
+      s->L2.next = &s->LL;
+   }
+
+   if (sim_inclusion == INCL_INCLUSIVE)
+      s->LL.inclusive_of = s;
+   else if (sim_inclusion == INCL_EXCLUSIVE)
+      (L2c != NULL ? &s->L2 : &s->D1)->spill = True;
+
+   if (sim_stackdist) {
+      /* distances count D1 lines, also when the LL lines are larger */
+      s->SD_D1_lines = D1c.size / D1c.line_size;
+      s->SD_L2_lines = L2c != NULL ? L2c->size / D1c.line_size : ~(UWord)0;
+      s->SD_LL_lines = LLc.size / D1c.line_size;
+      cachesd_setup(&s->SD, s->SD_D1_lines, s->SD_LL_lines, D1c.line_size);
+      if (L2c != NULL)
+         cachesd_add_bound(&s->SD, s->SD_L2_lines);
+   } else {
+      cacheinfi_setup(&s->INFI, D1c.line_size);
+      cachefa_initcache(D1c, &s->FA_D1);
+      cachefa_initcache(LLc, &s->FA_LL);
+      if (L2c != NULL)
+         cachefa_initcache(*L2c, &s->FA_L2);
+   }
+
+   if (D1c.line_size != LLc.line_size)
+      s->shadow_classify = sim_stackdist ? shadow_sd_gen : shadow_fa_gen;
+   else switch (D1c.line_size) {
+      case 32:  s->shadow_classify = sim_stackdist ? shadow_sd_5 : shadow_fa_5; break;
+      case 64:  s->shadow_classify = sim_stackdist ? shadow_sd_6 : shadow_fa_6; break;
+      case 128: s->shadow_classify = sim_stackdist ? shadow_sd_7 : shadow_fa_7; break;
+      default:  s->shadow_classify = sim_stackdist ? shadow_sd_gen : shadow_fa_gen; break;
+   }
 }
 
-static void cachesim_initcaches(cache_t I1c, cache_t D1c, cache_t LLc, UInt word_size)
+/* D1cs[k] and LLcs[k] are configuration k, for k < n_cfgs.  L2c, if
+   not NULL, is the L2 of every configuration. */
+static void cachesim_initcaches(cache_t I1c, const cache_t* D1cs, const cache_t* L2c,
+                                const cache_t* LLcs, UInt n_cfgs, UInt word_size)
 {
+   cache_t D1c = D1cs[0];
+   UInt k;
+
    open_cu_log();
 
-   cachesim_initcache(I1c, &I1, word_size);
-   cachesim_initcache(D1c, &D1, word_size);
-   cachesim_initcache(LLc, &LL, word_size);
+   var_table = 
+      VG_(OSetGen_Create)(0,
+                          cmp_var_range,
+                          VG_(malloc), "cg.sim.ci.3",
+                          VG_(free));
+
+   cachesim_initcache(I1c, &I1, CACHE_I1, word_size);
+
+   tl_assert(n_cfgs >= 1 && n_cfgs <= MAX_SIM_CFGS);
+   n_sim_cfgs = n_cfgs;
+   sim_L2 = L2c != NULL;
+   for (k = 0; k < n_cfgs; k++)
+      cachesim_initcfg(&sim_cfgs[k], D1cs[k], L2c, LLcs[k], word_size);
+
+   if (sim_prefetch != PF_NONE) {
+      for (k = 0; k < n_cfgs; k++) {
+         sim_cfg_t* c = &sim_cfgs[k];
+         c->pf_strides    = VG_(calloc)("cg.sim.pf.1", PF_STRIDES, sizeof(pf_stride_t));
+         c->pf_streams    = VG_(calloc)("cg.sim.pf.2", PF_STREAMS, sizeof(pf_stream_t));
+         c->pf_victims_D1 = VG_(calloc)("cg.sim.pf.3", PF_VICTIMS, sizeof(pf_victim_t));
+         c->pf_victims_LL = VG_(calloc)("cg.sim.pf.4", PF_VICTIMS, sizeof(pf_victim_t));
+      }
+   }
+
+   if (sim_cig_epoch) {
+      for (k = 0; k < n_cfgs; k++)
+         sim_cfgs[k].D1.epoch_cu = &sim_cfgs[k].epoch_cu;
+   }
+
+   if (sim_write_back) {
+      sim_ref_kind[REF_WRITE]    = sim_write_allocate ? REF_WRITE : REF_WRITE_NT;
+      sim_ref_kind[REF_WRITE_NT] = REF_WRITE_NT;
+   }
+
+   if (sim_threads_private) {
+      for (k = 0; k < n_cfgs; k++)
+         sim_cfgs[k].D1_thr = VG_(calloc)("cg.sim.ci.6", VG_N_THREADS, sizeof(cache_t2*));
+      sim_tids = VG_(malloc)("cg.sim.ci.7", VG_N_THREADS * sizeof(ThreadId));
+   }
 
    D1c.assoc = D1c.size / D1c.line_size;
-   cachesim_initcache(D1c, &D1_fa, word_size);
+   cachesim_initcache(D1c, &D1_fa, CACHE_D1, word_size);
 
    //VG_(printf)("cachesim_initcaches word_size: %u, word_size_bits: %d\n", word_size, D1.word_size_bits);
-
-   cachefa_initcache(D1c, &FA_D1);
-   cachefa_initcache(LLc, &FA_LL);
 }
 
 static void cachesim_finish(void)
 {
-   cachesim_collect_undrained_lines(&D1);
-   cachesim_collect_undrained_lines(&LL);
+   UInt k, t;
+
+   for (k = 0; k < n_sim_cfgs; k++) {
+      cachesim_collect_undrained_lines(&sim_cfgs[k].D1);
+      if (sim_L2)
+         cachesim_collect_undrained_lines(&sim_cfgs[k].L2);
+      cachesim_collect_undrained_lines(&sim_cfgs[k].LL);
+      for (t = 0; t < n_sim_tids; t++)
+         cachesim_collect_undrained_lines(sim_cfgs[k].D1_thr[sim_tids[t]]);
+   }
    close_cu_log();
 }
 
+/* An instruction fetch missed in I1: look it up in the LL of every
+   configuration. */
+static void cachesim_I1_miss_more(Addr a, UChar size, LineCC* line)
+{
+   cacheline_rep_t *cr = NULL;
+   UInt k;
+
+   for (k = 1, line = line->next_cfg; k < n_sim_cfgs; k++, line = line->next_cfg) {
+      sim_ifetch_line = line;
+      if (cachesim_ref_is_miss(&sim_cfgs[k].LL, a, size, REF_READ, 0, NULL, &cr)) {
+         line->Ir.mL++;
+         line->Tr.mem_rd += sim_cfgs[k].LL.line_size;
+      }
+   }
+}
+
+/* --L2: an instruction fetch missed in I1: look it up in the L2, then
+   the LL, of every configuration. */
+static __attribute__((noinline))
+void cachesim_I1_miss_L2(Addr a, UChar size, LineCC* line)
+{
+   cacheline_rep_t *cr = NULL;
+   UInt k;
+
+   for (k = 0; k < n_sim_cfgs; k++, line = line->next_cfg) {
+      sim_ifetch_line = line;
+      if (!cachesim_ref_is_miss(&sim_cfgs[k].L2, a, size, REF_READ, 0, NULL, &cr))
+         continue;
+      line->Ir.m2++;
+      if (cachesim_ref_is_miss(&sim_cfgs[k].LL, a, size, REF_READ, 0, NULL, &cr)) {
+         line->Ir.mL++;
+         line->Tr.mem_rd += sim_cfgs[k].LL.line_size;
+      }
+   }
+}
+
 __attribute__((always_inline))
 static __inline__
-void cachesim_I1_doref_Gen(Addr a, UChar size, ULong* m1, ULong *mL)
+void cachesim_I1_doref_Gen(Addr a, UChar size, LineCC* line)
 {
    cacheline_rep_t *cr = NULL;
-   if (cachesim_ref_is_miss(&I1, a, size, 0, NULL, &cr)) {
-      (*m1)++;
-      if (cachesim_ref_is_miss(&LL, a, size, 0, NULL, &cr))
-         (*mL)++;
+   if (UNLIKELY(sim_cig_ifetch))
+      sim_ifetch_line = line;
+   if (cachesim_ref_is_miss(&I1, a, size, REF_READ, 0, NULL, &cr)) {
+      line->Ir.m1++;
+      if (UNLIKELY(sim_L2)) {
+         cachesim_I1_miss_L2(a, size, line);
+         return;
+      }
+      sim_ifetch_line = line;
+      if (cachesim_ref_is_miss(&sim_cfgs[0].LL, a, size, REF_READ, 0, NULL, &cr)) {
+         line->Ir.mL++;
+         line->Tr.mem_rd += sim_cfgs[0].LL.line_size;
+      }
+      if (UNLIKELY(n_sim_cfgs > 1))
+         cachesim_I1_miss_more(a, size, line);
    }
 }
 
 // common special case IrNoX
 __attribute__((always_inline))
 static __inline__
-void cachesim_I1_doref_NoX(Addr a, UChar size, ULong* m1, ULong *mL)
+void cachesim_I1_doref_NoX(Addr a, UChar size, LineCC* line)
 {
    cacheline_rep_t *cr = NULL;
+   cache_t2* LL = &sim_cfgs[0].LL;
 
    UWord block  = a >> I1.line_size_bits;
    UInt  I1_set = block & I1.sets_min_1;
@@ -641,185 +2215,876 @@ void cachesim_I1_doref_NoX(Addr a, UChar size, ULong* m1, ULong *mL)
    UWord word_begin = addr_offset >> I1.word_size_bits;
    UWord word_end = (addr_offset + size - 1) >> I1.word_size_bits;
 
+   if (UNLIKELY(sim_cig_ifetch))
+      sim_ifetch_line = line;
    // use block as tag
-   if (cachesim_setref_is_miss(&I1, I1_set, block, word_begin, word_end, 0, NULL, &cr)) {
-      UInt  LL_set = block & LL.sets_min_1;
-      (*m1)++;
+   if (cachesim_setref_is_miss(&I1, I1_set, block, word_begin, word_end, REF_READ, 0, NULL, &cr)) {
+      UInt  LL_set = block & LL->sets_min_1;
+      line->Ir.m1++;
+      if (UNLIKELY(sim_L2)) {
+         cachesim_I1_miss_L2(a, size, line);
+         return;
+      }
+      sim_ifetch_line = line;
       // can use block as tag as L1I and LL cache line sizes are equal
-      if (cachesim_setref_is_miss(&LL, LL_set, block, word_begin, word_end, 0, NULL, &cr))
-         (*mL)++;
+      if (cachesim_setref_is_miss(LL, LL_set, block, word_begin, word_end, REF_READ, 0, NULL, &cr)) {
+         line->Ir.mL++;
+         line->Tr.mem_rd += LL->line_size;
+      }
+      if (UNLIKELY(n_sim_cfgs > 1))
+         cachesim_I1_miss_more(a, size, line);
    }
 }
 
+/* An invalidation miss of `line` at `a`, on a line invalidated by
+   another thread's write to `inv_by`.  The edge goes from the variable
+   referenced to the variable written, which differ under false sharing,
+   so both are looked up by address rather than by cache line. */
+static void cachesim_count_inv_edge(sim_cfg_t* s, LineCC* line, Addr a, Addr inv_by)
+{
+   variable_t *var_in, *var_out;
+
+   var_in  = VG_(OSetGen_LookupWithCmp)(var_table, &a, comp_addr_var);
+   var_out = VG_(OSetGen_LookupWithCmp)(var_table, &inv_by, comp_addr_var);
+   if (var_in != NULL && var_out != NULL) {
+      cr_table_get(&line->cr_table_D1, var_in->id, var_out->id)->m_inv++;
+      if (UNLIKELY(sim_cig_epoch))
+         cachesim_epoch_cr(s, var_in->id, var_out->id)->m_inv++;
+   }
+}
+
+static void cachesim_prefetch(sim_cfg_t* s, cache_t2* D1, Addr a, LineCC* line,
+                              Bool miss_D1, Bool miss_LL, Addr pc);
+
+/* --L2: a D1 miss of kind `kind` (REF_*), counted in `cc`, goes to L2
+   first; `shadow` classifies it.  Returns whether it missed there too. */
+static __attribute__((noinline))
+Bool cachesim_L2_miss(sim_cfg_t* s, CacheCC* cc, Addr a, UChar size, LineCC* line,
+                      UInt kind, UInt shadow)
+{
+   cacheline_rep_t *cr = NULL;
+
+   if (!cachesim_ref_is_miss(&s->L2, a, size, kind == REF_WRITE_NT ? kind : REF_READ,
+                             line->loc.line, line, &cr))
+      return False;
+
+   cc->m2++;
+   if (shadow & SHADOW_INFI)
+      cc->m2_comp++;
+   else if (!(shadow & SHADOW_FA_L2))
+      cc->m2_conf++;
+   else
+      cc->m2_cap++;
+   return True;
+}
+
+/* --LL-inclusion=exclusive: a reference of `line` to `a` missed in
+   `upper`, the level above LL, which has just filled its line.  An LL
+   hit moves the line up, with its dirty state; a miss leaves LL as it
+   is.  LL and `upper` have lines of the same size.  Returns whether the
+   reference missed. */
+static __attribute__((noinline))
+Bool cachesim_LL_take(cache_t2* LL, cache_t2* upper, Addr a, UChar size, LineCC* line)
+{
+   UWord block = a >> LL->line_size_bits;
+   UWord last  = (a + size - 1) >> LL->line_size_bits;
+   Bool  miss  = False;
+   UInt  set_no, uset;
+   Int   w, uw, i;
+
+   for (; block <= last; block++) {
+      set_no = block & LL->sets_min_1;
+      w = cachesim_find_way(&LL->tags[set_no * LL->assoc], &LL->ages[set_no * LL->assoc],
+                            LL->assoc, block);
+      if (w < 0) {
+         miss = True;
+         continue;
+      }
+
+      i = set_no * LL->assoc + w;
+      if (LL->dirty != NULL && LL->dirty[i]) {
+         LL->dirty[i] = 0;
+         uset = block & upper->sets_min_1;
+         uw = cachesim_find_way(&upper->tags[uset * upper->assoc],
+                                &upper->ages[uset * upper->assoc], upper->assoc, block);
+         if (uw >= 0)
+            upper->dirty[uset * upper->assoc + uw] = 1;
+         else
+            line->Tr.mem_wr += LL->line_size;
+      }
+      LL->tags[i] = 0;
+      LL->uses[i].bitvector = 0;
+      LL->uses[i].num_accesses = 0;
+      LL->owners[i].src_line = NULL;
+      cachesim_make_lru(LL, set_no, w);
+   }
+   return miss;
+}
+
+/* A data reference of kind `ref` (REF_*) of instruction `pc` in
+   configuration `s`, counted in the Dr or Dw of `line`.  `D1` is s->D1,
+   or the private D1 of the current thread, in which case a miss on a
+   line invalidated by a write to *inv_by is an invalidation miss. */
 __attribute__((always_inline))
 static __inline__
-Bool cachesim_D1_doref(Addr a, UChar size, ULong* m1, ULong *mL, int line_num, LineCC* line, CacheCC* cc)
+Bool cachesim_D1_doref_cfg(sim_cfg_t* s, cache_t2* D1, Addr a, UChar size, LineCC* line, UInt ref, const Addr* inv_by, Addr pc)
 {
    cacheline_rep_t *cr = NULL;
+   CacheCC* cc = (ref == REF_READ) ? &line->Dr : &line->Dw;
+   UInt kind = (ref == REF_READ) ? REF_READ : sim_ref_kind[ref];
+   Int line_num = line->loc.line;
+   Bool miss_LL = False;
 
-   Bool miss_infi;
-   Bool miss_fa;
-   Bool miss_fa_LL;
-
-   miss_infi = cacheinfi_ref_is_miss(&INFI, a, size);
-   miss_fa = cachefa_ref_is_miss(&FA_D1, a, size);
-   miss_fa_LL = cachefa_ref_is_miss(&FA_LL, a, size);
+   UInt shadow = s->shadow_classify(s, a, size, line);
+   Bool miss_infi = (shadow & SHADOW_INFI) != 0;
+   Bool miss_fa = (shadow & SHADOW_FA) != 0;
+   Bool miss_fa_LL = (shadow & SHADOW_FA_LL) != 0;
 
 //   Bool miss_fa_D1 = cachesim_ref_is_miss(&D1_fa, a, size, line_num, NULL, NULL);
 
-   if (cachesim_ref_is_miss(&D1, a, size, line_num, line, &cr)) {
-      (*m1)++;
+   if (cachesim_ref_is_miss(D1, a, size, kind, line_num, line, &cr)) {
+      cc->m1++;
 
-     if(miss_infi)
+     if(inv_by != NULL)
+     {
+        cc->m1_inv++;
+        cachesim_count_inv_edge(s, line, a, *inv_by);
+     }
+     else if(miss_infi)
      {
         cc->m1_comp++;
-        if(cr!=NULL)
+        if(cr!=NULL) {
           cr->m_comp++;
+          if (UNLIKELY(sim_cig_epoch))
+            cachesim_epoch_cr(s, cr->in_id, cr->out_id)->m_comp++;
+        }
       }
       else if(!miss_fa)
 //     else if(!miss_fa_D1)
       {
         cc->m1_conf++;
-        if(cr!=NULL)
+        if(cr!=NULL) {
           cr->m_conf++;
+          if (UNLIKELY(sim_cig_epoch))
+            cachesim_epoch_cr(s, cr->in_id, cr->out_id)->m_conf++;
+          if (UNLIKELY(sim_top_conflicts) && s == &sim_cfgs[0])
+            cachesim_top_conflict(cr->in_id, cr->out_id);
+        }
       }
       else {
         cc->m1_cap++;
-        if(cr!=NULL)
+        if(cr!=NULL) {
           cr->m_cap++;
+          if (UNLIKELY(sim_cig_epoch))
+            cachesim_epoch_cr(s, cr->in_id, cr->out_id)->m_cap++;
+        }
       }
 
-      if (cachesim_ref_is_miss(&LL, a, size, line_num, line, &cr)) {
-         (*mL)++;
+      /* L2, then LL, is read for the line D1 fills, or takes the write
+         D1 does not.  An exclusive LL gives the line up to the level above. */
+      if (LIKELY(!sim_L2) || cachesim_L2_miss(s, cc, a, size, line, kind, shadow)) {
+         if (UNLIKELY(sim_inclusion == INCL_EXCLUSIVE) && kind != REF_WRITE_NT)
+            miss_LL = cachesim_LL_take(&s->LL, sim_L2 ? &s->L2 : D1, a, size, line);
+         else
+            miss_LL = cachesim_ref_is_miss(&s->LL, a, size,
+                                           kind == REF_WRITE_NT ? kind : REF_READ,
+                                           line_num, line, &cr);
+      }
+      if (miss_LL) {
+         cc->mL++;
+         if (kind == REF_WRITE_NT)
+            line->Tr.mem_wr += size;
+         else
+            line->Tr.mem_rd += s->LL.line_size;
 
          if(miss_infi)
            cc->mL_comp++;
-         else if(miss_fa_LL)
+         else if(!miss_fa_LL)
            cc->mL_conf++;
          else
            cc->mL_cap++;
       }
 
+      if (UNLIKELY(sim_prefetch != PF_NONE))
+         cachesim_prefetch(s, D1, a, line, True, miss_LL, pc);
       return True;
    }
 
-   /* messy hack to read variables in the simulated program*/
-   /* A file named "varinfo.txt" is generated by the program under simulation */
-   /* We monitor its presence and read it to fill var_table */
-   static Int ref_counter = 0;
-   static Bool done = False;
-
-   struct vg_stat stat_buf;
-   VG_(memset)(&stat_buf, 0, sizeof(stat_buf));
-
-   const HChar filename[32] = "varinfo.txt";
-   SysRes  var_fd, stat_fd;
-   Int     fdno;
-   HChar    buffer[512], swap_buffer[256];
-   Int      read_len = 256;
-   HChar    *read_buffer = buffer, *buffer_end;
-   HChar    *line_start, *line_end, *var_name = NULL, *start = NULL;
-   Addr    begin, end;
-   Int     len;
-   Bool    finished;
-   variable_t *var;
+   if (UNLIKELY(sim_prefetch != PF_NONE))
+      cachesim_prefetch(s, D1, a, line, False, False, pc);
+   return False;
+}
 
-   if(!done)
-   {
-     if(ref_counter == 10000)
-     {
-       ref_counter = 0;
+static void cachesim_D1_doref_more(Addr a, UChar size, LineCC* line, UInt ref, Addr pc)
+{
+   UInt k;
 
-       stat_fd = VG_(stat)(filename, &stat_buf);
-       if(!sr_isError(stat_fd))
-       {
-         var_fd = VG_(open)(filename, VKI_O_RDONLY, VKI_S_IRUSR);
+   for (k = 1, line = line->next_cfg; k < n_sim_cfgs; k++, line = line->next_cfg)
+      cachesim_D1_doref_cfg(&sim_cfgs[k], &sim_cfgs[k].D1, a, size, line, ref, NULL, pc);
+}
 
-         if (sr_isError(var_fd)) {
-           VG_(printf)("Error: can't open %s!\n", filename);
+/* Makes way `w` of set `set_no` of `c`, which holds no valid line, the
+   next one to be evicted.  Under PLRU and RRIP, it also becomes the mru
+   way, which its tag never matches; under RANDOM, it is as likely to be
+   evicted as any other. */
+static void cachesim_make_lru(cache_t2* c, UInt set_no, Int w)
+{
+   UInt *ages = &c->ages[set_no * c->assoc];
+   UInt age = ages[w];
+   UInt n, half;
+   Int i;
+
+   switch (c->policy) {
+   case POLICY_LRU:
+   case POLICY_FIFO:
+      for (i = 0; i < c->assoc; i++)
+         ages[i] -= (ages[i] > age);
+      ages[w] = c->assoc - 1;
+      if (c->mru[set_no] == w) {
+         for (i = 0; i < c->assoc; i++)
+            if (ages[i] == 0)
+               c->mru[set_no] = i;
+      }
+      break;
+   case POLICY_PLRU:
+      for (n = 1, half = c->assoc >> 1; half > 0; half >>= 1) {
+         if (w & half) {
+            c->plru[set_no] |= 1U << n;
+            n = 2 * n + 1;
          } else {
-           fdno = sr_Res(var_fd);
-
-           while( (len = VG_(read)(fdno, read_buffer, read_len)))
-           {
-//             VG_(printf)("\nread len: %d\n", len);
-             buffer_end = read_buffer + len;
-             line_start = buffer;
-             line_end = line_start;
-             finished = False;
-             do
-             {
-               while(*line_end != '\n' && line_end < buffer_end) //grab a line
-               {
-                 line_end++;
-               }
-               
-               //find a line. We assume each line follows the format: "name start end". We don't check errors.
-               if(*line_end == '\n')
-               {
-                 var_name = line_start;
-                 while(*line_start != ' ') line_start++;
-                 *line_start = '\0';
-    
-                 start = ++line_start;
-                 while(*line_start != ' ') line_start++;
-                 begin = VG_(strtoll16)(start, &line_start);
-    
-                 start = ++line_start;
-                 end = VG_(strtoll16)(start, &line_end);
-
-                 var = VG_(OSetGen_AllocNode)(var_table, sizeof(variable_t));
-                 var->begin =  begin;
-                 var->end =  end;
-                 var->name = VG_(strdup)("cg.sim.var_table.1", var_name);
-                 var->id = var_index++;
-                 VG_(OSetGen_Insert)(var_table, var);
-
-                 line_end++;
-                 line_start = line_end;
-
-                 if(line_start == buffer_end)
-                 {
-                    read_buffer = buffer; //The whole buffer is finished.
-                    finished = True;
-                 }
-               }
-               else
-               {
-                  //We need to handle the buffer tail that is not finished
-                  VG_(memcpy)(swap_buffer, line_start, buffer_end - line_start);
-                  VG_(memcpy)(buffer, swap_buffer, buffer_end - line_start);
-                  read_buffer = buffer + (buffer_end-line_start);
-                  finished = True;
-               }
-             } while(!finished);
-           }
-           VG_(close)(fdno);
-           init_var_array();
-           /*print_var_table();*/
-           VG_(printf)("var_index: %u\n", var_index);
-           if(var_index > 0) //Sometime file read returns a NULL buffer. We need to keep trying it.
-               done = True;
+            c->plru[set_no] &= ~(1U << n);
+            n = 2 * n;
          }
-       }
-     }
-     ref_counter++;
+      }
+      c->mru[set_no] = w;
+      break;
+   case POLICY_SRRIP:
+   case POLICY_BRRIP:
+      ages[w] = RRIP_MAX;
+      c->mru[set_no] = w;
+      break;
    }
-   return False;
+}
+
+/* The current thread of configuration `s` writes `a`, in `block`, from
+   `line`: the copies of the block in the other threads' D1s are
+   invalidated.  They are counted as evicted by `line`. */
+static void cachesim_invalidate_others(sim_cfg_t* s, cache_t2* self, UWord block, Addr a, LineCC* line)
+{
+   UInt set_no = block & self->sets_min_1;
+   UInt t;
+
+   for (t = 0; t < n_sim_tids; t++) {
+      cache_t2* c = s->D1_thr[sim_tids[t]];
+      Int w, i;
+
+      if (c == self)
+         continue;
+      w = cachesim_find_way(&c->tags[set_no * c->assoc], &c->ages[set_no * c->assoc],
+                            c->assoc, block);
+      if (w < 0)
+         continue;
+
+      i = set_no * c->assoc + w;
+      cachesim_count_evict(c, block, c->owners[i].src_line,
+                           bitop_count(c->uses[i].bitvector),
+                           c->uses[i].num_accesses, line);
+      c->tags[i] = block | LINE_INVALID;
+      if (c->dirty != NULL)
+         c->dirty[i] = 0;    /* the writer takes the data over */
+      c->owners[i].src_line = NULL;
+      c->owners[i].inv_by = a;
+      cachesim_make_lru(c, set_no, w);
+      if (s == &sim_cfgs[0])
+         n_invalidations++;
+   }
+}
+
+/* The current thread of configuration `s` misses on `block` for a read:
+   the copies in the other threads' D1s are no longer exclusive.  Returns
+   whether there are any. */
+static Bool cachesim_share_others(sim_cfg_t* s, cache_t2* self, UWord block)
+{
+   UInt set_no = block & self->sets_min_1;
+   Bool shared = False;
+   UInt t;
+
+   for (t = 0; t < n_sim_tids; t++) {
+      cache_t2* c = s->D1_thr[sim_tids[t]];
+      Int w;
+
+      if (c == self)
+         continue;
+      w = cachesim_find_way(&c->tags[set_no * c->assoc], &c->ages[set_no * c->assoc],
+                            c->assoc, block);
+      if (w >= 0) {
+         c->states[set_no * c->assoc + w] = MESI_S;
+         shared = True;
+      }
+   }
+   return shared;
+}
+
+/* The coherence actions of a reference of the current thread to `a`, in
+   `block`, before the reference goes through `D1`, its D1 in
+   configuration `s`.  Returns the state of the line after a miss, or 0
+   if the reference hits.  A miss on an invalidated line sets *inv_by. */
+static UInt cachesim_coherence(sim_cfg_t* s, cache_t2* D1, UWord block, Addr a, LineCC* line, Bool is_write, Addr* inv_by)
+{
+   UInt  set_no = block & D1->sets_min_1;
+   UWord *tags  = &D1->tags[set_no * D1->assoc];
+   UInt  *ages  = &D1->ages[set_no * D1->assoc];
+   Int   w;
+
+   w = cachesim_find_way(tags, ages, D1->assoc, block);
+   if (w >= 0) {
+      UChar *state = &D1->states[set_no * D1->assoc + w];
+      if (is_write) {
+         if (*state == MESI_S)
+            cachesim_invalidate_others(s, D1, block, a, line);
+         *state = MESI_M;
+      }
+      return 0;
+   }
+
+   /* The invalidated copy is the LRU way, so the miss refills it. */
+   w = cachesim_find_way(tags, ages, D1->assoc, block | LINE_INVALID);
+   if (w >= 0) {
+      *inv_by = D1->owners[set_no * D1->assoc + w].inv_by;
+      tags[w] = 0;
+      cachesim_make_lru(D1, set_no, w);
+   }
+
+   if (is_write) {
+      cachesim_invalidate_others(s, D1, block, a, line);
+      return MESI_M;
+   }
+   return cachesim_share_others(s, D1, block) ? MESI_S : MESI_E;
+}
+
+/* The line is there, unless an inclusive LL has just back-invalidated it. */
+static void cachesim_set_state(cache_t2* D1, UWord block, UChar state)
+{
+   UInt set_no = block & D1->sets_min_1;
+   Int  w = cachesim_find_way(&D1->tags[set_no * D1->assoc], &D1->ages[set_no * D1->assoc],
+                              D1->assoc, block);
+
+   if (w >= 0)
+      D1->states[set_no * D1->assoc + w] = state;
+}
+
+/* A prefetch of `block` into `c`, issued by a reference of `line` in
+   configuration `s`.  Nothing happens if the line is already there. */
+static void cachesim_pf_fill(sim_cfg_t* s, cache_t2* c, UWord block, LineCC* line,
+                             pf_victim_t* victims)
+{
+   UInt  set_no = block & c->sets_min_1;
+   UWord *tags  = &c->tags[set_no * c->assoc];
+   UInt  *ages  = &c->ages[set_no * c->assoc];
+   UInt  state  = 0;
+   Addr  inv_by;
+   Int   w, i;
+   Bool  evict_dirty;
+   cacheline_use_t   *use;
+   cacheline_owner_t *owner;
+
+   if (c->states != NULL) {
+      /* a private D1 reads the line like a demand miss would */
+      state = cachesim_coherence(s, c, block, block << c->line_size_bits,
+                                 line, False, &inv_by);
+      if (state == 0)
+         return;
+   } else if (cachesim_find_way(tags, ages, c->assoc, block) >= 0) {
+      return;
+   }
+
+   /* a D1 prefetch goes through L2 and LL, as a reference of no statistics */
+   if (c->level == CACHE_D1) {
+      cacheline_rep_t *cr = NULL;
+      Addr pa = block << c->line_size_bits;
+      if ((!sim_L2 || cachesim_ref_is_miss(&s->L2, pa, 1, REF_READ, line->loc.line, line, &cr))
+          && cachesim_ref_is_miss(&s->LL, pa, 1, REF_READ, line->loc.line, line, &cr))
+         line->Tr.mem_rd += s->LL.line_size;
+   } else {
+      line->Tr.mem_rd += c->line_size;
+   }
+
+   w = cachesim_policy_fill(c, set_no);
+   i = set_no * c->assoc + w;
+   use   = &c->uses[i];
+   owner = &c->owners[i];
+
+   if (tags[w] != 0 && !(tags[w] & LINE_INVALID)) {
+      cachesim_count_evict(c, tags[w], owner->src_line, bitop_count(use->bitvector),
+                           use->num_accesses, line);
+      if (use->bitvector != 0) {
+         pf_victim_t *v = &victims[tags[w] & (PF_VICTIMS - 1)];
+         v->block = tags[w];
+         v->by    = line;
+      }
+      if (c->inclusive_of != NULL)
+         cachesim_back_invalidate(c, tags[w], line);
+      evict_dirty = c->dirty != NULL && c->dirty[i];
+      if (evict_dirty || c->spill)
+         cachesim_writeback(c, tags[w], line, evict_dirty);
+   }
+   if (c->dirty != NULL)
+      c->dirty[i] = 0;
+
+   tags[w] = block;
+   use->bitvector = 0;
+   use->num_accesses = 0;
+   owner->src_line = line;
+   owner->line_num = line->loc.line;
+   owner->pf_time  = pf_clock;
+   if (state)
+      c->states[i] = state;
+   line->Pf.issued++;
+}
+
+/* A demand miss on `block`: if a prefetch evicted it, that prefetch was
+   polluting. */
+__attribute__((always_inline))
+static __inline__
+void cachesim_pf_victim_missed(pf_victim_t* victims, UWord block)
+{
+   pf_victim_t *v = &victims[block & (PF_VICTIMS - 1)];
+
+   if (v->block == block) {
+      v->by->Pf.polluting++;
+      v->block = 0;
+   }
+}
+
+/* --prefetch=stride: trains the entry of instruction `pc` on a
+   reference to `a`, and returns the D1 line to prefetch, or 0. */
+static UWord cachesim_pf_stride(sim_cfg_t* s, cache_t2* D1, Addr a, Addr pc)
+{
+   pf_stride_t *e = &s->pf_strides[((pc >> 2) ^ (pc >> 12)) & (PF_STRIDES - 1)];
+   Word stride;
+
+   if (e->pc != pc) {
+      e->pc        = pc;
+      e->last_addr = a;
+      e->stride    = 0;
+      e->conf      = 0;
+      return 0;
+   }
+
+   stride = a - e->last_addr;
+   e->last_addr = a;
+   if (stride != 0 && stride == e->stride) {
+      if (e->conf < 3)
+         e->conf++;
+   } else {
+      if (e->conf > 0)
+         e->conf--;
+      if (e->conf == 0)
+         e->stride = stride;
+   }
+   if (e->conf < 2)
+      return 0;
+
+   /* short strides move on to the neighbouring line */
+   if (e->stride > 0 && e->stride < D1->line_size)
+      return (a >> D1->line_size_bits) + 1;
+   if (e->stride < 0 && -e->stride < D1->line_size)
+      return (a >> D1->line_size_bits) - 1;
+   return (a + e->stride) >> D1->line_size_bits;
+}
+
+/* --prefetch=stream: a D1 miss on LL line `block`.  It continues the
+   stream that last missed next to it, or starts a new one in place of
+   the least recently used stream. */
+static void cachesim_pf_stream(sim_cfg_t* s, UWord block, LineCC* line)
+{
+   pf_stream_t *e, *lru = &s->pf_streams[0];
+   UWord page = (block << s->LL.line_size_bits) >> 12;
+   Int   dir, d;
+   UInt  j;
+
+   for (j = 0; j < PF_STREAMS; j++) {
+      e = &s->pf_streams[j];
+      if (e->last_block != 0 && (block == e->last_block + 1 || block == e->last_block - 1))
+         break;
+      if (e->last_use < lru->last_use)
+         lru = e;
+   }
+   if (j == PF_STREAMS) {
+      lru->last_block = block;
+      lru->dir        = 0;
+      lru->last_use   = pf_clock;
+      return;
+   }
+
+   dir = (block > e->last_block) ? 1 : -1;
+   e->last_use   = pf_clock;
+   e->last_block = block;
+   if (e->dir != dir) {
+      e->dir = dir;    /* confirmed by the next miss in the same direction */
+      return;
+   }
+   for (d = 1; d <= PF_STREAM_DEGREE; d++) {
+      UWord next = block + d * dir;
+      if (((next << s->LL.line_size_bits) >> 12) != page)
+         break;
+      cachesim_pf_fill(s, &s->LL, next, line, s->pf_victims_LL);
+   }
+}
+
+/* The prefetcher's part of a data reference to `a`, by instruction `pc`
+   of `line`, in configuration `s`; the reference missed in D1, and in
+   LL, as given. */
+static void cachesim_prefetch(sim_cfg_t* s, cache_t2* D1, Addr a, LineCC* line,
+                              Bool miss_D1, Bool miss_LL, Addr pc)
+{
+   UWord block = a >> D1->line_size_bits;
+   UWord next;
+
+   if (s == &sim_cfgs[0])
+      pf_clock++;
+
+   if (miss_D1)
+      cachesim_pf_victim_missed(s->pf_victims_D1, block);
+   if (miss_LL)
+      cachesim_pf_victim_missed(s->pf_victims_LL, a >> s->LL.line_size_bits);
+
+   switch (sim_prefetch) {
+   case PF_NEXTLINE:
+      if (miss_D1)
+         cachesim_pf_fill(s, D1, block + 1, line, s->pf_victims_D1);
+      break;
+   case PF_STRIDE:
+      next = cachesim_pf_stride(s, D1, a, pc);
+      if (next != 0 && next != block)
+         cachesim_pf_fill(s, D1, next, line, s->pf_victims_D1);
+      break;
+   case PF_STREAM:
+      if (miss_D1)
+         cachesim_pf_stream(s, a >> s->LL.line_size_bits, line);
+      break;
+   }
+}
+
+/*------------------------------------------------------------*/
+/*--- DTLB and STLB (--DTLB, --STLB)                       ---*/
+/*------------------------------------------------------------*/
+
+/* A data TLB, and optionally a second level TLB behind it, translate
+   the data references before they reach D1.  They are shared by the
+   threads and by the D1/LL configurations, and their counts go to the
+   first configuration's LineCCs.  An entry is tagged with its page
+   number plus one, so that 0 is an empty entry, and remembers the
+   address that filled it: the miss that evicts it is then an edge from
+   the variable referenced to the variable of the evicted page, as the
+   CIG edges of D1.  DTLB misses are classified with an infinite and a
+   fully associative shadow TLB; page walks are only counted, their
+   memory references are not simulated.  Replacement is LRU. */
+typedef struct {
+   Int     entries;
+   Int     assoc;
+   Int     sets;
+   Int     page_bits;
+   UWord   *tags;     /* page + 1, 0 if empty */
+   UInt    *ages;
+   Addr    *fill;     /* address that filled each entry */
+   HChar   desc_line[128];
+} tlb_t;
+
+static Bool       sim_tlb  = False;
+static Bool       sim_stlb = False;
+static tlb_t      DTLB;
+static tlb_t      STLB;
+static cache_infi TLB_INFI;
+static cache_fa   TLB_FA;
+
+static void cachesim_inittlb(tlb_t* t, Int entries, Int assoc, Int page_bits)
+{
+   Int i, j;
+
+   t->entries   = entries;
+   t->assoc     = assoc;
+   t->sets      = entries / assoc;
+   t->page_bits = page_bits;
+   t->tags = VG_(calloc)("cg.sim.tlb.1", entries, sizeof(UWord));
+   t->ages = VG_(malloc)("cg.sim.tlb.2", entries * sizeof(UInt));
+   t->fill = VG_(calloc)("cg.sim.tlb.3", entries, sizeof(Addr));
+   for (i = 0; i < t->sets; i++)
+      for (j = 0; j < assoc; j++)
+         t->ages[i * assoc + j] = assoc - 1 - j;
+
+   if (assoc == entries)
+      VG_(sprintf)(t->desc_line, "%d entries, fully associative", entries);
+   else
+      VG_(sprintf)(t->desc_line, "%d entries, %d-way associative", entries, assoc);
+   VG_(sprintf)(t->desc_line + VG_(strlen)(t->desc_line), ", %s pages",
+                page_bits == 30 ? "1 GB" : page_bits == 21 ? "2 MB" : "4 KB");
+}
+
+/* --DTLB and --STLB have been given; `stlb_entries` is 0 without --STLB,
+   whose pages are those of the DTLB. */
+static void cachesim_inittlbs(Int entries, Int assoc, Int page_bits,
+                              Int stlb_entries, Int stlb_assoc)
+{
+   sim_tlb = True;
+   cachesim_inittlb(&DTLB, entries, assoc, page_bits);
+   if (stlb_entries > 0) {
+      sim_stlb = True;
+      cachesim_inittlb(&STLB, stlb_entries, stlb_assoc, page_bits);
+   }
+   cacheinfi_setup(&TLB_INFI, 1 << page_bits);
+   cachefa_setup(&TLB_FA, entries, 1 << page_bits);
+}
+
+/* Looks up the page of `a`.  A miss replaces the LRU entry of its set
+   and returns the address that had filled it, or 0, in `evicted`. */
+static Bool tlb_is_miss(tlb_t* t, Addr a, Addr* evicted)
+{
+   UWord  tag  = (a >> t->page_bits) + 1;
+   Int    set  = (a >> t->page_bits) & (t->sets - 1);
+   UWord* tags = &t->tags[set * t->assoc];
+   UInt*  ages = &t->ages[set * t->assoc];
+   Int    w    = cachesim_find_way(tags, ages, t->assoc, tag);
+
+   if (w >= 0) {
+      cachesim_age_hit(ages, t->assoc, ages[w]);
+      ages[w] = 0;
+      return False;
+   }
+   w = cachesim_age_miss(ages, t->assoc);
+   *evicted = t->fill[set * t->assoc + w];
+   tags[w] = tag;
+   t->fill[set * t->assoc + w] = a;
+   return True;
+}
+
+/* A data reference of `line` to `a`, a write if `is_write`. */
+static __attribute__((noinline))
+void cachesim_tlb_doref(Addr a, UChar size, LineCC* line, Bool is_write)
+{
+   Addr last = a + size - 1;
+   Addr evicted = 0, junk;
+   Bool miss = False, walk = False;
+   Bool miss_fa = cachefa_ref_is_miss(&TLB_FA, a, size, DTLB.page_bits);
+   cacheline_rep_t* cr = NULL;
+
+   if (tlb_is_miss(&DTLB, a, &evicted)) {
+      miss = True;
+      walk = !sim_stlb || tlb_is_miss(&STLB, a, &junk);
+   }
+   if (UNLIKELY((last >> DTLB.page_bits) != (a >> DTLB.page_bits))
+       && tlb_is_miss(&DTLB, last, &junk)) {
+      miss = True;
+      walk |= !sim_stlb || tlb_is_miss(&STLB, last, &junk);
+   }
+   if (!miss)
+      return;
+
+   if (is_write)
+      line->Tlb.mw++;
+   else
+      line->Tlb.mr++;
+   if (walk) {
+      if (is_write)
+         line->Tlb.walk_w++;
+      else
+         line->Tlb.walk_r++;
+   }
+
+   if (evicted != 0) {
+      variable_t *var_in  = VG_(OSetGen_LookupWithCmp)(var_table, &a, comp_addr_var);
+      variable_t *var_out = var_in == NULL ? NULL
+         : VG_(OSetGen_LookupWithCmp)(var_table, &evicted, comp_addr_var);
+      if (var_out != NULL)
+         cr = cr_table_get(&line->cr_table_TLB, var_in->id, var_out->id);
+   }
+
+   /* a page not referenced before misses in any TLB */
+   if (cacheinfi_ref_is_miss(&TLB_INFI, a, size, DTLB.page_bits)) {
+      line->Tlb.m_comp++;
+      if (cr != NULL)
+         cr->m_comp++;
+   } else if (!miss_fa) {
+      line->Tlb.m_conf++;
+      if (cr != NULL)
+         cr->m_conf++;
+   } else {
+      line->Tlb.m_cap++;
+      if (cr != NULL)
+         cr->m_cap++;
+   }
+}
+
+/* A data reference to `a`, which missed in the first configuration's
+   D1 if `miss`: count it in the field heat map of its struct array.
+   The offsets are those from the start of the range containing `a`, so
+   every heap block of a variable is an array of its own.
+
+   The variable is found in the map of that D1, which gives the owner of
+   the line `a` is in.  Only a variable starting inside that line, found
+   as the owner of the next one, or an array the map does not hold, can
+   contain `a` instead. */
+static __attribute__((noinline))
+void cachesim_field_ref(Addr a, UChar size, Bool miss)
+{
+   cache_t2 *c = &sim_cfgs[0].D1;
+   UWord line = a >> c->line_size_bits;
+   UInt hint;
+   variable_t *var, *arr;
+   UInt off, i;
+
+   var = cachesim_lookup_var(c, line, &c->vars.hint_field);
+   if (var == NULL || a < var->begin || a > var->end) {
+      hint = c->vars.hint_field;
+      var = cachesim_lookup_var(c, line + 1, &hint);
+      if (var == NULL || a < var->begin) {
+         if (LIKELY(n_field_vars_unmapped == 0))
+            return;
+         var = VG_(OSetGen_LookupWithCmp)(var_table, &a, comp_addr_var);
+         if (var == NULL)
+            return;
+      }
+   }
+   arr = var_array[var->id];
+   if (arr->elem_size == 0)
+      return;
+
+   off = (a - var->begin) % arr->elem_size;
+   for (i = 0; i < size; i++) {
+      arr->field_heat[off]++;
+      if (++off == arr->elem_size)
+         off = 0;
+   }
+   arr->field_refs++;
+   if (miss)
+      arr->field_misses++;
+}
+
+/* cg.zero: restarts the counts kept by the simulation itself, those
+   of the LineCCs aside.  The caches keep their contents. */
+static void cachesim_zero(void)
+{
+   UInt id, j;
+
+   n_invalidations = 0;
+   n_back_invalidations = 0;
+   for (id = 0; id < var_index; id++) {
+      variable_t* var = var_array[id];
+      if (var->elem_size > 0)
+         VG_(memset)(var->field_heat, 0, var->elem_size * sizeof(ULong));
+      var->field_refs = 0;
+      var->field_misses = 0;
+   }
+   for (j = 0; j < top_pairs.n_slots; j++)
+      top_pairs.slots[j].in_id = NO_VAR;
+   top_pairs.n_used = 0;
+   n_top_heap = 0;
+   for (j = 0; j < fn_edges.n_slots; j++)
+      fn_edges.slots[j].in_id = 0;
+   fn_edges.n_used = 0;
+}
+
+/* Creates the private D1s of thread `tid`, in every configuration. */
+static void cachesim_new_thread(ThreadId tid)
+{
+   UInt k;
+
+   for (k = 0; k < n_sim_cfgs; k++) {
+      cache_t2* D1 = &sim_cfgs[k].D1;
+      cache_t   config = { D1->size, D1->assoc, D1->line_size };
+      cache_t2* c = VG_(malloc)("cg.sim.nt.1", sizeof(cache_t2));
+
+      cachesim_initcache(config, c, CACHE_D1, 1 << D1->word_size_bits);
+      c->states = VG_(calloc)("cg.sim.nt.2", c->sets * c->assoc, sizeof(UChar));
+      c->next = D1->next;
+      c->spill = D1->spill;
+      c->epoch_cu = D1->epoch_cu;
+      cachesim_rebuild_var_map(c);
+      sim_cfgs[k].D1_thr[tid] = c;
+   }
+   sim_tids[n_sim_tids++] = tid;
+}
+
+/* A data reference of the current thread in configuration `s`, through
+   its private D1. */
+__attribute__((always_inline))
+static __inline__
+Bool cachesim_D1_doref_thr(sim_cfg_t* s, Addr a, UChar size, LineCC* line, UInt ref, Addr pc)
+{
+   cache_t2* D1 = s->D1_thr[sim_tid];
+   UWord block1 =  a           >> D1->line_size_bits;
+   UWord block2 = (a + size - 1) >> D1->line_size_bits;
+   UInt  state1, state2 = 0;
+   Addr  inv_by = 0;
+   Bool  miss;
+
+   state1 = cachesim_coherence(s, D1, block1, a, line, ref != REF_READ, &inv_by);
+   if (block2 != block1)
+      state2 = cachesim_coherence(s, D1, block2, a, line, ref != REF_READ, &inv_by);
+
+   miss = cachesim_D1_doref_cfg(s, D1, a, size, line, ref, inv_by ? &inv_by : NULL, pc);
+   if (state1)
+      cachesim_set_state(D1, block1, state1);
+   if (state2)
+      cachesim_set_state(D1, block2, state2);
+   return miss;
+}
+
+/* As cachesim_D1_doref, with --cache-sim-threads=private. */
+static __attribute__((noinline))
+Bool cachesim_D1_doref_private(Addr a, UChar size, LineCC* line, UInt ref, Addr pc)
+{
+   Bool miss = False;
+   UInt k;
+
+   if (UNLIKELY(sim_cfgs[0].D1_thr[sim_tid] == NULL))
+      cachesim_new_thread(sim_tid);
+
+   for (k = 0; k < n_sim_cfgs; k++, line = line->next_cfg) {
+      Bool m = cachesim_D1_doref_thr(&sim_cfgs[k], a, size, line, ref, pc);
+      if (k == 0)
+         miss = m;
+   }
+   return miss;
+}
+
+/* A data reference of kind `ref` (REF_*) of `line`, by the instruction
+   at `pc`, in every configuration.  Only the first configuration's
+   result is returned. */
+__attribute__((always_inline))
+static __inline__
+Bool cachesim_D1_doref(Addr a, UChar size, LineCC* line, UInt ref, Addr pc)
+{
+   Bool miss;
+
+   if (UNLIKELY(sim_tlb))
+      cachesim_tlb_doref(a, size, line, ref != REF_READ);
+   if (UNLIKELY(sim_threads_private)) {
+      miss = cachesim_D1_doref_private(a, size, line, ref, pc);
+   } else {
+      miss = cachesim_D1_doref_cfg(&sim_cfgs[0], &sim_cfgs[0].D1, a, size, line, ref, NULL, pc);
+      if (UNLIKELY(n_sim_cfgs > 1))
+         cachesim_D1_doref_more(a, size, line, ref, pc);
+   }
+   if (UNLIKELY(n_field_vars > 0))
+      cachesim_field_ref(a, size, miss);
+   return miss;
 }
 
 /* Check for special case IrNoX. Called at instrumentation time.
  *
  * Does this Ir only touch one cache line, and are L1I/LL cache
- * line sizes the same? This allows to get rid of a runtime check.
+ * line sizes the same, in every configuration? This allows to get rid of a runtime check.
  *
  * Returning false is always fine, as this calls the generic case
  */
 static Bool cachesim_is_IrNoX(Addr a, UChar size)
 {
    UWord block1, block2;
+   UInt  k;
 
-   if (I1.line_size_bits != LL.line_size_bits) return False;
+   for (k = 0; k < n_sim_cfgs; k++)
+      if (I1.line_size_bits != sim_cfgs[k].LL.line_size_bits) return False;
    block1 =  a         >> I1.line_size_bits;
    block2 = (a+size-1) >> I1.line_size_bits;
    if (block1 != block2) return False;
@@ -827,6 +3092,229 @@ static Bool cachesim_is_IrNoX(Addr a, UChar size)
    return True;
 }
 
+/*------------------------------------------------------------*/
+/*--- Belady's OPT (--opt-sim)                             ---*/
+/*------------------------------------------------------------*/
+
+/* With --opt-sim=yes, the data references replayed from a --trace-in
+   file are also kept, and once the replay is over, each D1 is simulated
+   again over them with Belady's replacement: a miss evicts the line
+   whose next reference is furthest away.  No policy misses less, so the
+   OPT misses of a line bound what any layout change that keeps its
+   references can hope for, under the same geometry.  Every miss fills
+   the line, as with --write-allocate=yes and no prefetching.
+
+   The next reference to each block is found by a backward pass over the
+   references, with a hash table from block to its next position; the
+   pass costs 8 bytes per block reference, on top of the references.
+   At most --opt-sim-max-refs references are kept: a longer trace is an
+   error rather than a run out of memory. */
+
+#define OPT_NEVER     (~(ULong)0)   /* no next reference */
+#define OPT_NO_BLOCK  (~(UWord)0)   /* an empty slot or way */
+
+typedef struct {
+   Addr    a;
+   LineCC* line;        /* in the first configuration */
+   UChar   size;
+   Bool    is_write;
+} opt_ref_t;
+
+static Bool       sim_opt = False;
+static Long       sim_opt_max_refs = 50000000;
+static opt_ref_t* opt_refs = NULL;
+static ULong      n_opt_refs = 0;
+static ULong      max_opt_refs = 0;
+
+static void cachesim_opt_record(Addr a, UChar size, LineCC* line, Bool is_write)
+{
+   opt_ref_t* r;
+
+   if (UNLIKELY(n_opt_refs == max_opt_refs)) {
+      if (n_opt_refs == sim_opt_max_refs) {
+         VG_(fmsg)("--opt-sim: the trace has more than %lld data references;\n",
+                   sim_opt_max_refs);
+         VG_(fmsg)("raise --opt-sim-max-refs, or replay a shorter trace\n");
+         VG_(exit)(1);
+      }
+      max_opt_refs = 2 * max_opt_refs + 65536;
+      if (max_opt_refs > sim_opt_max_refs)
+         max_opt_refs = sim_opt_max_refs;
+      opt_refs = VG_(realloc)("cg.sim.opt.1", opt_refs,
+                              max_opt_refs * sizeof(opt_ref_t));
+   }
+   r = &opt_refs[n_opt_refs++];
+   r->a        = a;
+   r->line     = line;
+   r->size     = size;
+   r->is_write = is_write;
+}
+
+typedef struct {
+   UWord* blocks;
+   ULong* pos;
+   UWord  n_slots;    /* a power of two */
+   UWord  n_used;
+} opt_map_t;
+
+static ULong* opt_map_slot(opt_map_t* m, UWord block)
+{
+   UWord i = (block * 0x9E3779B1U) & (m->n_slots - 1);
+
+   while (m->blocks[i] != block && m->blocks[i] != OPT_NO_BLOCK)
+      i = (i + 1) & (m->n_slots - 1);
+   if (m->blocks[i] == OPT_NO_BLOCK) {
+      m->blocks[i] = block;
+      m->pos[i] = OPT_NEVER;
+      m->n_used++;
+   }
+   return &m->pos[i];
+}
+
+static void opt_map_init(opt_map_t* m, UWord n_slots)
+{
+   UWord i;
+
+   m->n_slots = n_slots;
+   m->n_used  = 0;
+   m->blocks  = VG_(malloc)("cg.sim.opt.2", n_slots * sizeof(UWord));
+   m->pos     = VG_(malloc)("cg.sim.opt.3", n_slots * sizeof(ULong));
+   for (i = 0; i < n_slots; i++)
+      m->blocks[i] = OPT_NO_BLOCK;
+}
+
+/* The next reference to `block`, at `pos`, counted backwards. */
+static ULong opt_map_next(opt_map_t* m, UWord block, ULong pos)
+{
+   ULong *slot, next;
+
+   if (m->n_used * 2 >= m->n_slots) {
+      opt_map_t bigger;
+      UWord i;
+      opt_map_init(&bigger, 2 * m->n_slots);
+      for (i = 0; i < m->n_slots; i++)
+         if (m->blocks[i] != OPT_NO_BLOCK)
+            *opt_map_slot(&bigger, m->blocks[i]) = m->pos[i];
+      VG_(free)(m->blocks);
+      VG_(free)(m->pos);
+      *m = bigger;
+   }
+   slot = opt_map_slot(m, block);
+   next = *slot;
+   *slot = pos;
+   return next;
+}
+
+/* A reference to `block`, whose next reference is at `next`, in the OPT
+   simulation of `c`.  `tags` and `nexts` hold the block in each way and
+   the position of its next reference. */
+static Bool cachesim_opt_is_miss(cache_t2* c, UWord* tags, ULong* nexts,
+                                 UWord block, ULong next)
+{
+   UInt  set_no = block & c->sets_min_1;
+   UWord *t = &tags[set_no * c->assoc];
+   ULong *n = &nexts[set_no * c->assoc];
+   Int   i, victim = 0;
+
+   for (i = 0; i < c->assoc; i++) {
+      if (t[i] == block) {
+         n[i] = next;
+         return False;
+      }
+   }
+   for (i = 0; i < c->assoc; i++) {
+      if (t[i] == OPT_NO_BLOCK) {
+         victim = i;
+         break;
+      }
+      if (n[i] > n[victim])
+         victim = i;
+   }
+   t[victim] = block;
+   n[victim] = next;
+   return True;
+}
+
+/* Runs the OPT simulation of the D1 of configuration `k` over the
+   recorded references. */
+static void cachesim_opt_cfg(UInt k)
+{
+   cache_t2* c = &sim_cfgs[k].D1;
+   opt_map_t map;
+   ULong     *next, n_blocks = 0, pos, r;
+   UWord     *tags;
+   ULong     *nexts;
+   UInt      j;
+
+   /* every reference is to one line or two, in order */
+   for (r = 0; r < n_opt_refs; r++) {
+      const opt_ref_t* ref = &opt_refs[r];
+      n_blocks += 1 + ((ref->a >> c->line_size_bits)
+                       != ((ref->a + ref->size - 1) >> c->line_size_bits));
+   }
+   next = VG_(malloc)("cg.sim.opt.4", (n_blocks + 1) * sizeof(ULong));
+
+   opt_map_init(&map, 65536);
+   pos = n_blocks;
+   for (r = n_opt_refs; r-- > 0; ) {
+      const opt_ref_t* ref = &opt_refs[r];
+      UWord block1 =  ref->a                  >> c->line_size_bits;
+      UWord block2 = (ref->a + ref->size - 1) >> c->line_size_bits;
+      if (block2 != block1) {
+         pos--;
+         next[pos] = opt_map_next(&map, block2, pos);
+      }
+      pos--;
+      next[pos] = opt_map_next(&map, block1, pos);
+   }
+   VG_(free)(map.blocks);
+   VG_(free)(map.pos);
+
+   tags  = VG_(malloc)("cg.sim.opt.5", c->sets * c->assoc * sizeof(UWord));
+   nexts = VG_(malloc)("cg.sim.opt.6", c->sets * c->assoc * sizeof(ULong));
+   for (j = 0; j < c->sets * c->assoc; j++)
+      tags[j] = OPT_NO_BLOCK;
+
+   pos = 0;
+   for (r = 0; r < n_opt_refs; r++) {
+      const opt_ref_t* ref = &opt_refs[r];
+      UWord  block1 =  ref->a                  >> c->line_size_bits;
+      UWord  block2 = (ref->a + ref->size - 1) >> c->line_size_bits;
+      LineCC *line = ref->line;
+      Bool   miss;
+
+      miss = cachesim_opt_is_miss(c, tags, nexts, block1, next[pos]);
+      pos++;
+      if (block2 != block1) {
+         miss |= cachesim_opt_is_miss(c, tags, nexts, block2, next[pos]);
+         pos++;
+      }
+      if (miss) {
+         for (j = 0; j < k; j++)
+            line = line->next_cfg;
+         if (ref->is_write)
+            line->Dw.m1_opt++;
+         else
+            line->Dr.m1_opt++;
+      }
+   }
+
+   VG_(free)(tags);
+   VG_(free)(nexts);
+   VG_(free)(next);
+}
+
+static void cachesim_opt_finish(void)
+{
+   UInt k;
+
+   for (k = 0; k < n_sim_cfgs; k++)
+      cachesim_opt_cfg(k);
+   VG_(free)(opt_refs);
+   opt_refs = NULL;
+   n_opt_refs = max_opt_refs = 0;
+}
+
 /*--------------------------------------------------------------------*/
 /*--- end                                                 cg_sim.c ---*/
 /*--------------------------------------------------------------------*/
@@ -152,18 +152,13 @@ void acquire_var_addresses(int m, int n,
 {
   if(var_info != NULL)
   {
-    FILE *var_file = NULL;
-
-    var_file = fopen(var_info, "w");
-    if(var_file != NULL)
-    {
-      fprintf(var_file, "%s %p %p\n", getName(data), &(data[0][0]), &(data[_PB_N-1][_PB_M-1]));
-      fprintf(var_file, "%s %p %p\n", getName(corr), &(corr[0][0]), &(corr[_PB_M-1][_PB_M-1]));
-      fprintf(var_file, "%s %p %p\n", getName(mean), &(mean[0]), &(mean[_PB_M-1]));
-      fprintf(var_file, "%s %p %p\n", getName(stddev), &(stddev[0]), &(stddev[_PB_M-1]));
-
-      fclose(var_file);
-    }
+    if(varinfo_file_open(var_info) != 0)
+      fprintf(stderr, "Cannot open %s for recording varinfo\n", var_info);
+    varinfo_file_print(getName(data), &(data[0][0]), &(data[_PB_N-1][_PB_M-1]));
+    varinfo_file_print(getName(corr), &(corr[0][0]), &(corr[_PB_M-1][_PB_M-1]));
+    varinfo_file_print(getName(mean), &(mean[0]), &(mean[_PB_M-1]));
+    varinfo_file_print(getName(stddev), &(stddev[0]), &(stddev[_PB_M-1]));
+    varinfo_file_close();
   }
 
 }
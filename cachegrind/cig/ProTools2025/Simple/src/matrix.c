@@ -162,18 +162,13 @@ int main(int argc, char *argv[])
 
     if(var_info != NULL)
     {
-        FILE *var_file = NULL;
-
-        var_file = fopen(var_info, "w");
-        if(var_file != NULL)
-        {
-            fprintf(var_file, "%s %p %p\n", getName(A), A, A + size*size);
-            fprintf(var_file, "%s %p %p\n", getName(B), B, B + size*size);
-            fprintf(var_file, "%s %p %p\n", getName(C), C, C + size*size);
-            fprintf(var_file, "%s %p %p\n", getName(C_d), C_d, C_d + size*size);
-
-            fclose(var_file);
-        }
+        if(varinfo_file_open(var_info) != 0)
+            fprintf(stderr, "Cannot open %s for recording varinfo\n", var_info);
+        varinfo_file_print(getName(A), A, A + size*size);
+        varinfo_file_print(getName(B), B, B + size*size);
+        varinfo_file_print(getName(C), C, C + size*size);
+        varinfo_file_print(getName(C_d), C_d, C_d + size*size);
+        varinfo_file_close();
     }
 
     //initialization
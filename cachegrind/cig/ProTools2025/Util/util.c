@@ -5,6 +5,8 @@
 #include <stdlib.h>
 #include <string.h>
 
+#include "cachegrind.h"
+
 FILE *varinfo_file = NULL;
 
 int
@@ -17,15 +19,31 @@ varinfo_file_open(char *fname)
 	return -1;
 }
 
+/* Registers the variable with Cachegrind through a client request, so the
+   simulator no longer needs to read the varinfo file.  The file is still
+   written when one has been opened, for the scripts that archive it. */
 int
 varinfo_file_print(char *vname, void* begin, void* end)
 {
-	if(varinfo_file != NULL && vname != NULL && begin != NULL && end != NULL)
-	{
+	if(vname == NULL || begin == NULL || end == NULL)
+		return -1;
+
+	CACHEGRIND_REGISTER_VARIABLE(vname, begin, end);
+
+	if(varinfo_file != NULL)
 		fprintf(varinfo_file, "%s %p %p\n", vname, begin, end);
-		return 0;
-	}
-	return -1;
+
+	return 0;
+}
+
+int
+varinfo_unregister(void* begin)
+{
+	if(begin == NULL)
+		return -1;
+
+	CACHEGRIND_UNREGISTER_VARIABLE(begin);
+	return 0;
 }
 
 
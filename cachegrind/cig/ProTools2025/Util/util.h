@@ -13,6 +13,7 @@
 int varinfo_file_open(char *fname);
 int varinfo_file_close();
 int varinfo_file_print(char *vname, void* begin, void* end);
+int varinfo_unregister(void* begin);
 
 /*return the duration in seconds */
 double CalElapsedTime(struct timeval* tv_begin, struct timeval* tv_end);
@@ -0,0 +1,120 @@
+# pyright: strict
+
+# --------------------------------------------------------------------
+# --- Cachegrind's binary cacheusage reader.          cu_binfile.py ---
+# --------------------------------------------------------------------
+
+# This file is part of Cachegrind, a high-precision tracing profiler
+# built with Valgrind.
+#
+# Copyright (C) 2002-2023 Nicholas Nethercote
+#    njn@valgrind.org
+#
+# This program is free software; you can redistribute it and/or
+# modify it under the terms of the GNU General Public License as
+# published by the Free Software Foundation; either version 2 of the
+# License, or (at your option) any later version.
+#
+# This program is distributed in the hope that it will be useful, but
+# WITHOUT ANY WARRANTY; without even the implied warranty of
+# MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+# General Public License for more details.
+#
+# You should have received a copy of the GNU General Public License
+# along with this program; if not, see <http://www.gnu.org/licenses/>.
+#
+# The GNU General Public License is contained in the file COPYING.
+
+# This module reads cacheusage files written with `--cacheusage-format=bin`.
+# It is installed next to `cu_annotate` and `cu_merge`, which import it from
+# their own directory, as does `cig/cig_generator` from the directory above
+# its own.
+
+from __future__ import annotations
+
+import mmap
+import struct
+from typing import Any, Iterator
+
+
+# A binary cacheusage file, mapped into memory. The layout is described in
+# Cachegrind's manual. `table(name)` is a memoryview of a table's rows, and
+# `dtype(name)` describes their fields in numpy's terms, so
+# `numpy.frombuffer(f.table(name), numpy.dtype(f.dtype(name)))` is a record
+# array over the file, without copying. `rows(name)` iterates over the rows
+# as flat tuples without numpy.
+class CuBinFile:
+    MAGIC = b"CGCUBIN\0"
+    KIND_D1 = 1
+    KIND_CR = 2
+    FLAG_INV = 1
+    TABLES = ["str", "line", "cr", "cu"]
+
+    def __init__(self, filename: str) -> None:
+        with open(filename, "rb") as f:
+            self.buf = mmap.mmap(f.fileno(), 0, access=mmap.ACCESS_READ)
+        if self.buf[:8] != self.MAGIC:
+            raise ValueError("not a binary cacheusage file")
+        self.order = "<" if struct.unpack_from("<I", self.buf, 8)[0] == 0x01020304 else ">"
+        (self.version, self.kind, self.n_bins, self.flags, desc) = struct.unpack_from(
+            self.order + "5I", self.buf, 12
+        )
+        if self.version != 1:
+            raise ValueError(f"unsupported version {self.version}")
+        self.tabs: dict[str, tuple[int, int, int]] = {}
+        for n, name in enumerate(self.TABLES):
+            (offset, n_rows, row_size) = struct.unpack_from(self.order + "3Q", self.buf, 32 + 24 * n)
+            if offset + n_rows * row_size > len(self.buf):
+                raise ValueError(f"truncated `{name}` table")
+            if name != "str" and struct.calcsize(self.format(name)) != row_size:
+                raise ValueError(f"unexpected `{name}` row size {row_size}")
+            self.tabs[name] = (offset, n_rows, row_size)
+        self.desc = self.string(desc)
+
+    def fields(self, name: str) -> list[tuple[Any, ...]]:
+        counts = {
+            "line": ["access", "miss", "comp", "conf", "cap", "inv", "evicts"],
+            "cr": ["total", "comp", "conf", "cap", "inv"],
+        }
+        if name == "line":
+            head = [("file", "u4"), ("fn", "u4"), ("line", "i4"), ("pad", "u4")]
+        elif name == "cr":
+            head = [("line", "u4"), ("in_var", "u4"), ("out_var", "u4"), ("pad", "u4")]
+        else:
+            head = [("line", "u4"), ("var", "u4"), ("access", "u8")]
+        fields: list[tuple[Any, ...]] = head + [(c, "u8") for c in counts.get(name, [])]
+        if name != "cr":
+            fields.append(("bins", "u8", (self.n_bins,)))
+        return fields
+
+    def dtype(self, name: str) -> list[tuple[Any, ...]]:
+        return [(f[0], self.order + f[1]) + f[2:] for f in self.fields(name)]
+
+    def format(self, name: str) -> str:
+        codes = {"u4": "I", "i4": "i", "u8": "Q"}
+        return self.order + "".join(
+            (str(f[2][0]) if len(f) > 2 else "") + codes[f[1]] for f in self.fields(name)
+        )
+
+    def num_rows(self, name: str) -> int:
+        return self.tabs[name][1]
+
+    def table(self, name: str) -> memoryview:
+        (offset, n_rows, row_size) = self.tabs[name]
+        return memoryview(self.buf)[offset : offset + n_rows * row_size]
+
+    def rows(self, name: str) -> Iterator[tuple[Any, ...]]:
+        return struct.iter_unpack(self.format(name), self.table(name))
+
+    # The NUL-terminated string at `offset` in the `str` table.
+    def string(self, offset: int) -> str:
+        start = self.tabs["str"][0] + offset
+        return self.buf[start : self.buf.find(b"\0", start)].decode("utf-8")
+
+
+def is_cubin_file(filename: str) -> bool:
+    try:
+        with open(filename, "rb") as f:
+            return f.read(len(CuBinFile.MAGIC)) == CuBinFile.MAGIC
+    except OSError:
+        return False
@@ -0,0 +1,58 @@
+// Exercises --cig-auto-vars=heap,globals.  `grid` and the blocks are all
+// 4 KB, so on the direct-mapped 4 KB D1 of `cig_autovars.vgtest` every
+// access evicts a line of another of them and shows up as a CR edge.  The
+// blocks of `alloc_row` share an allocation stack and so make up one
+// variable, and `small` is below --cig-auto-min.
+
+#include <stdlib.h>
+
+#define N    512   // 4 KB of doubles
+#define ROWS 4
+
+double grid[N];
+
+static double* __attribute__((noinline)) alloc_row(void)
+{
+   return malloc(N * sizeof(double));
+}
+
+static double* __attribute__((noinline)) alloc_col(void)
+{
+   return calloc(N, sizeof(double));
+}
+
+static void conflict(double* a, double* b, double* c)
+{
+   int i;
+   for (i = 0; i < N; i++)
+      a[i] = b[i] + c[i];
+}
+
+int main(void)
+{
+   double* rows[ROWS];
+   double* col;
+   char*   small = malloc(64);
+   int     r;
+
+   for (r = 0; r < ROWS; r++)
+      rows[r] = alloc_row();
+   col = alloc_col();
+   small[0] = 0;
+
+   for (r = 0; r < ROWS; r++)
+      conflict(grid, rows[r], col);
+
+   // The freed block must be retired for the new one, which likely gets
+   // the same address, to be registered.
+   free(col);
+   col = alloc_col();
+   for (r = 0; r < ROWS; r++)
+      conflict(rows[r], grid, col);
+
+   for (r = 0; r < ROWS; r++)
+      free(rows[r]);
+   free(col);
+   free(small);
+   return 0;
+}
@@ -0,0 +1,42 @@
+// Exercises --cig-epoch and CACHEGRIND_CIG_EPOCH.  The three arrays map to
+// the same sets of the direct-mapped D1 used by `cig_epoch.vgtest`.  The
+// "setup" phase only makes A and B conflict, and the "solve" phase only A
+// and C, which the aggregate CR records of the run cannot tell apart.
+
+#include <stdlib.h>
+#include "../cachegrind.h"
+
+#define N 512   // 4 KB of doubles per array
+
+static void conflict(double* a, double* b)
+{
+   int i;
+   for (i = 0; i < N; i++)
+      a[i] += b[i];
+}
+
+int main(void)
+{
+   double* a = aligned_alloc(4096, N * sizeof(double));
+   double* b = aligned_alloc(4096, N * sizeof(double));
+   double* c = aligned_alloc(4096, N * sizeof(double));
+   int     r;
+
+   CACHEGRIND_REGISTER_VARIABLE("A", a, a + N - 1);
+   CACHEGRIND_REGISTER_VARIABLE("B", b, b + N - 1);
+   CACHEGRIND_REGISTER_VARIABLE("C", c, c + N - 1);
+
+   CACHEGRIND_CIG_EPOCH("setup");
+   for (r = 0; r < 4; r++)
+      conflict(a, b);
+
+   CACHEGRIND_CIG_EPOCH("solve");
+   for (r = 0; r < 4; r++)
+      conflict(a, c);
+
+   CACHEGRIND_CIG_EPOCH(NULL);
+   free(a);
+   free(b);
+   free(c);
+   return 0;
+}
@@ -0,0 +1,62 @@
+// Two threads each update their own counters under
+// --cache-sim-threads=private.  `A` and `B` share a cache line, so every
+// write of one thread invalidates the other's copy and shows up as an
+// invalidation edge between them; `C` and `D` are a line apart and never
+// interfere.
+
+#include <pthread.h>
+#include <sched.h>
+#include "../cachegrind.h"
+
+#define ITERS 20000
+
+static struct {
+   volatile long a;
+   volatile long b;
+} shared __attribute__((aligned(64)));
+
+static struct {
+   volatile long c;
+   char pad[120];
+   volatile long d;
+} padded __attribute__((aligned(64)));
+
+static void* thread_a(void* arg)
+{
+   int i;
+   for (i = 0; i < ITERS; i++) {
+      shared.a++;
+      padded.c++;
+      if (i % 1000 == 999)
+         sched_yield();
+   }
+   return NULL;
+}
+
+static void* thread_b(void* arg)
+{
+   int i;
+   for (i = 0; i < ITERS; i++) {
+      shared.b++;
+      padded.d++;
+      if (i % 1000 == 999)
+         sched_yield();
+   }
+   return NULL;
+}
+
+int main(void)
+{
+   pthread_t ta, tb;
+
+   CACHEGRIND_REGISTER_VARIABLE("A", &shared.a, &shared.a);
+   CACHEGRIND_REGISTER_VARIABLE("B", &shared.b, &shared.b);
+   CACHEGRIND_REGISTER_VARIABLE("C", &padded.c, &padded.c);
+   CACHEGRIND_REGISTER_VARIABLE("D", &padded.d, &padded.d);
+
+   pthread_create(&ta, NULL, thread_a, NULL);
+   pthread_create(&tb, NULL, thread_b, NULL);
+   pthread_join(ta, NULL);
+   pthread_join(tb, NULL);
+   return 0;
+}
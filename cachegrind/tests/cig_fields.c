@@ -0,0 +1,37 @@
+// Ten passes over the positions of an array of particles, and one over
+// their masses.  The velocities and ids are never read, so the hot
+// fields are 24 of the 64 bytes of an element.  `q` has elements too
+// large for a heat map and is not registered.
+
+#include "../cachegrind.h"
+
+#define N       4096
+#define PASSES  10
+
+struct particle {
+   double x, y, z;
+   double vx, vy, vz;
+   double mass;
+   long   id;
+};
+
+static struct particle p[N];
+static char q[16384];
+
+int main(void)
+{
+   int i, j;
+   double sum = 0;
+
+   CACHEGRIND_REGISTER_STRUCT_ARRAY("p", p, (char*)(p + N) - 1, sizeof(struct particle));
+   CACHEGRIND_REGISTER_STRUCT_ARRAY("q", q, q + sizeof(q) - 1, 8192);
+
+   CACHEGRIND_START_INSTRUMENTATION;
+   for (j = 0; j < PASSES; j++)
+      for (i = 0; i < N; i++)
+         sum += p[i].x + p[i].y + p[i].z;
+   for (i = 0; i < N; i++)
+      sum += p[i].mass;
+   CACHEGRIND_STOP_INSTRUMENTATION;
+   return sum == 1;
+}
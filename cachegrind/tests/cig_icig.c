@@ -0,0 +1,35 @@
+// Two functions called in turn, each aligned to a multiple of the 1 KB
+// direct-mapped I1 of the `cig_icig*.vgtest` tests, so that their code
+// maps to the same sets and each call evicts the lines of the other.
+// Placed next to each other, both fit in I1.
+
+#define CALLS  2000
+
+__attribute__((noinline, aligned(1024)))
+static int hot_a(int x)
+{
+   int i;
+   for (i = 0; i < 4; i++)
+      x = x * 31 + (x >> 3) + i;
+   return x;
+}
+
+__attribute__((noinline, aligned(1024)))
+static int hot_b(int x)
+{
+   int i;
+   for (i = 0; i < 4; i++)
+      x = x * 17 - (x >> 5) + i;
+   return x;
+}
+
+int main(void)
+{
+   int i, sum = 0;
+
+   for (i = 0; i < CALLS; i++) {
+      sum = hot_a(sum);
+      sum = hot_b(sum);
+   }
+   return sum == 1;
+}
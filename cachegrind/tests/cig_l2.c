@@ -0,0 +1,29 @@
+// Passes over `big`, 9 lines per set of the L2 and LL of the
+// `cig_l2_*.vgtest` tests, each of its lines followed by a reference to
+// one of the 4 lines of `hot`.  LL alone can not hold `big`, but L2 and
+// an exclusive LL together can.  `hot` never leaves D1, unless an
+// inclusive LL evicts it under the stream and back-invalidates it there.
+
+#include "../cachegrind.h"
+
+#define LINES   (9 * 64)
+#define HOT     4
+#define PASSES  20
+
+static volatile char big[LINES * 64] __attribute__((aligned(64)));
+static volatile char hot[HOT * 64] __attribute__((aligned(64)));
+
+int main(void)
+{
+   register int i, j;
+   int sum = 0;
+
+   CACHEGRIND_START_INSTRUMENTATION;
+   for (i = 0; i < PASSES; i++)
+      for (j = 0; j < LINES; j++) {
+         sum += big[j * 64];
+         sum += hot[(j % HOT) * 64];
+      }
+   CACHEGRIND_STOP_INSTRUMENTATION;
+   return sum == 1;
+}
@@ -0,0 +1,22 @@
+// Touches the upper half of 250 128-byte lines, then their lower half.
+// With the 128-byte lines of the .vgtest only the first loop has
+// compulsory misses; the second loop misses on lines evicted from the
+// 32-line D1, which are capacity misses.
+
+#include <stdlib.h>
+
+#define LINES 250
+
+int main(void)
+{
+   char* p = aligned_alloc(128, LINES * 128);
+   int i, sum = 0;
+
+   for (i = 0; i < LINES; i++)
+      sum += p[i * 128 + 64];   // upper
+   for (i = 0; i < LINES; i++)
+      sum += p[i * 128];        // lower
+
+   free(p);
+   return sum == 12345;
+}
@@ -0,0 +1,29 @@
+// Passes over `a` and `b`, 64 lines each, whose lines pairwise share a
+// set of the direct-mapped LL of `cig_llclass_conf.vgtest`.  Neither
+// fits D1 with the other, so every reference reaches LL.  The 128 lines
+// fit a fully associative LL of that size, so its misses after the
+// first pass are conflict misses; in the 64-line LL of
+// `cig_llclass_cap.vgtest` they are capacity misses.
+
+#include "../cachegrind.h"
+
+#define LINES   64
+#define STRIDE  65536
+#define PASSES  20
+
+static volatile char buf[2 * STRIDE] __attribute__((aligned(64)));
+
+int main(void)
+{
+   register int i, j;
+   int sum = 0;
+
+   CACHEGRIND_START_INSTRUMENTATION;
+   for (i = 0; i < PASSES; i++)
+      for (j = 0; j < LINES; j++) {
+         sum += buf[j * 64];
+         sum += buf[STRIDE + j * 64];
+      }
+   CACHEGRIND_STOP_INSTRUMENTATION;
+   return sum == 1;
+}
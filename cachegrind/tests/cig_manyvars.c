@@ -0,0 +1,29 @@
+// Registers more variables than the old packed CR keys could represent
+// (1024) and makes one source line evict lines of all of them, so that
+// its CR/CU tables, which start with 8 and 4 slots, are grown and
+// rehashed many times.  With the direct-mapped 64 KB D1 used by
+// `cig_manyvars.vgtest`, variable v evicts variable v-1024 and vice versa.
+
+#include <stdio.h>
+#include "../cachegrind.h"
+
+#define NV 2048   // variables, one 64-byte line each
+
+static char pool[NV][64] __attribute__((aligned(4096)));
+
+int main(void)
+{
+   char name[16];
+   int r, v;
+
+   for (v = 0; v < NV; v++) {
+      snprintf(name, sizeof(name), "v%d", v);
+      CACHEGRIND_REGISTER_VARIABLE(name, pool[v], pool[v] + 63);
+   }
+
+   for (r = 0; r < 3; r++)
+      for (v = 0; v < NV; v++)
+         pool[v][0]++;
+
+   return pool[NV - 1][0] == 3 ? 0 : 1;
+}
@@ -0,0 +1,45 @@
+// `A` and `B` are 4 KB apart and conflict in the direct-mapped D1 of
+// `cig_monitor.vgtest`, while `C` has a set of its own.  The monitor
+// commands are sent by the client itself.
+
+#include "../cachegrind.h"
+
+#define LEN     1024
+#define PASSES  100
+
+static volatile char buf[2 * 4096] __attribute__((aligned(4096)));
+
+static void passes(volatile char* a, volatile char* b, int n)
+{
+   int i, j;
+
+   for (j = 0; j < n; j++)
+      for (i = 0; i < LEN; i += 64) {
+         a[i]++;
+         b[i]++;
+      }
+}
+
+int main(void)
+{
+   volatile char* a = buf;
+   volatile char* b = buf + 4096;
+   volatile char* c = buf + 2048;
+
+   CACHEGRIND_REGISTER_VARIABLE("A", a, a + LEN - 1);
+   CACHEGRIND_REGISTER_VARIABLE("B", b, b + LEN - 1);
+   CACHEGRIND_REGISTER_STRUCT_ARRAY("C", c, c + LEN - 1, 16);
+
+   passes(a, b, PASSES);
+   passes(a, c, PASSES);
+   VALGRIND_MONITOR_COMMAND("cg.vars");
+   VALGRIND_MONITOR_COMMAND("cg.top-conflicts 1");
+   VALGRIND_MONITOR_COMMAND("cg.top-conflicts");
+   VALGRIND_MONITOR_COMMAND("cg.dump snap");
+   VALGRIND_MONITOR_COMMAND("cg.zero");
+   VALGRIND_MONITOR_COMMAND("cg.top-conflicts");
+   passes(b, a, 1);
+   VALGRIND_MONITOR_COMMAND("cg.top-conflicts");
+   VALGRIND_MONITOR_COMMAND("cg.top-conflicts 100");
+   return 0;
+}
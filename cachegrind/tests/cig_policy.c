@@ -0,0 +1,24 @@
+// A loop over one more line than the ways of a D1 set, which LRU and
+// FIFO miss on every time and Belady's OPT on about one in four times,
+// under the 4-way D1 of the `cig_policy_*.vgtest` tests.  Only the loop is
+// instrumented, and its counter stays in a register.
+
+#include "../cachegrind.h"
+
+#define WAYS   4
+#define SETS   4
+#define ITERS  4000
+
+static volatile char buf[(WAYS + 1) * SETS * 64] __attribute__((aligned(64)));
+
+int main(void)
+{
+   register int i;
+   int sum = 0;
+
+   CACHEGRIND_START_INSTRUMENTATION;
+   for (i = 0; i < ITERS; i++)
+      sum += buf[(i % (WAYS + 1)) * SETS * 64];
+   CACHEGRIND_STOP_INSTRUMENTATION;
+   return sum == 1;
+}
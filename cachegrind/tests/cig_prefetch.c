@@ -0,0 +1,20 @@
+// Reads an array sequentially and then with a stride of four lines, for
+// the prefetcher models of the `cig_prefetch_*.vgtest` tests.  The array
+// is larger than the LL used there, so every pass misses in both D1 and
+// LL unless something fetches ahead.  The passes read 8192 and 2048
+// lines; the tests give the misses of `main` as a share of the 10240.
+
+#define N (1 << 16)   // 512 KB of longs
+
+static long a[N];
+
+int main(void)
+{
+   long i, sum = 0;
+
+   for (i = 0; i < N; i++)
+      sum += a[i];
+   for (i = 0; i < N; i += 32)
+      sum += a[i];
+   return sum != 0;
+}
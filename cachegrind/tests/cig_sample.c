@@ -0,0 +1,27 @@
+// Passes over `big`, twice the size of the D1 of `cig_sample.vgtest`,
+// so that every reference to it misses, each followed by a reference to
+// `hot`, which always hits.  Every pass is the same, so a sample of them
+// gives the misses of all: one per line of `big` and pass.
+
+#include "../cachegrind.h"
+
+#define LINES   1024
+#define PASSES  100
+
+static volatile char big[LINES * 64] __attribute__((aligned(64)));
+static volatile char hot[64] __attribute__((aligned(64)));
+
+int main(void)
+{
+   register int i, j;
+   int sum = 0;
+
+   CACHEGRIND_START_INSTRUMENTATION;
+   for (i = 0; i < PASSES; i++)
+      for (j = 0; j < LINES; j++) {
+         sum += big[j * 64];
+         sum += hot[j % 64];
+      }
+   CACHEGRIND_STOP_INSTRUMENTATION;
+   return sum == 1;
+}
@@ -0,0 +1,22 @@
+// Walks 250 cache lines four times.  Every reference after the first walk
+// has a stack distance of 249 lines, plus the stack lines of the loop, so
+// with --cache-sim-mode=stackdist the loop shows up in the RD128 bin of
+// `cacheusage.rd.out`, and its D1 misses are capacity misses of the
+// 64-line D1 used by the .vgtest.
+
+#include <stdlib.h>
+
+#define LINES 250
+
+int main(void)
+{
+   char* p = aligned_alloc(64, LINES * 64);
+   int i, n, sum = 0;
+
+   for (n = 0; n < 4; n++)
+      for (i = 0; i < LINES; i++)
+         sum += p[i * 64];   // walk
+
+   free(p);
+   return sum == 12345;
+}
@@ -0,0 +1,33 @@
+// Two passes over `a` and then `b`, a reference per page.  Each is 64
+// 4 KB pages, more than the DTLB of `cig_tlb_4k.vgtest` holds, so every
+// reference misses; the first pages of each array evict the last pages
+// of the other.  The second pass hits in the STLB.  With 2 MB pages both
+// arrays fit in one or two entries and no page is ever evicted.
+
+#include "../cachegrind.h"
+
+#define PAGES   64
+#define PASSES  2
+
+static volatile char a[PAGES * 4096] __attribute__((aligned(4096)));
+static volatile char b[PAGES * 4096] __attribute__((aligned(4096)));
+
+int main(void)
+{
+   register int i, j;
+   int sum = 0;
+
+   CACHEGRIND_REGISTER_VARIABLE("A", a, a + sizeof(a) - 1);
+   CACHEGRIND_REGISTER_VARIABLE("B", b, b + sizeof(b) - 1);
+
+   CACHEGRIND_START_INSTRUMENTATION;
+   for (i = 0; i < PASSES; i++)
+   {
+      for (j = 0; j < PAGES; j++)
+         sum += a[j * 4096];
+      for (j = 0; j < PAGES; j++)
+         sum += b[j * 4096];
+   }
+   CACHEGRIND_STOP_INSTRUMENTATION;
+   return sum == 1;
+}
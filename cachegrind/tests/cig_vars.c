@@ -0,0 +1,42 @@
+// Exercises the CACHEGRIND_REGISTER_VARIABLE and
+// CACHEGRIND_UNREGISTER_VARIABLE client requests.  The three arrays map to
+// the same sets of the direct-mapped D1 used by `cig_vars.vgtest`, so every
+// access evicts a line of another array and shows up as a CR edge.
+
+#include <stdlib.h>
+#include "../cachegrind.h"
+
+#define N 512   // 4 KB of doubles per array
+
+static void conflict(double* a, double* b, double* c)
+{
+   int i;
+   for (i = 0; i < N; i++)
+      a[i] = b[i] + c[i];
+}
+
+int main(void)
+{
+   double* a = aligned_alloc(4096, N * sizeof(double));
+   double* b = aligned_alloc(4096, N * sizeof(double));
+   double* c = aligned_alloc(4096, N * sizeof(double));
+
+   CACHEGRIND_REGISTER_VARIABLE("A", a, a + N - 1);
+   CACHEGRIND_REGISTER_VARIABLE("B", b, b + N - 1);
+   CACHEGRIND_REGISTER_VARIABLE("C", c, c + N - 1);
+   CACHEGRIND_REGISTER_VARIABLE("A_overlap", a + 8, a + 16);   // warning
+
+   conflict(a, b, c);
+
+   // Retire `A` and track the same memory under a new name.
+   CACHEGRIND_UNREGISTER_VARIABLE(a);
+   CACHEGRIND_UNREGISTER_VARIABLE(a);                          // warning
+   CACHEGRIND_REGISTER_VARIABLE("A2", a, a + N - 1);
+
+   conflict(a, b, c);
+
+   free(a);
+   free(b);
+   free(c);
+   return 0;
+}
@@ -0,0 +1,33 @@
+// Writes a 1 MB array, more than LL holds, with ordinary and with
+// non-temporal stores, under --write-back=yes.  Ordinary stores read
+// every line before writing it, unless --write-allocate=no, and write
+// the dirty lines back when LL evicts them; non-temporal stores go
+// straight to memory.
+
+#define N (1 << 18)
+
+static int a[N], b[N];
+
+__attribute__((noinline))
+static void fill(int* p, int v)
+{
+   int i;
+   for (i = 0; i < N; i++)
+      p[i] = v;
+}
+
+__attribute__((noinline))
+static void fill_nt(int* p, int v)
+{
+   int i;
+   for (i = 0; i < N; i++)
+      __asm__ __volatile__("movnti %1, %0" : "=m" (p[i]) : "r" (v));
+}
+
+int main(void)
+{
+   fill(a, 1);
+   fill(a, 2);
+   fill_nt(b, 3);
+   return a[N / 2] + b[N / 2] == 5 ? 0 : 1;
+}
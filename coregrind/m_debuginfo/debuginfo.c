@@ -5001,6 +5001,24 @@ void VG_(DebugInfo_syms_getidx) ( const DebugInfo *si,
    if (isGlobal)  *isGlobal  = si->symtab[idx].isGlobal;
 }
 
+Bool VG_(DebugInfo_get_datasym) ( const DebugInfo *si,
+                                        Int idx,
+                                  /*OUT*/Addr*          avma,
+                                  /*OUT*/SizeT*         size,
+                                  /*OUT*/const HChar**  name )
+{
+   const DiSym* sym;
+
+   vg_assert(idx >= 0 && idx < si->symtab_used);
+   sym = &si->symtab[idx];
+   if (sym->isText || sym->size == 0)
+      return False;
+   *avma = sym->avmas.main;
+   *size = sym->size;
+   *name = sym->pri_name;
+   return True;
+}
+
 
 /*------------------------------------------------------------*/
 /*--- SectKind query functions                             ---*/
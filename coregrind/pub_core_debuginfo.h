@@ -212,14 +212,14 @@ typedef
 # define SET_LOCAL_EP_AVMA(_sym_avmas, _val)  /* */
 #endif
 
-/* Functions for traversing all the symbols in a DebugInfo.  _howmany
-   tells how many symbol table entries there are.  _getidx retrieves
+/* Functions for traversing all the symbols in a DebugInfo.
+   VG_(DebugInfo_syms_howmany) (see pub_tool_debuginfo.h) tells how
+   many symbol table entries there are.  _getidx retrieves
    the n'th entry, for n in 0 .. _howmany-1.  You may not modify the
    function names thereby acquired; if you want to do so, first strdup
    them.  The primary name is returned in *pri_name, and *sec_names is
    set either to NULL or to a NULL terminated vector containing
    pointers to the secondary names. */
-Int  VG_(DebugInfo_syms_howmany) ( const DebugInfo *di );
 void VG_(DebugInfo_syms_getidx)  ( const DebugInfo *di, 
                                    Int idx,
                                    /*OUT*/SymAVMAs* ad,
@@ -67,17 +67,6 @@ extern Int  VG_(clo_show_error_list);
    default: no markers. */
 extern HChar *VG_(clo_error_markers)[2];
 
-typedef 
-   enum { 
-      Vg_VgdbNo,   // Do not activate gdbserver.
-      Vg_VgdbYes,  // Activate gdbserver (default).
-      Vg_VgdbFull, // ACtivate gdbserver in full mode, allowing
-                   // a precise handling of watchpoints and single stepping
-                   // at any moment.
-   } 
-   VgVgdb;
-/* if != Vg_VgdbNo, allows valgrind to serve vgdb/gdb. */
-extern VgVgdb VG_(clo_vgdb);
 /* if > 0, checks every VG_(clo_vgdb_poll) BBS if vgdb wants to be served. */
 extern Int VG_(clo_vgdb_poll);
 
@@ -291,6 +291,18 @@ PtrdiffT      VG_(DebugInfo_get_text_bias)   ( const DebugInfo *di );
    of the list stays constant. */
 const DebugInfo* VG_(next_DebugInfo)    ( const DebugInfo *di );
 
+/* Functions for traversing the data symbols of a DebugInfo.  _howmany
+   tells how many symbol table entries there are.  _get_datasym
+   retrieves the n'th entry, for n in 0 .. _howmany-1, if it is a data
+   object of known size, and returns False otherwise.  The name must
+   be strdup'd if it is to be kept. */
+Int  VG_(DebugInfo_syms_howmany) ( const DebugInfo *di );
+Bool VG_(DebugInfo_get_datasym)  ( const DebugInfo *di,
+                                   Int idx,
+                                   /*OUT*/Addr*          avma,
+                                   /*OUT*/SizeT*         size,
+                                   /*OUT*/const HChar**  name );
+
 /* A simple enumeration to describe the 'kind' of various kinds of
    segments that arise from the mapping of object files. */
 typedef
@@ -353,6 +353,18 @@ extern Int  VG_(clo_verbosity);
 /* Show tool and core statistics */
 extern Bool VG_(clo_stats);
 
+typedef 
+   enum { 
+      Vg_VgdbNo,   // Do not activate gdbserver.
+      Vg_VgdbYes,  // Activate gdbserver (default).
+      Vg_VgdbFull, // ACtivate gdbserver in full mode, allowing
+                   // a precise handling of watchpoints and single stepping
+                   // at any moment.
+   } 
+   VgVgdb;
+/* if != Vg_VgdbNo, allows valgrind to serve vgdb/gdb. */
+extern VgVgdb VG_(clo_vgdb);
+
 /* wait for vgdb/gdb after reporting that amount of error.
    Note that this value can be changed dynamically. */
 extern Int VG_(clo_vgdb_error);